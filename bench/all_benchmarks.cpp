@@ -0,0 +1,28 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <benchmark/benchmark.h>
+#include <glog/logging.h>
+
+/**
+ * Runs all the microbenchmarks.
+ *
+ * <p>To save the results, so that they can be compared with those of a different release (e.g.,
+ * using Google Benchmark's `tools/compare.py`), run with something like:
+ * <pre>
+ *      $ ./build/bin/distlib_bench --benchmark_out=bench-0.18.0.json --benchmark_out_format=json
+ * </pre>
+ *
+ * <p>A subset of the benchmarks can be run with `--benchmark_filter=<regex>`.
+ */
+int main(int argc, char **argv) {
+  ::google::InitGoogleLogging(argv[0]);
+
+  ::benchmark::Initialize(&argc, argv);
+  if (::benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  ::benchmark::RunSpecifiedBenchmarks();
+  ::benchmark::Shutdown();
+  return 0;
+}
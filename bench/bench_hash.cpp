@@ -0,0 +1,86 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "ConsistentHash.hpp"
+#include "keystore/HashedKey.hpp"
+
+using namespace keystore;
+
+namespace {
+
+// All benchmarks cycle through this many keys, so that they are not always hashing the same one.
+const size_t kNumKeys = 1024;
+
+std::vector<std::string> MakeStrings(size_t length) {
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < kNumKeys; ++i) {
+    auto key = "key-" + std::to_string(i * 7919);
+    key.resize(std::max(length, key.size()), 'x');
+    keys.push_back(key);
+  }
+  return keys;
+}
+
+} // namespace
+
+static void BM_ConsistentHash(benchmark::State &state) {
+  auto keys = MakeStrings(state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(consistent_hash(keys[i++ % kNumKeys]));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ConsistentHash)->RangeMultiplier(4)->Range(8, 1024);
+
+static void BM_HashKeyString(benchmark::State &state) {
+  auto keys = MakeStrings(16);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashKey(keys[i++ % kNumKeys]));
+  }
+}
+BENCHMARK(BM_HashKeyString);
+
+static void BM_HashKeyCharPtr(benchmark::State &state) {
+  auto keys = MakeStrings(16);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashKey(keys[i++ % kNumKeys].c_str()));
+  }
+}
+BENCHMARK(BM_HashKeyCharPtr);
+
+template<typename T>
+static void BM_HashKeyNumeric(benchmark::State &state) {
+  T key = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashKey<T>(key));
+    key += 7919;
+  }
+}
+BENCHMARK_TEMPLATE(BM_HashKeyNumeric, int);
+BENCHMARK_TEMPLATE(BM_HashKeyNumeric, long);
+
+static void BM_HashKey64String(benchmark::State &state) {
+  auto keys = MakeStrings(16);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashKey64(keys[i++ % kNumKeys]));
+  }
+}
+BENCHMARK(BM_HashKey64String);
+
+static void BM_HashKey64Long(benchmark::State &state) {
+  long key = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashKey64(key));
+    key += 7919;
+  }
+}
+BENCHMARK(BM_HashKey64Long);
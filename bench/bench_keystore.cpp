@@ -0,0 +1,162 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/Workload.hpp"
+
+using namespace keystore;
+
+namespace {
+
+const long kNumKeys = 100000;
+const int kNumBuckets = 16;
+
+template<typename K>
+K MakeKey(long i);
+
+template<>
+long MakeKey(long i) { return i * 7919; }
+
+template<>
+std::string MakeKey(long i) { return "key-" + std::to_string(i * 7919); }
+
+template<typename K>
+const std::vector<K> &Keys() {
+  static const std::vector<K> keys = []() {
+    std::vector<K> keys;
+    keys.reserve(kNumKeys);
+    for (long i = 0; i < kNumKeys; ++i) {
+      keys.push_back(MakeKey<K>(i));
+    }
+    return keys;
+  }();
+  return keys;
+}
+
+std::unordered_set<std::string> AllBuckets() {
+  std::unordered_set<std::string> buckets;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    buckets.insert("bucket-" + std::to_string(i));
+  }
+  return buckets;
+}
+
+/**
+ * The store shared by all the threads of a benchmark, which owns all the buckets and initially
+ * holds all the `Keys()`; optionally, replicating its hot keys.
+ */
+template<typename K, bool kReplicated = false>
+InMemoryKeyStore<K, long> &Store() {
+  static std::shared_ptr<View> view = make_balanced_view(kNumBuckets, 5);
+  static InMemoryKeyStore<K, long> store{"bench", view, AllBuckets()};
+  static bool filled = [&]() {
+    if (kReplicated) {
+      store.EnableHotKeyReplication();
+    }
+    const auto &keys = Keys<K>();
+    for (long i = 0; i < kNumKeys; ++i) {
+      store.Put(keys[i], i);
+    }
+    return true;
+  }();
+  benchmark::DoNotOptimize(filled);
+  return store;
+}
+
+// Each thread starts from a different key, so that threads do not all hit the same bucket.
+size_t FirstKey(const benchmark::State &state) {
+  return state.thread_index() * (kNumKeys / state.threads());
+}
+
+// The indexes (in `Keys()`) of a stream of reads following a Zipfian distribution, with the
+// same skew (0.99) as the YCSB workloads: the hottest key alone gets ~8% of the reads.
+const std::vector<size_t> &ZipfianReads() {
+  static const std::vector<size_t> reads = []() {
+    ZipfianGenerator zipfian{kNumKeys};
+    std::mt19937_64 rnd{7};
+    std::vector<size_t> reads(1U << 20U);
+    for (auto &read : reads) {
+      read = zipfian.Next(rnd);
+    }
+    return reads;
+  }();
+  return reads;
+}
+
+} // namespace
+
+template<typename K>
+static void BM_KeyStoreGet(benchmark::State &state) {
+  auto &store = Store<K>();
+  const auto &keys = Keys<K>();
+  auto i = FirstKey(state);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.Get(keys[i++ % kNumKeys]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_KeyStoreGet, long)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_KeyStoreGet, std::string)->ThreadRange(1, 8)->UseRealTime();
+
+// Under a skewed workload, the threads contend on the locks of the hottest keys' buckets: unless
+// the hot keys are replicated (see `InMemoryKeyStore::EnableHotKeyReplication()`).
+template<bool kReplicated>
+static void BM_KeyStoreZipfianGet(benchmark::State &state) {
+  auto &store = Store<long, kReplicated>();
+  const auto &keys = Keys<long>();
+  const auto &reads = ZipfianReads();
+  size_t i = state.thread_index() * (reads.size() / state.threads());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.Get(keys[reads[i++ % reads.size()]]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_KeyStoreZipfianGet, false)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_KeyStoreZipfianGet, true)->ThreadRange(1, 8)->UseRealTime();
+
+template<typename K>
+static void BM_KeyStorePut(benchmark::State &state) {
+  auto &store = Store<K>();
+  const auto &keys = Keys<K>();
+  auto i = FirstKey(state);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.Put(keys[i % kNumKeys], static_cast<long>(i)));
+    ++i;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_KeyStorePut, long)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_KeyStorePut, std::string)->ThreadRange(1, 8)->UseRealTime();
+
+// Only the removals are timed: each thread puts back the keys it removed, every `kBatch`.
+template<typename K>
+static void BM_KeyStoreRemove(benchmark::State &state) {
+  const size_t kBatch = 1000;
+  auto &store = Store<K>();
+  const auto &keys = Keys<K>();
+  auto first = FirstKey(state);
+  size_t removed = 0;
+  for (auto _ : state) {
+    if (removed == kBatch) {
+      state.PauseTiming();
+      for (size_t i = 0; i < kBatch; ++i) {
+        store.Put(keys[first + i], static_cast<long>(first + i));
+      }
+      removed = 0;
+      state.ResumeTiming();
+    }
+    benchmark::DoNotOptimize(store.Remove(keys[first + removed++]));
+  }
+  for (size_t i = 0; i < removed; ++i) {
+    store.Put(keys[first + i], static_cast<long>(first + i));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_KeyStoreRemove, long)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_KeyStoreRemove, std::string)->ThreadRange(1, 8)->UseRealTime();
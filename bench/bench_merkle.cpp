@@ -0,0 +1,51 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "MerkleNode.hpp"
+
+namespace {
+
+// Hashes the concatenation of the children's hashes.
+std::string HashOfHashes(const std::shared_ptr<std::string> &psl,
+                         const std::shared_ptr<std::string> &psr) {
+  if (!(psl || psr)) return "";
+  return utils::hash_str(!psl ? *psr : !psr ? *psl : *psl + *psr);
+}
+
+using MD5MerkleNode = merkle::MerkleNode<std::string, std::string, utils::hash_str, HashOfHashes>;
+
+std::vector<std::string> MakeValues(long count) {
+  std::vector<std::string> values;
+  for (long i = 0; i < count; ++i) {
+    values.push_back("value-" + std::to_string(i));
+  }
+  return values;
+}
+
+} // namespace
+
+static void BM_MerkleBuild(benchmark::State &state) {
+  auto values = MakeValues(state.range(0));
+  for (auto _ : state) {
+    auto root = merkle::Build<std::string, std::string, utils::hash_str, HashOfHashes>(values);
+    benchmark::DoNotOptimize(root.get());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MerkleBuild)->ArgName("leaves")->RangeMultiplier(4)->Range(16, 4096);
+
+static void BM_MerkleIsValid(benchmark::State &state) {
+  std::unique_ptr<MD5MerkleNode> root =
+      merkle::Build<std::string, std::string, utils::hash_str, HashOfHashes>(
+          MakeValues(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(root->IsValid());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MerkleIsValid)->ArgName("leaves")->RangeMultiplier(4)->Range(16, 4096);
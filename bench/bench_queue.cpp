@@ -0,0 +1,34 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <benchmark/benchmark.h>
+
+#include "utils/ThreadsafeQueue.hpp"
+
+static void BM_QueuePushPop(benchmark::State &state) {
+  // Shared by all threads; each one pops as many items as it pushes, so that it is left empty.
+  static utils::ThreadsafeQueue<long> queue;
+  long item = 0;
+  for (auto _ : state) {
+    queue.push(item++);
+    benchmark::DoNotOptimize(queue.pop());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueuePushPop)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_QueueFillDrain(benchmark::State &state) {
+  utils::ThreadsafeQueue<std::string> queue;
+  const std::string item(32, 'x');
+  for (auto _ : state) {
+    for (long i = 0; i < state.range(0); ++i) {
+      queue.push(item);
+    }
+    std::string value;
+    while (queue.pop(value)) {
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_QueueFillDrain)->RangeMultiplier(8)->Range(8, 4096);
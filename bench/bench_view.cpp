@@ -0,0 +1,76 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "View.hpp"
+
+namespace {
+
+// Random points on the ring, generated once, so that generating them is not measured.
+const std::vector<float> &Points() {
+  static const std::vector<float> points = []() {
+    std::mt19937 rnd{42};
+    std::uniform_real_distribution<float> dist{0.0, 1.0};
+    std::vector<float> points(4096);
+    for (auto &point : points) {
+      point = dist(rnd);
+    }
+    return points;
+  }();
+  return points;
+}
+
+} // namespace
+
+static void BM_FindBucket(benchmark::State &state) {
+  auto view = make_balanced_view(state.range(0), state.range(1));
+  const auto &points = Points();
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(view->FindBucket(points[i++ % points.size()]));
+  }
+}
+BENCHMARK(BM_FindBucket)
+    ->ArgNames({"buckets", "partitions"})
+    ->ArgsProduct({{4, 16, 64, 256, 1024}, {1, 5, 20}});
+
+static void BM_FindBucketIndex(benchmark::State &state) {
+  auto view = make_balanced_view(state.range(0), state.range(1));
+  const auto &points = Points();
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(view->FindBucketIndex(points[i++ % points.size()]));
+  }
+}
+BENCHMARK(BM_FindBucketIndex)
+    ->ArgNames({"buckets", "partitions"})
+    ->ArgsProduct({{4, 64, 1024}, {5}});
+
+// All threads look up buckets in the same `View`, contending for its (shared) lock.
+static void BM_FindBucketThreads(benchmark::State &state) {
+  static std::shared_ptr<View> view = make_balanced_view(64, 5);
+  const auto &points = Points();
+  size_t i = state.thread_index() * 512;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(view->FindBucket(points[i++ % points.size()]));
+  }
+}
+BENCHMARK(BM_FindBucketThreads)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_PartitionPoint(benchmark::State &state) {
+  std::vector<float> partition_points;
+  for (int i = 0; i < state.range(0); ++i) {
+    partition_points.push_back(static_cast<float>(i + 1) / (state.range(0) + 1));
+  }
+  Bucket bucket{"bucket", partition_points};
+  const auto &points = Points();
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(bucket.partition_point(points[i++ % points.size()]));
+  }
+}
+BENCHMARK(BM_PartitionPoint)->ArgName("partitions")->RangeMultiplier(4)->Range(1, 256);
@@ -3,6 +3,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <functional>
 #include <string>
 #include <utility>
@@ -35,6 +36,16 @@ inline const unsigned long kBase = 13;
  */
 float consistent_hash(const std::string &msg);
 
+/**
+ * As `consistent_hash()`, also returning 32 more bits of the message's digest, so that callers
+ * which need a wider hash (e.g., to look the key up in a hash table) need not hash it again.
+ *
+ * @param msg the string to hash
+ * @param bits will contain the first 32 bits of the MD5 digest of `msg`
+ * @return the same value as `consistent_hash(msg)`
+ */
+float consistent_hash(const std::string &msg, uint32_t *bits);
+
 
 /**
  * Comparator function object, compares two floats, assuming
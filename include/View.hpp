@@ -3,14 +3,17 @@
 
 #pragma once
 
+#include <atomic>
 #include <set>
 #include <shared_mutex>
 
 #include <glog/logging.h>
 #include <map>
+#include <unordered_map>
 
 #include "ConsistentHash.hpp"
 #include "Bucket.hpp"
+#include "utils/LockProfiler.hpp"
 
 
 /**
@@ -18,11 +21,17 @@
  */
 using BucketPtr = std::shared_ptr<Bucket>;
 
+/**
+ * The mutex guarding the `View`, and the buckets' data in the stores: it is a `shared_mutex`,
+ * unless lock profiling is enabled (see `utils::ProfiledMutex`).
+ */
+using SharedMutex = utils::ProfiledMutex<std::shared_mutex>;
+
 /**
  * A shared lock to allow multiple reader/single writer pattern.
  */
-using SharedLock = std::shared_lock<std::shared_mutex>;
-using UniqueLock = std::lock_guard<std::shared_mutex>;
+using SharedLock = std::shared_lock<SharedMutex>;
+using UniqueLock = std::lock_guard<SharedMutex>;
 
 inline std::ostream& operator<<(std::ostream& out, const BucketPtr& ptr) {
   out << *ptr;
@@ -40,12 +49,27 @@ inline bool operator<(const BucketPtr &lhs, const BucketPtr &rhs) {
   return lhs->name() < rhs->name();
 }
 
+/**
+ * The maximum number of distinct buckets that can ever be added to a `View`; this bounds the
+ * dense bucket indexes (see `View::IndexOf()`) so that users can size flat, index-addressed
+ * arrays once and for all.
+ */
+inline const size_t kMaxBuckets = 4096;
+
+/**
+ * The owner of a partition point: the `Bucket`, as well as its dense index in the `View`.
+ */
+struct PartitionOwner {
+  BucketPtr bucket;
+  size_t index = 0;
+};
+
 /**
  * A `map` which compares its `float` keys with a given `Tolerance`.
  *
  * @see FloatLessWithTolerance
  */
-using MapWithTolerance = std::map<float, BucketPtr, FloatLessWithTolerance<>>;
+using MapWithTolerance = std::map<float, PartitionOwner, FloatLessWithTolerance<>>;
 
 /**
  * A `View` is a mapping of the whole space of hashes onto a set of `Bucket`s, using
@@ -72,10 +96,22 @@ class View {
    * Maps each bucket's partition point to the respective bucket.
    */
   MapWithTolerance partition_to_bucket_;
-  mutable std::shared_mutex partition_map_mx_;
+  mutable SharedMutex partition_map_mx_{"View::partition_map_mx_"};
+
+  // Incremented whenever the partition map changes, see `generation()`.
+  std::atomic_uint64_t generation_{0};
 
   std::set<BucketPtr> buckets_;
-  mutable std::shared_mutex buckets_mx_;
+  mutable SharedMutex buckets_mx_{"View::buckets_mx_"};
+
+  /**
+   * Every bucket this `View` has ever seen is assigned a dense index, which is never re-used,
+   * even after the bucket is removed; this is protected by the `buckets_mx_`.
+   */
+  std::unordered_map<BucketPtr, size_t> bucket_index_;
+
+  // Must be called while holding the `buckets_mx_` exclusively.
+  size_t AssignIndex(const BucketPtr& bucket);
 
   /**
    * Streams a view, listing all the intervals and associated buckets; then emits a list of all
@@ -131,8 +167,68 @@ public:
    */
   BucketPtr FindBucket(float hash) const;
 
+  /**
+   * Batched version of `FindBucket()`: it only acquires the lock on the partition map once
+   * for all the `hashes`.
+   *
+   * @param hashes the hash values for a set of keys, all in the [0, 1] interval
+   * @return the `Bucket`s which the `hashes` belong to, in the same order
+   */
+  std::vector<BucketPtr> FindBuckets(const std::vector<float> &hashes) const;
+
+  /**
+   * Same as `FindBucket()`, but returns the dense index of the bucket (see `IndexOf()`) instead.
+   *
+   * @param hash the hash value for a key, in the [0, 1] interval
+   * @return the index of the `Bucket` which the `hash` belongs to
+   */
+  size_t FindBucketIndex(float hash) const;
+
+  /**
+   * Batched version of `FindBucketIndex()`, see `FindBuckets()`.
+   */
+  std::vector<size_t> FindBucketIndexes(const std::vector<float> &hashes) const;
+
+  /**
+   * Each bucket is assigned a dense index, in the [0, `kMaxBuckets`) range, the first time it is
+   * seen by this `View`: the index will never change, or be re-assigned to a different bucket,
+   * even after the bucket is removed from the `View`.
+   *
+   * <p>This allows users of the `View` to keep per-bucket data in flat arrays, and access it
+   * directly from the result of `FindBucketIndex()`.
+   *
+   * <p>Buckets which have not been (yet) added to this `View` are assigned an index too.
+   *
+   * @param bucket the bucket whose index we want to know
+   * @return the dense index for the `bucket`
+   * @throws std::out_of_range if more than `kMaxBuckets` distinct buckets have been indexed
+   */
+  size_t IndexOf(const BucketPtr& bucket);
+
+  /**
+   * Same as `IndexOf()`, but never assigns an index to a bucket which does not have one yet:
+   * this only acquires the `buckets_mx_` shared, so that it can be called concurrently with
+   * other lookups.
+   *
+   * @return the dense index for the `bucket`, or `kMaxBuckets` if it was never assigned one
+   */
+  size_t FindIndex(const BucketPtr& bucket) const;
+
   std::set<BucketPtr> buckets() const;
 
+  /**
+   * @return a counter which changes whenever a bucket is added to or removed from this `View`,
+   *    so that callers can find out whether anything they derived from it (e.g., the position
+   *    of an interrupted scan) may no longer be valid
+   */
+  uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+  /**
+   * @return the (estimated) memory used by this `View`: its buckets (with their names and
+   *    partition points), the map of the partition points and the index of the buckets
+   */
+  size_t EstimateSize() const;
+
   using cstriter = const std::vector<std::string>::const_iterator;
 
   void RenameBuckets(cstriter &beg, cstriter& end ) {
@@ -0,0 +1,336 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace keystore {
+
+/**
+ * An in-memory B+tree, mapping (ordered) keys to values.
+ *
+ * <p>All the entries are stored in the leaves, which are linked to each other, so that the
+ * entries can be iterated over in order; each node holds up to `kNodeSize` keys in a contiguous
+ * array, so that, unlike a `std::map`, finding a key only misses the cache once or twice per
+ * level, and there are only a few levels (three, for a million entries).
+ *
+ * <p>Nodes which become less than half full, as entries are removed, are not merged with their
+ * siblings (as most in-memory trees do, too): they are only freed once empty.
+ *
+ * <p>This class is **not** thread-safe: concurrent reads are safe, as long as no write is made
+ * at the same time.
+ *
+ * @tparam K the type of the keys, which must be copyable and ordered by `Compare`
+ * @tparam V the type of the values, which must be copyable
+ */
+template<typename K, typename V, typename Compare = std::less<K>>
+class BPlusTree {
+ public:
+  // The maximum number of keys held by each node.
+  static constexpr size_t kNodeSize = 64;
+
+ private:
+  struct Node {
+    explicit Node(bool leaf) : is_leaf{leaf} {
+      keys.reserve(kNodeSize + 1);
+    }
+    virtual ~Node() = default;
+
+    const bool is_leaf;
+    std::vector<K> keys;
+  };
+
+  struct Leaf : public Node {
+    Leaf() : Node(true) {
+      values.reserve(kNodeSize + 1);
+    }
+    std::vector<V> values;
+    Leaf *prev = nullptr;
+    Leaf *next = nullptr;
+  };
+
+  // Child `i` holds the keys in [keys[i - 1], keys[i]).
+  struct Inner : public Node {
+    Inner() : Node(false) {
+      children.reserve(kNodeSize + 2);
+    }
+    std::vector<std::unique_ptr<Node>> children;
+  };
+
+  // The right half of a node that was split, and the first key it holds.
+  struct Split {
+    K separator;
+    std::unique_ptr<Node> right;
+  };
+
+  std::unique_ptr<Node> root_ = std::make_unique<Leaf>();
+  size_t size_ = 0;
+  Compare compare_;
+
+  bool Equal(const K &a, const K &b) const {
+    return !compare_(a, b) && !compare_(b, a);
+  }
+
+  size_t ChildIndex(const Inner *inner, const K &key) const {
+    return std::upper_bound(inner->keys.begin(), inner->keys.end(), key, compare_)
+        - inner->keys.begin();
+  }
+
+  std::optional<Split> Insert(Node *node, const K &key, const V &value, bool *inserted);
+  bool Erase(Node *node, const K &key);
+
+ public:
+  /**
+   * A position in the tree, which is only valid as long as the tree is not modified.
+   */
+  class const_iterator {
+    friend class BPlusTree;
+
+    const Leaf *leaf_ = nullptr;
+    size_t pos_ = 0;
+
+    const_iterator(const Leaf *leaf, size_t pos) : leaf_{leaf}, pos_{pos} {
+      // Only the root can be an empty leaf.
+      if (leaf_ && pos_ == leaf_->keys.size()) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+    }
+
+   public:
+    const_iterator() = default;
+
+    [[nodiscard]] bool valid() const { return leaf_ != nullptr; }
+    const K &key() const { return leaf_->keys[pos_]; }
+    const V &value() const { return leaf_->values[pos_]; }
+
+    const_iterator &operator++() {
+      *this = const_iterator{leaf_, pos_ + 1};
+      return *this;
+    }
+
+    bool operator==(const const_iterator &other) const {
+      return leaf_ == other.leaf_ && pos_ == other.pos_;
+    }
+    bool operator!=(const const_iterator &other) const { return !(*this == other); }
+  };
+
+  BPlusTree() = default;
+  BPlusTree(const BPlusTree &) = delete;
+  BPlusTree &operator=(const BPlusTree &) = delete;
+
+  /**
+   * Stores the `value` for the `key`, replacing its current one, if any.
+   *
+   * @return `true` if the key was not in the tree
+   */
+  bool Insert(const K &key, const V &value);
+
+  /**
+   * @return the value of the `key`, which is only valid until the tree is next modified; or
+   *    `nullptr` if the key is not in the tree
+   */
+  const V *Find(const K &key) const;
+
+  /**
+   * @return whether the key was found (and removed)
+   */
+  bool Erase(const K &key);
+
+  /** @return the position of the first key which is not less than `key` */
+  const_iterator LowerBound(const K &key) const;
+
+  const_iterator begin() const;
+  const_iterator end() const { return {}; }
+
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+
+  /** @return the number of levels of the tree, including the leaves */
+  [[nodiscard]] size_t height() const;
+};
+
+template<typename K, typename V, typename Compare>
+bool BPlusTree<K, V, Compare>::Insert(const K &key, const V &value) {
+  bool inserted = false;
+  auto split = Insert(root_.get(), key, value, &inserted);
+  if (split) {
+    // The tree grows at the root.
+    auto root = std::make_unique<Inner>();
+    root->keys.push_back(std::move(split->separator));
+    root->children.push_back(std::move(root_));
+    root->children.push_back(std::move(split->right));
+    root_ = std::move(root);
+  }
+  if (inserted) {
+    ++size_;
+  }
+  return inserted;
+}
+
+template<typename K, typename V, typename Compare>
+auto BPlusTree<K, V, Compare>::Insert(Node *node, const K &key, const V &value, bool *inserted)
+    -> std::optional<Split> {
+  if (node->is_leaf) {
+    auto *leaf = static_cast<Leaf *>(node);
+    auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key, compare_);
+    auto pos = it - leaf->keys.begin();
+    if (it != leaf->keys.end() && Equal(*it, key)) {
+      leaf->values[pos] = value;
+      return std::nullopt;
+    }
+    *inserted = true;
+    leaf->keys.insert(it, key);
+    leaf->values.insert(leaf->values.begin() + pos, value);
+    if (leaf->keys.size() <= kNodeSize) {
+      return std::nullopt;
+    }
+    auto right = std::make_unique<Leaf>();
+    auto mid = leaf->keys.size() / 2;
+    std::move(leaf->keys.begin() + mid, leaf->keys.end(), std::back_inserter(right->keys));
+    std::move(leaf->values.begin() + mid, leaf->values.end(), std::back_inserter(right->values));
+    leaf->keys.resize(mid);
+    leaf->values.resize(mid);
+    right->next = leaf->next;
+    right->prev = leaf;
+    if (leaf->next) {
+      leaf->next->prev = right.get();
+    }
+    leaf->next = right.get();
+    K separator = right->keys.front();
+    return Split{std::move(separator), std::move(right)};
+  }
+
+  auto *inner = static_cast<Inner *>(node);
+  auto index = ChildIndex(inner, key);
+  auto split = Insert(inner->children[index].get(), key, value, inserted);
+  if (!split) {
+    return std::nullopt;
+  }
+  inner->keys.insert(inner->keys.begin() + index, std::move(split->separator));
+  inner->children.insert(inner->children.begin() + index + 1, std::move(split->right));
+  if (inner->keys.size() <= kNodeSize) {
+    return std::nullopt;
+  }
+  // The middle key moves up to the parent.
+  auto right = std::make_unique<Inner>();
+  auto mid = inner->keys.size() / 2;
+  K separator = std::move(inner->keys[mid]);
+  std::move(inner->keys.begin() + mid + 1, inner->keys.end(), std::back_inserter(right->keys));
+  std::move(inner->children.begin() + mid + 1, inner->children.end(),
+            std::back_inserter(right->children));
+  inner->keys.resize(mid);
+  inner->children.resize(mid + 1);
+  return Split{std::move(separator), std::move(right)};
+}
+
+template<typename K, typename V, typename Compare>
+const V *BPlusTree<K, V, Compare>::Find(const K &key) const {
+  const Node *node = root_.get();
+  while (!node->is_leaf) {
+    auto *inner = static_cast<const Inner *>(node);
+    node = inner->children[ChildIndex(inner, key)].get();
+  }
+  auto *leaf = static_cast<const Leaf *>(node);
+  auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key, compare_);
+  if (it == leaf->keys.end() || !Equal(*it, key)) {
+    return nullptr;
+  }
+  return &leaf->values[it - leaf->keys.begin()];
+}
+
+template<typename K, typename V, typename Compare>
+bool BPlusTree<K, V, Compare>::Erase(const K &key) {
+  if (!Erase(root_.get(), key)) {
+    return false;
+  }
+  --size_;
+  // The tree shrinks at the root.
+  while (!root_->is_leaf) {
+    auto *inner = static_cast<Inner *>(root_.get());
+    if (inner->children.size() > 1) {
+      break;
+    }
+    root_ = inner->children.empty() ? std::make_unique<Leaf>() : std::move(inner->children[0]);
+  }
+  return true;
+}
+
+template<typename K, typename V, typename Compare>
+bool BPlusTree<K, V, Compare>::Erase(Node *node, const K &key) {
+  if (node->is_leaf) {
+    auto *leaf = static_cast<Leaf *>(node);
+    auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key, compare_);
+    if (it == leaf->keys.end() || !Equal(*it, key)) {
+      return false;
+    }
+    leaf->values.erase(leaf->values.begin() + (it - leaf->keys.begin()));
+    leaf->keys.erase(it);
+    return true;
+  }
+
+  auto *inner = static_cast<Inner *>(node);
+  auto index = ChildIndex(inner, key);
+  auto *child = inner->children[index].get();
+  if (!Erase(child, key)) {
+    return false;
+  }
+  bool empty = child->is_leaf ? child->keys.empty()
+                              : static_cast<Inner *>(child)->children.empty();
+  if (empty) {
+    if (child->is_leaf) {
+      auto *leaf = static_cast<Leaf *>(child);
+      if (leaf->prev) {
+        leaf->prev->next = leaf->next;
+      }
+      if (leaf->next) {
+        leaf->next->prev = leaf->prev;
+      }
+    }
+    // The keys of the removed child are now covered by its left (or right) sibling.
+    if (!inner->keys.empty()) {
+      inner->keys.erase(inner->keys.begin() + (index > 0 ? index - 1 : 0));
+    }
+    inner->children.erase(inner->children.begin() + index);
+  }
+  return true;
+}
+
+template<typename K, typename V, typename Compare>
+auto BPlusTree<K, V, Compare>::LowerBound(const K &key) const -> const_iterator {
+  const Node *node = root_.get();
+  while (!node->is_leaf) {
+    auto *inner = static_cast<const Inner *>(node);
+    node = inner->children[ChildIndex(inner, key)].get();
+  }
+  auto *leaf = static_cast<const Leaf *>(node);
+  auto pos = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key, compare_)
+      - leaf->keys.begin();
+  return const_iterator{leaf, static_cast<size_t>(pos)};
+}
+
+template<typename K, typename V, typename Compare>
+auto BPlusTree<K, V, Compare>::begin() const -> const_iterator {
+  const Node *node = root_.get();
+  while (!node->is_leaf) {
+    node = static_cast<const Inner *>(node)->children.front().get();
+  }
+  return const_iterator{static_cast<const Leaf *>(node), 0};
+}
+
+template<typename K, typename V, typename Compare>
+size_t BPlusTree<K, V, Compare>::height() const {
+  size_t height = 1;
+  for (const Node *node = root_.get(); !node->is_leaf; ++height) {
+    node = static_cast<const Inner *>(node)->children.front().get();
+  }
+  return height;
+}
+
+} // namespace keystore
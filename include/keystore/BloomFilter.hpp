@@ -0,0 +1,47 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace keystore {
+
+/**
+ * A Bloom filter over the 64-bit hashes of a set of keys (see `HashKey64()`): it never reports
+ * a key which was added as missing, while reporting a key which was not added as (possibly)
+ * present with a probability which only depends on the `bits_per_key` (about 1% for 10 bits).
+ *
+ * <p>The filter's bits can be saved (see `data()`) and loaded back, so that it can be stored
+ * along with the data it describes (e.g., in an `SSTable`).
+ *
+ * <p>This class is **not** thread-safe while keys are being added; once built, it can be read
+ * concurrently.
+ */
+class BloomFilter {
+ public:
+  /**
+   * @param keys how many keys will be added, at most
+   * @param bits_per_key the more bits, the fewer the false positives
+   */
+  BloomFilter(size_t keys, size_t bits_per_key);
+
+  /** Loads a filter saved from `data()`. */
+  explicit BloomFilter(std::string data);
+
+  void Add(uint64_t hash);
+
+  /** @return `false` if the key whose hash is `hash` was certainly not added */
+  bool MayContain(uint64_t hash) const;
+
+  /** @return the filter's bits, followed by the number of probes for each key */
+  const std::string &data() const { return data_; }
+
+ private:
+  std::string data_;
+  size_t bits_;
+  uint8_t probes_;
+};
+
+} // namespace keystore
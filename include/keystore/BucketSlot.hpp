@@ -0,0 +1,532 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <shared_mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "Entry.hpp"
+#include "Eviction.hpp"
+#include "HotKeyReplicas.hpp"
+#include "KeySketches.hpp"
+#include "KeyStore.hpp"
+#include "Rebalance.hpp"
+#include "ShardedCounters.hpp"
+#include "SizeEstimator.hpp"
+#include "SlabMemoryResource.hpp"
+#include "TimingWheel.hpp"
+#include "TokenIndex.hpp"
+
+namespace keystore {
+
+class WriteAheadLog;
+
+/**
+ * Creates the memory resource which will be used to allocate all the data for one bucket.
+ *
+ * <p>The resource must release all the memory it allocated when it is destroyed (as is the case
+ * for the standard `std::pmr` pool and monotonic resources, as well as the `SlabMemoryResource`).
+ */
+using MemoryResourceFactory = std::function<std::unique_ptr<std::pmr::memory_resource>()>;
+
+inline std::unique_ptr<std::pmr::memory_resource> MakeSlabMemoryResource() {
+  return std::make_unique<SlabMemoryResource>();
+}
+
+/**
+ * Whether the entries of a map with keys `K` and values `V` can be dropped by simply releasing
+ * the memory resource they were allocated from, without running their destructors: this is the
+ * case if their destructors have no effects other than returning memory to the same resource.
+ *
+ * <p>This is *not* the case for `std::string`, whose (non-inline) characters are allocated with
+ * the default allocator: use `std::pmr::string` instead.
+ */
+template<typename K, typename V>
+inline constexpr bool kReleasedWithArena =
+    (std::is_trivially_destructible_v<K> ||
+        std::uses_allocator_v<K, std::pmr::polymorphic_allocator<K>>) &&
+    (std::is_trivially_destructible_v<V> ||
+        std::uses_allocator_v<V, std::pmr::polymorphic_allocator<V>>);
+
+/**
+ * How many expired entries are reclaimed (at most) by each write to a bucket, see
+ * `BucketSlot::Store()`: this bounds the extra time that the bucket's lock is held for.
+ */
+inline constexpr size_t kExpirePerWrite = 4;
+
+/**
+ * All the data for one of the buckets owned by an `InMemoryKeyStore`, co-located with the mutex
+ * that protects it, and aligned to a cache line, so that two buckets never share one.
+ *
+ * <p>The `data` map (and its nodes) is allocated from a per-bucket `arena`: when the bucket is
+ * dropped, the arena is released in one go. The entries are also indexed by the token their key
+ * hashes to (see `TokenIndex`), so that the entries in any range of the hash ring can be found
+ * without scanning the whole bucket.
+ *
+ * <p>All access to the data should go through the slot's methods (rather than the `data` map
+ * directly) so that the per-bucket bookkeeping (the eviction policy, in cache mode, and the
+ * timing wheel, for entries with a TTL) is kept up to date; the caller must hold the `mutex`
+ * (shared, for the `const` methods; exclusively, for all others) and must have checked that the
+ * `bucket` is still owned.
+ */
+template<typename K, typename V>
+struct alignas(kCacheLineSize) BucketSlot {
+  using Map = EntryMap<K, V>;
+  using Node = EntryNode<K, V>;
+
+  // Named after the store and bucket, once allocated, for lock profiling.
+  mutable SharedMutex mutex{"BucketSlot::mutex"};
+
+  // The bucket whose data is stored in this slot, or `nullptr` if the bucket is no longer owned
+  // by the store: this can only be modified while holding the `mutex` exclusively.
+  BucketPtr bucket;
+
+  // Only valid while the `bucket` is owned; allocated from the `arena`.
+  Map *data = nullptr;
+  std::optional<TokenIndex<K, V>> tokens;
+  std::unique_ptr<std::pmr::memory_resource> arena;
+
+  // The estimated memory used by the entries (see `SizeEstimator`), kept up to date by every
+  // write: in cache mode, this is what the `CacheOptions::max_bytes` limit applies to.
+  long bytes = 0;
+
+  // Cache mode only: the store's cache state, and this bucket's eviction policy and usage.
+  CacheState *cache = nullptr;
+  std::unique_ptr<TinyLfuPolicy<K, V>> policy;
+  mutable std::atomic_ulong hits{0};
+  mutable std::atomic_ulong misses{0};
+  std::atomic_ulong evictions{0};
+
+  // Only allocated once the first entry with a TTL is stored in the bucket.
+  std::unique_ptr<TimingWheel<K, V>> wheel;
+  mutable std::atomic_ulong expired_reads{0};
+  std::atomic_ulong reclaimed{0};
+
+  // The progress of moving data out of this bucket, if a rebalance is under way; only modified by
+  // the (single) thread running the rebalance.
+  RebalanceProgress rebalance;
+
+  // The write-ahead log the bucket's writes are appended to (owned by the store), if any; and the
+  // last of its records included in the bucket's latest snapshot (or in the one it was restored
+  // from): the records up to this one are no longer needed to recover the bucket.
+  WriteAheadLog *wal = nullptr;
+  std::atomic_uint64_t snapshot_lsn{0};
+
+  // Always-on operation counters, updated by the store's operations (without the `mutex`).
+  mutable ShardedCounters counters;
+
+  // Only set if the store keeps sketches of the keys accessed (see `RecordKey()`): once set, this
+  // is never reset (only cleared, when the data is dropped) so that it can be read without the
+  // `mutex`.
+  std::unique_ptr<KeySketches<K>> sketches;
+
+  // Only set if the store replicates the bucket's hot keys (see `SampleRead()`): as the
+  // `sketches`, this is never reset once set, so that replicas can be read without the `mutex`.
+  std::unique_ptr<HotKeyReplicas<K, V>> replicas;
+
+  // The number of entries (and of those with a TTL), their estimated bytes and those of the
+  // indexes, as of the last write to the bucket: published by the writers, so that they can be
+  // read (e.g., by `InMemoryKeyStore::Stats()`) without acquiring the `mutex`.
+  std::atomic_size_t published_size{0};
+  std::atomic_size_t published_scheduled{0};
+  std::atomic_long published_bytes{0};
+  std::atomic_size_t published_overhead{0};
+
+  BucketSlot() = default;
+  BucketSlot(const BucketSlot &) = delete;
+  BucketSlot &operator=(const BucketSlot &) = delete;
+
+  ~BucketSlot() { Drop(); }
+
+  /**
+   * Creates a new, empty, `data` map in the given `resource`, dropping the current one, if any.
+   *
+   * @param resource the arena for the bucket's data
+   * @param cache_state if not `nullptr`, the bucket will evict entries to stay within the limits
+   */
+  void Allocate(std::unique_ptr<std::pmr::memory_resource> resource,
+                CacheState *cache_state = nullptr) {
+    Drop();
+    arena = std::move(resource);
+    void *mem = arena->allocate(sizeof(Map), alignof(Map));
+    data = new(mem) Map(std::pmr::polymorphic_allocator<std::byte>(arena.get()));
+    tokens.emplace(arena.get());
+    if (cache_state) {
+      EnableCache(cache_state);
+    }
+    Publish();
+  }
+
+  /**
+   * Drops all the data, and releases the arena: if the entries can be released with the arena
+   * (see `kReleasedWithArena`) this takes O(1) in the number of entries; otherwise (e.g., for
+   * `std::string` keys or values) each entry is destroyed, in O(n).
+   */
+  void Drop() {
+    if (data) {
+      if (cache) {
+        cache->entries -= data->size();
+        cache->bytes -= bytes;
+      }
+      if constexpr (!kReleasedWithArena<K, V>) {
+        data->~Map();
+      }
+      data = nullptr;
+    }
+    tokens.reset();
+    arena.reset();
+    policy.reset();
+    wheel.reset();
+    rebalance = {};
+    cache = nullptr;
+    bytes = 0;
+    snapshot_lsn = 0;
+    if (sketches) {
+      sketches->Reset();
+    }
+    if (replicas) {
+      replicas->Clear();
+    }
+    Publish();
+  }
+
+  /**
+   * Takes over all the data of the `other` slot (which is left empty), dropping the current
+   * data, if any: the map, its nodes and all the per-bucket indexes are handed over as they are,
+   * along with the arena they were allocated from, so that no entry is copied (or even visited,
+   * unless the eviction policy needs to be rebuilt).
+   *
+   * <p>The caller must hold both slots' mutexes exclusively.
+   *
+   * @param cache_state if not `nullptr`, the bucket will evict entries to stay within the limits
+   */
+  void Adopt(BucketSlot &other, CacheState *cache_state = nullptr) {
+    Drop();
+    if (other.cache) {
+      other.cache->entries -= other.data->size();
+      other.cache->bytes -= other.bytes;
+      other.cache = nullptr;
+    }
+    data = std::exchange(other.data, nullptr);
+    tokens = std::move(other.tokens);
+    other.tokens.reset();
+    arena = std::move(other.arena);
+    wheel = std::move(other.wheel);
+    expired_reads.store(other.expired_reads.exchange(0));
+    reclaimed.store(other.reclaimed.exchange(0));
+    hits.store(other.hits.exchange(0));
+    misses.store(other.misses.exchange(0));
+    evictions.store(other.evictions.exchange(0));
+    // The sketches are only kept if this slot has (compatible) sketches too.
+    if (sketches && other.sketches && sketches->Mergeable(*other.sketches)) {
+      sketches->Merge(*other.sketches);
+    }
+
+    // The eviction policy is only kept if the adopting bucket is a cache too.
+    auto other_policy = std::move(other.policy);
+    bytes = std::exchange(other.bytes, 0);
+    other.Drop();
+    if (cache_state && other_policy) {
+      policy = std::move(other_policy);
+      JoinCache(cache_state);
+      Evict();
+    } else if (cache_state) {
+      EnableCache(cache_state);
+    }
+    Publish();
+  }
+
+  /**
+   * Starts tracking all the bucket's entries in an eviction policy, and evicts entries as
+   * necessary to stay within the `cache_state` limits.
+   */
+  void EnableCache(CacheState *cache_state) {
+    policy = std::make_unique<TinyLfuPolicy<K, V>>(cache_state->options.window_ratio,
+                                                   cache_state->options.sketch_width);
+    for (auto &node : *data) {
+      policy->OnInsert(&node);
+    }
+    JoinCache(cache_state);
+    Evict();
+    Publish();
+  }
+
+  size_t size() const { return data->size(); }
+
+  /** Records an access to `key` in the bucket's sketches, if any. */
+  void RecordKey(const HashedKey<K> &key) const {
+    if (sketches) {
+      sketches->Record(key.key, key.hash);
+    }
+  }
+
+  /**
+   * @return a pointer to the value associated with `key`, or `nullptr` if not found (or if it
+   *    has expired, even if not yet reclaimed); this is only valid while the mutex is held.
+   */
+  const V *Find(const HashedKey<K> &key) const {
+    auto pos = data->find(key);
+    if (pos != data->end() && pos->second.IsExpired(NowMillis())) {
+      expired_reads.fetch_add(1, std::memory_order_relaxed);
+      pos = data->end();
+    }
+    if (cache) {
+      policy->RecordAccess(key.hash);
+      if (pos != data->end()) {
+        pos->second.referenced.store(true, std::memory_order_relaxed);
+        hits.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        misses.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    return pos != data->end() ? &pos->second.value : nullptr;
+  }
+
+  /**
+   * Counts a sampled read of `key` towards finding the hot keys and, if it is one, replicates
+   * it (see `HotKeyReplicas`); the caller must hold the `mutex` shared.
+   */
+  void SampleRead(const HashedKey<K> &key) const {
+    if (!replicas || !replicas->Observe(key)) {
+      return;
+    }
+    auto pos = data->find(key);
+    if (pos != data->end() && !pos->second.IsExpired(NowMillis())) {
+      replicas->Promote(key, pos->second.value, pos->second.expires_at);
+    }
+  }
+
+  /**
+   * Associates `value` with `key`, replacing the current value (and its TTL), if any.
+   *
+   * <p>If any entries in this bucket have a TTL, this will also reclaim (up to
+   * `kExpirePerWrite`) entries which have expired.
+   *
+   * @param expires_at when the entry will expire (see `NowMillis()`), or 0 if it never does
+   */
+  void Store(const HashedKey<K> &key, const V &value, int64_t expires_at = 0) {
+    if (wheel) {
+      Expire(NowMillis(), kExpirePerWrite);
+    }
+    if (replicas) {
+      replicas->Invalidate(key);
+    }
+    auto [pos, inserted] = data->try_emplace(key, value);
+    if (inserted) {
+      tokens->Add(&*pos);
+    }
+    if (wheel || expires_at != 0) {
+      Reschedule(&*pos, expires_at);
+    }
+    if (inserted) {
+      Account(EstimateSize(*pos), 1);
+    } else {
+      Account(-EstimateSize(*pos), 0);
+      pos->second.value = value;
+      Account(EstimateSize(*pos), 0);
+    }
+    if (cache) {
+      if (inserted) {
+        policy->OnInsert(&*pos);
+      } else {
+        policy->RecordAccess(key.hash);
+        pos->second.referenced.store(true, std::memory_order_relaxed);
+      }
+      Evict();
+    }
+    Publish();
+  }
+
+  /** @return whether `key` was found and removed */
+  bool Erase(const HashedKey<K> &key) {
+    auto pos = data->find(key);
+    if (pos == data->end()) {
+      return false;
+    }
+    if (cache) {
+      policy->OnRemove(&*pos);
+    }
+    EraseNode(pos);
+    Publish();
+    return true;
+  }
+
+  /**
+   * Removes (up to `budget`) entries which expired at, or before, `now`.
+   *
+   * @return the number of entries removed
+   */
+  size_t Expire(int64_t now, size_t budget) {
+    if (!wheel) {
+      return 0;
+    }
+    auto count = wheel->Advance(now, budget, [this](Node *node) {
+      if (cache) {
+        policy->OnRemove(node);
+      }
+      EraseNode(data->find(node->first));
+    });
+    reclaimed.fetch_add(count, std::memory_order_relaxed);
+    Publish();
+    return count;
+  }
+
+  /**
+   * Invokes `func(token, nodes)` on the non-empty tokens (see `TokenIndex`), in order, starting
+   * from the `cursor`, and advances the `cursor` past them; `func` returns how many of the
+   * `nodes` it visited (possibly none, if it could skip the whole token).
+   *
+   * <p>The scan stops once (at least) `max_entries` entries, or `max_entries` tokens, have been
+   * visited, so that it can be resumed after the lock has been released (and re-acquired).
+   *
+   * @return the number of entries visited
+   */
+  template<typename Func>
+  size_t ScanTokens(ScanCursor &cursor, size_t max_entries, Func func) const {
+    size_t visited = 0;
+    size_t tokens_visited = 0;
+    cursor.position = tokens->ForEachFrom(cursor.position,
+        [&](uint32_t token, const typename TokenIndex<K, V>::Nodes &nodes) {
+          visited += func(token, nodes);
+          return visited < max_entries && ++tokens_visited < max_entries;
+        });
+    return visited;
+  }
+
+  /** @return the number of entries with a TTL, which have not been reclaimed yet */
+  size_t scheduled() const { return wheel ? wheel->size() : 0; }
+
+  /**
+   * Updates the `published_` values: this must be called (holding the `mutex` exclusively) after
+   * every change to the bucket's data.
+   */
+  void Publish() {
+    published_size.store(data ? data->size() : 0, std::memory_order_relaxed);
+    published_scheduled.store(scheduled(), std::memory_order_relaxed);
+    published_bytes.store(bytes, std::memory_order_relaxed);
+    published_overhead.store(Overhead(), std::memory_order_relaxed);
+  }
+
+  /**
+   * @return the memory used by the bucket, as of the last write (see `Publish()`); this can be
+   *    called without holding the `mutex`
+   */
+  MemoryFootprint PublishedFootprint() const {
+    MemoryFootprint footprint;
+    footprint.entries = published_size.load(std::memory_order_relaxed);
+    footprint.data_bytes = published_bytes.load(std::memory_order_relaxed);
+    footprint.overhead_bytes = published_overhead.load(std::memory_order_relaxed);
+    return footprint;
+  }
+
+  /**
+   * Invokes `func(key, entry)` on each of the entries, until it returns `false`; expired entries
+   * which have not been reclaimed yet are skipped.
+   *
+   * @return `false` if the iteration was stopped by `func`
+   */
+  template<typename Func>
+  bool ForEach(Func func) const {
+    auto now = NowMillis();
+    for (const auto &[hashed, entry] : *data) {
+      if (entry.IsExpired(now)) {
+        continue;
+      }
+      if (!func(hashed.key, entry)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static long EstimateSize(const Node &node) {
+    // The node itself is allocated with, at least, a pointer to the next node.
+    return sizeof(void *) + sizeof(Node) - sizeof(K) - sizeof(V) +
+        keystore::EstimateSize(node.first.key) + keystore::EstimateSize(node.second.value);
+  }
+
+  void Reschedule(Node *node, int64_t expires_at) {
+    if (!wheel) {
+      wheel = std::make_unique<TimingWheel<K, V>>();
+    }
+    wheel->Cancel(node);
+    node->second.expires_at = expires_at;
+    if (expires_at != 0) {
+      wheel->Schedule(node);
+    }
+  }
+
+  // Removes the entry from the bucket, the token index and the timing wheel; the caller must have
+  // already removed it from the eviction policy, if any.
+  void EraseNode(typename Map::iterator pos) {
+    if (replicas) {
+      replicas->Invalidate(pos->first);
+    }
+    tokens->Remove(&*pos);
+    if (wheel) {
+      wheel->Cancel(&*pos);
+    }
+    Account(-EstimateSize(*pos), -1);
+    data->erase(pos);
+  }
+
+  void Account(long delta_bytes, long delta_entries) {
+    bytes += delta_bytes;
+    if (cache) {
+      cache->bytes += delta_bytes;
+      cache->entries += delta_entries;
+    }
+  }
+
+  // Adds this bucket's entries to the store's cache usage.
+  void JoinCache(CacheState *cache_state) {
+    cache = cache_state;
+    cache->bytes += bytes;
+    cache->entries += static_cast<long>(data->size());
+  }
+
+  // The memory used by the map itself (and its array of buckets), by the token index and by the
+  // sketches and hot-key replicas, if any.
+  size_t Overhead() const {
+    if (!data) {
+      return 0;
+    }
+    return sizeof(Map) + data->bucket_count() * sizeof(void *) +
+        tokens->EstimateSize(data->size()) + (sketches ? sketches->EstimateSize() : 0) +
+        (replicas ? replicas->EstimateSize() : 0);
+  }
+
+  bool OverBudget() const {
+    const auto &options = cache->options;
+    bool global = options.scope == CacheOptions::Scope::kGlobal;
+    long used_entries = global ? cache->entries.load() : static_cast<long>(data->size());
+    long used_bytes = global ? cache->bytes.load() : bytes;
+    return (options.max_entries > 0 && used_entries > static_cast<long>(options.max_entries)) ||
+        (options.max_bytes > 0 && used_bytes > static_cast<long>(options.max_bytes));
+  }
+
+  // Evicts entries from this bucket, until the cache is within its limits (or this bucket is
+  // empty: with a global scope, other buckets will evict their entries, as they are written to).
+  void Evict() {
+    while (OverBudget()) {
+      auto victim = policy->SelectVictim();
+      if (!victim) {
+        break;
+      }
+      EraseNode(data->find(victim->first));
+      evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    policy->Maintain();
+  }
+};
+
+} // namespace keystore
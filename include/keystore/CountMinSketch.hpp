@@ -0,0 +1,97 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace keystore {
+
+/**
+ * A Count-Min Sketch, which estimates the frequency of items (identified by their 64-bit hash)
+ * in a stream, using a fixed amount of memory.
+ *
+ * <p>Counters are of type `Counter`, and saturate at `MaxCount`; to let the sketch "forget" old
+ * history, all counters are halved every `sample_size` increments: use `kNoAging` to count
+ * forever. See the `CountMinSketch` and `WideCountMinSketch` aliases below.
+ *
+ * <p>All operations are lock-free, and can be called concurrently: updates are approximate
+ * (a concurrent increment may be lost while the counters are being halved) which is
+ * acceptable for a probabilistic data structure.
+ *
+ * <p>See: Cormode, Muthukrishnan, "An Improved Data Stream Summary: The Count-Min Sketch and its
+ * Applications" and Einziger et al., "TinyLFU: A Highly Efficient Cache Admission Policy".
+ */
+template<typename Counter, Counter MaxCount>
+class BasicCountMinSketch {
+ public:
+  /** The number of rows (independent hash functions) in the sketch. */
+  static constexpr size_t kDepth = 4;
+
+  /** Counters saturate at this value. */
+  static constexpr Counter kMaxCount = MaxCount;
+
+  /** A `sample_size` which never ages the counters. */
+  static constexpr unsigned long kNoAging = ~0UL;
+
+  /**
+   * @param width the number of counters in each row, rounded up to a power of 2
+   * @param sample_size how many increments before all counters are halved; if 0, ten times the
+   *    `width`
+   */
+  explicit BasicCountMinSketch(size_t width = 4096, unsigned long sample_size = 0);
+
+  BasicCountMinSketch(const BasicCountMinSketch &) = delete;
+  BasicCountMinSketch &operator=(const BasicCountMinSketch &) = delete;
+
+  /**
+   * Records one occurrence of the item whose hash is `hash`.
+   *
+   * @return the estimated frequency of the item, including this occurrence
+   */
+  Counter Increment(uint64_t hash);
+
+  /** @return the estimated frequency of the item whose hash is `hash`. */
+  Counter Estimate(uint64_t hash) const;
+
+  /** Halves all counters, so that the sketch progressively forgets old history. */
+  void Age();
+
+  /**
+   * Adds the counts of `other` to this sketch's, so that it estimates the frequencies over both
+   * streams.
+   *
+   * @throws std::invalid_argument if the two sketches have different widths
+   */
+  void Merge(const BasicCountMinSketch &other);
+
+  /** Clears all counters. */
+  void Reset();
+
+  size_t width() const { return width_; }
+
+  /** @return the memory used by the counters, in bytes. */
+  size_t EstimateSize() const { return sizeof(*this) + kDepth * width_ * sizeof(Counter); }
+
+ private:
+  size_t Index(uint64_t hash, size_t row) const;
+  void Halve();
+
+  size_t width_;
+  unsigned long sample_size_;
+  std::atomic_ulong additions_{0};
+  std::unique_ptr<std::atomic<Counter>[]> counters_;
+};
+
+/** The frequency filter of the TinyLFU policy (see `TinyLfuPolicy`): 4-bit counts, aged. */
+using CountMinSketch = BasicCountMinSketch<uint8_t, 15>;
+
+/** Counts up to 2^32 - 1 occurrences, suitable to find heavy hitters (see `KeySketches`). */
+using WideCountMinSketch = BasicCountMinSketch<uint32_t, UINT32_MAX>;
+
+extern template class BasicCountMinSketch<uint8_t, 15>;
+extern template class BasicCountMinSketch<uint32_t, UINT32_MAX>;
+
+} // namespace keystore
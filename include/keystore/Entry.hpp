@@ -0,0 +1,78 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "HashedKey.hpp"
+
+namespace keystore {
+
+/**
+ * The value stored in an `InMemoryKeyStore` for each key, along with the per-entry metadata that
+ * the store needs to keep.
+ *
+ * <p>An `Entry` is allocator-aware: when it is allocated from a `std::pmr` memory resource, its
+ * `value` is allocated from the same resource, if `V` is itself a `std::pmr` type (i.e., it takes
+ * a `polymorphic_allocator` as its last constructor argument, such as `std::pmr::string`).
+ *
+ * @tparam V the type of the stored values
+ */
+template<typename V>
+struct Entry {
+  using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+  V value;
+
+  // Cache mode only: the region and position of the entry in the bucket's eviction policy,
+  // and whether it was accessed since the CLOCK hand last swept past it.
+  uint32_t policy_pos = 0;
+  uint8_t policy_region = 0;
+  mutable std::atomic_bool referenced{false};
+
+  // Only for entries with a TTL: when the entry expires (see `NowMillis()`; 0 means never), and
+  // its slot and position in the bucket's `TimingWheel`.
+  static constexpr uint16_t kNotScheduled = UINT16_MAX;
+  int64_t expires_at = 0;
+  uint32_t wheel_pos = 0;
+  uint16_t wheel_slot = kNotScheduled;
+
+  // The entry's position in the bucket's `TokenIndex`.
+  uint32_t token_pos = 0;
+
+  bool IsExpired(int64_t now) const { return expires_at != 0 && expires_at <= now; }
+
+  Entry(std::allocator_arg_t, const allocator_type &alloc) :
+      value(MakeWithAllocator<V>(alloc)) { }
+
+  Entry(std::allocator_arg_t, const allocator_type &alloc, const V &value) :
+      value(MakeWithAllocator<V>(alloc, value)) { }
+
+  Entry(std::allocator_arg_t, const allocator_type &alloc, const Entry &other) :
+      value(MakeWithAllocator<V>(alloc, other.value)) { }
+
+  Entry(std::allocator_arg_t, const allocator_type &alloc, Entry &&other) :
+      value(MakeWithAllocator<V>(alloc, std::move(other.value))) { }
+};
+
+/**
+ * The map which holds the data of one bucket: its keys carry their own hash (see `HashedKey`).
+ */
+template<typename K, typename V>
+using EntryMap = std::pmr::unordered_map<HashedKey<K>, Entry<V>, typename HashedKey<K>::Hasher>;
+
+/**
+ * A node in an `EntryMap`: the per-bucket indexes (eviction policy, timing wheel and token index)
+ * all keep pointers to these, which remain valid until the entry is removed.
+ */
+template<typename K, typename V>
+using EntryNode = typename EntryMap<K, V>::value_type;
+
+} // namespace keystore
@@ -0,0 +1,205 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "CountMinSketch.hpp"
+#include "Entry.hpp"
+#include "SizeEstimator.hpp"
+
+namespace keystore {
+
+/**
+ * Configures an `InMemoryKeyStore` to run in "cache mode," where entries are evicted to keep
+ * the store within a memory budget (see `InMemoryKeyStore::EnableCache()`).
+ */
+struct CacheOptions {
+  /** Whether the limits apply to each bucket individually, or to the store as a whole. */
+  enum class Scope { kPerBucket, kGlobal };
+
+  /** Maximum number of entries; 0 means no limit. */
+  size_t max_entries = 0;
+
+  /** Maximum (estimated, see `EstimateSize()`) number of bytes; 0 means no limit. */
+  size_t max_bytes = 0;
+
+  Scope scope = Scope::kGlobal;
+
+  /** The fraction of each bucket's entries which are kept in the admission window. */
+  double window_ratio = 0.01;
+
+  /** The width of each bucket's frequency sketch, see `CountMinSketch`. */
+  size_t sketch_width = 4096;
+};
+
+/**
+ * The cache configuration and usage, shared by all the buckets of a store: usage is kept in
+ * atomic counters, so that no global lock is ever needed to enforce the limits.
+ */
+struct CacheState {
+  explicit CacheState(CacheOptions opts) : options{opts} { }
+
+  const CacheOptions options;
+  std::atomic_long entries{0};
+  std::atomic_long bytes{0};
+};
+
+/**
+ * A (simplified) W-TinyLFU eviction policy, for the entries of a single bucket.
+ *
+ * <p>New entries are admitted into a small "window" region (a fraction of the entries, given by
+ * `window_ratio`) while the rest of the entries are kept in the "main" region; both regions are
+ * managed as a CLOCK (an approximation of LRU, where an access only needs to set the entry's
+ * `referenced` bit, which can be done while holding a shared lock).
+ *
+ * <p>When an entry must be evicted, the window's victim (the "candidate") is compared with the
+ * main region's victim, using their estimated access frequency (as recorded in a
+ * `CountMinSketch`): the least frequently accessed of the two is evicted, and the candidate
+ * moves to the main region if it wins. This makes the policy scan-resistant: a scan can only
+ * flood the window, but will never push frequently accessed entries out of the main region.
+ *
+ * <p>See: Einziger et al., "TinyLFU: A Highly Efficient Cache Admission Policy."
+ *
+ * <p>Apart from `RecordAccess()`, this class is **not** thread-safe: the bucket's mutex must be
+ * held exclusively when calling any of the other methods.
+ */
+template<typename K, typename V>
+class TinyLfuPolicy {
+ public:
+  using Node = EntryNode<K, V>;
+
+  TinyLfuPolicy(double window_ratio, size_t sketch_width) :
+      window_ratio_{window_ratio}, sketch_{sketch_width} { }
+
+  /**
+   * Records an access (hit or miss) to the key whose hash (see `HashKey64()`) is `hash`; may be
+   * called while holding a shared lock.
+   */
+  void RecordAccess(uint64_t hash) {
+    sketch_.Increment(hash);
+  }
+
+  /** A new entry was added to the bucket. */
+  void OnInsert(Node *node) {
+    RecordAccess(node->first.hash);
+    Add(kWindow, node);
+  }
+
+  /** The entry is about to be removed from the bucket. */
+  void OnRemove(Node *node) {
+    Remove(node);
+  }
+
+  /**
+   * Selects the next entry to evict, and removes it from the policy; the caller must then
+   * remove it from the bucket.
+   *
+   * @return the entry to evict, or `nullptr` if there are no entries left
+   */
+  Node *SelectVictim();
+
+  /**
+   * Moves the entries overflowing the window into the main region; this is only needed when no
+   * evictions take place (and, thus, no admission decisions are made).
+   */
+  void Maintain() {
+    while (regions_[kWindow].nodes.size() > WindowTarget()) {
+      auto node = regions_[kWindow].nodes[Sweep(kWindow)];
+      Remove(node);
+      Add(kMain, node);
+    }
+  }
+
+  size_t size() const { return regions_[kWindow].nodes.size() + regions_[kMain].nodes.size(); }
+
+ private:
+  enum Region : uint8_t { kWindow = 0, kMain = 1 };
+
+  struct Clock {
+    std::vector<Node *> nodes;
+    size_t hand = 0;
+  };
+
+  size_t WindowTarget() const {
+    return std::max(size_t{1}, static_cast<size_t>(window_ratio_ * size()));
+  }
+
+  uint8_t Frequency(const Node *node) const {
+    return sketch_.Estimate(node->first.hash);
+  }
+
+  void Add(Region region, Node *node) {
+    auto &clock = regions_[region];
+    node->second.policy_region = region;
+    node->second.policy_pos = clock.nodes.size();
+    clock.nodes.push_back(node);
+  }
+
+  void Remove(Node *node) {
+    auto &clock = regions_[node->second.policy_region];
+    auto pos = node->second.policy_pos;
+    clock.nodes[pos] = clock.nodes.back();
+    clock.nodes[pos]->second.policy_pos = pos;
+    clock.nodes.pop_back();
+  }
+
+  // Advances the CLOCK hand, clearing the `referenced` bits along the way, until it finds an
+  // entry which was not recently accessed; the region must not be empty.
+  size_t Sweep(Region region);
+
+  double window_ratio_;
+  std::array<Clock, 2> regions_;
+  CountMinSketch sketch_;
+};
+
+template<typename K, typename V>
+size_t TinyLfuPolicy<K, V>::Sweep(Region region) {
+  auto &clock = regions_[region];
+  while (true) {
+    if (clock.hand >= clock.nodes.size()) {
+      clock.hand = 0;
+    }
+    auto &entry = clock.nodes[clock.hand]->second;
+    if (!entry.referenced.exchange(false, std::memory_order_relaxed)) {
+      return clock.hand;
+    }
+    ++clock.hand;
+  }
+}
+
+template<typename K, typename V>
+typename TinyLfuPolicy<K, V>::Node *TinyLfuPolicy<K, V>::SelectVictim() {
+  auto &window = regions_[kWindow].nodes;
+  auto &main = regions_[kMain].nodes;
+
+  if (window.empty() && main.empty()) {
+    return nullptr;
+  }
+  if (main.empty() || (!window.empty() && window.size() >= WindowTarget())) {
+    auto candidate = window[Sweep(kWindow)];
+    Remove(candidate);
+    if (main.empty()) {
+      return candidate;
+    }
+    auto victim = main[Sweep(kMain)];
+    if (Frequency(candidate) > Frequency(victim)) {
+      Remove(victim);
+      Add(kMain, candidate);
+      return victim;
+    }
+    return candidate;
+  }
+  auto victim = main[Sweep(kMain)];
+  Remove(victim);
+  return victim;
+}
+
+} // namespace keystore
@@ -0,0 +1,192 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "ConsistentHash.hpp"
+
+namespace keystore {
+
+template<typename T>
+inline float HashKey(const T &key) {
+  std::string key_str = std::string{key};
+  return consistent_hash(key_str);
+}
+
+inline float HashKey(const char *key) {
+  unsigned long iter = strlen(key) / sizeof(long);
+  unsigned long remainder = strlen(key) % sizeof(long);
+
+  long n = 0;
+  long accum = 0;
+  for (int i = 0; i < iter; ++i) {
+    memcpy(&n, key + sizeof(long) * i, sizeof(long));
+    accum += n;
+  }
+  if (remainder > 0) {
+    memcpy(&n, key + sizeof(long) * iter, remainder);
+    accum += n;
+  }
+  float f = static_cast<float >(accum % kModulo) / kModulo;
+  VLOG(3) << key << " hashes to " << f;
+
+  return f;
+}
+
+template<>
+inline float HashKey(const long &key) {
+  return static_cast<float >(key % kModulo) / kModulo;
+}
+
+template<>
+inline float HashKey<int>(const int &key) {
+  return static_cast<float >(key % kModulo) / kModulo;
+}
+
+template<>
+inline float HashKey(const std::string &key) {
+  return consistent_hash(key);
+}
+
+/**
+ * Packs a key's `position` on the hash ring (see `HashKey()`) and 32 more `bits` of its hash into
+ * a single 64-bit hash.
+ *
+ * <p>The position is kept (exactly) in the upper 32 bits: as it is never negative, hashes compare
+ * in the same order as the positions they contain.
+ */
+inline uint64_t PackHash(float position, uint32_t bits) {
+  uint32_t upper;
+  static_assert(sizeof(upper) == sizeof(position));
+  memcpy(&upper, &position, sizeof(upper));
+  return (static_cast<uint64_t>(upper) << 32U) | bits;
+}
+
+/**
+ * @return the position on the hash ring of a key whose 64-bit hash is `hash`, see `PackHash()`
+ */
+inline float PositionOf(uint64_t hash) {
+  auto upper = static_cast<uint32_t>(hash >> 32U);
+  float position;
+  memcpy(&position, &upper, sizeof(position));
+  return position;
+}
+
+/**
+ * Scrambles the bits of an integer key (the "finalizer" of SplitMix64), as its position on the
+ * ring only depends on its value modulo `kModulo`.
+ */
+inline uint32_t MixBits(uint64_t x) {
+  x = (x ^ (x >> 30U)) * 0xbf58476d1ce4e5b9UL;
+  x = (x ^ (x >> 27U)) * 0x94d049bb133111ebUL;
+  return static_cast<uint32_t>(x ^ (x >> 31U));
+}
+
+/**
+ * Computes the 64-bit hash of `key`: its position on the ring (the same as `HashKey(key)`) and
+ * enough other bits to tell apart the keys which are mapped to the same position.
+ *
+ * <p>This is the only hash of the key computed by an `InMemoryKeyStore`, see `HashedKey`.
+ */
+template<typename T>
+inline uint64_t HashKey64(const T &key) {
+  uint32_t bits;
+  float position = consistent_hash(std::string{key}, &bits);
+  return PackHash(position, bits);
+}
+
+inline uint64_t HashKey64(const char *key) {
+  return PackHash(HashKey(key), std::hash<std::string_view>{}(key));
+}
+
+template<>
+inline uint64_t HashKey64(const long &key) {
+  return PackHash(HashKey(key), MixBits(key));
+}
+
+template<>
+inline uint64_t HashKey64<int>(const int &key) {
+  return PackHash(HashKey(key), MixBits(key));
+}
+
+template<>
+inline uint64_t HashKey64(const std::string &key) {
+  uint32_t bits;
+  float position = consistent_hash(key, &bits);
+  return PackHash(position, bits);
+}
+
+/**
+ * Constructs a `T` from the `args`, passing it the `alloc`ator too, if `T` is allocator-aware
+ * (i.e., it takes a `polymorphic_allocator` as its last constructor argument, such as
+ * `std::pmr::string`).
+ */
+template<typename T, typename... Args>
+inline T MakeWithAllocator(const std::pmr::polymorphic_allocator<std::byte> &alloc,
+                           Args &&... args) {
+  if constexpr (std::uses_allocator_v<T, std::pmr::polymorphic_allocator<std::byte>>) {
+    return T(std::forward<Args>(args)..., alloc);
+  } else {
+    return T(std::forward<Args>(args)...);
+  }
+}
+
+/**
+ * A key, along with its 64-bit hash (see `HashKey64()`): this is what an `InMemoryKeyStore` keys
+ * its data maps with, so that each key is hashed exactly once, when it first reaches the store.
+ *
+ * <p>The same hash is used to find the key's bucket (its `position()` on the ring), its token
+ * (see `TokenOf()`), and to look it up in the bucket's map (see `Hasher`): neither rehashing the
+ * map, when it grows, nor scanning the bucket (e.g., to rebalance it) ever needs to hash the keys
+ * again. Keys are only compared (after their hashes) if their hashes match.
+ *
+ * <p>As with `Entry`, when allocated from a `std::pmr` memory resource, the `key` is allocated
+ * from the same resource, if `K` is itself a `std::pmr` type.
+ *
+ * @tparam K the type of the key, must be possible to hash it using one of the `HashKey64`
+ *      functions variant.
+ */
+template<typename K>
+struct HashedKey {
+  using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+  /** Returns the cached hash, as the hash function of the data maps. */
+  struct Hasher {
+    size_t operator()(const HashedKey &hashed) const noexcept { return hashed.hash; }
+  };
+
+  K key;
+  uint64_t hash;
+
+  explicit HashedKey(const K &key) : key{key}, hash{HashKey64(key)} { }
+
+  /** For a `key` which has already been hashed; `hash` must be `HashKey64(key)`. */
+  HashedKey(const K &key, uint64_t hash) : key{key}, hash{hash} { }
+
+  HashedKey(const HashedKey &) = default;
+  HashedKey(HashedKey &&) noexcept = default;
+
+  HashedKey(std::allocator_arg_t, const allocator_type &alloc, const HashedKey &other) :
+      key(MakeWithAllocator<K>(alloc, other.key)), hash{other.hash} { }
+
+  HashedKey(std::allocator_arg_t, const allocator_type &alloc, HashedKey &&other) :
+      key(MakeWithAllocator<K>(alloc, std::move(other.key))), hash{other.hash} { }
+
+  /** @return the key's position on the ring, the same as `HashKey(key)` */
+  float position() const { return PositionOf(hash); }
+
+  bool operator==(const HashedKey &other) const { return hash == other.hash && key == other.key; }
+};
+
+} // namespace keystore
@@ -0,0 +1,325 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "json.hpp"
+
+#include "CountMinSketch.hpp"
+#include "HashedKey.hpp"
+#include "KeySketches.hpp"
+#include "ShardedCounters.hpp"
+#include "TimingWheel.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * The configuration of the read replicas of each bucket's hot keys, see
+ * `InMemoryKeyStore::EnableHotKeyReplication()`.
+ */
+struct ReplicationOptions {
+  // How many keys, at most, each bucket replicates.
+  size_t max_keys = 8;
+
+  // One in this many reads (a power of 2) is served by the bucket even if the key is
+  // replicated, and counted towards finding the hot keys.
+  uint32_t sample_every = 16;
+
+  // A key is replicated once this many of its reads have been sampled: as the counts are halved
+  // every 10 x `sketch_width` samples, this is relative to the bucket's recent reads.
+  uint32_t promote_after = 16;
+
+  // The width of the Count-Min sketch which counts the sampled reads.
+  size_t sketch_width = 1024;
+};
+
+/**
+ * Read-only copies of the most frequently read keys of a bucket, one for each of the
+ * `kCounterShards` shards that threads are assigned to (see `ThisThreadShard()`).
+ *
+ * <p>Reading a key from the bucket requires acquiring its lock, shared: under a skewed workload,
+ * all the threads reading the same few keys keep writing to the same cache line (the lock's
+ * reader count) which caps the read throughput of the whole bucket. A thread reading a
+ * replicated key, instead, only locks its own shard, in a cache line of its own, which no other
+ * thread (up to `kCounterShards` of them) ever writes to.
+ *
+ * <p>Keys are promoted once enough of their reads are sampled (see `Observe()`); when all
+ * the `max_keys` replicas are taken, a key only replaces the least frequently read one, if it
+ * is read more often. Any write to a replicated key (including its removal, expiry or eviction)
+ * invalidates all its replicas, before the write completes: the next sampled read of the key
+ * promotes it again, if it is still hot.
+ *
+ * <p>Promotions (and the bucket's sampled reads) must hold the bucket's lock shared, and all
+ * other changes must hold it exclusively; lookups (`Find()`) need no lock at all.
+ */
+template<typename K, typename V>
+class HotKeyReplicas {
+ public:
+  /**
+   * @throws std::invalid_argument if the options are not valid
+   */
+  explicit HotKeyReplicas(const ReplicationOptions &options) :
+      options_{options},
+      detector_{options.sketch_width},
+      members_{new std::atomic_uint64_t[std::max(options.max_keys, size_t{1})]()} {
+    if (options.max_keys == 0 || options.promote_after == 0 || options.sample_every == 0 ||
+        (options.sample_every & (options.sample_every - 1)) != 0) {
+      throw std::invalid_argument("Invalid hot-key replication options: max_keys and "
+                                  "promote_after must be positive, and sample_every a power of 2");
+    }
+  }
+
+  HotKeyReplicas(const HotKeyReplicas &) = delete;
+  HotKeyReplicas &operator=(const HotKeyReplicas &) = delete;
+
+  /** @return whether the read about to run on this thread should be served by the bucket */
+  bool Sample() const {
+    // A per-thread xorshift generator, as in `SampleLatency()`.
+    thread_local uint32_t state = 0x85EBCA6BU + static_cast<uint32_t>(ThisThreadShard());
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state & (options_.sample_every - 1)) == 0;
+  }
+
+  /**
+   * @return the value of `key`, from this thread's replica; or nothing, if the key is not
+   *    replicated (or has expired), and must be looked up in the bucket
+   */
+  std::optional<V> Find(const HashedKey<K> &key) const {
+    if ((filter_.load(std::memory_order_acquire) & FilterBit(key.hash)) == 0) {
+      return {};
+    }
+    auto &shard = shards_[ThisThreadShard()];
+    std::lock_guard<std::mutex> lk(shard.mx);
+    for (auto &replica : shard.replicas) {
+      if (replica.hash == key.hash && replica.key == key.key) {
+        if (replica.expires_at != 0 && replica.expires_at <= NowMillis()) {
+          return {};
+        }
+        ++replica.hits;
+        shard.hits.store(shard.hits.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+        return replica.value;
+      }
+    }
+    return {};
+  }
+
+  /**
+   * Counts a sampled read of `key`, served by the bucket.
+   *
+   * @return whether the key should be promoted (see `Promote()`)
+   */
+  bool Observe(const HashedKey<K> &key) {
+    return detector_.Increment(key.hash) >= options_.promote_after && !IsMember(key.hash);
+  }
+
+  /**
+   * Replicates the `key` (whose current `value`, and expiry, are copied to every shard)
+   * replacing the coldest replicated key, if there is no room left and it is read less often.
+   */
+  void Promote(const HashedKey<K> &key, const V &value, int64_t expires_at) {
+    std::lock_guard<std::mutex> lk(mx_);
+    if (IsMember(key.hash)) {
+      return;
+    }
+    auto size = size_.load(std::memory_order_relaxed);
+    if (size == options_.max_keys) {
+      size_t coldest = 0;
+      for (size_t i = 1; i < size; ++i) {
+        if (detector_.Estimate(members_[i].load(std::memory_order_relaxed)) <
+            detector_.Estimate(members_[coldest].load(std::memory_order_relaxed))) {
+          coldest = i;
+        }
+      }
+      auto hash = members_[coldest].load(std::memory_order_relaxed);
+      if (detector_.Estimate(hash) >= detector_.Estimate(key.hash)) {
+        return;
+      }
+      Drop(hash);
+      demotions_.fetch_add(1, std::memory_order_relaxed);
+    }
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> shard_lk(shard.mx);
+      shard.replicas.push_back({key.key, key.hash, value, expires_at, 0});
+    }
+    size = size_.load(std::memory_order_relaxed);
+    members_[size].store(key.hash, std::memory_order_relaxed);
+    size_.store(size + 1, std::memory_order_release);
+    filter_.fetch_or(FilterBit(key.hash), std::memory_order_release);
+    promotions_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /** Drops the replicas of `key`, if any, as it is being written to. */
+  void Invalidate(const HashedKey<K> &key) {
+    if ((filter_.load(std::memory_order_relaxed) & FilterBit(key.hash)) == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(mx_);
+    if (IsMember(key.hash)) {
+      Drop(key.hash);
+      invalidations_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /** Drops all the replicas, and forgets the reads counted so far. */
+  void Clear() {
+    std::lock_guard<std::mutex> lk(mx_);
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> shard_lk(shard.mx);
+      shard.replicas.clear();
+    }
+    size_.store(0, std::memory_order_release);
+    filter_.store(0, std::memory_order_release);
+    detector_.Reset();
+  }
+
+  /** @return the keys currently replicated, with the number of reads their replicas served */
+  std::vector<HotKey<K>> Replicated() const {
+    std::unordered_map<uint64_t, HotKey<K>> keys;
+    for (const auto &shard : shards_) {
+      std::lock_guard<std::mutex> lk(shard.mx);
+      for (const auto &replica : shard.replicas) {
+        auto [pos, inserted] = keys.try_emplace(replica.hash,
+                                                HotKey<K>{replica.key, replica.hash, 0});
+        pos->second.count += replica.hits;
+      }
+    }
+    std::vector<HotKey<K>> result;
+    for (auto &[hash, key] : keys) {
+      result.push_back(std::move(key));
+    }
+    std::sort(result.begin(), result.end(), [](const HotKey<K> &a, const HotKey<K> &b) {
+      return a.count > b.count;
+    });
+    return result;
+  }
+
+  /** @return the number of reads served by the replicas, since they were created */
+  uint64_t hits() const {
+    uint64_t hits = 0;
+    for (const auto &shard : shards_) {
+      hits += shard.hits.load(std::memory_order_relaxed);
+    }
+    return hits;
+  }
+
+  uint64_t promotions() const { return promotions_.load(std::memory_order_relaxed); }
+  uint64_t demotions() const { return demotions_.load(std::memory_order_relaxed); }
+  uint64_t invalidations() const { return invalidations_.load(std::memory_order_relaxed); }
+
+  const ReplicationOptions &options() const { return options_; }
+
+  /**
+   * @return the memory used by the replicas, in bytes, assuming keys and values own no other
+   *    memory
+   */
+  size_t EstimateSize() const {
+    return sizeof(*this) + detector_.EstimateSize() +
+        options_.max_keys * (sizeof(uint64_t) + shards_.size() * sizeof(Replica));
+  }
+
+ private:
+  struct Replica {
+    K key;
+    uint64_t hash;
+    V value;
+    int64_t expires_at;
+    // Only accessed while holding the shard's `mx`.
+    uint64_t hits;
+  };
+
+  struct alignas(kCacheLineSize) Shard {
+    mutable std::mutex mx;
+    mutable std::vector<Replica> replicas;
+    // Only incremented while holding the `mx`, but read without it.
+    mutable std::atomic_uint64_t hits{0};
+  };
+
+  static uint64_t FilterBit(uint64_t hash) {
+    return uint64_t{1} << ((hash * 0x9E3779B97F4A7C15ULL) >> 58U);
+  }
+
+  bool IsMember(uint64_t hash) const {
+    auto size = size_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < size; ++i) {
+      if (members_[i].load(std::memory_order_relaxed) == hash) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Removes all the replicas of the key whose hash is `hash`; the caller must hold the `mx_`.
+  void Drop(uint64_t hash) {
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> shard_lk(shard.mx);
+      auto &replicas = shard.replicas;
+      replicas.erase(std::remove_if(replicas.begin(), replicas.end(), [hash](const Replica &r) {
+        return r.hash == hash;
+      }), replicas.end());
+    }
+    // The last member takes the place of the dropped one.
+    auto size = size_.load(std::memory_order_relaxed);
+    uint64_t filter = 0;
+    for (size_t i = 0; i < size; ++i) {
+      if (members_[i].load(std::memory_order_relaxed) == hash) {
+        members_[i].store(members_[size - 1].load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+        size_.store(--size, std::memory_order_release);
+      }
+      if (i < size) {
+        filter |= FilterBit(members_[i].load(std::memory_order_relaxed));
+      }
+    }
+    filter_.store(filter, std::memory_order_release);
+  }
+
+  ReplicationOptions options_;
+
+  // Counts the sampled reads (halving the counts periodically) to find the hot keys.
+  WideCountMinSketch detector_;
+
+  // Guards changes to the replicated keys.
+  std::mutex mx_;
+
+  // The hashes of the `size_` replicated keys, and a one-word Bloom filter of them: most reads
+  // of keys which are not replicated do not even need to lock their shard.
+  std::unique_ptr<std::atomic_uint64_t[]> members_;
+  std::atomic_size_t size_{0};
+  std::atomic_uint64_t filter_{0};
+
+  std::array<Shard, kCounterShards> shards_;
+
+  std::atomic_uint64_t promotions_{0};
+  std::atomic_uint64_t demotions_{0};
+  std::atomic_uint64_t invalidations_{0};
+};
+
+template<typename K, typename V>
+void to_json(json &j, const HotKeyReplicas<K, V> &replicas) {
+  j = {
+      {"replicated", replicas.Replicated()},
+      {"hits", replicas.hits()},
+      {"promotions", replicas.promotions()},
+      {"demotions", replicas.demotions()},
+      {"invalidations", replicas.invalidations()}
+  };
+}
+
+} // namespace keystore
@@ -0,0 +1,75 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace keystore {
+
+/**
+ * A HyperLogLog sketch, which estimates the number of distinct items (identified by their 64-bit
+ * hash) in a stream, using `2^precision` one-byte registers.
+ *
+ * <p>The standard error of the estimate is about `1.04 / sqrt(2^precision)`: 1.6% with the
+ * default precision of 12 (4 KB of registers).
+ *
+ * <p>All operations are lock-free, and can be called concurrently; sketches with the same
+ * precision can be merged, to estimate the cardinality of the union of their streams.
+ *
+ * <p>See: Flajolet et al., "HyperLogLog: the analysis of a near-optimal cardinality estimation
+ * algorithm" and Heule et al., "HyperLogLog in Practice".
+ */
+class HyperLogLog {
+ public:
+  static constexpr unsigned int kMinPrecision = 4;
+  static constexpr unsigned int kMaxPrecision = 18;
+  static constexpr unsigned int kDefaultPrecision = 12;
+
+  /**
+   * @param precision the number of bits of the hash used to choose a register
+   * @throws std::invalid_argument if `precision` is not between `kMinPrecision` and
+   *    `kMaxPrecision`
+   */
+  explicit HyperLogLog(unsigned int precision = kDefaultPrecision);
+
+  HyperLogLog(const HyperLogLog &) = delete;
+  HyperLogLog &operator=(const HyperLogLog &) = delete;
+
+  /**
+   * Records the item whose hash is `hash`.
+   *
+   * <p>The hash is mixed again before use, so it need not be uniformly distributed over all
+   * of its 64 bits (e.g., a `HashedKey` hash, whose upper bits are the key's position on the
+   * ring, and are thus all very close for the keys in one bucket).
+   */
+  void Add(uint64_t hash);
+
+  /** @return the estimated number of distinct items added so far. */
+  double Estimate() const;
+
+  /**
+   * Adds all the items of `other` to this sketch.
+   *
+   * @throws std::invalid_argument if the two sketches have different precisions
+   */
+  void Merge(const HyperLogLog &other);
+
+  /** Clears all registers. */
+  void Reset();
+
+  unsigned int precision() const { return precision_; }
+
+  /** @return the memory used by the registers, in bytes. */
+  size_t EstimateSize() const { return sizeof(*this) + registers(); }
+
+ private:
+  size_t registers() const { return size_t{1} << precision_; }
+
+  unsigned int precision_;
+  std::unique_ptr<std::atomic_uint8_t[]> registers_;
+};
+
+} // namespace keystore
@@ -4,50 +4,55 @@
 #pragma once
 
 #include <utils/ThreadsafeQueue.hpp>
+#include <array>
+#include <atomic>
+#include <filesystem>
 #include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include "BucketSlot.hpp"
 #include "KeyStore.hpp"
+#include "LatencyHistogram.hpp"
+#include "SizeEstimator.hpp"
+#include "Snapshot.hpp"
+#include "WriteAheadLog.hpp"
 
 namespace keystore {
 
-template<typename T>
-inline float HashKey(const T &key) {
-  std::string key_str = std::string{key};
-  return consistent_hash(key_str);
-}
+/**
+ * How many keys ahead of the current one we start fetching the hash bucket, when running
+ * batched operations (see `InMemoryKeyStore::MultiGet()`).
+ */
+inline const size_t kPrefetchDistance = 4;
 
-inline float HashKey(const char *key) {
-  unsigned long iter = strlen(key) / sizeof(long);
-  unsigned long remainder = strlen(key) % sizeof(long);
+/**
+ * How many entries (at most, plus those in the last token scanned) `InMemoryKeyStore::Iterate()`
+ * copies while holding a bucket's lock.
+ */
+inline const size_t kIterateBatchSize = 1024;
 
-  long n = 0;
-  long accum = 0;
-  for (int i = 0; i < iter; ++i) {
-    memcpy(&n, key + sizeof(long) * i, sizeof(long));
-    accum += n;
+/**
+ * Hints the CPU to start loading the first node of the hash bucket where `key` would be
+ * stored, so that a lookup for the same key, a few iterations later, is less likely to stall
+ * on a cache miss.
+ *
+ * <p>This only makes sense when looking up several keys in the same `map` in a tight loop, so
+ * that the memory loads for the next few keys overlap with the work on the current one.
+ */
+template<typename Map, typename Key>
+inline void PrefetchBucket(const Map &map, const Key &key) {
+#if defined(__GNUC__) || defined(__clang__)
+  if (map.bucket_count() == 0) {
+    return;
   }
-  if (remainder > 0) {
-    memcpy(&n, key + sizeof(long) * iter, remainder);
-    accum += n;
+  auto n = map.bucket(key);
+  auto pos = map.begin(n);
+  if (pos != map.end(n)) {
+    __builtin_prefetch(&*pos);
   }
-  float f = static_cast<float >(accum % kModulo) / kModulo;
-  VLOG(3) << key << " hashes to " << f;
-
-  return f;
-}
-
-template<>
-inline float HashKey(const long &key) {
-  return static_cast<float >(key % kModulo) / kModulo;
-}
-
-template<>
-inline float HashKey<int>(const int &key) {
-  return static_cast<float >(key % kModulo) / kModulo;
-}
-
-template<>
-inline float HashKey(const std::string &key) {
-  return consistent_hash(key);
+#endif
 }
 
 /**
@@ -57,9 +62,18 @@ inline float HashKey(const std::string &key) {
  * using `HashKey(key)`, across a set of `Bucket`s; the data is kept in unordered associative
  * containers, so that access is O(1).
  *
+ * <p>Each key is only hashed once, when it reaches the store (see `HashedKey`): the same 64-bit
+ * hash selects its bucket, and is then stored along with the key in the bucket's map, where it is
+ * used to look the key up, and never needs to be computed again.
+ *
  * <p>Each `InMemoryKeyStore` retains a full "global" `View` of the system, as well as its own set of
  * `Bucket`s (`buckets_`) which map the stored data.
  *
+ * <p>The data for each bucket is kept in a `BucketSlot`, in a flat array addressed directly by the
+ * bucket's index in the `View` (see `View::FindBucketIndex()`): finding where a key is stored
+ * only requires one lookup in the `View` and a bit test to confirm the bucket is owned by this
+ * store.
+ *
  * <p>The store's API is extremely simple, implementing essentially the CRUD primitives (`Get`,
  * `Put` and `Remove`); however, due to each `InMemoryKeyStore` only being responsible for a portion of
  * the data, we return an `optional<V>` instead of the actual value, as there may actually be no
@@ -67,7 +81,7 @@ inline float HashKey(const std::string &key) {
  * of those the store is storing data for).
  *
  * @tparam K the type of the key, must be possible to hash it to a float in [0,1.0] space using
- *      one of the `HashKey` functions variant.
+ *      one of the `HashKey` (and `HashKey64`) functions variant.
  * @tparam V the type of the data being stored, must provide default and copy constructors, so
  *      that it can be stored in an associative (unordered) container.
  */
@@ -75,23 +89,179 @@ template<typename K, typename V>
 class InMemoryKeyStore : public PartitionedKeyStore<K, V> {
 
   std::shared_ptr<View> view_ptr_;
-  std::unordered_map<BucketPtr, MapPtr<K, V>> maps_;
   std::unordered_set<BucketPtr> buckets_;
+  // Buckets may be added and removed concurrently, e.g. by a `RebalanceCoordinator`.
+  mutable std::mutex buckets_mx_;
+  MemoryResourceFactory arena_factory_;
+
+  // Only set in cache mode, see EnableCache().
+  std::unique_ptr<CacheState> cache_;
+
+  // Only set once the buckets keep sketches of the keys accessed, see EnableSketches().
+  std::optional<SketchOptions> sketch_options_;
+
+  // Only set once the buckets replicate their hot keys, see EnableHotKeyReplication().
+  std::optional<ReplicationOptions> replication_options_;
+
+  // Only set once the write-ahead log is enabled, see EnableWal(): either one log shared by all
+  // the buckets, or one log for each bucket, by name (which is kept if the bucket is removed,
+  // guarded by `buckets_mx_`).
+  std::optional<WalOptions> wal_options_;
+  std::unique_ptr<WriteAheadLog> shared_wal_;
+  std::map<std::string, std::unique_ptr<WriteAheadLog>> bucket_wals_;
+
+  // Indexed by the buckets' dense index in the View; a slot is allocated the first time its
+  // bucket is added to this store, and is only emptied (never deleted) when the bucket is
+  // removed, so that concurrent readers can never access a deleted slot.
+  std::array<std::unique_ptr<BucketSlot<K, V>>, kMaxBuckets> slots_;
+
+  // One bit for each of the slots_, set if (and only if) the bucket is owned by this store.
+  std::array<std::atomic_uint64_t, kMaxBuckets / 64> owned_;
 
-  // These protect the maps_ from threads races; like the maps_ themselves, they
-  // are indexed via the buckets_.
-  std::unordered_map<BucketPtr, MutexPtr> mutexes_;
+  // Only updated if (and when) sampled, see `ScopedLatency`.
+  mutable OpLatencies latencies_;
+
+  // Slots are never deleted, and their sketches and replicas are only created along with them
+  // (or by EnableSketches() and EnableHotKeyReplication()) before they are accessed concurrently.
+  std::unique_ptr<BucketSlot<K, V>> NewSlot() const {
+    auto slot = std::make_unique<BucketSlot<K, V>>();
+    if (sketch_options_) {
+      slot->sketches = std::make_unique<KeySketches<K>>(*sketch_options_);
+    }
+    if (replication_options_) {
+      slot->replicas = std::make_unique<HotKeyReplicas<K, V>>(*replication_options_);
+    }
+    return slot;
+  }
+
+  bool IsOwned(size_t index) const {
+    return owned_[index / 64].load(std::memory_order_acquire) & (1UL << (index % 64));
+  }
+
+  /**
+   * Invokes `func` on each of the slots owned by this store.
+   */
+  template<typename Func>
+  void ForEachOwnedSlot(Func func) const;
 
  protected:
   /**
-   * Given a `key` it hashes it, finds the appropriate `Bucket` and returns the corresponding
-   * associative container which may contain the data.
+   * Given a (hashed) `key`, finds the appropriate `Bucket` and returns the corresponding slot,
+   * which may contain the data.
+   *
+   * <p>Note that the bucket may be removed from this store after this method returns: callers
+   * must confirm that the slot's `bucket` is still valid, once they have acquired its mutex.
    *
    * @param key
-   * @return a pointer to the map where the `data` *may* be stored; or `None` if the key hashes
-   *        to a bucket that does not belong to this store
+   * @return the slot where the `data` *may* be stored; or `nullptr` if the key hashes to a bucket
+   *        that does not belong to this store
+   */
+  BucketSlot<K, V> *FindSlot(const HashedKey<K> &key) const {
+    return FindSlotByHash(key.position());
+  }
+
+  /**
+   * As `FindSlot()`, for a key whose position on the ring is `hash`.
+   */
+  BucketSlot<K, V> *FindSlotByHash(float hash) const;
+
+  static void CountGets(const BucketSlot<K, V> &slot, uint64_t gets, uint64_t hits,
+                        uint64_t bytes_out) {
+    auto &counters = slot.counters;
+    counters.Add(OpCounter::kGets, gets);
+    if (hits > 0) {
+      counters.Add(OpCounter::kHits, hits);
+      counters.Add(OpCounter::kBytesOut, bytes_out);
+    }
+    if (hits < gets) {
+      counters.Add(OpCounter::kMisses, gets - hits);
+    }
+  }
+
+  static void CountPuts(BucketSlot<K, V> &slot, uint64_t puts, uint64_t bytes_in) {
+    slot.counters.Add(OpCounter::kPuts, puts);
+    slot.counters.Add(OpCounter::kBytesIn, bytes_in);
+  }
+
+  /**
+   * Stores the entry in the `destination` store, carrying over its remaining TTL, if any.
+   */
+  static bool MoveEntry(const K &key, const V &value, int64_t expires_at,
+                        const KeyStorePtr<K, V> &destination) {
+    if (expires_at == 0) {
+      return destination->Put(key, value);
+    }
+    auto remaining = std::chrono::milliseconds(expires_at - NowMillis());
+    return destination->Put(key, value, std::max(remaining, std::chrono::milliseconds(1)));
+  }
+
+  /**
+   * Stores all the `items` in the first of the `destinations` which accepts them: the ones
+   * without a TTL are sent to each destination in a single `MultiPut()`, while the others
+   * carry over their remaining TTL.
+   *
+   * @return whether each of the `items` was stored
+   */
+  static std::vector<bool> MoveEntries(const std::vector<std::pair<K, V>> &items,
+                                       const std::vector<int64_t> &expires_at,
+                                       const std::vector<KeyStorePtr<K, V>> &destinations);
+
+  /**
+   * Moves the data out of the `bucket` (all of it, if `all_keys`, or only the keys which no
+   * longer hash to it otherwise) to the `destinations`, in batches; see `Rebalance()`.
+   */
+  RebalanceProgress MoveData(BucketPtr bucket, bool all_keys,
+                             const std::vector<KeyStorePtr<K, V>> &destinations,
+                             const RebalanceOptions &options);
+
+  /**
+   * Hashes all the keys in one pass, and groups their positions (in `items`) by the slot
+   * they belong to; keys which hash to buckets not owned by this store are dropped.
+   *
+   * @param items the items to group, typically either keys or key/value pairs
+   * @param key_of extracts the key from each of the `items`
+   * @param keys will contain the hashed key of each of the `items`
+   * @return a map of each slot to the positions of the `items` which belong to it
+   */
+  template<typename Item, typename KeyOf>
+  std::unordered_map<BucketSlot<K, V> *, std::vector<size_t>> GroupBySlot(
+      const std::vector<Item> &items, KeyOf key_of, std::vector<HashedKey<K>> &keys) const;
+
+  // The LSN of the last record appended to each log, by a batch of writes.
+  using WalCommits = std::unordered_map<WriteAheadLog *, uint64_t>;
+
+  /**
+   * @return the log the `bucket`'s writes are appended to, once the WAL is enabled; or `nullptr`
    */
-  std::optional<std::pair<MutexPtr, MapPtr<K, V>>> FindMap(const K &key) const override;
+  WriteAheadLog *WalFor(const BucketPtr &bucket);
+
+  /**
+   * Appends a write to the `slot`'s log, if it has one: the caller must hold the slot's lock
+   * exclusively, so that the writes to each bucket are logged in the same order as they are
+   * applied.
+   *
+   * @param value only for `kPut`
+   * @param expires_at when the entry will expire (see `NowMillis()`), or 0 if it never does
+   * @return the LSN to `Commit()`, once the lock is released; or 0, if there is no log
+   */
+  uint64_t LogWrite(BucketSlot<K, V> &slot, WalOp op, const HashedKey<K> &key,
+                    const V *value = nullptr, int64_t expires_at = 0);
+
+  /** Waits for the records logged by a (batch of) writes to be committed. */
+  static void Commit(const WalCommits &commits);
+
+  /**
+   * Applies the log records in the `buffer` (each one preceded by its LSN and size) to the
+   * `slot`, skipping those which are already included in its snapshot.
+   *
+   * @return the number of records applied
+   */
+  uint64_t ApplyWalRecords(BucketSlot<K, V> &slot, const std::vector<char> &buffer);
+
+  /**
+   * @return the index of the bucket (in the `View`) which the key in the log `record` belongs to
+   */
+  size_t WalRecordIndex(const char *record, size_t size) const;
 
  public:
 
@@ -106,210 +276,1761 @@ class InMemoryKeyStore : public PartitionedKeyStore<K, V> {
    * @param buckets the subset (or, possibly, the entirety) of the data that this store is
    * responsible for storing: this is described by the name of the buckets (in the `view`) that
    * are allocated to this store, matched by `name`.
+   *
+   * @param arena_factory creates the memory resource for each bucket's data, every time a bucket
+   * is added to this store; by default a `SlabMemoryResource`.
    */
   InMemoryKeyStore(const std::string &name, const std::shared_ptr<View> &view,
-                   const std::unordered_set<std::string> &buckets);
+                   const std::unordered_set<std::string> &buckets,
+                   MemoryResourceFactory arena_factory = MakeSlabMemoryResource);
 
   virtual ~InMemoryKeyStore() = default;
 
   // ============= The Key/Value Store interface ===================
   bool Put(const K &key, const V &value) override;
+  bool Put(const K &key, const V &value, std::chrono::milliseconds ttl) override;
   std::optional<V> Get(const K &key) const override;
   bool Remove(const K &key) override;
 
+  // ============= Batched operations ==============================
+  // All keys are hashed up front, and grouped by bucket: each bucket's lock is then only
+  // acquired once per batch.
+  std::vector<std::optional<V>> MultiGet(const std::vector<K> &keys) const override;
+  std::vector<bool> MultiPut(const std::vector<std::pair<K, V>> &items) override;
+  std::vector<bool> MultiRemove(const std::vector<K> &keys) override;
+
+  /**
+   * Visits the buckets in order of name, and each bucket's entries in the order of the tokens
+   * their keys hash to (see `TokenIndex`): the continuation is the bucket, and the next token to
+   * visit in it, so that the iteration can be resumed even if buckets have been added or removed
+   * in the meantime.
+   *
+   * <p>As the entries of a token are all returned in the same batch, batches may hold a few more
+   * than `max_entries` entries; expired entries are skipped.
+   */
+  IterationBatch<K, V> Iterate(const std::string &continuation, size_t max_entries,
+                               const BucketFilter &filter = nullptr) const override;
+
   // ============= Getters and Setters =============================
   const View *view() const { return view_ptr_.get(); }
 
-  const std::unordered_set<BucketPtr> &buckets() const { return buckets_; }
-  int num_buckets() const { return buckets_.size(); }
+  /** @return a copy of the buckets owned by this store, as they may change concurrently */
+  std::unordered_set<BucketPtr> buckets() const {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    return buckets_;
+  }
+  int num_buckets() const {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    return buckets_.size();
+  }
   std::vector<std::string> bucket_names() const;
 
   // ============= Class methods & Utilities =======================
 
-  void AddBucket(BucketPtr bucket) override {
-    VLOG(2) << "Adding bucket " << bucket << ", to KeyStore " << this->name();
-    buckets_.insert(bucket);
-    VLOG(2) << "Adding data store for bucket " << bucket;
-    maps_[bucket] = std::make_shared<std::unordered_map<K, V>>();
-    mutexes_[bucket] = std::make_shared<std::shared_mutex>();
-  }
+  /**
+   * Switches this store to "cache mode": from now on, entries will be evicted to keep the store
+   * within the limits (number of entries and/or estimated bytes) set in the `options`.
+   *
+   * <p>Each bucket selects the entries to evict using a `TinyLfuPolicy` and only ever takes its
+   * own lock to do so: with a `kGlobal` scope, the store's usage is tracked using atomic counters,
+   * and a bucket which is written to when the store is over its limits evicts its own entries.
+   *
+   * <p>Note that, in cache mode, a successful `Put()` no longer guarantees that the value will be
+   * found by subsequent `Get()`s, as it may be evicted at any time (possibly, immediately, if
+   * the entry is not deemed worth admitting into the cache).
+   *
+   * <p>This must be called before the store is accessed concurrently, and only once.
+   *
+   * @param options the limits and configuration for the cache
+   */
+  void EnableCache(const CacheOptions &options);
+
+  bool is_cache() const { return cache_ != nullptr; }
+
+  /**
+   * Keeps streaming sketches of the keys accessed in each bucket (see `KeySketches`): an
+   * estimate of the number of distinct keys, and the most frequently accessed ones. These are
+   * reported by `Stats()`, and can be merged across stores (see `Sketches()`).
+   *
+   * <p>All reads and writes (`Get()`, `Put()` and their batched versions) are recorded, while
+   * holding the bucket's lock, but without any further locking: see `KeySketches::Record()`. The
+   * sketches follow their bucket when it is handed over to another store (if it keeps sketches,
+   * with the same options) and are cleared when it is removed.
+   *
+   * <p>This must be called before the store is accessed concurrently, and only once.
+   *
+   * @throws std::invalid_argument if the HyperLogLog `precision` is out of range
+   */
+  void EnableSketches(const SketchOptions &options = {});
+
+  bool has_sketches() const { return sketch_options_.has_value(); }
+
+  /**
+   * @return the sketches of all the buckets owned by this store, merged; or `nullptr` if sketches
+   *    are not enabled (see `EnableSketches()`). No bucket is locked.
+   */
+  std::unique_ptr<KeySketches<K>> Sketches() const;
+
+  /** @return a copy of the `bucket`'s sketches; or `nullptr` if it is not owned, or not sketched */
+  std::unique_ptr<KeySketches<K>> Sketches(const BucketPtr &bucket) const;
+
+  /** Clears the sketches of all the buckets, e.g., to summarize the accesses in a time window. */
+  void ResetSketches();
+
+  /**
+   * Serves the most frequently read keys of each bucket from per-thread read-only replicas (see
+   * `HotKeyReplicas`), so that reading them does not require acquiring the bucket's lock: under
+   * a skewed workload, this keeps the threads reading the few hottest keys from contending on the
+   * same cache line.
+   *
+   * <p>The hot keys are found by sampling the reads served by the buckets; a key stops being
+   * replicated as soon as it is written to (and until it is found to be hot again) so that a
+   * `Get()` never returns a value older than that of the last completed `Put()`. Only `Get()`
+   * uses the replicas: batched reads already acquire each bucket's lock once per batch. Reads
+   * served by the replicas are still counted by the `Sketches()`; in cache mode (see
+   * `EnableCache()`) the replicas are not used, as the eviction policy must see every read.
+   *
+   * <p>The promotions, and the reads served by the replicas, are reported by `Stats()`.
+   *
+   * <p>This must be called before the store is accessed concurrently, and only once.
+   *
+   * @throws std::invalid_argument if the `options` are not valid
+   */
+  void EnableHotKeyReplication(const ReplicationOptions &options = {});
+
+  bool has_hot_key_replication() const { return replication_options_.has_value(); }
+
+  /**
+   * Reclaims the memory of the entries whose TTL has elapsed.
+   *
+   * <p>Expired entries are never returned by `Get()`, and each write to a bucket already
+   * reclaims a few of them (see `kExpirePerWrite`); however, the entries in buckets which are
+   * rarely written to would linger until then: this method should be called periodically (e.g.,
+   * from a background thread) to reclaim them.
+   *
+   * <p>Each bucket's expired entries are found via its `TimingWheel`, without scanning the data,
+   * and the bucket's lock is only held while removing (at most) `max_per_bucket` of them.
+   *
+   * @param max_per_bucket how many entries to reclaim, at most, from each bucket
+   * @return the number of entries reclaimed
+   */
+  size_t Expire(size_t max_per_bucket = 1024);
+
+  /**
+   * Saves all the data of the `bucket` to a binary file at `path`, see `SnapshotWriter`: the
+   * keys and values are encoded using their `SnapshotCodec`, along with the keys' hashes and TTLs.
+   *
+   * <p>The snapshot does not block writers: the bucket is scanned in batches of `batch_size`
+   * entries, holding its lock shared only while each batch is encoded (but not while it is
+   * written to the file). As a consequence, this is a "fuzzy" snapshot: writes made while the
+   * snapshot is taken may, or may not, be included in it (depending on whether their keys had
+   * been scanned yet); a consistent state can be recovered by replaying, on top of it, all the
+   * writes made since the snapshot was started.
+   *
+   * @param bucket one of the buckets owned by this store
+   * @param path the snapshot file; it is only replaced once the new snapshot is complete
+   * @return the number of entries, and bytes, written
+   * @throws snapshot_error if the snapshot cannot be written
+   */
+  SnapshotStats Snapshot(BucketPtr bucket, const std::string &path,
+                         size_t batch_size = 4096) const;
+
+  /**
+   * Snapshots all the buckets owned by this store, in parallel, to the `dir` directory (see
+   * `SnapshotPath()`).
+   *
+   * @param max_concurrency the maximum number of buckets snapshotted at the same time
+   * @return the outcome for each of the buckets; errors are reported there, rather than thrown
+   */
+  std::vector<SnapshotStats> SnapshotAll(
+      const std::string &dir,
+      size_t max_concurrency = std::max(1U, std::thread::hardware_concurrency())) const;
+
+  /**
+   * Loads all the entries in the snapshot at `path` into the bucket it was taken from, which
+   * must be owned by this store (and be in the same `View` as when the snapshot was taken).
+   *
+   * <p>The file is memory-mapped, and the bucket's map is sized up front for all its entries:
+   * the keys are not hashed again, and the entries whose TTL has since elapsed are skipped.
+   * Entries already in the bucket are overwritten by those in the snapshot.
+   *
+   * @return the number of entries restored, and the size of the snapshot
+   * @throws snapshot_error if the snapshot cannot be read, or is corrupted
+   */
+  SnapshotStats Restore(const std::string &path);
+
+  /**
+   * Restores, in parallel, all the snapshots in the `dir` directory (see `SnapshotAll()`).
+   *
+   * @param max_concurrency the maximum number of snapshots restored at the same time
+   * @return the outcome for each of the snapshots; errors are reported there, rather than thrown
+   */
+  std::vector<SnapshotStats> RestoreAll(
+      const std::string &dir,
+      size_t max_concurrency = std::max(1U, std::thread::hardware_concurrency()));
+
+  /**
+   * Appends all the writes (`Put()`, `Remove()` and their batched versions) to a write-ahead log,
+   * so that the data can be recovered after a restart: either one log shared by all the buckets,
+   * or one for each bucket (see `WalOptions`).
+   *
+   * <p>Each write is appended while holding its bucket's lock, but committed (see
+   * `WriteAheadLog::Commit()`) only once the lock is released: writes only return once they are
+   * durable (according to the `SyncPolicy`), while concurrent writers share the cost of syncing
+   * the log (a batched write only waits once for all its keys).
+   *
+   * <p>The data moved to other stores by a rebalance, and the entries evicted (in cache mode) or
+   * expired are not logged; and neither are the buckets handed over by `TransferBucket()`, which
+   * should be snapshotted by the adopting store.
+   *
+   * <p>This must be called before the store is accessed concurrently, and only once.
+   *
+   * @throws wal_error if the logs' existing segments cannot be read
+   */
+  void EnableWal(const WalOptions &options);
+
+  bool has_wal() const { return wal_options_.has_value(); }
+
+  /**
+   * Recovers the writes in the write-ahead log which are not included in the buckets' snapshots
+   * (so, this should be called after `RestoreAll()`, if there are any snapshots) and before any
+   * new write is made.
+   *
+   * <p>Each bucket's records are applied in order, but the buckets are recovered in parallel: with
+   * one log per bucket, each log is read by a separate thread; a shared log is read sequentially,
+   * and its records are dispatched to the buckets they belong to.
+   *
+   * <p>The records are routed to the buckets according to the current `View`; those of buckets
+   * which are not owned by this store, or (with one log per bucket) which have since moved to
+   * another bucket, are skipped.
+   *
+   * @param max_concurrency the maximum number of buckets recovered at the same time
+   * @return the number of records applied
+   * @throws wal_error if the log is corrupted
+   */
+  uint64_t ReplayWal(size_t max_concurrency = std::max(1U, std::thread::hardware_concurrency()));
+
+  /**
+   * Deletes the log segments which only contain records already included in the latest snapshot
+   * of every bucket they may belong to (see `Snapshot()`): with a shared log, this only happens
+   * once all the buckets have been snapshotted. `SnapshotAll()` calls this, once all the snapshots
+   * have been taken.
+   *
+   * @return the number of segments deleted
+   */
+  size_t TruncateWal() const;
+
+  void AddBucket(BucketPtr bucket) override;
 
   bool RemoveBucket(BucketPtr bucket,
                     std::set<KeyStorePtr<K, V>> destination_stores) override;
 
+  /**
+   * Moves all the data in the `bucket` to the `destination_stores`, in batches, in the same way
+   * as `Rebalance()` does; once all the data has been moved, the bucket is removed.
+   *
+   * <p>Each entry is stored in the first of the `destination_stores` which accepts it: the
+   * entries of each batch are sent to each destination in a single `MultiPut()`.
+   *
+   * @param bucket that will be removed; it must have already been removed from the `View`
+   * @param destination_stores where to move the data to
+   * @param options the batch size, rate limits and progress callback
+   * @return the progress made; `complete` is `true` only once the bucket has been removed
+   */
+  RebalanceProgress RemoveBucket(BucketPtr bucket,
+                                 const std::set<KeyStorePtr<K, V>> &destination_stores,
+                                 const RebalanceOptions &options);
+
+  /**
+   * The data of a bucket which was released by its store (see `ReleaseBucket()`), and not yet
+   * adopted by another one.
+   */
+  using ReleasedBucket = std::unique_ptr<BucketSlot<K, V>>;
+
+  /**
+   * Detaches all the data of the `bucket` from this store, which no longer owns it, without
+   * copying any of it: the bucket's map (along with its arena and indexes) is handed over, as a
+   * whole, to the returned object, which can then be adopted by another store in the same
+   * process (see `AdoptBucket()`).
+   *
+   * <p>Unlike `RemoveBucket()`, the `View` is not changed: the same bucket is only moved to a
+   * different store. Until it is adopted, the bucket's keys are not found in either store.
+   *
+   * @param bucket one of the buckets owned by this store
+   * @return the bucket's data, or `nullptr` if the bucket is not owned by this store
+   */
+  ReleasedBucket ReleaseBucket(BucketPtr bucket);
+
+  /**
+   * Takes over the data of a bucket released by another store (see `ReleaseBucket()`), without
+   * copying any of it: this takes O(1) in the number of entries (unless the data needs to be
+   * tracked by an eviction policy, that the releasing store did not have, in cache mode).
+   *
+   * <p>If this store has a write-ahead log, the bucket's writes are logged to it from now on; the
+   * entries adopted are not, and should be snapshotted to be recovered (see `Snapshot()`).
+   *
+   * @param released the data to adopt; it is only moved from (and reset) if adopted
+   * @return `false` if the bucket (in `released`) is already owned by this store
+   */
+  bool AdoptBucket(ReleasedBucket &&released);
+
+  /**
+   * Hands the `bucket` over to the `destination` store, in the same process: the data is moved
+   * as a whole (see `ReleaseBucket()`) instead of being copied, one entry at a time, as
+   * `RemoveBucket()` and `Rebalance()` do.
+   *
+   * @return whether the bucket was handed over; if not, this store still owns it (unless the
+   *    bucket was added back to it while being transferred: then the data released from it is
+   *    dropped, and an error is logged)
+   */
+  bool TransferBucket(BucketPtr bucket, InMemoryKeyStore &destination);
+
   bool Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) override;
 
   /**
-   * Provides metrics for this KVS
+   * Moves the data which no longer belongs to the `source` bucket to the `destination_store`,
+   * in batches, so that the bucket keeps serving traffic throughout.
+   *
+   * <p>Each batch is scanned holding the bucket's lock shared, for (at most) `batch_size`
+   * entries; the lock is then released while the entries to move are stored in the destination,
+   * and only re-acquired (exclusively) to remove them from the bucket. The rate at which the data
+   * is moved can be limited (in keys and/or bytes per second) in the `options`.
+   *
+   * <p>The rebalance can be interrupted (after `max_batches`, or if some of the data cannot be
+   * moved) and resumed later: the bucket keeps a `ScanCursor` (along with the progress so far,
+   * which is also reported by `Stats()`) and the next `Rebalance()` for the same bucket starts
+   * from there (unless the `View` has changed, or the bucket is being removed, see
+   * `RemoveBucket()`, in the meantime: then the scan starts over). Only one rebalance at a time can run on any given bucket.
+   *
+   * @param source the bucket whose data will be scanned, and moved (if appropriate)
+   * @param destination_store the destination for the moved data
+   * @param options the batch size, rate limits and progress callback
+   * @return the progress made; `complete` is `true` only once all the data has been moved
+   */
+  RebalanceProgress Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store,
+                              const RebalanceOptions &options);
+
+  /**
+   * Provides metrics for this KVS: the size of each bucket, and the operations run on it (see
+   * `Counters()`), the cache and TTL statistics, the latency percentiles of the operations (see
+   * `Latencies()`) and the statistics of the write-ahead log.
+   *
+   * <p>No bucket (or write-ahead log) is locked, so that this is cheap enough to be called
+   * frequently (e.g., every second, by a monitoring agent) even while the store is under load:
+   * the values are read from atomics published by the writers, and thus those of different
+   * buckets (or counters) are not read at the same instant. The only locks acquired are the
+   * store's list of buckets (only written to by `AddBucket()`, `ReleaseBucket()` and the like)
+   * and, shared, the `View`'s index of the buckets.
    *
    * @return a map of metrics
    */
   json Stats() const override;
 
+  /**
+   * As `Stats()`, plus the details which can only be read while holding each bucket's lock:
+   * the memory used by the bucket's arena, the number of non-empty tokens and the progress of
+   * any rebalance. These are meant for troubleshooting, rather than for regular monitoring.
+   */
+  json DetailedStats() const;
+
+  /**
+   * @return the (always on) counts of the operations run on this store, and the bytes written
+   *    and read, summed over all the buckets it currently owns; no bucket is locked
+   */
+  OpCounts Counters() const;
+
+  /**
+   * Estimates the memory used by this store: the entries of all the buckets it owns (their keys
+   * and values, see `SizeEstimator`, and the map nodes) and the indexes on them, plus the slots
+   * of the buckets themselves. This is kept up to date by every write, so that no bucket is
+   * locked (and the cost does not depend on the number of entries).
+   *
+   * <p>This is what capacity-based placement should go by: e.g., a new bucket is best assigned to
+   * the store with the smallest footprint, relative to the memory available to it; while the
+   * buckets with the largest `Footprint(bucket)` are the ones to move off a store running short.
+   */
+  MemoryFootprint Footprint() const;
+
+  /** @return the memory used by the `bucket`, as `Footprint()`; empty if it is not owned */
+  MemoryFootprint Footprint(const BucketPtr &bucket) const;
+
+  /**
+   * @return the latency histograms of this store's operations (see `LatencyOp`), which are
+   *    also summarized by `Stats()`; they are empty if `kLatencyHistograms` is not set
+   */
+  const OpLatencies &Latencies() const { return latencies_; }
 };
 
 template<typename K, typename V>
 InMemoryKeyStore<K, V>::InMemoryKeyStore(
     const std::string &name,
     const std::shared_ptr<View> &view,
-    const std::unordered_set<std::string> &buckets
-) : PartitionedKeyStore<K, V>(name) {
+    const std::unordered_set<std::string> &buckets,
+    MemoryResourceFactory arena_factory
+) : PartitionedKeyStore<K, V>(name), arena_factory_{std::move(arena_factory)} {
   VLOG(2) << "Creating InMemoryKeyStore with "
           << buckets.size() << " buckets (of " << view->num_buckets() << ")";
 
   view_ptr_ = view;
+  for (auto &word : owned_) {
+    word.store(0);
+  }
   for (auto &b : view_ptr_->buckets()) {
     if (buckets.count(b->name()) > 0) {
-      buckets_.insert(b);
-      VLOG(2) << "Adding data store for bucket " << b;
-      maps_[b] = std::make_shared<std::unordered_map<K, V>>();
-      mutexes_[b] = std::make_shared<std::shared_mutex>();
+      AddBucket(b);
     }
   }
 }
 
 template<typename K, typename V>
-bool InMemoryKeyStore<K, V>::Put(const K &key, const V &value) {
-  auto mutex_map_pair_maybe = FindMap(key);
-  if (mutex_map_pair_maybe) {
-    auto mutex_map = *mutex_map_pair_maybe;
-
-    // As we are modifying the data map, we need exclusive access to it.
-    UniqueLock lk(*mutex_map.first);
-    (*mutex_map.second)[key] = value;
-    return true;
+void InMemoryKeyStore<K, V>::AddBucket(BucketPtr bucket) {
+  VLOG(2) << "Adding bucket " << bucket << ", to KeyStore " << this->name();
+  auto index = view_ptr_->IndexOf(bucket);
+  if (!slots_[index]) {
+    slots_[index] = NewSlot();
   }
-  return false;
+  VLOG(2) << "Adding data store for bucket " << bucket << " in slot " << index;
+  if (utils::kLockProfiling) {
+    slots_[index]->mutex.set_name(this->name() + "/" + bucket->name());
+  }
+  auto wal = WalFor(bucket);
+  {
+    UniqueLock lk(slots_[index]->mutex);
+    slots_[index]->bucket = bucket;
+    slots_[index]->Allocate(arena_factory_(), cache_.get());
+    slots_[index]->wal = wal;
+  }
+  owned_[index / 64].fetch_or(1UL << (index % 64), std::memory_order_release);
+  std::lock_guard<std::mutex> lk(buckets_mx_);
+  buckets_.insert(bucket);
 }
 
 template<typename K, typename V>
-std::optional<V> InMemoryKeyStore<K, V>::Get(const K &key) const {
-  auto mutex_map_pair_maybe = FindMap(key);
-  if (mutex_map_pair_maybe) {
-    auto mutex_map = *mutex_map_pair_maybe;
-
-    // As we are NOT modifying the data map, we don't need exclusive access to it.
-    SharedLock lk(*mutex_map.first);
-    if (mutex_map.second->count(key) > 0) {
-      return mutex_map.second->at(key);
+void InMemoryKeyStore<K, V>::EnableCache(const CacheOptions &options) {
+  if (cache_) {
+    throw std::logic_error("KeyStore " + this->name() + " is already in cache mode");
+  }
+  cache_ = std::make_unique<CacheState>(options);
+  for (size_t index = 0; index < slots_.size(); ++index) {
+    if (IsOwned(index)) {
+      UniqueLock lk(slots_[index]->mutex);
+      slots_[index]->EnableCache(cache_.get());
     }
   }
-  return {};
 }
 
 template<typename K, typename V>
-bool InMemoryKeyStore<K, V>::Remove(const K &key) {
-  auto mutex_map_pair_maybe = FindMap(key);
-  if (mutex_map_pair_maybe) {
-    auto mutex_map = *mutex_map_pair_maybe;
-
-    // As we are modifying the data map, we need exclusive access to it.
-    UniqueLock lk(*mutex_map.first);
-    return mutex_map.second->erase(key) > 0;
+void InMemoryKeyStore<K, V>::EnableSketches(const SketchOptions &options) {
+  if (sketch_options_) {
+    throw std::logic_error("KeyStore " + this->name() + " already keeps sketches");
+  }
+  // Validates the options, before any slot is modified.
+  KeySketches<K> validated{options};
+  sketch_options_ = options;
+  for (auto &slot : slots_) {
+    if (slot) {
+      UniqueLock lk(slot->mutex);
+      slot->sketches = std::make_unique<KeySketches<K>>(options);
+      slot->Publish();
+    }
   }
-  return false;
 }
 
 template<typename K, typename V>
-std::optional<std::pair<MutexPtr, MapPtr<K, V>>> InMemoryKeyStore<K, V>::FindMap(
-    const K &key) const {
-  float hash = HashKey(key);
-  auto bp = view_ptr_->FindBucket(hash);
+void InMemoryKeyStore<K, V>::EnableHotKeyReplication(const ReplicationOptions &options) {
+  if (replication_options_) {
+    throw std::logic_error("KeyStore " + this->name() + " already replicates hot keys");
+  }
+  // Validates the options, before any slot is modified.
+  HotKeyReplicas<K, V> validated{options};
+  replication_options_ = options;
+  for (auto &slot : slots_) {
+    if (slot) {
+      UniqueLock lk(slot->mutex);
+      slot->replicas = std::make_unique<HotKeyReplicas<K, V>>(options);
+      slot->Publish();
+    }
+  }
+}
 
-  // To the extent that `hash` is in the [0, 1.0) interval, FindBucket will _always_ return a
-  // valid BucketPtr (or it will throw an exception otherwise).
-  if (maps_.count(bp) > 0 && mutexes_.count(bp) > 0) {
-    return std::make_pair(mutexes_.at(bp), maps_.at(bp));
+template<typename K, typename V>
+std::unique_ptr<KeySketches<K>> InMemoryKeyStore<K, V>::Sketches() const {
+  if (!sketch_options_) {
+    return nullptr;
   }
-  return {};
+  auto merged = std::make_unique<KeySketches<K>>(*sketch_options_);
+  ForEachOwnedSlot([&merged](const BucketSlot<K, V> &slot) {
+    if (slot.sketches) {
+      merged->Merge(*slot.sketches);
+    }
+  });
+  return merged;
 }
 
 template<typename K, typename V>
-std::vector<std::string> InMemoryKeyStore<K, V>::bucket_names() const {
-  std::vector<std::string> names;
-  for (const auto &b : buckets_) {
-    names.push_back(b->name());
+std::unique_ptr<KeySketches<K>> InMemoryKeyStore<K, V>::Sketches(const BucketPtr &bucket) const {
+  auto index = view_ptr_->IndexOf(bucket);
+  if (!sketch_options_ || !IsOwned(index)) {
+    return nullptr;
   }
-  std::sort(names.begin(), names.end());
-  return names;
+  return std::make_unique<KeySketches<K>>(*slots_[index]->sketches);
 }
 
 template<typename K, typename V>
-json InMemoryKeyStore<K, V>::Stats() const {
+void InMemoryKeyStore<K, V>::ResetSketches() {
+  ForEachOwnedSlot([](const BucketSlot<K, V> &slot) {
+    if (slot.sketches) {
+      slot.sketches->Reset();
+    }
+  });
+}
 
-  auto stats = KeyStore<K, V>::Stats();
+template<typename K, typename V>
+template<typename Func>
+void InMemoryKeyStore<K, V>::ForEachOwnedSlot(Func func) const {
+  for (size_t w = 0; w < owned_.size(); ++w) {
+    auto bits = owned_[w].load(std::memory_order_acquire);
+    while (bits != 0) {
+      size_t index = w * 64 + __builtin_ctzl(bits);
+      bits &= bits - 1;
+      func(*slots_[index]);
+    }
+  }
+}
 
-  unsigned long tot_keys = 0;
-  std::vector<json> bj;
-  for (const auto &bp : buckets()) {
-    json j = *bp;
-    long size = 0;
+template<typename K, typename V>
+bool InMemoryKeyStore<K, V>::Put(const K &key, const V &value) {
+  ScopedLatency latency{latencies_[LatencyOp::kPut]};
+  HashedKey<K> hashed{key};
+  auto slot = FindSlot(hashed);
+  latency.Lap(latencies_[LatencyOp::kFindBucket]);
+  if (slot) {
+    // As we are modifying the data map, we need exclusive access to it.
+    uint64_t lsn;
     {
-      SharedLock lk(*(mutexes_.find(bp)->second));
-      size = maps_.find(bp)->second->size();
+      UniqueLock lk(slot->mutex);
+      // The bucket may have been removed, while we were waiting for the lock.
+      if (!slot->bucket) {
+        return false;
+      }
+      slot->Store(hashed, value);
+      slot->RecordKey(hashed);
+      lsn = LogWrite(*slot, WalOp::kPut, hashed, &value);
     }
-    tot_keys += size;
-    j["size"] = size;
-    bj.push_back(j);
+    CountPuts(*slot, 1, EstimateSize(key) + EstimateSize(value));
+    // Other writers can proceed while waiting for the write to be durable.
+    if (lsn != 0) {
+      slot->wal->Commit(lsn);
+    }
+    return true;
   }
-  stats["buckets"] = bj;
-  stats["num_buckets"] = num_buckets();
-  stats["tot_elem_counts"] = tot_keys;
-
-  return stats;
+  return false;
+}
+
+template<typename K, typename V>
+bool InMemoryKeyStore<K, V>::Put(const K &key, const V &value, std::chrono::milliseconds ttl) {
+  ScopedLatency latency{latencies_[LatencyOp::kPut]};
+  HashedKey<K> hashed{key};
+  auto slot = FindSlot(hashed);
+  latency.Lap(latencies_[LatencyOp::kFindBucket]);
+  if (slot) {
+    uint64_t lsn;
+    {
+      UniqueLock lk(slot->mutex);
+      if (!slot->bucket) {
+        return false;
+      }
+      slot->RecordKey(hashed);
+      if (ttl.count() > 0) {
+        auto expires_at = NowMillis() + ttl.count();
+        slot->Store(hashed, value, expires_at);
+        lsn = LogWrite(*slot, WalOp::kPut, hashed, &value, expires_at);
+      } else {
+        slot->Erase(hashed);
+        lsn = LogWrite(*slot, WalOp::kRemove, hashed);
+      }
+    }
+    CountPuts(*slot, 1, EstimateSize(key) + EstimateSize(value));
+    if (lsn != 0) {
+      slot->wal->Commit(lsn);
+    }
+    return true;
+  }
+  return false;
+}
+
+template<typename K, typename V>
+size_t InMemoryKeyStore<K, V>::Expire(size_t max_per_bucket) {
+  size_t reclaimed = 0;
+  ForEachOwnedSlot([&](BucketSlot<K, V> &slot) {
+    UniqueLock lk(slot.mutex);
+    if (slot.bucket) {
+      reclaimed += slot.Expire(NowMillis(), max_per_bucket);
+    }
+  });
+  return reclaimed;
+}
+
+template<typename K, typename V>
+std::optional<V> InMemoryKeyStore<K, V>::Get(const K &key) const {
+  ScopedLatency latency{latencies_[LatencyOp::kGet]};
+  HashedKey<K> hashed{key};
+  auto slot = FindSlot(hashed);
+  latency.Lap(latencies_[LatencyOp::kFindBucket]);
+  if (slot) {
+    // Hot keys are served by this thread's replica, without acquiring the bucket's lock; but a
+    // sample of the reads still goes to the bucket, to find out which keys are hot. In cache
+    // mode, every read must reach the bucket's eviction policy, which requires the lock.
+    bool replicated = slot->replicas && !cache_;
+    bool sampled = replicated && slot->replicas->Sample();
+    if (replicated && !sampled) {
+      if (auto value = slot->replicas->Find(hashed)) {
+        // The sketches are never reset once set, and can be updated without the lock.
+        slot->RecordKey(hashed);
+        CountGets(*slot, 1, 1, EstimateSize(*value));
+        return value;
+      }
+    }
+    // As we are NOT modifying the data map, we don't need exclusive access to it.
+    SharedLock lk(slot->mutex);
+    if (slot->bucket) {
+      slot->RecordKey(hashed);
+      auto value = slot->Find(hashed);
+      if (value) {
+        CountGets(*slot, 1, 1, EstimateSize(*value));
+        if (sampled) {
+          slot->SampleRead(hashed);
+        }
+        return *value;
+      }
+      CountGets(*slot, 1, 0, 0);
+    }
+  }
+  return {};
+}
+
+template<typename K, typename V>
+bool InMemoryKeyStore<K, V>::Remove(const K &key) {
+  ScopedLatency latency{latencies_[LatencyOp::kRemove]};
+  HashedKey<K> hashed{key};
+  auto slot = FindSlot(hashed);
+  latency.Lap(latencies_[LatencyOp::kFindBucket]);
+  if (slot) {
+    uint64_t lsn;
+    {
+      // As we are modifying the data map, we need exclusive access to it.
+      UniqueLock lk(slot->mutex);
+      if (!slot->bucket || !slot->Erase(hashed)) {
+        return false;
+      }
+      lsn = LogWrite(*slot, WalOp::kRemove, hashed);
+    }
+    slot->counters.Add(OpCounter::kRemoves);
+    if (lsn != 0) {
+      slot->wal->Commit(lsn);
+    }
+    return true;
+  }
+  return false;
+}
+
+template<typename K, typename V>
+template<typename Item, typename KeyOf>
+std::unordered_map<BucketSlot<K, V> *, std::vector<size_t>> InMemoryKeyStore<K, V>::GroupBySlot(
+    const std::vector<Item> &items, KeyOf key_of, std::vector<HashedKey<K>> &keys) const {
+  std::vector<float> positions;
+  keys.clear();
+  keys.reserve(items.size());
+  positions.reserve(items.size());
+  for (const auto &item : items) {
+    keys.emplace_back(key_of(item));
+    positions.push_back(keys.back().position());
+  }
+  auto indexes = view_ptr_->FindBucketIndexes(positions);
+
+  std::unordered_map<BucketSlot<K, V> *, std::vector<size_t>> groups;
+  for (size_t pos = 0; pos < indexes.size(); ++pos) {
+    if (IsOwned(indexes[pos])) {
+      groups[slots_[indexes[pos]].get()].push_back(pos);
+    }
+  }
+  return groups;
+}
+
+template<typename K, typename V>
+std::vector<std::optional<V>> InMemoryKeyStore<K, V>::MultiGet(const std::vector<K> &keys) const {
+  std::vector<std::optional<V>> results(keys.size());
+
+  auto key_of = [](const K &key) -> const K & { return key; };
+  std::vector<HashedKey<K>> hashed;
+  for (const auto &[slot, positions] : GroupBySlot(keys, key_of, hashed)) {
+    SharedLock lk(slot->mutex);
+    if (!slot->bucket) {
+      continue;
+    }
+    const auto &data = *slot->data;
+    uint64_t hits = 0, bytes = 0;
+    for (size_t i = 0; i < positions.size(); ++i) {
+      if (i + kPrefetchDistance < positions.size()) {
+        PrefetchBucket(data, hashed[positions[i + kPrefetchDistance]]);
+      }
+      slot->RecordKey(hashed[positions[i]]);
+      auto value = slot->Find(hashed[positions[i]]);
+      if (value) {
+        results[positions[i]] = *value;
+        ++hits;
+        bytes += EstimateSize(*value);
+      }
+    }
+    CountGets(*slot, positions.size(), hits, bytes);
+  }
+  return results;
+}
+
+template<typename K, typename V>
+std::vector<bool> InMemoryKeyStore<K, V>::MultiPut(const std::vector<std::pair<K, V>> &items) {
+  std::vector<bool> results(items.size(), false);
+
+  auto key_of = [](const std::pair<K, V> &item) -> const K & { return item.first; };
+  std::vector<HashedKey<K>> hashed;
+  WalCommits commits;
+  for (const auto &[slot, positions] : GroupBySlot(items, key_of, hashed)) {
+    UniqueLock lk(slot->mutex);
+    if (!slot->bucket) {
+      continue;
+    }
+    auto &data = *slot->data;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < positions.size(); ++i) {
+      if (i + kPrefetchDistance < positions.size()) {
+        PrefetchBucket(data, hashed[positions[i + kPrefetchDistance]]);
+      }
+      const auto &[key, value] = items[positions[i]];
+      slot->Store(hashed[positions[i]], value);
+      slot->RecordKey(hashed[positions[i]]);
+      if (auto lsn = LogWrite(*slot, WalOp::kPut, hashed[positions[i]], &value)) {
+        commits[slot->wal] = lsn;
+      }
+      results[positions[i]] = true;
+      bytes += EstimateSize(key) + EstimateSize(value);
+    }
+    CountPuts(*slot, positions.size(), bytes);
+  }
+  // The whole batch is committed at once.
+  Commit(commits);
+  return results;
+}
+
+template<typename K, typename V>
+std::vector<bool> InMemoryKeyStore<K, V>::MultiRemove(const std::vector<K> &keys) {
+  std::vector<bool> results(keys.size(), false);
+
+  auto key_of = [](const K &key) -> const K & { return key; };
+  std::vector<HashedKey<K>> hashed;
+  WalCommits commits;
+  for (const auto &[slot, positions] : GroupBySlot(keys, key_of, hashed)) {
+    UniqueLock lk(slot->mutex);
+    if (!slot->bucket) {
+      continue;
+    }
+    auto &data = *slot->data;
+    for (size_t i = 0; i < positions.size(); ++i) {
+      if (i + kPrefetchDistance < positions.size()) {
+        PrefetchBucket(data, hashed[positions[i + kPrefetchDistance]]);
+      }
+      results[positions[i]] = slot->Erase(hashed[positions[i]]);
+      if (results[positions[i]]) {
+        if (auto lsn = LogWrite(*slot, WalOp::kRemove, hashed[positions[i]])) {
+          commits[slot->wal] = lsn;
+        }
+        slot->counters.Add(OpCounter::kRemoves);
+      }
+    }
+  }
+  Commit(commits);
+  return results;
+}
+
+template<typename K, typename V>
+BucketSlot<K, V> *InMemoryKeyStore<K, V>::FindSlotByHash(float hash) const {
+  // To the extent that the hash is in the [0, 1.0) interval, FindBucketIndex will _always_
+  // return a valid index (or it will throw an exception otherwise).
+  auto index = view_ptr_->FindBucketIndex(hash);
+  if (IsOwned(index)) {
+    return slots_[index].get();
+  }
+  return nullptr;
+}
+
+template<typename K, typename V>
+std::vector<std::string> InMemoryKeyStore<K, V>::bucket_names() const {
+  std::vector<std::string> names;
+  std::lock_guard<std::mutex> lk(buckets_mx_);
+  for (const auto &b : buckets_) {
+    names.push_back(b->name());
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+template<typename K, typename V>
+IterationBatch<K, V> InMemoryKeyStore<K, V>::Iterate(const std::string &continuation,
+                                                     size_t max_entries,
+                                                     const BucketFilter &filter) const {
+  // The continuation is "<token>:<bucket name>".
+  std::string start_bucket;
+  ScanCursor cursor;
+  if (!continuation.empty()) {
+    // Tokens are at most 5 digits long, which also keeps `stoul()` from overflowing.
+    static const auto kMaxDigits = std::to_string(kTokens).size();
+    auto sep = continuation.find(':');
+    if (sep == std::string::npos || sep == 0 || sep > kMaxDigits ||
+        continuation.find_first_not_of("0123456789") != sep) {
+      throw invalid_continuation(continuation);
+    }
+    cursor.position = std::stoul(continuation.substr(0, sep));
+    if (cursor.position > kTokens) {
+      throw invalid_continuation(continuation);
+    }
+    start_bucket = continuation.substr(sep + 1);
+  }
+
+  std::vector<BucketPtr> buckets;
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    for (const auto &b : buckets_) {
+      if (b->name() >= start_bucket && (!filter || filter(b))) {
+        buckets.push_back(b);
+      }
+    }
+  }
+  std::sort(buckets.begin(), buckets.end(), [](const BucketPtr &a, const BucketPtr &b) {
+    return a->name() < b->name();
+  });
+
+  IterationBatch<K, V> batch;
+  max_entries = std::max(max_entries, size_t{1});
+  for (const auto &bucket : buckets) {
+    if (bucket->name() != start_bucket) {
+      cursor = ScanCursor{};
+    }
+    auto &slot = *slots_[view_ptr_->IndexOf(bucket)];
+    // The lock is released (and the bucket's ownership checked again) after each short scan.
+    while (!cursor.done() && batch.entries.size() < max_entries) {
+      SharedLock lk(slot.mutex);
+      if (slot.bucket != bucket) {
+        break;
+      }
+      auto now = NowMillis();
+      slot.ScanTokens(cursor, std::min(max_entries - batch.entries.size(), kIterateBatchSize),
+          [&](uint32_t, const typename TokenIndex<K, V>::Nodes &nodes) -> size_t {
+            for (const auto *node : nodes) {
+              const auto &[hashed, entry] = *node;
+              if (!entry.IsExpired(now)) {
+                batch.entries.emplace_back(hashed.key, entry.value);
+              }
+            }
+            return nodes.size();
+          });
+    }
+    if (batch.entries.size() >= max_entries) {
+      // If the bucket was fully scanned, resuming from it will move on to the next one.
+      batch.continuation = std::to_string(cursor.position) + ":" + bucket->name();
+      return batch;
+    }
+  }
+  return batch;
+}
+
+template<typename K, typename V>
+OpCounts InMemoryKeyStore<K, V>::Counters() const {
+  OpCounts counts;
+  ForEachOwnedSlot([&counts](const BucketSlot<K, V> &slot) {
+    counts += slot.counters.Read();
+  });
+  return counts;
+}
+
+template<typename K, typename V>
+MemoryFootprint InMemoryKeyStore<K, V>::Footprint() const {
+  MemoryFootprint footprint;
+  footprint.overhead_bytes = sizeof(*this);
+  ForEachOwnedSlot([&footprint](const BucketSlot<K, V> &slot) {
+    footprint += slot.PublishedFootprint();
+    footprint.overhead_bytes += sizeof(slot);
+  });
+  return footprint;
+}
+
+template<typename K, typename V>
+MemoryFootprint InMemoryKeyStore<K, V>::Footprint(const BucketPtr &bucket) const {
+  auto index = view_ptr_->FindIndex(bucket);
+  if (index == kMaxBuckets || !IsOwned(index)) {
+    return {};
+  }
+  return slots_[index]->PublishedFootprint();
+}
+
+template<typename K, typename V>
+json InMemoryKeyStore<K, V>::DetailedStats() const {
+  json stats = Stats();
+  std::map<std::string, json> details;
+  ForEachOwnedSlot([&details](const BucketSlot<K, V> &slot) {
+    SharedLock lk(slot.mutex);
+    if (!slot.bucket) {
+      return;
+    }
+    json j;
+    j["tokens"] = slot.tokens->size();
+    if (slot.rebalance.batches > 0) {
+      j["rebalance"] = slot.rebalance;
+    }
+    // Only the memory allocated from the bucket's arena is accounted for: this excludes, for
+    // example, the heap memory of `std::string` keys and values (but not `std::pmr::string`).
+    auto slab = dynamic_cast<const SlabMemoryResource *>(slot.arena.get());
+    if (slab) {
+      auto size = slot.size();
+      j["memory"] = {
+          {"allocations", slab->allocations()},
+          {"deallocations", slab->deallocations()},
+          {"bytes_in_use", slab->bytes_in_use()},
+          {"bytes_reserved", slab->bytes_reserved()},
+          {"bytes_per_entry", size > 0 ? static_cast<double>(slab->bytes_in_use()) / size : 0.0}
+      };
+    }
+    details[slot.bucket->name()] = j;
+  });
+  for (auto &bucket : stats["buckets"]) {
+    auto pos = details.find(bucket["name"].get<std::string>());
+    if (pos != details.end()) {
+      bucket.update(pos->second);
+    }
+  }
+  return stats;
+}
+
+template<typename K, typename V>
+json InMemoryKeyStore<K, V>::Stats() const {
+  auto stats = KeyStore<K, V>::Stats();
+
+  std::vector<BucketPtr> buckets;
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets.assign(buckets_.begin(), buckets_.end());
+  }
+  std::sort(buckets.begin(), buckets.end(), [](const BucketPtr &a, const BucketPtr &b) {
+    return a->name() < b->name();
+  });
+
+  // No bucket is locked: all the values are read from (relaxed) atomics, published by the writers.
+  unsigned long tot_keys = 0;
+  unsigned long hits = 0, misses = 0, evictions = 0;
+  unsigned long scheduled = 0, expired_reads = 0, reclaimed = 0;
+  OpCounts ops;
+  MemoryFootprint memory;
+  memory.overhead_bytes = sizeof(*this);
+  auto sketches = sketch_options_ ? std::make_unique<KeySketches<K>>(*sketch_options_) : nullptr;
+  uint64_t replica_hits = 0, promotions = 0, demotions = 0, invalidations = 0;
+  std::vector<json> bj;
+  for (const auto &bucket : buckets) {
+    auto index = view_ptr_->FindIndex(bucket);
+    if (index == kMaxBuckets || !slots_[index]) {
+      continue;
+    }
+    const auto &slot = *slots_[index];
+    json j = *bucket;
+    auto size = slot.published_size.load(std::memory_order_relaxed);
+    tot_keys += size;
+    j["size"] = size;
+    auto counts = slot.counters.Read();
+    ops += counts;
+    j["ops"] = counts;
+    auto footprint = slot.PublishedFootprint();
+    memory += footprint;
+    memory.overhead_bytes += sizeof(slot);
+    j["bytes"] = footprint.data_bytes;
+    j["overhead_bytes"] = footprint.overhead_bytes;
+    if (slot.sketches) {
+      j["sketches"] = *slot.sketches;
+      sketches->Merge(*slot.sketches);
+    }
+    if (slot.replicas) {
+      j["replication"] = *slot.replicas;
+      replica_hits += slot.replicas->hits();
+      promotions += slot.replicas->promotions();
+      demotions += slot.replicas->demotions();
+      invalidations += slot.replicas->invalidations();
+    }
+
+    if (cache_) {
+      j["cache"] = {
+          {"hits", slot.hits.load()},
+          {"misses", slot.misses.load()},
+          {"evictions", slot.evictions.load()},
+          {"bytes", slot.published_bytes.load(std::memory_order_relaxed)}
+      };
+      hits += slot.hits;
+      misses += slot.misses;
+      evictions += slot.evictions;
+    }
+
+    auto bucket_scheduled = slot.published_scheduled.load(std::memory_order_relaxed);
+    if (bucket_scheduled > 0 || slot.expired_reads > 0 || slot.reclaimed > 0) {
+      j["ttl"] = {
+          {"scheduled", bucket_scheduled},
+          {"expired_reads", slot.expired_reads.load()},
+          {"reclaimed", slot.reclaimed.load()}
+      };
+      scheduled += bucket_scheduled;
+      expired_reads += slot.expired_reads;
+      reclaimed += slot.reclaimed;
+    }
+    bj.push_back(j);
+  }
+  stats["buckets"] = bj;
+  stats["num_buckets"] = buckets.size();
+  stats["tot_elem_counts"] = tot_keys;
+  stats["ops"] = ops;
+  stats["memory"] = memory;
+  stats["memory"]["view_bytes"] = view_ptr_->EstimateSize();
+  if (kLatencyHistograms) {
+    stats["latency"] = latencies_;
+  }
+  if (sketches) {
+    stats["sketches"] = *sketches;
+  }
+  if (replication_options_) {
+    stats["replication"] = {
+        {"hits", replica_hits},
+        {"promotions", promotions},
+        {"demotions", demotions},
+        {"invalidations", invalidations}
+    };
+  }
+
+  stats["ttl"] = {
+      {"scheduled", scheduled},
+      {"expired_reads", expired_reads},
+      {"reclaimed", reclaimed}
+  };
+
+  if (cache_) {
+    const auto &options = cache_->options;
+    stats["cache"] = {
+        {"scope", options.scope == CacheOptions::Scope::kGlobal ? "global" : "bucket"},
+        {"max_entries", options.max_entries},
+        {"max_bytes", options.max_bytes},
+        {"entries", cache_->entries.load()},
+        {"bytes", cache_->bytes.load()},
+        {"hits", hits},
+        {"misses", misses},
+        {"hit_ratio", hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0},
+        {"evictions", evictions}
+    };
+  }
+
+  if (wal_options_) {
+    json logs = json::array();
+    if (shared_wal_) {
+      logs.push_back(shared_wal_->Stats());
+    }
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    for (const auto &[name, wal] : bucket_wals_) {
+      logs.push_back(wal->Stats());
+    }
+    stats["wal"] = logs;
+  }
+
+  return stats;
 }
 
 template<typename K, typename V>
 bool InMemoryKeyStore<K, V>::Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) {
+  return Rebalance(source, destination_store, RebalanceOptions{}).complete;
+}
+
+template<typename K, typename V>
+RebalanceProgress InMemoryKeyStore<K, V>::Rebalance(BucketPtr source,
+                                                    KeyStorePtr<K, V> destination_store,
+                                                    const RebalanceOptions &options) {
   // This method is typically called after one (or more) bucket(s) have been added to the View,
   // and the data needs to moved out (via a full data scan) from the "old" bucket(s) and into the
   // new bucket(s), according to where the hash points to.
   //
   // This obviously assumes the View has already been updated, and the `destination_store`
   // "owns" the destination bucket(s).
-  if (buckets_.count(source) == 0) {
-    LOG(ERROR) << "Rebalance request for source bucket " << source->name()
-               << " cannot be executed by this KeyStore, as it does not own the data";
-    return false;
+  ScopedLatency latency{latencies_[LatencyOp::kRebalance], true};
+  auto progress = MoveData(source, false, {destination_store}, options);
+  if (progress.complete) {
+    VLOG(2) << "Done re-balancing from Bucket [" << source->name() << "] to KeyStore ["
+            << destination_store->name() << "]";
   }
+  return progress;
+}
 
-  // The first pass is a scan of all the data mapped to the `source` bucket, to be copied to the
-  // appropriate bucket in the `destination_store`.
-  // We want this to fail noisily if the data cannot be found, so we use at()
-  auto data = maps_.at(source);
-  std::vector<K> to_be_erased;
+template<typename K, typename V>
+RebalanceProgress InMemoryKeyStore<K, V>::MoveData(
+    BucketPtr bucket, bool all_keys,
+    const std::vector<KeyStorePtr<K, V>> &destinations,
+    const RebalanceOptions &options) {
+  // As the View has already been updated, the keys which need moving are no longer written to
+  // the `bucket`, and they can be safely removed once they have been copied.
+  RebalanceProgress progress;
+  progress.bucket = bucket->name();
+  auto index = view_ptr_->IndexOf(bucket);
+  if (!IsOwned(index)) {
+    LOG(ERROR) << "Cannot move data out of bucket " << bucket->name() << " from KeyStore "
+               << this->name() << ", as it does not own it";
+    progress.failed = true;
+    return progress;
+  }
 
-  // The first pass is done with a shared lock, as we are not modifying the source data map.
-  {
-    SharedLock lk(*mutexes_.at(source));
-    for (const auto &[key, value] : *data) {
-      // First find out whether it should be moved at all:
-      if (source != view_ptr_->FindBucket(HashKey(key))) {
-        if (!destination_store->Put(key, value)) {
-          LOG(ERROR) << "Key " << key << " cannot be stored to destination KeyStore ["
-                     << destination_store->name() << "]: hash(" << std::to_string(HashKey(key))
-                     << "), source(" << source->name() << "), dest("
-                     << view_ptr_->FindBucket(HashKey(key))->name() << ")";
-          return false;
+  // Read before the partition points, so that a change to the `View` after this is never missed.
+  auto generation = view_ptr_->generation();
+
+  // Only the keys in the tokens which straddle a partition point may belong to different buckets
+  // (and are checked one by one, using their cached hash): all the others belong, as a whole, to
+  // the bucket which owns their range of the ring, and are either skipped, or moved.
+  std::unordered_set<uint32_t> boundaries;
+  if (!all_keys) {
+    const float epsilon = 1e-5;  // See FloatLessWithTolerance
+    for (const auto &b : view_ptr_->buckets()) {
+      for (auto point : b->partition_points()) {
+        boundaries.insert({TokenOf(point - epsilon), TokenOf(point), TokenOf(point + epsilon)});
+      }
+    }
+  }
+
+  auto &slot = *slots_[index];
+  RebalanceThrottle throttle{options};
+  for (size_t batch = 0; options.max_batches == 0 || batch < options.max_batches; ++batch) {
+    std::vector<std::pair<K, V>> items;
+    std::vector<uint64_t> hashes;
+    std::vector<int64_t> expires_at;
+    size_t bytes = 0;
+    ScanCursor start;
+    bool scanned;
+
+    // The scan is done with a shared lock, as we are not modifying the source data map.
+    {
+      SharedLock lk(slot.mutex);
+      if (!slot.bucket) {
+        LOG(ERROR) << "Bucket " << bucket->name() << " was removed while moving its data";
+        progress.failed = true;
+        return progress;
+      }
+      progress = slot.rebalance;
+      if (progress.all_keys != all_keys || progress.view_generation != generation) {
+        // The tokens already scanned by an interrupted move of the other kind (or against a
+        // different `View`) may still hold keys which this one needs to move.
+        progress = RebalanceProgress{};
+        progress.all_keys = all_keys;
+        progress.view_generation = generation;
+      }
+      progress.bucket = bucket->name();
+      progress.failed = false;
+      start = progress.cursor;
+      auto now = NowMillis();
+      progress.keys_scanned += slot.ScanTokens(progress.cursor, options.batch_size,
+          [&](uint32_t token, const typename TokenIndex<K, V>::Nodes &nodes) -> size_t {
+            bool whole = all_keys;
+            if (!all_keys && boundaries.count(token) == 0) {
+              auto [begin, end] = TokenRange(token);
+              if (view_ptr_->FindBucketIndex((begin + end) / 2) == index) {
+                return 0;
+              }
+              whole = true;
+            }
+            for (const auto *node : nodes) {
+              const auto &[hashed, entry] = *node;
+              if (entry.IsExpired(now)) {
+                continue;
+              }
+              if (whole || index != view_ptr_->FindBucketIndex(hashed.position())) {
+                items.emplace_back(hashed.key, entry.value);
+                hashes.push_back(hashed.hash);
+                expires_at.push_back(entry.expires_at);
+                bytes += EstimateSize(hashed.key) + EstimateSize(entry.value);
+              }
+            }
+            return nodes.size();
+          });
+      scanned = progress.cursor.done();
+    }
+
+    // No lock is held while the data is copied to the destinations.
+    auto moved = MoveEntries(items, expires_at, destinations);
+
+    // This time we need to lock the data map exclusively, as we are modifying it.
+    {
+      UniqueLock lk(slot.mutex);
+      if (!slot.bucket) {
+        LOG(ERROR) << "Bucket " << bucket->name() << " was removed while moving its data";
+        progress.failed = true;
+        return progress;
+      }
+      for (size_t i = 0; i < items.size(); ++i) {
+        if (moved[i]) {
+          VLOG(3) << "Removing data for key: " << items[i].first;
+          slot.Erase(HashedKey<K>{items[i].first, hashes[i]});
+          ++progress.keys_moved;
         } else {
-          to_be_erased.push_back(key);
+          auto position = PositionOf(hashes[i]);
+          LOG(ERROR) << "Key " << items[i].first << " cannot be moved to any of the destinations: "
+                     << "hash(" << std::to_string(position) << "), source(" << bucket->name()
+                     << "), dest(" << view_ptr_->FindBucket(position)->name() << ")";
+          ++progress.keys_failed;
+          progress.failed = true;
         }
       }
+      progress.bytes_moved += bytes;
+      ++progress.batches;
+      if (progress.failed) {
+        // The next attempt will re-scan this batch: the keys already moved won't be found again.
+        progress.cursor = start;
+      }
+      progress.complete = scanned && !progress.failed;
+      slot.rebalance = progress.complete ? RebalanceProgress{} : progress;
+    }
+
+    if (options.on_progress) {
+      options.on_progress(progress);
+    }
+    if (progress.failed || progress.complete) {
+      break;
+    }
+    throttle.Acquire(items.size(), bytes);
+  }
+  return progress;
+}
+
+template<typename K, typename V>
+std::vector<bool> InMemoryKeyStore<K, V>::MoveEntries(
+    const std::vector<std::pair<K, V>> &items,
+    const std::vector<int64_t> &expires_at,
+    const std::vector<KeyStorePtr<K, V>> &destinations) {
+  std::vector<bool> moved(items.size(), false);
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < items.size(); ++i) {
+    pending.push_back(i);
+  }
+  for (const auto &destination : destinations) {
+    if (pending.empty()) {
+      break;
+    }
+    std::vector<std::pair<K, V>> batch;
+    std::vector<size_t> positions;
+    std::vector<size_t> rejected;
+    for (auto i : pending) {
+      if (expires_at[i] == 0) {
+        batch.push_back(items[i]);
+        positions.push_back(i);
+      } else if (MoveEntry(items[i].first, items[i].second, expires_at[i], destination)) {
+        moved[i] = true;
+      } else {
+        rejected.push_back(i);
+      }
     }
+    auto results = destination->MultiPut(batch);
+    for (size_t pos = 0; pos < positions.size(); ++pos) {
+      if (results[pos]) {
+        moved[positions[pos]] = true;
+      } else {
+        rejected.push_back(positions[pos]);
+      }
+    }
+    pending = std::move(rejected);
+  }
+  return moved;
+}
+
+template<typename K, typename V>
+void InMemoryKeyStore<K, V>::EnableWal(const WalOptions &options) {
+  if (wal_options_) {
+    throw std::logic_error("KeyStore " + this->name() + " already has a write-ahead log");
+  }
+  wal_options_ = options;
+  if (!options.per_bucket) {
+    shared_wal_ = std::make_unique<WriteAheadLog>("wal", options);
+  }
+  ForEachOwnedSlot([this](BucketSlot<K, V> &slot) {
+    auto wal = WalFor(slot.bucket);
+    UniqueLock lk(slot.mutex);
+    slot.wal = wal;
+  });
+}
+
+template<typename K, typename V>
+WriteAheadLog *InMemoryKeyStore<K, V>::WalFor(const BucketPtr &bucket) {
+  if (!wal_options_) {
+    return nullptr;
+  }
+  if (!wal_options_->per_bucket) {
+    return shared_wal_.get();
+  }
+  std::lock_guard<std::mutex> lk(buckets_mx_);
+  auto &wal = bucket_wals_[bucket->name()];
+  if (!wal) {
+    wal = std::make_unique<WriteAheadLog>(bucket->name(), *wal_options_);
   }
-  // Data cannot be removed from a collection while iterating on it
-  // so we do it once the iteration is completed.
-  // This time we need to lock the data map exclusively, as we are modifying it.
+  return wal.get();
+}
+
+template<typename K, typename V>
+uint64_t InMemoryKeyStore<K, V>::LogWrite(BucketSlot<K, V> &slot, WalOp op,
+                                          const HashedKey<K> &key, const V *value,
+                                          int64_t expires_at) {
+  using KeyCodec = SnapshotCodec<K>;
+  using ValueCodec = SnapshotCodec<V>;
+  if (!slot.wal) {
+    return 0;
+  }
+  WalRecord record{};
+  record.op = op;
+  record.key_size = KeyCodec::Size(key.key);
+  record.value_size = value ? ValueCodec::Size(*value) : 0;
+  record.hash = key.hash;
+  record.expires_at = expires_at == 0 ? 0 : WallClockMillis() + expires_at - NowMillis();
+
+  // Each thread re-uses its own buffer, to avoid allocating one for every write.
+  thread_local std::vector<char> buffer;
+  buffer.resize(sizeof(record) + record.key_size + record.value_size);
+  memcpy(buffer.data(), &record, sizeof(record));
+  KeyCodec::Write(key.key, buffer.data() + sizeof(record));
+  if (value) {
+    ValueCodec::Write(*value, buffer.data() + sizeof(record) + record.key_size);
+  }
+  return slot.wal->Append(buffer.data(), buffer.size());
+}
+
+template<typename K, typename V>
+void InMemoryKeyStore<K, V>::Commit(const WalCommits &commits) {
+  for (const auto &[wal, lsn] : commits) {
+    wal->Commit(lsn);
+  }
+}
+
+template<typename K, typename V>
+size_t InMemoryKeyStore<K, V>::WalRecordIndex(const char *record, size_t size) const {
+  WalRecord header{};
+  if (size < sizeof(header)) {
+    throw wal_error("Corrupted record in the write-ahead log of KeyStore " + this->name());
+  }
+  memcpy(&header, record, sizeof(header));
+  return view_ptr_->FindBucketIndex(PositionOf(header.hash));
+}
+
+template<typename K, typename V>
+uint64_t InMemoryKeyStore<K, V>::ApplyWalRecords(BucketSlot<K, V> &slot,
+                                                 const std::vector<char> &buffer) {
+  using KeyCodec = SnapshotCodec<K>;
+  using ValueCodec = SnapshotCodec<V>;
+
+  uint64_t applied = 0;
+  auto now = NowMillis();
+  auto wall_now = WallClockMillis();
+  UniqueLock lk(slot.mutex);
+  if (!slot.bucket) {
+    return 0;
+  }
+  for (size_t pos = 0; pos < buffer.size();) {
+    uint64_t lsn;
+    uint32_t size;
+    memcpy(&lsn, buffer.data() + pos, sizeof(lsn));
+    memcpy(&size, buffer.data() + pos + sizeof(lsn), sizeof(size));
+    const char *data = buffer.data() + pos + sizeof(lsn) + sizeof(size);
+    pos += sizeof(lsn) + sizeof(size) + size;
+    if (lsn <= slot.snapshot_lsn) {
+      continue;
+    }
+
+    WalRecord record{};
+    memcpy(&record, data, sizeof(record));
+    if (sizeof(record) + record.key_size + record.value_size != size) {
+      throw wal_error("Corrupted record " + std::to_string(lsn) +
+          " in the write-ahead log of KeyStore " + this->name());
+    }
+    HashedKey<K> key{KeyCodec::Read(data + sizeof(record), record.key_size), record.hash};
+    if (record.op == WalOp::kRemove ||
+        (record.expires_at != 0 && record.expires_at <= wall_now)) {
+      slot.Erase(key);
+    } else {
+      auto value = ValueCodec::Read(data + sizeof(record) + record.key_size, record.value_size);
+      slot.Store(key, value, record.expires_at == 0 ? 0 : now + record.expires_at - wall_now);
+    }
+    ++applied;
+  }
+  return applied;
+}
+
+template<typename K, typename V>
+uint64_t InMemoryKeyStore<K, V>::ReplayWal(size_t max_concurrency) {
+  // The records are applied in batches, so that each bucket's lock is only acquired once per
+  // batch: each record is buffered, preceded by its LSN and size.
+  constexpr size_t kBatchBytes = 4 * 1024 * 1024;
+  auto buffer_record = [](std::vector<char> &buffer, uint64_t lsn, const char *data,
+                          size_t size) {
+    auto pos = buffer.size();
+    auto size32 = static_cast<uint32_t>(size);
+    buffer.resize(pos + sizeof(lsn) + sizeof(size32) + size);
+    memcpy(buffer.data() + pos, &lsn, sizeof(lsn));
+    memcpy(buffer.data() + pos + sizeof(lsn), &size32, sizeof(size32));
+    memcpy(buffer.data() + pos + sizeof(lsn) + sizeof(size32), data, size);
+  };
+
+  std::vector<size_t> indexes;
+  ForEachOwnedSlot([&](BucketSlot<K, V> &slot) {
+    indexes.push_back(view_ptr_->IndexOf(slot.bucket));
+  });
+  std::atomic_uint64_t applied{0};
+
+  if (wal_options_ && wal_options_->per_bucket) {
+    ParallelFor(indexes.size(), max_concurrency, [&](size_t i) {
+      auto index = indexes[i];
+      auto &slot = *slots_[index];
+      std::vector<char> buffer;
+      slot.wal->Replay(slot.snapshot_lsn, [&](uint64_t lsn, const char *data, size_t size) {
+        // The keys which were moved to another bucket were logged there, too.
+        if (WalRecordIndex(data, size) == index) {
+          buffer_record(buffer, lsn, data, size);
+          if (buffer.size() >= kBatchBytes) {
+            applied += ApplyWalRecords(slot, buffer);
+            buffer.clear();
+          }
+        }
+      });
+      applied += ApplyWalRecords(slot, buffer);
+    });
+  } else if (shared_wal_) {
+    // The log is read sequentially, and each bucket's records are applied in parallel.
+    std::unordered_map<size_t, std::vector<char>> buffers;
+    size_t buffered = 0;
+    auto apply = [&]() {
+      std::vector<size_t> pending;
+      for (const auto &[index, buffer] : buffers) {
+        pending.push_back(index);
+      }
+      ParallelFor(pending.size(), max_concurrency, [&](size_t i) {
+        applied += ApplyWalRecords(*slots_[pending[i]], buffers[pending[i]]);
+      });
+      buffers.clear();
+      buffered = 0;
+    };
+    uint64_t after = UINT64_MAX;
+    for (auto index : indexes) {
+      after = std::min(after, slots_[index]->snapshot_lsn.load());
+    }
+    shared_wal_->Replay(indexes.empty() ? 0 : after,
+        [&](uint64_t lsn, const char *data, size_t size) {
+          auto index = WalRecordIndex(data, size);
+          if (IsOwned(index)) {
+            buffer_record(buffers[index], lsn, data, size);
+            buffered += size;
+            if (buffered >= kBatchBytes * std::max(size_t{1}, indexes.size())) {
+              apply();
+            }
+          }
+        });
+    apply();
+  }
+  VLOG(2) << "Replayed " << applied << " records of the write-ahead log of KeyStore "
+          << this->name();
+  return applied;
+}
+
+template<typename K, typename V>
+size_t InMemoryKeyStore<K, V>::TruncateWal() const {
+  size_t deleted = 0;
+  uint64_t shared_lsn = UINT64_MAX;
+  ForEachOwnedSlot([&](BucketSlot<K, V> &slot) {
+    if (!slot.wal) {
+      return;
+    }
+    if (slot.wal == shared_wal_.get()) {
+      shared_lsn = std::min(shared_lsn, slot.snapshot_lsn.load());
+    } else if (slot.snapshot_lsn > 0) {
+      deleted += slot.wal->Truncate(slot.snapshot_lsn);
+    }
+  });
+  if (shared_wal_ && shared_lsn != UINT64_MAX && shared_lsn > 0) {
+    deleted += shared_wal_->Truncate(shared_lsn);
+  }
+  return deleted;
+}
+
+template<typename K, typename V>
+SnapshotStats InMemoryKeyStore<K, V>::Snapshot(BucketPtr bucket, const std::string &path,
+                                               size_t batch_size) const {
+  using KeyCodec = SnapshotCodec<K>;
+  using ValueCodec = SnapshotCodec<V>;
+
+  auto start = std::chrono::steady_clock::now();
+  SnapshotStats stats;
+  stats.bucket = bucket->name();
+  stats.path = path;
+  auto index = view_ptr_->IndexOf(bucket);
+  if (!IsOwned(index)) {
+    throw snapshot_error("Cannot snapshot bucket " + bucket->name() + ", as KeyStore " +
+        this->name() + " does not own it");
+  }
+  auto &slot = *slots_[index];
+
+  // All the writes to the bucket logged up to here have been applied, as they are logged while
+  // holding its lock: only the following ones need replaying, after restoring the snapshot.
+  uint64_t lsn = 0;
+  {
+    SharedLock lk(slot.mutex);
+    lsn = slot.wal ? slot.wal->last_lsn() : 0;
+  }
+  SnapshotWriter writer{path, bucket->name(), lsn};
+  ScanCursor cursor;
+  while (!cursor.done()) {
+    {
+      SharedLock lk(slot.mutex);
+      if (!slot.bucket) {
+        throw snapshot_error("Bucket " + bucket->name() + " was removed while snapshotting it");
+      }
+      auto now = NowMillis();
+      auto wall_now = WallClockMillis();
+      slot.ScanTokens(cursor, batch_size,
+          [&](uint32_t, const typename TokenIndex<K, V>::Nodes &nodes) -> size_t {
+            for (const auto *node : nodes) {
+              const auto &[hashed, entry] = *node;
+              if (entry.IsExpired(now)) {
+                continue;
+              }
+              SnapshotRecord record{};
+              record.key_size = KeyCodec::Size(hashed.key);
+              record.value_size = ValueCodec::Size(entry.value);
+              record.hash = hashed.hash;
+              record.expires_at = entry.expires_at == 0 ? 0 : wall_now + entry.expires_at - now;
+              char *out = writer.Append(sizeof(record) + record.key_size + record.value_size);
+              memcpy(out, &record, sizeof(record));
+              KeyCodec::Write(hashed.key, out + sizeof(record));
+              ValueCodec::Write(entry.value, out + sizeof(record) + record.key_size);
+            }
+            return nodes.size();
+          });
+    }
+    // No lock is held while the data is written to the file.
+    writer.Flush();
+  }
+  stats.bytes = writer.Finish();
+  stats.entries = writer.entries();
+  stats.lsn = lsn;
+  slot.snapshot_lsn = lsn;
+  stats.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  VLOG(2) << "Saved " << stats.entries << " entries of bucket " << bucket->name() << " to "
+          << path << " in " << stats.duration.count() << " msec";
+  return stats;
+}
+
+template<typename K, typename V>
+std::vector<SnapshotStats> InMemoryKeyStore<K, V>::SnapshotAll(const std::string &dir,
+                                                               size_t max_concurrency) const {
+  std::vector<BucketPtr> buckets;
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets.assign(buckets_.begin(), buckets_.end());
+  }
+  std::vector<SnapshotStats> results(buckets.size());
+  ParallelFor(buckets.size(), max_concurrency, [&](size_t i) {
+    auto path = SnapshotPath(dir, buckets[i]->name());
+    try {
+      results[i] = Snapshot(buckets[i], path);
+    } catch (const std::exception &ex) {
+      LOG(ERROR) << "Could not snapshot bucket " << buckets[i]->name() << ": " << ex.what();
+      results[i].bucket = buckets[i]->name();
+      results[i].path = path;
+      results[i].error = ex.what();
+    }
+  });
+  if (std::all_of(results.begin(), results.end(), [](const auto &r) { return r.error.empty(); })) {
+    TruncateWal();
+  }
+  return results;
+}
+
+template<typename K, typename V>
+SnapshotStats InMemoryKeyStore<K, V>::Restore(const std::string &path) {
+  using KeyCodec = SnapshotCodec<K>;
+  using ValueCodec = SnapshotCodec<V>;
+
+  auto start = std::chrono::steady_clock::now();
+  SnapshotReader reader{path};
+  SnapshotStats stats;
+  stats.bucket = reader.bucket();
+  stats.path = path;
+  stats.bytes = reader.size();
+
+  BucketPtr bucket;
+  for (const auto &b : view_ptr_->buckets()) {
+    if (b->name() == reader.bucket()) {
+      bucket = b;
+    }
+  }
+  if (!bucket || !IsOwned(view_ptr_->IndexOf(bucket))) {
+    throw snapshot_error("Cannot restore " + path + ", as KeyStore " + this->name() +
+        " does not own bucket " + reader.bucket());
+  }
+  auto &slot = *slots_[view_ptr_->IndexOf(bucket)];
+  {
+    UniqueLock lk(slot.mutex);
+    if (slot.bucket) {
+      slot.data->reserve(slot.size() + reader.entries());
+      slot.snapshot_lsn = reader.lsn();
+    }
+  }
+  stats.lsn = reader.lsn();
+
+  const char *records;
+  size_t size;
+  uint32_t count;
+  while (reader.NextBlock(&records, &size, &count)) {
+    auto now = NowMillis();
+    auto wall_now = WallClockMillis();
+    const char *pos = records;
+    const char *end = records + size;
+
+    // The lock is only held while each block is loaded, so that the bucket can serve traffic.
+    UniqueLock lk(slot.mutex);
+    if (!slot.bucket) {
+      throw snapshot_error("Bucket " + bucket->name() + " was removed while restoring it");
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      SnapshotRecord record{};
+      if (pos + sizeof(record) > end) {
+        throw snapshot_error("Corrupted record in snapshot: " + path);
+      }
+      memcpy(&record, pos, sizeof(record));
+      pos += sizeof(record);
+      if (pos + record.key_size + record.value_size > end) {
+        throw snapshot_error("Corrupted record in snapshot: " + path);
+      }
+      HashedKey<K> key{KeyCodec::Read(pos, record.key_size), record.hash};
+      pos += record.key_size;
+      auto value = ValueCodec::Read(pos, record.value_size);
+      pos += record.value_size;
+
+      int64_t expires_at = 0;
+      if (record.expires_at != 0) {
+        if (record.expires_at <= wall_now) {
+          continue;
+        }
+        expires_at = now + record.expires_at - wall_now;
+      }
+      slot.Store(key, value, expires_at);
+      ++stats.entries;
+    }
+  }
+  stats.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  VLOG(2) << "Restored " << stats.entries << " entries of bucket " << bucket->name() << " from "
+          << path << " in " << stats.duration.count() << " msec";
+  return stats;
+}
+
+template<typename K, typename V>
+std::vector<SnapshotStats> InMemoryKeyStore<K, V>::RestoreAll(const std::string &dir,
+                                                              size_t max_concurrency) {
+  std::vector<std::string> paths;
+  for (const auto &file : std::filesystem::directory_iterator(dir)) {
+    if (file.is_regular_file() && file.path().extension() == kSnapshotExtension) {
+      paths.push_back(file.path().string());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<SnapshotStats> results(paths.size());
+  ParallelFor(paths.size(), max_concurrency, [&](size_t i) {
+    try {
+      results[i] = Restore(paths[i]);
+    } catch (const std::exception &ex) {
+      LOG(ERROR) << "Could not restore " << paths[i] << ": " << ex.what();
+      results[i].path = paths[i];
+      results[i].error = ex.what();
+    }
+  });
+  return results;
+}
+
+template<typename K, typename V>
+typename InMemoryKeyStore<K, V>::ReleasedBucket InMemoryKeyStore<K, V>::ReleaseBucket(
+    BucketPtr bucket) {
+  auto index = view_ptr_->IndexOf(bucket);
+  if (!IsOwned(index)) {
+    LOG(ERROR) << "Cannot release bucket " << bucket->name() << " from KeyStore "
+               << this->name() << ", as it does not own it";
+    return nullptr;
+  }
+  owned_[index / 64].fetch_and(~(1UL << (index % 64)), std::memory_order_release);
+  auto released = std::make_unique<BucketSlot<K, V>>();
   {
-    UniqueLock lk(*mutexes_.at(source));
-    for (const auto &key : to_be_erased) {
-      VLOG(3) << "Removing data for key: " << key;
-      data->erase(key);
+    auto &slot = *slots_[index];
+    if (slot.sketches) {
+      released->sketches = std::make_unique<KeySketches<K>>(slot.sketches->options());
     }
+    UniqueLock lk(slot.mutex);
+    UniqueLock released_lk(released->mutex);
+    released->Adopt(slot);
+    released->bucket = std::move(slot.bucket);
   }
-  VLOG(2) << "Done re-balancing from Bucket [" << source->name() << "] to KeyStore ["
-          << destination_store->name() << "]";
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets_.erase(bucket);
+  }
+  VLOG(2) << "Released bucket " << bucket->name() << " from KeyStore " << this->name();
+  return released;
+}
 
+template<typename K, typename V>
+bool InMemoryKeyStore<K, V>::AdoptBucket(ReleasedBucket &&released) {
+  auto bucket = released->bucket;
+  auto index = view_ptr_->IndexOf(bucket);
+  if (IsOwned(index)) {
+    LOG(ERROR) << "Cannot adopt bucket " << bucket->name() << " into KeyStore "
+               << this->name() << ", as it already owns it";
+    return false;
+  }
+  if (!slots_[index]) {
+    slots_[index] = NewSlot();
+  }
+  auto wal = WalFor(bucket);
+  {
+    auto &slot = *slots_[index];
+    UniqueLock lk(slot.mutex);
+    UniqueLock released_lk(released->mutex);
+    slot.Adopt(*released, cache_.get());
+    slot.bucket = std::move(released->bucket);
+    slot.wal = wal;
+  }
+  released.reset();
+  owned_[index / 64].fetch_or(1UL << (index % 64), std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets_.insert(bucket);
+  }
+  VLOG(2) << "Adopted bucket " << bucket->name() << " into KeyStore " << this->name();
+  return true;
+}
+
+template<typename K, typename V>
+bool InMemoryKeyStore<K, V>::TransferBucket(BucketPtr bucket, InMemoryKeyStore &destination) {
+  auto released = ReleaseBucket(bucket);
+  if (!released) {
+    return false;
+  }
+  if (!destination.AdoptBucket(std::move(released))) {
+    // This store keeps the bucket, unless it was added back to it in the meantime: then the
+    // released data can go nowhere, and is dropped.
+    if (!AdoptBucket(std::move(released))) {
+      LOG(ERROR) << "Bucket " << bucket->name() << " was added back to KeyStore " << this->name()
+                 << " while being transferred to KeyStore " << destination.name()
+                 << ": dropping the " << released->size() << " entries released from it";
+    }
+    return false;
+  }
   return true;
 }
 
@@ -317,29 +2038,36 @@ template<typename K, typename V>
 bool InMemoryKeyStore<K, V>::RemoveBucket(
     BucketPtr bucket,
     std::set<KeyStorePtr<K, V>> destination_stores) {
+  return RemoveBucket(bucket, destination_stores, RebalanceOptions{}).complete;
+}
+
+template<typename K, typename V>
+RebalanceProgress InMemoryKeyStore<K, V>::RemoveBucket(
+    BucketPtr bucket,
+    const std::set<KeyStorePtr<K, V>> &destination_stores,
+    const RebalanceOptions &options) {
   VLOG(2) << "Scanning data for bucket " << bucket->name();
-  // We want this to fail noisily if the data cannot be found, so we use at()
-  auto data = maps_.at(bucket);
+  std::vector<KeyStorePtr<K, V>> destinations{destination_stores.begin(),
+                                              destination_stores.end()};
+  auto progress = MoveData(bucket, true, destinations, options);
+  if (!progress.complete) {
+    return progress;
+  }
+  auto index = view_ptr_->IndexOf(bucket);
+  owned_[index / 64].fetch_and(~(1UL << (index % 64)), std::memory_order_release);
   {
-    SharedLock lk(*mutexes_.at(bucket));
-    for (const auto &[key, value] : *data) {
-      for (const auto &store : destination_stores) {
-        if (store->Put(key, value)) {
-          break;
-        }
-        LOG(ERROR) << "Key " << key << " cannot be moved to any of the destinations";
-        return false;
-      }
-    }
+    // This releases the bucket's arena in one go.
+    auto &slot = *slots_[index];
+    UniqueLock lk(slot.mutex);
+    slot.bucket.reset();
+    slot.Drop();
   }
   {
-    UniqueLock lk(*mutexes_.at(bucket));
-    maps_.erase(bucket);
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets_.erase(bucket);
   }
-  buckets_.erase(bucket);
-  mutexes_.erase(bucket);
   VLOG(2) << "Done moving data from Bucket " << bucket->name();
-  return true;
+  return progress;
 }
 
 } // namespace keystore
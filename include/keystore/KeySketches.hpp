@@ -0,0 +1,263 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "json.hpp"
+
+#include "CountMinSketch.hpp"
+#include "HyperLogLog.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * The configuration of the `KeySketches` kept for each bucket, see
+ * `InMemoryKeyStore::EnableSketches()`: only sketches with the same options can be merged.
+ */
+struct SketchOptions {
+  // The HyperLogLog precision: the distinct keys are estimated within ~1.6% with 12 bits.
+  unsigned int precision = HyperLogLog::kDefaultPrecision;
+
+  // The width of the Count-Min sketch: the frequency of each key is over-estimated by (at most)
+  // 2/width of all the accesses, with a probability of 94% (1 - 1/2^4, for its 4 rows).
+  size_t width = 2048;
+
+  // How many of the most frequently accessed keys are tracked.
+  size_t top_k = 10;
+};
+
+/** One of the most frequently accessed keys, see `KeySketches::HotKeys()`. */
+template<typename K>
+struct HotKey {
+  K key;
+  uint64_t hash;
+  // The estimated number of accesses, which may be larger (but never smaller) than the actual.
+  uint64_t count;
+};
+
+/**
+ * Streaming summaries of the keys accessed in a bucket: how many distinct keys (a
+ * `HyperLogLog`), and which are the most frequently accessed ones (the "heavy hitters", found
+ * with the Space-Saving algorithm, whose counts are estimated by a `WideCountMinSketch`).
+ *
+ * <p>Recording an access is lock-free, and only takes a few relaxed atomic updates; the mutex
+ * guarding the `top_k` candidates is only acquired when a key not yet among them is accessed
+ * more often than the least frequent of them (or while there are fewer than `top_k`): once the
+ * heavy hitters have emerged, this is rare.
+ *
+ * <p>Keys are identified by their 64-bit hash (see `HashedKey`), so that they are never hashed
+ * again; sketches with the same options can be merged, e.g., to summarize all the buckets of a
+ * store, or of a whole cluster.
+ *
+ * <p>See: Metwally et al., "Efficient Computation of Frequent and Top-k Elements in Data
+ * Streams".
+ */
+template<typename K>
+class KeySketches {
+ public:
+  explicit KeySketches(const SketchOptions &options) :
+      options_{options},
+      distinct_{options.precision},
+      counts_{options.width, WideCountMinSketch::kNoAging},
+      candidates_{new Candidate[std::max(options.top_k, size_t{1})]} { }
+
+  /** Creates a copy of `other`, taken from its current state (it may be concurrently updated). */
+  KeySketches(const KeySketches &other) : KeySketches(other.options_) {
+    Merge(other);
+  }
+
+  KeySketches &operator=(const KeySketches &) = delete;
+
+  /** Records one access to `key`, whose hash is `hash`. */
+  void Record(const K &key, uint64_t hash) {
+    distinct_.Add(hash);
+    uint64_t count = counts_.Increment(hash);
+    if (count <= threshold_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    // Already a candidate: only its count needs updating.
+    auto size = size_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < size; ++i) {
+      if (candidates_[i].hash.load(std::memory_order_relaxed) == hash) {
+        candidates_[i].count.store(count, std::memory_order_relaxed);
+        return;
+      }
+    }
+    std::lock_guard<std::mutex> lk(mx_);
+    Admit(key, hash, count);
+  }
+
+  /** @return the estimated number of distinct keys recorded */
+  uint64_t DistinctKeys() const {
+    return static_cast<uint64_t>(std::llround(distinct_.Estimate()));
+  }
+
+  /** @return the estimated number of accesses to the key whose hash is `hash` */
+  uint64_t Frequency(uint64_t hash) const { return counts_.Estimate(hash); }
+
+  /** @return (up to `top_k`) the most frequently accessed keys, most frequent first */
+  std::vector<HotKey<K>> HotKeys() const {
+    std::vector<HotKey<K>> keys;
+    {
+      std::lock_guard<std::mutex> lk(mx_);
+      auto size = size_.load(std::memory_order_relaxed);
+      keys.reserve(size);
+      for (size_t i = 0; i < size; ++i) {
+        auto hash = candidates_[i].hash.load(std::memory_order_relaxed);
+        keys.push_back({candidates_[i].key, hash, counts_.Estimate(hash)});
+      }
+    }
+    std::sort(keys.begin(), keys.end(), [](const HotKey<K> &a, const HotKey<K> &b) {
+      return a.count > b.count;
+    });
+    return keys;
+  }
+
+  /**
+   * Adds all the accesses recorded by `other` to this one: the distinct keys are those of the
+   * union of the two, and the heavy hitters are chosen among the candidates of both.
+   *
+   * @throws std::invalid_argument if the two were not created with the same options
+   */
+  void Merge(const KeySketches &other) {
+    if (!Mergeable(other)) {
+      throw std::invalid_argument("Cannot merge sketches created with different options");
+    }
+    if (&other == this) {
+      return;
+    }
+    distinct_.Merge(other.distinct_);
+    counts_.Merge(other.counts_);
+
+    auto others = other.HotKeys();
+    std::lock_guard<std::mutex> lk(mx_);
+    for (size_t i = 0; i < size_.load(std::memory_order_relaxed); ++i) {
+      auto &candidate = candidates_[i];
+      candidate.count.store(counts_.Estimate(candidate.hash.load(std::memory_order_relaxed)),
+                            std::memory_order_relaxed);
+    }
+    for (const auto &hot : others) {
+      Admit(hot.key, hot.hash, counts_.Estimate(hot.hash));
+    }
+  }
+
+  /** @return whether `other` can be merged into this, see `Merge()` */
+  bool Mergeable(const KeySketches &other) const {
+    return options_.precision == other.options_.precision &&
+        options_.width == other.options_.width && options_.top_k == other.options_.top_k;
+  }
+
+  /** Forgets all the accesses recorded so far. */
+  void Reset() {
+    std::lock_guard<std::mutex> lk(mx_);
+    distinct_.Reset();
+    counts_.Reset();
+    size_.store(0, std::memory_order_release);
+    threshold_.store(0, std::memory_order_relaxed);
+  }
+
+  const SketchOptions &options() const { return options_; }
+
+  /** @return the memory used by the sketches, in bytes. */
+  size_t EstimateSize() const {
+    return sizeof(*this) + distinct_.EstimateSize() + counts_.EstimateSize() +
+        capacity() * sizeof(Candidate);
+  }
+
+ private:
+  struct Candidate {
+    // Only modified while holding the `mx_`, but read (and counted) without it.
+    std::atomic_uint64_t hash{0};
+    std::atomic_uint64_t count{0};
+    // Only accessed while holding the `mx_`.
+    K key{};
+  };
+
+  size_t capacity() const { return std::max(options_.top_k, size_t{1}); }
+
+  // Space-Saving: the key joins the candidates if there is room, or replaces the least frequent
+  // one, if it has been accessed more often. The caller must hold the `mx_`.
+  void Admit(const K &key, uint64_t hash, uint64_t count) {
+    auto size = size_.load(std::memory_order_relaxed);
+    size_t min = 0;
+    for (size_t i = 0; i < size; ++i) {
+      if (candidates_[i].hash.load(std::memory_order_relaxed) == hash) {
+        candidates_[i].count.store(std::max(count,
+                                            candidates_[i].count.load(std::memory_order_relaxed)),
+                                   std::memory_order_relaxed);
+        return;
+      }
+      if (candidates_[i].count.load(std::memory_order_relaxed) <
+          candidates_[min].count.load(std::memory_order_relaxed)) {
+        min = i;
+      }
+    }
+    if (size < capacity()) {
+      Replace(size, key, hash, count);
+      size_.store(size + 1, std::memory_order_release);
+    } else if (count > candidates_[min].count.load(std::memory_order_relaxed)) {
+      Replace(min, key, hash, count);
+    }
+    if (size_.load(std::memory_order_relaxed) == capacity()) {
+      uint64_t threshold = UINT64_MAX;
+      for (size_t i = 0; i < capacity(); ++i) {
+        threshold = std::min(threshold, candidates_[i].count.load(std::memory_order_relaxed));
+      }
+      threshold_.store(threshold, std::memory_order_relaxed);
+    }
+  }
+
+  void Replace(size_t pos, const K &key, uint64_t hash, uint64_t count) {
+    auto &candidate = candidates_[pos];
+    candidate.key = key;
+    candidate.count.store(count, std::memory_order_relaxed);
+    candidate.hash.store(hash, std::memory_order_relaxed);
+  }
+
+  SketchOptions options_;
+  HyperLogLog distinct_;
+  WideCountMinSketch counts_;
+
+  mutable std::mutex mx_;
+  std::unique_ptr<Candidate[]> candidates_;
+  std::atomic_size_t size_{0};
+  // Accesses are only counted against the candidates once their estimate is above this: the
+  // smallest count among them (once there are `top_k` of them).
+  std::atomic_uint64_t threshold_{0};
+};
+
+template<typename K>
+void to_json(json &j, const HotKey<K> &hot) {
+  if constexpr (std::is_arithmetic_v<K>) {
+    j["key"] = hot.key;
+  } else if constexpr (std::is_convertible_v<const K &, std::string_view>) {
+    j["key"] = std::string{std::string_view{hot.key}};
+  } else {
+    j["hash"] = hot.hash;
+  }
+  j["count"] = hot.count;
+}
+
+template<typename K>
+void to_json(json &j, const KeySketches<K> &sketches) {
+  j = {
+      {"distinct_keys", sketches.DistinctKeys()},
+      {"hot_keys", sketches.HotKeys()}
+  };
+}
+
+} // namespace keystore
@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <iomanip>
 #include <list>
 #include <map>
@@ -12,6 +14,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
+#include <vector>
 
 #include <glog/logging.h>
 
@@ -34,6 +37,15 @@ class not_found : public utils::base_error {
   }
 };
 
+/**
+ * Raised by `KeyStore::Iterate()` when passed a continuation which it did not return.
+ */
+class invalid_continuation : public utils::base_error {
+ public:
+  explicit invalid_continuation(const std::string &continuation) :
+      base_error{"Invalid continuation: '" + continuation + "'"} { }
+};
+
 // Forward declaration
 template<typename Key, typename Value>
 class KeyStore;
@@ -49,6 +61,34 @@ using KeyStorePtr = std::shared_ptr<KeyStore<Key, Value>>;
 
 using MutexPtr = std::shared_ptr<std::shared_mutex>;
 
+/**
+ * One batch of the entries of a store, see `KeyStore::Iterate()`.
+ */
+template<typename Key, typename Value>
+struct IterationBatch {
+  std::vector<std::pair<Key, Value>> entries;
+
+  /**
+   * Where the next batch starts: an opaque string, which can be passed to `Iterate()` at any
+   * later time (e.g., by a client, in its next request); empty once all the entries have been
+   * returned.
+   */
+  std::string continuation;
+
+  [[nodiscard]] bool done() const { return continuation.empty(); }
+};
+
+/**
+ * Selects the buckets whose entries are returned by `KeyStore::Iterate()`.
+ */
+using BucketFilter = std::function<bool(const BucketPtr &)>;
+
+/**
+ * Size of a cache line: data which is frequently accessed by different threads is aligned to
+ * this, so that it does not incur "false sharing."
+ */
+inline constexpr size_t kCacheLineSize = 64;
+
 
 /**
  * Abstract interface for a distributed KeyValue Store.
@@ -91,6 +131,26 @@ class KeyStore {
    */
   virtual bool Put(const K &key, const V &value) = 0;
 
+  /**
+   * Stores the `value`, as `Put(key, value)` does, but only for the given `ttl`: once that has
+   * elapsed, the entry expires, and `Get(key)` will no longer return it.
+   *
+   * <p>Storing a new value for the `key` (with or without a TTL) replaces the current TTL.
+   *
+   * <p>Not all stores support expiring entries: the default implementation throws a
+   * `utils::not_implemented` exception.
+   *
+   * @param key     the key that maps to the `value`
+   * @param value   the associated value to store
+   * @param ttl     how long the entry will be kept for; if not positive, the entry expires
+   *    immediately
+   * @return `true` if successful; `false`otherwise
+   */
+  virtual bool Put([[maybe_unused]] const K &key, [[maybe_unused]] const V &value,
+                   [[maybe_unused]] std::chrono::milliseconds ttl) {
+    throw utils::not_implemented("Put(key, value, ttl)");
+  }
+
   /**
    * Retrieves the data mapped by the `key`.
    *
@@ -115,6 +175,86 @@ class KeyStore {
    */
   virtual bool Remove(const K &key) = 0;
 
+  /**
+   * Batched version of `Get()`: looks up all the `keys` and returns the results in the same
+   * order as they were passed in.
+   *
+   * <p>The default implementation simply calls `Get()` for each key in turn; implementations
+   * which can amortize the per-key costs (hashing, finding the bucket, locking) across the
+   * batch should override it.
+   *
+   * @param keys the keys to look up
+   * @return one `optional` per key, in input order; each one is empty if the corresponding
+   *    `Get(key)` would have returned an empty `optional`
+   */
+  virtual std::vector<std::optional<V>> MultiGet(const std::vector<K> &keys) const {
+    std::vector<std::optional<V>> results;
+    results.reserve(keys.size());
+    for (const auto &key : keys) {
+      results.push_back(Get(key));
+    }
+    return results;
+  }
+
+  /**
+   * Batched version of `Put()`, the same guarantees apply to each of the `items`.
+   *
+   * @param items the key/value pairs to store
+   * @return for each of the `items`, in input order, whether it was successfully stored
+   */
+  virtual std::vector<bool> MultiPut(const std::vector<std::pair<K, V>> &items) {
+    std::vector<bool> results;
+    results.reserve(items.size());
+    for (const auto &[key, value] : items) {
+      results.push_back(Put(key, value));
+    }
+    return results;
+  }
+
+  /**
+   * Batched version of `Remove()`.
+   *
+   * @param keys the keys to remove, along with their associated values
+   * @return for each of the `keys`, in input order, whether it was found and removed
+   */
+  virtual std::vector<bool> MultiRemove(const std::vector<K> &keys) {
+    std::vector<bool> results;
+    results.reserve(keys.size());
+    for (const auto &key : keys) {
+      results.push_back(Remove(key));
+    }
+    return results;
+  }
+
+  /**
+   * Returns all the entries of the store, one batch at a time: each call returns the next batch,
+   * and where the one after it starts (its `continuation`), until the iteration is `done()`.
+   *
+   * <p>Unlike iterating over the store's data directly, this never holds a lock for longer than
+   * it takes to copy a few entries, so that even very large stores can be walked (e.g., to
+   * export, or back up, their data) without blocking other clients. As a consequence, the
+   * iteration is not a consistent snapshot: entries which are neither written nor removed while
+   * it runs are returned exactly once, while those modified concurrently may, or may not, be.
+   *
+   * <p>Not all stores support iterating over their entries: the default implementation throws a
+   * `utils::not_implemented` exception.
+   *
+   * @param continuation where to start from: empty, for the first batch; or the `continuation`
+   *    returned with the previous batch
+   * @param max_entries how many entries to return (implementations may return a few more, but
+   *    never fewer, unless the iteration is done)
+   * @param filter if set, only the entries in the buckets for which it returns `true` are
+   *    returned; it must be the same for all the batches of an iteration
+   * @return the next batch of entries, in no particular order
+   * @throws invalid_continuation if `continuation` was not returned by this store
+   */
+  virtual IterationBatch<K, V> Iterate(
+      [[maybe_unused]] const std::string &continuation,
+      [[maybe_unused]] size_t max_entries,
+      [[maybe_unused]] const BucketFilter &filter = nullptr) const {
+    throw utils::not_implemented("Iterate()");
+  }
+
   [[nodiscard]] virtual json Stats() const {
     json stats;
     stats["name"] = name();
@@ -134,17 +274,6 @@ class KeyStore {
  */
 template<typename Key, typename Value>
 class PartitionedKeyStore : public KeyStore<Key, Value> {
- protected:
-  /**
-   * Given a `key` it hashes it, finds the appropriate `Bucket` and returns the corresponding
-   * associative container which may contain the data.
-   *
-   * @param key
-   * @return a pointer to the map where the `data` *may* be stored; or `None` if the key hashes
-   *        to a bucket that does not belong to this store
-   */
-  virtual std::optional<std::pair<MutexPtr, MapPtr<Key, Value>>> FindMap(const Key &key) const = 0;
-
  public:
   explicit PartitionedKeyStore(const std::string& name) : KeyStore<Key, Value>(name) { }
 
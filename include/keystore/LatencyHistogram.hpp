@@ -0,0 +1,240 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "json.hpp"
+
+#include "ShardedCounters.hpp"
+
+/**
+ * Latency histograms can be compiled out altogether (e.g., with `-DLATENCY_HISTOGRAMS=OFF`, when
+ * running `cmake`): no clock is then ever read, and `Stats()` does not report them.
+ */
+#ifndef KEYSTORE_LATENCY_HISTOGRAMS
+#define KEYSTORE_LATENCY_HISTOGRAMS 1
+#endif
+
+namespace keystore {
+
+inline constexpr bool kLatencyHistograms = KEYSTORE_LATENCY_HISTOGRAMS != 0;
+
+/**
+ * On average, only one operation in this many is timed (must be a power of 2): reading the clock
+ * costs about as much as a cached `Get()` (20-40 nsec, under virtualization) and timing every
+ * operation would noticeably slow down the store. Sampled operations are chosen at random, so
+ * that the percentiles are unbiased, even for workloads which follow a regular pattern.
+ */
+inline constexpr uint32_t kLatencySampleEvery = 16;
+
+/**
+ * @return the current value of a monotonic clock, in "ticks": on x86 processors, the CPU's
+ *    time-stamp counter; nanoseconds, elsewhere
+ */
+inline uint64_t ReadClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/**
+ * @return how many nanoseconds each tick of `ReadClock()` lasts; the first call measures it,
+ *    which takes a few milliseconds
+ */
+double NanosPerTick();
+
+/**
+ * @return whether the operation about to run on this thread should be timed, see
+ *    `kLatencySampleEvery`
+ */
+inline bool SampleLatency() {
+  // A per-thread xorshift generator: cheaper than a shared counter, and not periodic.
+  thread_local uint32_t state = 0x9E3779B9U + static_cast<uint32_t>(ThisThreadShard());
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return (state & (kLatencySampleEvery - 1)) == 0;
+}
+
+/**
+ * A snapshot of a `LatencyHistogram`, all of whose shards have been merged.
+ */
+class LatencySnapshot {
+  std::vector<uint64_t> counts_;
+  uint64_t total_ = 0;
+  double nanos_per_tick_;
+
+ public:
+  LatencySnapshot(std::vector<uint64_t> counts, double nanos_per_tick);
+
+  /** @return the number of values recorded */
+  [[nodiscard]] uint64_t count() const { return total_; }
+
+  /**
+   * @param percentile in the [0, 100] range
+   * @return the (highest equivalent, see `LatencyHistogram`) value, in nanoseconds, which is not
+   *    exceeded by `percentile`% of the values recorded; 0 if no value was recorded
+   */
+  [[nodiscard]] double ValueAt(double percentile) const;
+
+  [[nodiscard]] double Max() const { return ValueAt(100.0); }
+  [[nodiscard]] double Mean() const;
+
+  /**
+   * Renders the distribution of values as text, one line for each range of values recorded,
+   * in the same format as HdrHistogram's `outputPercentileDistribution()`, so that it can be
+   * plotted with the same tools.
+   */
+  [[nodiscard]] std::string ToText() const;
+};
+
+void to_json(json &j, const LatencySnapshot &snapshot);
+
+/**
+ * A log-linear ("HDR") histogram of latencies: each power of 2 range of values is split into
+ * `kSubBuckets` linear sub-buckets, so that all values are recorded with the same (about 3%)
+ * relative precision, from a few nanoseconds to several minutes, with a fixed amount of memory.
+ *
+ * <p>As with `ShardedCounters`, each thread records values in a shard of its own (a relaxed
+ * atomic increment); shards are only merged when a `Snapshot()` is taken.
+ *
+ * <p>Values are recorded in `ReadClock()` ticks, and only converted into nanoseconds in the
+ * `Snapshot()`.
+ */
+class LatencyHistogram {
+ public:
+  static constexpr size_t kSubBucketBits = 5;
+  static constexpr size_t kSubBuckets = 1UL << kSubBucketBits;
+
+  /** Larger values are recorded as `2^kMaxValueBits - 1` (that is, several minutes). */
+  static constexpr size_t kMaxValueBits = 42;
+  static constexpr size_t kNumBuckets = (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets;
+
+  static size_t BucketOf(uint64_t value) {
+    if (value < kSubBuckets) {
+      return value;
+    }
+    if (value >> kMaxValueBits) {
+      value = (1ULL << kMaxValueBits) - 1;
+    }
+    size_t shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+    return (shift << kSubBucketBits) + (value >> shift);
+  }
+
+  /** @return the highest value which is recorded in the `bucket` */
+  static uint64_t HighestValueIn(size_t bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    size_t shift = (bucket >> kSubBucketBits) - 1;
+    return ((bucket - (shift << kSubBucketBits) + 1) << shift) - 1;
+  }
+
+  LatencyHistogram() : shards_{std::make_unique<Shard[]>(kCounterShards)} { }
+
+  void Record(uint64_t ticks) {
+    shards_[ThisThreadShard()].counts[BucketOf(ticks)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * @param nanos_per_tick only meant for tests, to read the values as they were recorded
+   */
+  [[nodiscard]] LatencySnapshot Snapshot(double nanos_per_tick = NanosPerTick()) const;
+
+  void Reset();
+
+ private:
+  struct alignas(kCacheLineSize) Shard {
+    std::array<std::atomic_uint64_t, kNumBuckets> counts{};
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+};
+
+/**
+ * Times the operation in whose scope it lives (if sampled, see `SampleLatency()`), recording
+ * its duration in the `histogram` when it goes out of scope.
+ */
+class ScopedLatency {
+  LatencyHistogram &histogram_;
+  uint64_t start_ = 0;
+
+ public:
+  explicit ScopedLatency(LatencyHistogram &histogram, bool sampled = SampleLatency())
+      : histogram_{histogram} {
+    if (kLatencyHistograms && sampled) {
+      start_ = ReadClock();
+    }
+  }
+
+  ScopedLatency(const ScopedLatency &) = delete;
+  ScopedLatency &operator=(const ScopedLatency &) = delete;
+
+  ~ScopedLatency() {
+    if (kLatencyHistograms && start_ != 0) {
+      histogram_.Record(ReadClock() - start_);
+    }
+  }
+
+  /**
+   * Records, in the `histogram`, the time elapsed so far: this is used to time one step of the
+   * operation (e.g., finding the key's bucket) as well as the whole of it.
+   */
+  void Lap(LatencyHistogram &histogram) const {
+    if (kLatencyHistograms && start_ != 0) {
+      histogram.Record(ReadClock() - start_);
+    }
+  }
+};
+
+/**
+ * The operations whose latency is recorded by a `KeyStore`.
+ */
+enum class LatencyOp : size_t {
+  kGet = 0,
+  kPut,
+  kRemove,
+  // Hashing the key, and finding its bucket in the `View`.
+  kFindBucket,
+  kRebalance,
+};
+
+inline constexpr size_t kNumLatencyOps = 5;
+
+/**
+ * One `LatencyHistogram` for each of the `LatencyOp`s.
+ */
+class OpLatencies {
+  std::array<LatencyHistogram, kNumLatencyOps> histograms_;
+
+ public:
+  LatencyHistogram &operator[](LatencyOp op) { return histograms_[static_cast<size_t>(op)]; }
+  const LatencyHistogram &operator[](LatencyOp op) const {
+    return histograms_[static_cast<size_t>(op)];
+  }
+
+  /** @return the distributions of all the operations, as text, see `LatencySnapshot::ToText()` */
+  [[nodiscard]] std::string ToText() const;
+};
+
+/** @return the name of the `op`, as reported in `Stats()` */
+const char *LatencyOpName(LatencyOp op);
+
+void to_json(json &j, const OpLatencies &latencies);
+
+} // namespace keystore
@@ -0,0 +1,468 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <unordered_map>
+
+#include "HashedKey.hpp"
+#include "KeyStore.hpp"
+#include "LsmTree.hpp"
+#include "Snapshot.hpp"
+
+namespace keystore {
+
+/**
+ * A `PartitionedKeyStore` whose data is stored on disk, so that it can exceed the memory
+ * available: each bucket is a separate `LsmTree`, in its own directory (named after the bucket)
+ * under `LsmOptions::dir`.
+ *
+ * <p>Keys and values are encoded as they are in snapshots (see `SnapshotCodec`); the entries in
+ * each tree are sorted by the keys' hashes, that is by their position on the ring, so that the
+ * keys which need moving when the ring is re-partitioned are contiguous in the tables.
+ *
+ * <p>The memtables are flushed, and the tables compacted, by a pool of background threads
+ * shared by all the buckets (see `LsmOptions::compaction_threads`).
+ *
+ * <p>As each bucket is self-contained, moving it to another store means shipping its files
+ * rather than its entries: see `TransferBucket()` (for stores in the same process, or on the same
+ * filesystem) and `ExportBucket()`.
+ *
+ * <p>Entries cannot expire: `Put(key, value, ttl)` is not supported.
+ *
+ * @tparam K the type of the key, which must have a `SnapshotCodec`
+ * @tparam V the type of the data being stored, which must have a `SnapshotCodec`
+ */
+template<typename K, typename V>
+class LsmKeyStore : public PartitionedKeyStore<K, V> {
+
+  // How many entries are moved to the destination stores, in each `MultiPut()`.
+  static constexpr size_t kMoveBatchSize = 1000;
+
+  std::shared_ptr<View> view_ptr_;
+  LsmOptions options_;
+  // Declared before the trees, so that it outlives them (the trees wait for their jobs to end).
+  std::unique_ptr<BackgroundPool> pool_;
+
+  std::unordered_set<BucketPtr> buckets_;
+  mutable std::mutex buckets_mx_;
+
+  // Indexed by the buckets' dense index in the View, and only set for the buckets owned by this
+  // store; accessed atomically, so that buckets can be added and removed concurrently.
+  std::array<std::shared_ptr<LsmTree>, kMaxBuckets> trees_;
+
+  std::shared_ptr<LsmTree> FindTree(uint64_t hash) const {
+    return std::atomic_load(&trees_[view_ptr_->FindBucketIndex(PositionOf(hash))]);
+  }
+
+  std::string BucketDir(const BucketPtr &bucket) const {
+    return options_.dir + "/" + bucket->name();
+  }
+
+  // Opens the bucket's tree, unless this store already has one open for it.
+  bool OpenTree(const BucketPtr &bucket);
+
+  /**
+   * Stores the live entries of the `tree` for which `should_move(hash)` holds in the first of the
+   * `destinations` which accepts them, in batches; if `remove`, the entries moved are then
+   * removed from the tree.
+   *
+   * @return whether all the entries were moved
+   */
+  template<typename Pred>
+  bool MoveEntries(LsmTree &tree, const std::vector<KeyStorePtr<K, V>> &destinations,
+                   Pred should_move, bool remove);
+
+  void DeleteTree(std::shared_ptr<LsmTree> tree);
+
+ public:
+  /**
+   * Creates the store, opening (or creating) the trees of the `buckets` it owns.
+   *
+   * @throws lsm_error if any of the trees cannot be opened
+   */
+  LsmKeyStore(const std::string &name,
+              const std::shared_ptr<View> &view,
+              const std::unordered_set<std::string> &buckets,
+              const LsmOptions &options);
+
+  ~LsmKeyStore() override = default;
+
+  bool Put(const K &key, const V &value) override;
+  std::optional<V> Get(const K &key) const override;
+  bool Remove(const K &key) override;
+
+  /**
+   * Groups the `items` by bucket, and applies (and logs) each group in one go.
+   */
+  std::vector<bool> MultiPut(const std::vector<std::pair<K, V>> &items) override;
+
+  /**
+   * Opens the bucket's tree: if its directory already exists (e.g., because the bucket was
+   * owned by this store before it was restarted, or its files were shipped from another store,
+   * see `ExportBucket()`) its data is recovered.
+   *
+   * <p>If this store already owns the bucket, its tree is left as it is.
+   */
+  void AddBucket(BucketPtr bucket) override;
+
+  /**
+   * Moves all the bucket's entries to the `destination_stores` and then deletes its files.
+   *
+   * <p>Writes to the bucket fail while its entries are being moved; it can still be read from,
+   * until they all are.
+   */
+  bool RemoveBucket(BucketPtr bucket,
+                    std::set<KeyStorePtr<K, V>> destination_stores) override;
+
+  /**
+   * Moves the entries which no longer belong to the `source` bucket to the `destination_store`,
+   * then removes them.
+   */
+  bool Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) override;
+
+  /**
+   * Hands the `bucket` over to the `destination` store, without re-writing any of its entries:
+   * its files are hard-linked (or, across filesystems, copied) into the destination's directory,
+   * which then opens them.
+   *
+   * <p>The bucket stops serving requests from this store as soon as the transfer starts: writes
+   * which were already under way either complete before the bucket's files are copied, or fail.
+   *
+   * @return whether the bucket was handed over; if not, this store still owns it
+   */
+  bool TransferBucket(BucketPtr bucket, LsmKeyStore &destination);
+
+  /**
+   * Writes a copy of the `bucket`'s files to `dir`, which must not exist: copying that directory
+   * to `<dir>/<bucket name>` of another store (e.g., on a different host) and then adding the
+   * bucket to it is enough to move the bucket.
+   *
+   * <p>Writes made while the copy is taken may not be included in it.
+   *
+   * @return the files written
+   * @throws lsm_error if the bucket is not owned by this store, or cannot be copied
+   */
+  std::vector<std::string> ExportBucket(BucketPtr bucket, const std::string &dir);
+
+  /** Writes all the memtables to disk, and waits until all the compactions are done. */
+  void Flush();
+
+  [[nodiscard]] json Stats() const override;
+};
+
+template<typename K, typename V>
+LsmKeyStore<K, V>::LsmKeyStore(
+    const std::string &name,
+    const std::shared_ptr<View> &view,
+    const std::unordered_set<std::string> &buckets,
+    const LsmOptions &options
+) : PartitionedKeyStore<K, V>(name), view_ptr_{view}, options_{options},
+    pool_{std::make_unique<BackgroundPool>(options.compaction_threads)} {
+  VLOG(2) << "Creating LsmKeyStore in " << options_.dir << " with " << buckets.size()
+          << " buckets (of " << view->num_buckets() << ")";
+  std::filesystem::create_directories(options_.dir);
+  for (auto &b : view_ptr_->buckets()) {
+    if (buckets.count(b->name()) > 0) {
+      AddBucket(b);
+    }
+  }
+}
+
+template<typename K, typename V>
+void LsmKeyStore<K, V>::AddBucket(BucketPtr bucket) {
+  VLOG(2) << "Adding bucket " << bucket << ", to KeyStore " << this->name();
+  if (!OpenTree(bucket)) {
+    LOG(ERROR) << "Cannot add bucket " << bucket->name() << " to KeyStore " << this->name()
+               << ", as it already owns it";
+  }
+}
+
+template<typename K, typename V>
+bool LsmKeyStore<K, V>::OpenTree(const BucketPtr &bucket) {
+  auto index = view_ptr_->IndexOf(bucket);
+  // Held while the tree is opened, so that no two trees are ever open in the same directory.
+  std::lock_guard<std::mutex> lk(buckets_mx_);
+  if (std::atomic_load(&trees_[index])) {
+    return false;
+  }
+  auto tree = std::make_shared<LsmTree>(BucketDir(bucket), options_, pool_.get());
+  std::atomic_store(&trees_[index], tree);
+  buckets_.insert(bucket);
+  return true;
+}
+
+template<typename K, typename V>
+bool LsmKeyStore<K, V>::Put(const K &key, const V &value) {
+  auto hash = HashKey64(key);
+  auto tree = FindTree(hash);
+  if (!tree) {
+    return false;
+  }
+  try {
+    tree->Put(hash, EncodeValue(key), EncodeValue(value));
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Cannot store key " << key << ": " << e.what();
+    return false;
+  }
+  return true;
+}
+
+template<typename K, typename V>
+std::optional<V> LsmKeyStore<K, V>::Get(const K &key) const {
+  auto hash = HashKey64(key);
+  auto tree = FindTree(hash);
+  std::string value;
+  if (tree && tree->Get(hash, EncodeValue(key), &value)) {
+    return DecodeValue<V>(value);
+  }
+  return std::nullopt;
+}
+
+template<typename K, typename V>
+bool LsmKeyStore<K, V>::Remove(const K &key) {
+  auto hash = HashKey64(key);
+  auto tree = FindTree(hash);
+  if (!tree) {
+    return false;
+  }
+  try {
+    return tree->Remove(hash, EncodeValue(key));
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Cannot remove key " << key << ": " << e.what();
+    return false;
+  }
+}
+
+template<typename K, typename V>
+std::vector<bool> LsmKeyStore<K, V>::MultiPut(const std::vector<std::pair<K, V>> &items) {
+  std::vector<bool> results(items.size(), false);
+  std::unordered_map<std::shared_ptr<LsmTree>, std::vector<size_t>> groups;
+  std::vector<LsmTree::Write> writes;
+  writes.reserve(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    auto hash = HashKey64(items[i].first);
+    writes.push_back({hash, EncodeValue(items[i].first), EncodeValue(items[i].second)});
+    if (auto tree = FindTree(hash)) {
+      groups[tree].push_back(i);
+    }
+  }
+  for (const auto &[tree, positions] : groups) {
+    std::vector<LsmTree::Write> batch;
+    batch.reserve(positions.size());
+    for (auto i : positions) {
+      batch.push_back(std::move(writes[i]));
+    }
+    try {
+      tree->Apply(batch);
+    } catch (const std::exception &e) {
+      LOG(ERROR) << "Cannot store " << batch.size() << " keys in " << tree->dir() << ": "
+                 << e.what();
+      continue;
+    }
+    for (auto i : positions) {
+      results[i] = true;
+    }
+  }
+  return results;
+}
+
+template<typename K, typename V>
+template<typename Pred>
+bool LsmKeyStore<K, V>::MoveEntries(LsmTree &tree,
+                                    const std::vector<KeyStorePtr<K, V>> &destinations,
+                                    Pred should_move, bool remove) {
+  std::vector<std::pair<K, V>> items;
+  std::vector<LsmTree::Write> tombstones;
+  auto move = [&]() {
+    std::vector<bool> moved(items.size(), false);
+    std::vector<size_t> pending(items.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    for (const auto &destination : destinations) {
+      if (pending.empty()) {
+        break;
+      }
+      std::vector<std::pair<K, V>> batch;
+      for (auto i : pending) {
+        batch.push_back(items[i]);
+      }
+      auto results = destination->MultiPut(batch);
+      std::vector<size_t> rejected;
+      for (size_t j = 0; j < pending.size(); ++j) {
+        if (results[j]) {
+          moved[pending[j]] = true;
+        } else {
+          rejected.push_back(pending[j]);
+        }
+      }
+      pending = std::move(rejected);
+    }
+    if (remove) {
+      std::vector<LsmTree::Write> removed;
+      for (size_t i = 0; i < items.size(); ++i) {
+        if (moved[i]) {
+          removed.push_back(std::move(tombstones[i]));
+        }
+      }
+      tree.Apply(removed);
+    }
+    for (auto i : pending) {
+      LOG(ERROR) << "Key " << items[i].first << " cannot be moved to any of the destinations";
+    }
+    items.clear();
+    tombstones.clear();
+    return pending.empty();
+  };
+
+  auto entries = tree.NewIterator();
+  for (; entries->Valid(); entries->Next()) {
+    if (entries->deleted() || !should_move(entries->hash())) {
+      continue;
+    }
+    items.emplace_back(DecodeValue<K>(entries->key()), DecodeValue<V>(entries->value()));
+    tombstones.push_back({entries->hash(), std::string{entries->key()}, std::nullopt});
+    if (items.size() >= kMoveBatchSize && !move()) {
+      return false;
+    }
+  }
+  return move();
+}
+
+template<typename K, typename V>
+void LsmKeyStore<K, V>::DeleteTree(std::shared_ptr<LsmTree> tree) {
+  auto dir = tree->dir();
+  // Readers which still use the tree can carry on, as its tables are mapped in memory.
+  tree->WaitForCompactions();
+  tree.reset();
+  std::filesystem::remove_all(dir);
+}
+
+template<typename K, typename V>
+bool LsmKeyStore<K, V>::RemoveBucket(BucketPtr bucket,
+                                     std::set<KeyStorePtr<K, V>> destination_stores) {
+  VLOG(2) << "Moving data out of bucket " << bucket->name();
+  auto index = view_ptr_->IndexOf(bucket);
+  auto tree = std::atomic_load(&trees_[index]);
+  if (!tree) {
+    LOG(ERROR) << "Cannot remove bucket " << bucket->name() << " from KeyStore "
+               << this->name() << ", as it does not own it";
+    return false;
+  }
+  std::vector<KeyStorePtr<K, V>> destinations{destination_stores.begin(),
+                                              destination_stores.end()};
+  // The whole tree is deleted, once all its entries are moved: no more writes can be made to it
+  // that would not be moved.
+  tree->Close();
+  if (!MoveEntries(*tree, destinations, [](uint64_t) { return true; }, false)) {
+    tree->Reopen();
+    return false;
+  }
+  std::atomic_store(&trees_[index], std::shared_ptr<LsmTree>{});
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets_.erase(bucket);
+  }
+  DeleteTree(std::move(tree));
+  VLOG(2) << "Done moving data from Bucket " << bucket->name();
+  return true;
+}
+
+template<typename K, typename V>
+bool LsmKeyStore<K, V>::Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) {
+  auto index = view_ptr_->IndexOf(source);
+  auto tree = std::atomic_load(&trees_[index]);
+  if (!tree) {
+    LOG(ERROR) << "Cannot move data out of bucket " << source->name() << " from KeyStore "
+               << this->name() << ", as it does not own it";
+    return false;
+  }
+  return MoveEntries(*tree, {destination_store}, [this, index](uint64_t hash) {
+    return view_ptr_->FindBucketIndex(PositionOf(hash)) != index;
+  }, true);
+}
+
+template<typename K, typename V>
+bool LsmKeyStore<K, V>::TransferBucket(BucketPtr bucket, LsmKeyStore &destination) {
+  auto index = view_ptr_->IndexOf(bucket);
+  auto tree = std::atomic_load(&trees_[index]);
+  if (!tree || std::atomic_load(&destination.trees_[destination.view_ptr_->IndexOf(bucket)])) {
+    return false;
+  }
+  // No more writes reach the tree (and those already under way fail, unless they are done
+  // before it closes) so that the copy is complete.
+  std::atomic_store(&trees_[index], std::shared_ptr<LsmTree>{});
+  tree->Close();
+  auto destination_index = destination.view_ptr_->IndexOf(bucket);
+  try {
+    tree->Checkpoint(destination.BucketDir(bucket));
+    if (!destination.OpenTree(bucket)) {
+      throw lsm_error("the bucket was added to it in the meantime");
+    }
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Cannot transfer bucket " << bucket->name() << " to KeyStore "
+               << destination.name() << ": " << e.what();
+    // The copy is removed, unless the destination has opened a tree in its directory.
+    if (!std::atomic_load(&destination.trees_[destination_index])) {
+      std::filesystem::remove_all(destination.BucketDir(bucket));
+    }
+    tree->Reopen();
+    std::atomic_store(&trees_[index], tree);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    buckets_.erase(bucket);
+  }
+  DeleteTree(std::move(tree));
+  return true;
+}
+
+template<typename K, typename V>
+std::vector<std::string> LsmKeyStore<K, V>::ExportBucket(BucketPtr bucket,
+                                                         const std::string &dir) {
+  auto tree = std::atomic_load(&trees_[view_ptr_->IndexOf(bucket)]);
+  if (!tree) {
+    throw lsm_error("Bucket " + bucket->name() + " is not owned by KeyStore " + this->name());
+  }
+  return tree->Checkpoint(dir);
+}
+
+template<typename K, typename V>
+void LsmKeyStore<K, V>::Flush() {
+  for (auto &slot : trees_) {
+    if (auto tree = std::atomic_load(&slot)) {
+      tree->Flush();
+      tree->WaitForCompactions();
+    }
+  }
+}
+
+template<typename K, typename V>
+json LsmKeyStore<K, V>::Stats() const {
+  json stats = KeyStore<K, V>::Stats();
+  json buckets = json::array();
+  uint64_t tables = 0, bytes = 0;
+  for (const auto &slot : trees_) {
+    if (auto tree = std::atomic_load(&slot)) {
+      auto tree_stats = tree->Stats();
+      for (const auto &level : tree_stats["levels"]) {
+        tables += level["tables"].template get<uint64_t>();
+        bytes += level["bytes"].template get<uint64_t>();
+      }
+      buckets.push_back(tree_stats);
+    }
+  }
+  stats["buckets"] = buckets;
+  stats["tot_tables"] = tables;
+  stats["tot_table_bytes"] = bytes;
+  return stats;
+}
+
+} // namespace keystore
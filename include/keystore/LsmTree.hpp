@@ -0,0 +1,257 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+
+#include "SSTable.hpp"
+#include "WriteAheadLog.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+struct LsmOptions {
+  // The directory where each bucket's tree is stored (in a sub-directory named after the bucket).
+  std::string dir;
+
+  // Once the memtable (where the writes are buffered) exceeds this size, it is written to disk.
+  size_t memtable_size = 4 * 1024 * 1024;
+
+  // The (approximate) size of the tables' data blocks: the unit which is read by a lookup.
+  size_t block_size = 4096;
+  size_t bloom_bits_per_key = 10;
+
+  // Level 0 (the tables flushed from the memtables, which may overlap) is compacted into
+  // level 1 once it has this many tables.
+  size_t l0_compaction_trigger = 4;
+
+  // Each level (from 1) is compacted into the next one once it exceeds this size, multiplied by
+  // `level_multiplier` for each level past the first.
+  size_t level_base_size = 10 * 1024 * 1024;
+  size_t level_multiplier = 10;
+
+  // Compactions split their output into tables of (about) this size.
+  size_t table_size = 2 * 1024 * 1024;
+
+  // The threads which flush the memtables and compact the tables, shared by all the buckets.
+  size_t compaction_threads = 2;
+
+  // How the writes buffered in the memtables are synced to their write-ahead log.
+  SyncPolicy sync = SyncPolicy::kAlways;
+};
+
+/**
+ * A fixed-size pool of threads, which run the jobs submitted to it in order.
+ */
+class BackgroundPool {
+ public:
+  explicit BackgroundPool(size_t threads);
+  BackgroundPool(const BackgroundPool &) = delete;
+  BackgroundPool &operator=(const BackgroundPool &) = delete;
+
+  /** Runs all the jobs already submitted, then stops the threads. */
+  ~BackgroundPool();
+
+  void Submit(std::function<void()> job);
+
+ private:
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable pending_;
+  std::deque<std::function<void()>> jobs_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+/**
+ * A log-structured merge tree of opaque keys and values (sorted by the keys' hashes, see
+ * `CompareEntries()`), stored in its own directory.
+ *
+ * <p>Writes are appended to a write-ahead log and applied to an in-memory table; once that is
+ * full, it is frozen and written to disk, by a background job, as a level 0 `SSTable`. Level 0
+ * tables are then merged (compacted) into level 1 and, as each level grows past its size,
+ * one of its tables is merged into the next level: each level (from 1) holds non-overlapping
+ * tables, ten times as much data as the previous one.
+ *
+ * <p>Lookups check the memtables first, then the level 0 tables (newest first) and then at most
+ * one table in each of the other levels; the Bloom filters mean that only about one table is
+ * actually read, for each lookup.
+ *
+ * <p>The tables which make up the tree are recorded in a `MANIFEST` file: once a memtable is
+ * written to disk, the manifest records the last record of the log it contains, and the log is
+ * truncated; when the tree is re-opened, the log records after it are re-applied.
+ *
+ * <p>This class is thread-safe; the background jobs of all the trees share the same pool.
+ */
+class LsmTree {
+ public:
+  static constexpr size_t kLevels = 7;
+
+  // The writers are stalled while this many memtables are waiting to be written to disk.
+  static constexpr size_t kMaxImmutables = 2;
+
+  static constexpr char kManifest[] = "MANIFEST";
+
+  struct Write {
+    uint64_t hash;
+    std::string key;
+    // Empty, to remove the key.
+    std::optional<std::string> value;
+  };
+
+  /**
+   * Opens the tree in `dir` (creating it, if it does not exist), recovering the tables listed in
+   * its manifest and re-applying the writes in its log.
+   *
+   * @throws lsm_error (or wal_error) if the tree cannot be opened
+   */
+  LsmTree(const std::string &dir, const LsmOptions &options, BackgroundPool *pool);
+  LsmTree(const LsmTree &) = delete;
+  LsmTree &operator=(const LsmTree &) = delete;
+
+  /** Waits for the background job (if one is running) to stop. */
+  ~LsmTree();
+
+  /**
+   * Applies all the `writes`, in order, logging them in one go.
+   *
+   * @throws lsm_error if the tree can no longer be written to (because a background job failed,
+   *    or it was closed)
+   */
+  void Apply(const std::vector<Write> &writes);
+
+  void Put(uint64_t hash, std::string_view key, std::string_view value);
+
+  /**
+   * Removes the key, if it is found.
+   *
+   * @return whether the key was found
+   */
+  bool Remove(uint64_t hash, std::string_view key);
+
+  /**
+   * @param value will contain the value, if the key is found
+   * @return whether the key was found
+   */
+  bool Get(uint64_t hash, std::string_view key, std::string *value) const;
+
+  /**
+   * @return an iterator over the entries (including the removed ones, see
+   *    `EntryIterator::deleted()`) as of now: later writes are not seen by the iterator
+   */
+  std::unique_ptr<EntryIterator> NewIterator() const;
+
+  /** Writes the memtable to disk, and waits until it is done. */
+  void Flush();
+
+  /**
+   * Stops accepting writes: once this returns, all the writes which succeeded are in the tree
+   * (e.g., to be copied, see `Checkpoint()`) and any later one fails, even from writers which
+   * were already waiting to apply it. The tree can still be read from.
+   */
+  void Close();
+
+  /** Accepts writes again, after `Close()`. */
+  void Reopen();
+
+  /** Waits until there is no more background work (flushes or compactions) to do. */
+  void WaitForCompactions();
+
+  /**
+   * Writes a consistent copy of the tree to `dir` (which must not exist), from which a new tree
+   * can be opened: the tables are hard-linked, when `dir` is on the same filesystem (and
+   * copied otherwise); the log is not, as the memtable is flushed first.
+   *
+   * <p>Writes made while the copy is taken may not be included in it.
+   *
+   * @return the files written to `dir`
+   */
+  std::vector<std::string> Checkpoint(const std::string &dir);
+
+  const std::string &dir() const { return dir_; }
+
+  json Stats() const;
+
+ private:
+  struct MemTable;
+  struct Version;
+
+  // Appends the write to the log, and applies it: the caller must hold `mutex_` exclusively.
+  uint64_t LogLocked(uint64_t hash, std::string_view key, const std::string_view *value);
+  void ApplyLocked(uint64_t hash, std::string_view key, const std::string_view *value,
+                   uint64_t lsn);
+
+  // Stalls the writer while too many memtables are waiting to be written to disk; throws if the
+  // tree failed, or was closed.
+  void MakeRoom(std::unique_lock<std::shared_mutex> &lk);
+  // Freezes the memtable, if it is full (or `force`), and schedules it to be written to disk;
+  // as for `MaybeSchedule()`, the caller must hold `mutex_` exclusively.
+  void MaybeRotate(bool force = false);
+  void MaybeSchedule();
+  bool NeedsCompaction(const Version &version) const;
+  size_t MaxBytes(size_t level) const;
+
+  void RunBackground();
+  bool FlushImmutable();
+  bool Compact();
+
+  // Writes the `entries` to new tables, of about `table_size` each.
+  std::vector<std::shared_ptr<SSTable>> WriteTables(EntryIterator *entries, bool drop_deleted,
+                                                    size_t table_size);
+  std::string TablePath(uint64_t number) const;
+  void Recover();
+  json Manifest(const Version &version, uint64_t flushed_lsn) const;
+  static void SaveManifest(const std::string &dir, const json &manifest);
+  void CheckError() const;
+
+  std::string dir_;
+  LsmOptions options_;
+  BackgroundPool *pool_;
+  std::unique_ptr<WriteAheadLog> wal_;
+
+  // Guards the memtables and the current version; the writers hold it exclusively (while they
+  // append to the log and apply their writes), the readers shared.
+  mutable std::shared_mutex mutex_;
+  std::condition_variable_any changed_;
+  std::shared_ptr<MemTable> memtable_;
+  // The frozen memtables, waiting to be written to disk: oldest first.
+  std::vector<std::shared_ptr<MemTable>> immutables_;
+  std::shared_ptr<const Version> version_;
+  std::atomic_uint64_t next_file_{1};
+  uint64_t flushed_lsn_ = 0;
+
+  // At most one background job runs for each tree; the job holds `background_mx_` while it
+  // changes the files, so that a checkpoint is not taken while they are being deleted.
+  bool scheduled_ = false;
+  bool stopping_ = false;
+  // Set by `Close()`: the writers fail, rather than apply writes which would be lost.
+  bool closed_ = false;
+  std::mutex background_mx_;
+  std::string error_;
+  // The next table to compact, for each level, round-robin.
+  std::array<uint64_t, kLevels> compact_pointer_{};
+
+  uint64_t flushes_ = 0;
+  uint64_t compactions_ = 0;
+  uint64_t bytes_compacted_ = 0;
+  uint64_t stalls_ = 0;
+};
+
+} // namespace keystore
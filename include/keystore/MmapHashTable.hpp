@@ -0,0 +1,126 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "json.hpp"
+
+#include "utils/utils.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * Raised when the file of an `MmapHashTable` cannot be created, mapped or grown, or it is not a
+ * valid table.
+ */
+class mmap_error : public utils::base_error {
+ public:
+  explicit mmap_error(const std::string &error) : base_error{error} { }
+};
+
+/**
+ * An open-addressing hash table of opaque keys and values, which lives in a memory-mapped file:
+ * a fixed header, followed by a heap from which both the slot array and the records (each key
+ * with its value) are allocated.
+ *
+ * <p>All the references within the file are offsets, so that opening an existing table only
+ * requires mapping it: nothing is loaded, or rebuilt. A lookup touches the slot array (linear
+ * probing over 16-byte slots, each with the key's full 64-bit hash, so that the keys themselves
+ * are only compared when the hashes match) and then the record, typically in one or two pages.
+ *
+ * <p>The table grows online: once it is 3/4 full, a new slot array (twice the size) is allocated
+ * and each write moves a few more entries from the old array to the new one (incremental
+ * rehashing) while lookups check both, so that no single write pays for a full rehash.
+ *
+ * <p>Records are allocated in power-of-two size classes, and the space of those removed (or
+ * outgrown by their new values) is re-used for new ones; values which still fit are overwritten
+ * in place.
+ *
+ * <p>The mapping is shared: writes reach the OS as soon as they are made (and survive the
+ * process crashing) but are only guaranteed to be on disk once `Sync()` returns.
+ *
+ * <p>This class is **not** thread-safe: concurrent reads are safe, as long as no write is made
+ * at the same time (writes may re-map the file).
+ */
+class MmapHashTable {
+ public:
+  /**
+   * Opens the table in the file at `path`, creating it (with room for `initial_capacity`
+   * entries) if it does not exist.
+   *
+   * @throws mmap_error if the file cannot be opened, or is not a valid table
+   */
+  explicit MmapHashTable(const std::string &path, size_t initial_capacity = 1024);
+  MmapHashTable(const MmapHashTable &) = delete;
+  MmapHashTable &operator=(const MmapHashTable &) = delete;
+
+  /** Syncs the file to disk and unmaps it. */
+  ~MmapHashTable();
+
+  /**
+   * @return the key's value, which is only valid until the next write to the table; or an
+   *    empty `optional` if the key is not found
+   */
+  std::optional<std::string_view> Get(uint64_t hash, std::string_view key) const;
+
+  /**
+   * @throws mmap_error if the file cannot grow
+   */
+  void Put(uint64_t hash, std::string_view key, std::string_view value);
+
+  /**
+   * @return whether the key was found
+   */
+  bool Remove(uint64_t hash, std::string_view key);
+
+  /**
+   * Invokes `func(hash, key, value)` on each of the entries, in no particular order.
+   */
+  void ForEach(const std::function<void(uint64_t, std::string_view, std::string_view)> &func)
+      const;
+
+  /** Writes all the changes made so far to disk (`msync`). */
+  void Sync() const;
+
+  size_t size() const;
+  const std::string &path() const { return path_; }
+
+  json Stats() const;
+
+ private:
+  struct Header;
+  struct Slot;
+
+  Header *header() const { return reinterpret_cast<Header *>(data_); }
+  Slot *slots(uint64_t offset) const { return reinterpret_cast<Slot *>(data_ + offset); }
+
+  // @return the position of the key in the `capacity` slots at `offset`, or `capacity`
+  size_t Find(uint64_t offset, uint64_t capacity, uint64_t hash, std::string_view key) const;
+
+  // @return the first empty (or removed) slot where the hash can be inserted
+  static size_t FindFree(const Slot *slots, uint64_t capacity, uint64_t hash);
+
+  uint64_t Allocate(uint64_t size);
+  void Free(uint64_t offset);
+  uint64_t WriteRecord(std::string_view key, std::string_view value);
+
+  void MaybeGrow();
+  void Migrate(size_t count);
+  void Map(size_t size);
+  void Resize(size_t size);
+
+  std::string path_;
+  int fd_ = -1;
+  char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace keystore
@@ -0,0 +1,412 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+
+#include "HashedKey.hpp"
+#include "KeyStore.hpp"
+#include "MmapHashTable.hpp"
+#include "Snapshot.hpp"
+
+namespace keystore {
+
+struct MmapOptions {
+  // The directory where each bucket's table is stored (in a file named after the bucket).
+  std::string dir;
+
+  // How many entries each new table has room for, before it first grows.
+  size_t initial_capacity = 1024;
+};
+
+/**
+ * A `PartitionedKeyStore` whose buckets are each a persistent, memory-mapped hash table (see
+ * `MmapHashTable`), for keys and values which are fixed-size, or small: unlike an
+ * `LsmKeyStore`, lookups never read more than the one entry, and re-opening the store (e.g., after
+ * a restart) takes no time at all, as the tables are only mapped, not loaded.
+ *
+ * <p>Keys and values are encoded as they are in snapshots (see `SnapshotCodec`). Writes survive
+ * the process crashing as soon as they are made, and the machine crashing once `Sync()` returns.
+ *
+ * <p>Each bucket is guarded by its own reader/writer lock, as in an `InMemoryKeyStore`, which
+ * this store can replace; entries cannot expire, though: `Put(key, value, ttl)` is not
+ * supported.
+ *
+ * @tparam K the type of the key, which must have a `SnapshotCodec`
+ * @tparam V the type of the data being stored, which must have a `SnapshotCodec`
+ */
+template<typename K, typename V>
+class MmapKeyStore : public PartitionedKeyStore<K, V> {
+
+  static constexpr char kTableExtension[] = ".ht";
+
+  // The table of a bucket (only set while the bucket is owned by this store); like the slots of
+  // an `InMemoryKeyStore`, these are never deleted, so that readers can safely lock them.
+  struct TableSlot {
+    mutable std::shared_mutex mutex;
+    std::unique_ptr<MmapHashTable> table;
+  };
+
+  std::shared_ptr<View> view_ptr_;
+  MmapOptions options_;
+  // Indexed by the buckets' dense index in the View; a slot is allocated the first time its
+  // bucket is added to this store (and kept in `allocated_`, guarded by `buckets_mx_`).
+  std::array<std::atomic<TableSlot *>, kMaxBuckets> slots_;
+  std::vector<std::unique_ptr<TableSlot>> allocated_;
+  mutable std::mutex buckets_mx_;
+
+  TableSlot *FindSlot(uint64_t hash) const {
+    return slots_[view_ptr_->FindBucketIndex(PositionOf(hash))].load(std::memory_order_acquire);
+  }
+
+  TableSlot *SlotOf(const BucketPtr &bucket) const {
+    return slots_[view_ptr_->IndexOf(bucket)].load(std::memory_order_acquire);
+  }
+
+  std::string TablePath(const BucketPtr &bucket) const {
+    return options_.dir + "/" + bucket->name() + kTableExtension;
+  }
+
+  /**
+   * Moves the entries of the `bucket` for which `should_move(hash)` holds to the first of the
+   * `destinations` which accepts them, and removes them from the table; if `drop`, the table
+   * (and its file) is then deleted.
+   *
+   * <p>No lock is held while the entries are copied: those written in the meantime (or
+   * overwritten, after they were copied) are not removed, but copied again, until there are
+   * none left to move.
+   *
+   * @return whether all the entries were moved
+   */
+  template<typename Pred>
+  bool MoveEntries(const BucketPtr &bucket, const std::vector<KeyStorePtr<K, V>> &destinations,
+                   Pred should_move, bool drop = false);
+
+ public:
+  /**
+   * Creates the store, opening (or creating) the tables of the `buckets` it owns.
+   *
+   * @throws mmap_error if any of the tables cannot be opened
+   */
+  MmapKeyStore(const std::string &name,
+               const std::shared_ptr<View> &view,
+               const std::unordered_set<std::string> &buckets,
+               const MmapOptions &options);
+
+  bool Put(const K &key, const V &value) override;
+  std::optional<V> Get(const K &key) const override;
+  bool Remove(const K &key) override;
+
+  /**
+   * Opens the bucket's table: if its file already exists (because the bucket was owned by this
+   * store before, or the file was shipped from another store) its data is immediately available.
+   * Adding a bucket which this store already owns logs an error, and keeps its table.
+   */
+  void AddBucket(BucketPtr bucket) override;
+
+  /**
+   * Moves all the bucket's entries to the `destination_stores` and then deletes its file.
+   */
+  bool RemoveBucket(BucketPtr bucket,
+                    std::set<KeyStorePtr<K, V>> destination_stores) override;
+
+  bool Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) override;
+
+  /**
+   * Hands the `bucket` over to the `destination` store by moving its file (renaming it, on the
+   * same filesystem) instead of its entries.
+   *
+   * @return whether the bucket was handed over; if not, this store still owns it
+   */
+  bool TransferBucket(BucketPtr bucket, MmapKeyStore &destination);
+
+  /** Writes all the changes made so far to disk. */
+  void Sync() const;
+
+  [[nodiscard]] json Stats() const override;
+};
+
+template<typename K, typename V>
+MmapKeyStore<K, V>::MmapKeyStore(
+    const std::string &name,
+    const std::shared_ptr<View> &view,
+    const std::unordered_set<std::string> &buckets,
+    const MmapOptions &options
+) : PartitionedKeyStore<K, V>(name), view_ptr_{view}, options_{options} {
+  VLOG(2) << "Creating MmapKeyStore in " << options_.dir << " with " << buckets.size()
+          << " buckets (of " << view->num_buckets() << ")";
+  for (auto &slot : slots_) {
+    slot.store(nullptr);
+  }
+  std::filesystem::create_directories(options_.dir);
+  for (auto &b : view_ptr_->buckets()) {
+    if (buckets.count(b->name()) > 0) {
+      AddBucket(b);
+    }
+  }
+}
+
+template<typename K, typename V>
+void MmapKeyStore<K, V>::AddBucket(BucketPtr bucket) {
+  VLOG(2) << "Adding bucket " << bucket << ", to KeyStore " << this->name();
+  auto index = view_ptr_->IndexOf(bucket);
+  TableSlot *slot;
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    slot = slots_[index].load();
+    if (!slot) {
+      slot = allocated_.emplace_back(std::make_unique<TableSlot>()).get();
+      slots_[index].store(slot, std::memory_order_release);
+    }
+  }
+  std::unique_lock<std::shared_mutex> lk(slot->mutex);
+  if (slot->table) {
+    // Mapping the file a second time would replace the table in use.
+    LOG(ERROR) << "Cannot add bucket " << bucket->name() << " to KeyStore " << this->name()
+               << ", as it already owns it";
+    return;
+  }
+  slot->table = std::make_unique<MmapHashTable>(TablePath(bucket), options_.initial_capacity);
+}
+
+template<typename K, typename V>
+bool MmapKeyStore<K, V>::Put(const K &key, const V &value) {
+  auto hash = HashKey64(key);
+  auto slot = FindSlot(hash);
+  if (!slot) {
+    return false;
+  }
+  auto encoded_key = EncodeValue(key);
+  auto encoded_value = EncodeValue(value);
+  std::unique_lock<std::shared_mutex> lk(slot->mutex);
+  if (!slot->table) {
+    return false;
+  }
+  try {
+    slot->table->Put(hash, encoded_key, encoded_value);
+  } catch (const mmap_error &e) {
+    LOG(ERROR) << "Cannot store key " << key << ": " << e.what();
+    return false;
+  }
+  return true;
+}
+
+template<typename K, typename V>
+std::optional<V> MmapKeyStore<K, V>::Get(const K &key) const {
+  auto hash = HashKey64(key);
+  auto slot = FindSlot(hash);
+  if (!slot) {
+    return std::nullopt;
+  }
+  auto encoded_key = EncodeValue(key);
+  std::shared_lock<std::shared_mutex> lk(slot->mutex);
+  if (slot->table) {
+    // The value is decoded while the lock is held, as a write could move it.
+    if (auto value = slot->table->Get(hash, encoded_key)) {
+      return DecodeValue<V>(*value);
+    }
+  }
+  return std::nullopt;
+}
+
+template<typename K, typename V>
+bool MmapKeyStore<K, V>::Remove(const K &key) {
+  auto hash = HashKey64(key);
+  auto slot = FindSlot(hash);
+  if (!slot) {
+    return false;
+  }
+  auto encoded_key = EncodeValue(key);
+  std::unique_lock<std::shared_mutex> lk(slot->mutex);
+  return slot->table && slot->table->Remove(hash, encoded_key);
+}
+
+template<typename K, typename V>
+template<typename Pred>
+bool MmapKeyStore<K, V>::MoveEntries(const BucketPtr &bucket,
+                                     const std::vector<KeyStorePtr<K, V>> &destinations,
+                                     Pred should_move, bool drop) {
+  auto *slot = SlotOf(bucket);
+  while (true) {
+    std::vector<std::pair<K, V>> items;
+    std::vector<uint64_t> hashes;
+    // The encoded values, as they were copied.
+    std::vector<std::string> values;
+    {
+      std::shared_lock<std::shared_mutex> lk(slot->mutex);
+      if (!slot->table) {
+        LOG(ERROR) << "Cannot move data out of bucket " << bucket->name() << " from KeyStore "
+                   << this->name() << ", as it does not own it";
+        return false;
+      }
+      slot->table->ForEach([&](uint64_t hash, std::string_view key, std::string_view value) {
+        if (should_move(hash)) {
+          items.emplace_back(DecodeValue<K>(key), DecodeValue<V>(value));
+          hashes.push_back(hash);
+          values.emplace_back(value);
+        }
+      });
+    }
+
+    // No lock is held while the data is copied to the destinations.
+    std::vector<bool> moved(items.size(), false);
+    std::vector<size_t> pending(items.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    for (const auto &destination : destinations) {
+      if (pending.empty()) {
+        break;
+      }
+      std::vector<std::pair<K, V>> batch;
+      for (auto i : pending) {
+        batch.push_back(items[i]);
+      }
+      auto results = destination->MultiPut(batch);
+      std::vector<size_t> rejected;
+      for (size_t j = 0; j < pending.size(); ++j) {
+        if (results[j]) {
+          moved[pending[j]] = true;
+        } else {
+          rejected.push_back(pending[j]);
+        }
+      }
+      pending = std::move(rejected);
+    }
+
+    std::unique_lock<std::shared_mutex> lk(slot->mutex);
+    if (!slot->table) {
+      LOG(ERROR) << "Bucket " << bucket->name() << " was removed while moving its data";
+      return false;
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (moved[i]) {
+        auto key = EncodeValue(items[i].first);
+        auto current = slot->table->Get(hashes[i], key);
+        if (current && *current == values[i]) {
+          slot->table->Remove(hashes[i], key);
+        }
+      } else {
+        LOG(ERROR) << "Key " << items[i].first << " cannot be moved to any of the destinations";
+      }
+    }
+    if (!pending.empty()) {
+      return false;
+    }
+    bool done = true;
+    slot->table->ForEach([&](uint64_t hash, std::string_view, std::string_view) {
+      done = done && !should_move(hash);
+    });
+    if (done) {
+      if (drop) {
+        auto path = slot->table->path();
+        slot->table.reset();
+        std::filesystem::remove(path);
+      }
+      return true;
+    }
+  }
+}
+
+template<typename K, typename V>
+bool MmapKeyStore<K, V>::Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) {
+  auto index = view_ptr_->IndexOf(source);
+  if (!SlotOf(source)) {
+    return false;
+  }
+  return MoveEntries(source, {destination_store}, [this, index](uint64_t hash) {
+    return view_ptr_->FindBucketIndex(PositionOf(hash)) != index;
+  });
+}
+
+template<typename K, typename V>
+bool MmapKeyStore<K, V>::RemoveBucket(BucketPtr bucket,
+                                      std::set<KeyStorePtr<K, V>> destination_stores) {
+  auto *slot = SlotOf(bucket);
+  if (!slot) {
+    return false;
+  }
+  std::vector<KeyStorePtr<K, V>> destinations{destination_stores.begin(),
+                                              destination_stores.end()};
+  if (!MoveEntries(bucket, destinations, [](uint64_t) { return true; }, true)) {
+    return false;
+  }
+  VLOG(2) << "Done moving data from Bucket " << bucket->name();
+  return true;
+}
+
+template<typename K, typename V>
+bool MmapKeyStore<K, V>::TransferBucket(BucketPtr bucket, MmapKeyStore &destination) {
+  auto *slot_ptr = SlotOf(bucket);
+  if (!slot_ptr || &destination == this) {
+    return false;
+  }
+  auto &slot = *slot_ptr;
+  std::unique_lock<std::shared_mutex> lk(slot.mutex);
+  auto target = destination.TablePath(bucket);
+  if (!slot.table || std::filesystem::exists(target)) {
+    return false;
+  }
+  auto path = slot.table->path();
+  // Closing the table syncs it to disk.
+  slot.table.reset();
+  try {
+    std::error_code ec;
+    std::filesystem::rename(path, target, ec);
+    if (ec) {
+      // Across filesystems, the file is copied instead.
+      std::filesystem::copy_file(path, target);
+    }
+    destination.AddBucket(bucket);
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Cannot transfer bucket " << bucket->name() << " to KeyStore "
+               << destination.name() << ": " << e.what();
+    if (std::filesystem::exists(path)) {
+      std::filesystem::remove(target);
+    } else {
+      std::filesystem::rename(target, path);
+    }
+    slot.table = std::make_unique<MmapHashTable>(path);
+    return false;
+  }
+  std::filesystem::remove(path);
+  return true;
+}
+
+template<typename K, typename V>
+void MmapKeyStore<K, V>::Sync() const {
+  std::lock_guard<std::mutex> buckets_lk(buckets_mx_);
+  for (const auto &slot : allocated_) {
+    std::shared_lock<std::shared_mutex> lk(slot->mutex);
+    if (slot->table) {
+      slot->table->Sync();
+    }
+  }
+}
+
+template<typename K, typename V>
+json MmapKeyStore<K, V>::Stats() const {
+  json stats = KeyStore<K, V>::Stats();
+  json buckets = json::array();
+  uint64_t entries = 0;
+  std::lock_guard<std::mutex> buckets_lk(buckets_mx_);
+  for (const auto &slot : allocated_) {
+    std::shared_lock<std::shared_mutex> lk(slot->mutex);
+    if (slot->table) {
+      buckets.push_back(slot->table->Stats());
+      entries += slot->table->size();
+    }
+  }
+  stats["buckets"] = buckets;
+  stats["tot_elem_counts"] = entries;
+  return stats;
+}
+
+} // namespace keystore
@@ -0,0 +1,469 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+
+#include "BPlusTree.hpp"
+#include "HashedKey.hpp"
+#include "KeyStore.hpp"
+
+namespace keystore {
+
+/**
+ * A `PartitionedKeyStore` which keeps each bucket's entries sorted by key (in a `BPlusTree`), so
+ * that, besides the usual point lookups, it can efficiently return all the entries in a range
+ * of keys (see `Scan()`), or with a common prefix (see `PrefixScan()`).
+ *
+ * <p>Keys are still distributed across the buckets by their hash, so a range of keys spans all
+ * of them: scans merge the (ordered) entries of all the buckets owned by this store.
+ *
+ * <p>Each bucket is guarded by its own reader/writer lock, as in an `InMemoryKeyStore`; entries
+ * cannot expire, though: `Put(key, value, ttl)` is not supported.
+ *
+ * @tparam K the type of the key, which must be ordered by `operator<`
+ * @tparam V the type of the data being stored, which must be comparable by `operator==`
+ */
+template<typename K, typename V>
+class OrderedKeyStore : public PartitionedKeyStore<K, V> {
+ public:
+  using Tree = BPlusTree<K, V>;
+  using Entries = std::vector<std::pair<K, V>>;
+
+  // How many entries are copied out of each bucket (while its lock is held) at a time, by scans.
+  static constexpr size_t kScanBatchSize = 256;
+
+ private:
+  // The tree of a bucket (only set while the bucket is owned by this store); these are never
+  // deleted, so that readers can safely lock them.
+  struct TreeSlot {
+    mutable std::shared_mutex mutex;
+    std::unique_ptr<Tree> tree;
+  };
+
+  // The entries of one bucket, which a scan is merging, fetched a batch at a time.
+  struct Cursor {
+    const TreeSlot *slot = nullptr;
+    Entries batch{};
+    size_t pos = 0;
+    bool exhausted = false;
+  };
+
+  std::shared_ptr<View> view_ptr_;
+  // Indexed by the buckets' dense index in the View; a slot is allocated the first time its
+  // bucket is added to this store (and kept in `allocated_`, guarded by `buckets_mx_`).
+  std::array<std::atomic<TreeSlot *>, kMaxBuckets> slots_;
+  std::vector<std::unique_ptr<TreeSlot>> allocated_;
+  mutable std::mutex buckets_mx_;
+
+  TreeSlot *FindSlot(const K &key) const {
+    auto hash = HashKey64(key);
+    return slots_[view_ptr_->FindBucketIndex(PositionOf(hash))].load(std::memory_order_acquire);
+  }
+
+  TreeSlot *SlotOf(const BucketPtr &bucket) const {
+    return slots_[view_ptr_->IndexOf(bucket)].load(std::memory_order_acquire);
+  }
+
+  TreeSlot *AllocateSlot(const BucketPtr &bucket);
+
+  /**
+   * Replaces the `cursor`'s batch with the next entries of its bucket, starting at `from`
+   * (or right after it, unless `inclusive`), for as long as `in_range(key)` holds.
+   */
+  template<typename Pred>
+  void Fill(Cursor &cursor, const K &from, bool inclusive, const Pred &in_range,
+            size_t max_entries) const;
+
+  /**
+   * Merges the entries of all the buckets, in order, starting at `start`, until `in_range(key)`
+   * no longer holds, or `limit` entries have been found.
+   */
+  template<typename Pred>
+  Entries ScanWhile(const K &start, const Pred &in_range, size_t limit) const;
+
+  /**
+   * Moves the entries of the `bucket` for which `should_move(key)` holds to the first of the
+   * `destinations` which accepts them, and removes them from the tree; if `drop`, the tree is
+   * then deleted.
+   *
+   * <p>No lock is held while the entries are copied: those written in the meantime (or
+   * overwritten, after they were copied) are not removed, but copied again, until there are
+   * none left to move.
+   *
+   * @return whether all the entries were moved
+   */
+  template<typename Pred>
+  bool MoveEntries(const BucketPtr &bucket, const std::vector<KeyStorePtr<K, V>> &destinations,
+                   Pred should_move, bool drop = false);
+
+ public:
+  OrderedKeyStore(const std::string &name,
+                  const std::shared_ptr<View> &view,
+                  const std::unordered_set<std::string> &buckets);
+
+  bool Put(const K &key, const V &value) override;
+  std::optional<V> Get(const K &key) const override;
+  bool Remove(const K &key) override;
+
+  /**
+   * Returns the entries whose keys are in the `[start, end)` range, in order; at most `limit`
+   * of them (the first ones).
+   *
+   * <p>Buckets are only locked while a batch of their entries is copied (see `kScanBatchSize`),
+   * so writes are not blocked by long scans; as a consequence, a scan is not atomic: entries
+   * written (or removed) while it runs may, or may not, be returned.
+   */
+  Entries Scan(const K &start, const K &end, size_t limit) const;
+
+  /**
+   * Returns the entries whose keys start with the `prefix` (e.g., all the entries in a given
+   * time bucket, for keys such as "2020-06-14T10:31:02"), in order; at most `limit` of them.
+   *
+   * <p>Only available for `std::string` keys; the same caveats as for `Scan()` apply.
+   */
+  Entries PrefixScan(const K &prefix, size_t limit) const;
+
+  void AddBucket(BucketPtr bucket) override;
+
+  bool RemoveBucket(BucketPtr bucket,
+                    std::set<KeyStorePtr<K, V>> destination_stores) override;
+
+  bool Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) override;
+
+  /**
+   * Hands the `bucket` over to the `destination` store, in the same process, by moving its tree
+   * (instead of its entries).
+   *
+   * @return whether the bucket was handed over (that is, whether this store owned it, and the
+   *    destination did not)
+   */
+  bool TransferBucket(BucketPtr bucket, OrderedKeyStore &destination);
+
+  [[nodiscard]] json Stats() const override;
+};
+
+template<typename K, typename V>
+OrderedKeyStore<K, V>::OrderedKeyStore(
+    const std::string &name,
+    const std::shared_ptr<View> &view,
+    const std::unordered_set<std::string> &buckets
+) : PartitionedKeyStore<K, V>(name), view_ptr_{view} {
+  VLOG(2) << "Creating OrderedKeyStore with " << buckets.size()
+          << " buckets (of " << view->num_buckets() << ")";
+  for (auto &slot : slots_) {
+    slot.store(nullptr);
+  }
+  for (auto &b : view_ptr_->buckets()) {
+    if (buckets.count(b->name()) > 0) {
+      AddBucket(b);
+    }
+  }
+}
+
+template<typename K, typename V>
+typename OrderedKeyStore<K, V>::TreeSlot *OrderedKeyStore<K, V>::AllocateSlot(
+    const BucketPtr &bucket) {
+  auto index = view_ptr_->IndexOf(bucket);
+  std::lock_guard<std::mutex> lk(buckets_mx_);
+  auto *slot = slots_[index].load();
+  if (!slot) {
+    slot = allocated_.emplace_back(std::make_unique<TreeSlot>()).get();
+    slots_[index].store(slot, std::memory_order_release);
+  }
+  return slot;
+}
+
+template<typename K, typename V>
+void OrderedKeyStore<K, V>::AddBucket(BucketPtr bucket) {
+  VLOG(2) << "Adding bucket " << bucket << ", to KeyStore " << this->name();
+  auto *slot = AllocateSlot(bucket);
+  std::unique_lock<std::shared_mutex> lk(slot->mutex);
+  if (!slot->tree) {
+    slot->tree = std::make_unique<Tree>();
+  }
+}
+
+template<typename K, typename V>
+bool OrderedKeyStore<K, V>::Put(const K &key, const V &value) {
+  auto slot = FindSlot(key);
+  if (!slot) {
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> lk(slot->mutex);
+  if (!slot->tree) {
+    return false;
+  }
+  slot->tree->Insert(key, value);
+  return true;
+}
+
+template<typename K, typename V>
+std::optional<V> OrderedKeyStore<K, V>::Get(const K &key) const {
+  auto slot = FindSlot(key);
+  if (!slot) {
+    return std::nullopt;
+  }
+  std::shared_lock<std::shared_mutex> lk(slot->mutex);
+  if (slot->tree) {
+    if (auto *value = slot->tree->Find(key)) {
+      return *value;
+    }
+  }
+  return std::nullopt;
+}
+
+template<typename K, typename V>
+bool OrderedKeyStore<K, V>::Remove(const K &key) {
+  auto slot = FindSlot(key);
+  if (!slot) {
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> lk(slot->mutex);
+  return slot->tree && slot->tree->Erase(key);
+}
+
+template<typename K, typename V>
+template<typename Pred>
+void OrderedKeyStore<K, V>::Fill(Cursor &cursor, const K &from, bool inclusive,
+                                 const Pred &in_range, size_t max_entries) const {
+  cursor.batch.clear();
+  cursor.pos = 0;
+  std::shared_lock<std::shared_mutex> lk(cursor.slot->mutex);
+  if (!cursor.slot->tree) {
+    // The bucket was removed, or handed over, since the scan started.
+    cursor.exhausted = true;
+    return;
+  }
+  auto it = cursor.slot->tree->LowerBound(from);
+  if (!inclusive && it.valid() && !(from < it.key())) {
+    ++it;
+  }
+  for (; it.valid() && cursor.batch.size() < max_entries; ++it) {
+    if (!in_range(it.key())) {
+      cursor.exhausted = true;
+      return;
+    }
+    cursor.batch.emplace_back(it.key(), it.value());
+  }
+  cursor.exhausted = !it.valid();
+}
+
+template<typename K, typename V>
+template<typename Pred>
+typename OrderedKeyStore<K, V>::Entries OrderedKeyStore<K, V>::ScanWhile(
+    const K &start, const Pred &in_range, size_t limit) const {
+  Entries results;
+  if (limit == 0) {
+    return results;
+  }
+  auto batch_size = std::min(limit, kScanBatchSize);
+  std::vector<Cursor> cursors;
+  {
+    std::lock_guard<std::mutex> lk(buckets_mx_);
+    for (const auto &slot : allocated_) {
+      cursors.push_back(Cursor{slot.get()});
+    }
+  }
+
+  // A min-heap of the cursors, by their current key: as the buckets hold disjoint sets of keys,
+  // there are no ties.
+  auto greater = [&cursors](size_t a, size_t b) {
+    return cursors[b].batch[cursors[b].pos].first < cursors[a].batch[cursors[a].pos].first;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap{greater};
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    Fill(cursors[i], start, true, in_range, batch_size);
+    if (!cursors[i].batch.empty()) {
+      heap.push(i);
+    }
+  }
+  while (!heap.empty() && results.size() < limit) {
+    auto i = heap.top();
+    heap.pop();
+    auto &cursor = cursors[i];
+    results.push_back(std::move(cursor.batch[cursor.pos++]));
+    if (cursor.pos == cursor.batch.size()) {
+      if (cursor.exhausted) {
+        continue;
+      }
+      Fill(cursor, results.back().first, false, in_range, batch_size);
+      if (cursor.batch.empty()) {
+        continue;
+      }
+    }
+    heap.push(i);
+  }
+  return results;
+}
+
+template<typename K, typename V>
+typename OrderedKeyStore<K, V>::Entries OrderedKeyStore<K, V>::Scan(
+    const K &start, const K &end, size_t limit) const {
+  return ScanWhile(start, [&end](const K &key) { return key < end; }, limit);
+}
+
+template<typename K, typename V>
+typename OrderedKeyStore<K, V>::Entries OrderedKeyStore<K, V>::PrefixScan(
+    const K &prefix, size_t limit) const {
+  static_assert(std::is_same_v<K, std::string>, "PrefixScan() requires std::string keys");
+  return ScanWhile(prefix, [&prefix](const K &key) {
+    return key.compare(0, prefix.size(), prefix) == 0;
+  }, limit);
+}
+
+template<typename K, typename V>
+template<typename Pred>
+bool OrderedKeyStore<K, V>::MoveEntries(const BucketPtr &bucket,
+                                        const std::vector<KeyStorePtr<K, V>> &destinations,
+                                        Pred should_move, bool drop) {
+  auto *slot = SlotOf(bucket);
+  while (true) {
+    Entries items;
+    {
+      std::shared_lock<std::shared_mutex> lk(slot->mutex);
+      if (!slot->tree) {
+        LOG(ERROR) << "Cannot move data out of bucket " << bucket->name() << " from KeyStore "
+                   << this->name() << ", as it does not own it";
+        return false;
+      }
+      for (auto it = slot->tree->begin(); it.valid(); ++it) {
+        if (should_move(it.key())) {
+          items.emplace_back(it.key(), it.value());
+        }
+      }
+    }
+
+    // No lock is held while the data is copied to the destinations.
+    std::vector<bool> moved(items.size(), false);
+    std::vector<size_t> pending(items.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    for (const auto &destination : destinations) {
+      if (pending.empty()) {
+        break;
+      }
+      Entries batch;
+      for (auto i : pending) {
+        batch.push_back(items[i]);
+      }
+      auto results = destination->MultiPut(batch);
+      std::vector<size_t> rejected;
+      for (size_t j = 0; j < pending.size(); ++j) {
+        if (results[j]) {
+          moved[pending[j]] = true;
+        } else {
+          rejected.push_back(pending[j]);
+        }
+      }
+      pending = std::move(rejected);
+    }
+
+    std::unique_lock<std::shared_mutex> lk(slot->mutex);
+    if (!slot->tree) {
+      LOG(ERROR) << "Bucket " << bucket->name() << " was removed while moving its data";
+      return false;
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (moved[i]) {
+        auto *current = slot->tree->Find(items[i].first);
+        if (current && *current == items[i].second) {
+          slot->tree->Erase(items[i].first);
+        }
+      } else {
+        LOG(ERROR) << "Key " << items[i].first << " cannot be moved to any of the destinations";
+      }
+    }
+    if (!pending.empty()) {
+      return false;
+    }
+    bool done = true;
+    for (auto it = slot->tree->begin(); done && it.valid(); ++it) {
+      done = !should_move(it.key());
+    }
+    if (done) {
+      if (drop) {
+        slot->tree.reset();
+      }
+      return true;
+    }
+  }
+}
+
+template<typename K, typename V>
+bool OrderedKeyStore<K, V>::Rebalance(BucketPtr source, KeyStorePtr<K, V> destination_store) {
+  auto index = view_ptr_->IndexOf(source);
+  if (!SlotOf(source)) {
+    return false;
+  }
+  return MoveEntries(source, {destination_store}, [this, index](const K &key) {
+    return view_ptr_->FindBucketIndex(PositionOf(HashKey64(key))) != index;
+  });
+}
+
+template<typename K, typename V>
+bool OrderedKeyStore<K, V>::RemoveBucket(BucketPtr bucket,
+                                         std::set<KeyStorePtr<K, V>> destination_stores) {
+  auto *slot = SlotOf(bucket);
+  if (!slot) {
+    return false;
+  }
+  std::vector<KeyStorePtr<K, V>> destinations{destination_stores.begin(),
+                                              destination_stores.end()};
+  if (!MoveEntries(bucket, destinations, [](const K &) { return true; }, true)) {
+    return false;
+  }
+  VLOG(2) << "Done moving data from Bucket " << bucket->name();
+  return true;
+}
+
+template<typename K, typename V>
+bool OrderedKeyStore<K, V>::TransferBucket(BucketPtr bucket, OrderedKeyStore &destination) {
+  auto *slot = SlotOf(bucket);
+  if (!slot || &destination == this) {
+    return false;
+  }
+  auto *target = destination.AllocateSlot(bucket);
+  // Locks are always taken in the same order (by address) so that two stores can transfer
+  // buckets to each other concurrently.
+  std::unique_lock<std::shared_mutex> first(std::min(slot, target)->mutex, std::defer_lock);
+  std::unique_lock<std::shared_mutex> second(std::max(slot, target)->mutex, std::defer_lock);
+  std::lock(first, second);
+  if (!slot->tree || target->tree) {
+    return false;
+  }
+  target->tree = std::move(slot->tree);
+  VLOG(2) << "Bucket " << bucket->name() << " handed over to KeyStore " << destination.name();
+  return true;
+}
+
+template<typename K, typename V>
+json OrderedKeyStore<K, V>::Stats() const {
+  json stats = KeyStore<K, V>::Stats();
+  size_t entries = 0;
+  size_t buckets = 0;
+  size_t max_height = 0;
+  std::lock_guard<std::mutex> buckets_lk(buckets_mx_);
+  for (const auto &slot : allocated_) {
+    std::shared_lock<std::shared_mutex> lk(slot->mutex);
+    if (slot->tree) {
+      ++buckets;
+      entries += slot->tree->size();
+      max_height = std::max(max_height, slot->tree->height());
+    }
+  }
+  stats["num_buckets"] = buckets;
+  stats["tot_elem_counts"] = entries;
+  stats["max_tree_height"] = max_height;
+  return stats;
+}
+
+} // namespace keystore
@@ -0,0 +1,132 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "json.hpp"
+
+#include "TokenIndex.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * A position in the data of a bucket, which remains meaningful while the bucket's lock is
+ * released (unlike an iterator): it is the next token (see `TokenIndex`) to be scanned.
+ */
+struct ScanCursor {
+  uint32_t position = 0;
+
+  /** @return whether all the tokens have been scanned */
+  bool done() const { return position >= kTokens; }
+};
+
+/**
+ * The progress of moving the data out of a bucket, see `InMemoryKeyStore::Rebalance()`.
+ */
+struct RebalanceProgress {
+  std::string bucket;
+  ScanCursor cursor;
+
+  // Whether all the bucket's keys are being moved (see `InMemoryKeyStore::RemoveBucket()`), or
+  // only those which no longer belong to it: the `cursor` of one kind of move cannot be used to
+  // resume the other.
+  bool all_keys = false;
+
+  // The `View::generation()` the `cursor` was computed against: once buckets are added to (or
+  // removed from) the `View`, the tokens already scanned may hold keys which need moving.
+  uint64_t view_generation = 0;
+
+  unsigned long batches = 0;
+  unsigned long keys_scanned = 0;
+  unsigned long keys_moved = 0;
+  unsigned long bytes_moved = 0;
+  unsigned long keys_failed = 0;
+
+  // Whether all the data which needed moving has been moved.
+  bool complete = false;
+
+  // Whether the rebalance was interrupted because some data could not be moved.
+  bool failed = false;
+};
+
+inline void to_json(json &j, const RebalanceProgress &progress) {
+  j = {
+      {"bucket", progress.bucket},
+      {"position", progress.cursor.position},
+      {"batches", progress.batches},
+      {"keys_scanned", progress.keys_scanned},
+      {"keys_moved", progress.keys_moved},
+      {"bytes_moved", progress.bytes_moved},
+      {"keys_failed", progress.keys_failed},
+      {"complete", progress.complete},
+      {"failed", progress.failed}
+  };
+}
+
+/**
+ * Configures how the data is moved out of a bucket, see `InMemoryKeyStore::Rebalance()`.
+ */
+struct RebalanceOptions {
+  /** How many entries are scanned while holding the bucket's lock. */
+  size_t batch_size = 1024;
+
+  /** The maximum number of keys moved per second; 0 means no limit. */
+  size_t max_keys_per_sec = 0;
+
+  /** The maximum (estimated, see `EstimateSize()`) bytes moved per second; 0 means no limit. */
+  size_t max_bytes_per_sec = 0;
+
+  /**
+   * How many batches to move before returning, even if the rebalance is not complete; 0 means
+   * no limit. A subsequent `Rebalance()` of the same bucket resumes where this one stopped.
+   */
+  size_t max_batches = 0;
+
+  /** If set, invoked after each batch has been moved. */
+  std::function<void(const RebalanceProgress &)> on_progress;
+};
+
+/**
+ * Limits the rate of keys and bytes moved, by sleeping as long as necessary after each batch,
+ * so that the average rate since the start never exceeds the limits.
+ */
+class RebalanceThrottle {
+ public:
+  explicit RebalanceThrottle(const RebalanceOptions &options) :
+      max_keys_per_sec_{options.max_keys_per_sec}, max_bytes_per_sec_{options.max_bytes_per_sec},
+      start_{std::chrono::steady_clock::now()} { }
+
+  /** Accounts for a batch that was just moved, and waits if the rate is too high. */
+  void Acquire(size_t keys, size_t bytes) {
+    keys_ += keys;
+    bytes_ += bytes;
+    double secs = 0;
+    if (max_keys_per_sec_ > 0) {
+      secs = std::max(secs, static_cast<double>(keys_) / max_keys_per_sec_);
+    }
+    if (max_bytes_per_sec_ > 0) {
+      secs = std::max(secs, static_cast<double>(bytes_) / max_bytes_per_sec_);
+    }
+    if (secs > 0) {
+      std::this_thread::sleep_until(start_ + std::chrono::duration_cast<
+          std::chrono::steady_clock::duration>(std::chrono::duration<double>(secs)));
+    }
+  }
+
+ private:
+  size_t max_keys_per_sec_;
+  size_t max_bytes_per_sec_;
+  std::chrono::steady_clock::time_point start_;
+  size_t keys_ = 0;
+  size_t bytes_ = 0;
+};
+
+} // namespace keystore
@@ -0,0 +1,189 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <utils/ThreadsafeQueue.hpp>
+
+#include "InMemoryKeyStore.hpp"
+#include "Rebalance.hpp"
+
+namespace keystore {
+
+/**
+ * The outcome of moving the data out of one bucket, see `RebalanceCoordinator::Run()`.
+ */
+struct BucketMoveResult {
+  enum class Kind { kRebalance, kRemove };
+
+  Kind kind = Kind::kRebalance;
+
+  // The name of the store which owns the bucket the data was moved out of.
+  std::string store;
+
+  // The bucket, keys and bytes moved, and how many keys could not be moved.
+  RebalanceProgress progress;
+
+  std::chrono::milliseconds duration{0};
+
+  // Set if the move was aborted by an exception.
+  std::string error;
+
+  bool success() const { return progress.complete && error.empty(); }
+};
+
+inline void to_json(json &j, const BucketMoveResult &result) {
+  j = {
+      {"kind", result.kind == BucketMoveResult::Kind::kRebalance ? "rebalance" : "remove"},
+      {"store", result.store},
+      {"bucket", result.progress.bucket},
+      {"keys_moved", result.progress.keys_moved},
+      {"bytes_moved", result.progress.bytes_moved},
+      {"keys_failed", result.progress.keys_failed},
+      {"duration_msec", result.duration.count()},
+      {"success", result.success()}
+  };
+  if (!result.error.empty()) {
+    j["error"] = result.error;
+  }
+}
+
+/**
+ * Runs several bucket rebalances and removals concurrently, on a pool of (at most)
+ * `max_concurrency` worker threads.
+ *
+ * <p>When a node joins (or leaves) the cluster, typically several buckets are affected: each of
+ * them is moved independently (only ever locking the bucket itself, and the destination buckets
+ * while their data is stored there, see `InMemoryKeyStore::Rebalance()`) so that the moves can
+ * proceed in parallel, each with its own `RebalanceOptions` throttling.
+ *
+ * <p>Usage:
+ * <pre>
+ *    RebalanceCoordinator<K, V> coordinator{4};
+ *    coordinator.Rebalance(source_store, source_bucket, new_bucket_store);
+ *    coordinator.RemoveBucket(old_store, old_bucket, destination_stores);
+ *    for (const auto &result : coordinator.Run()) { ... }
+ * </pre>
+ *
+ * <p>The same bucket must not be added more than once, and the `View` must have been updated
+ * before calling `Run()`; the `on_progress` callback (if any, in the `options`) may be invoked
+ * concurrently by several workers. This class is not thread-safe.
+ */
+template<typename K, typename V>
+class RebalanceCoordinator {
+ public:
+  using StorePtr = std::shared_ptr<InMemoryKeyStore<K, V>>;
+
+  /**
+   * @param max_concurrency the maximum number of buckets moved at the same time
+   * @param options used for each of the moves (the rate limits apply to each move separately)
+   */
+  explicit RebalanceCoordinator(
+      size_t max_concurrency = std::max(1U, std::thread::hardware_concurrency()),
+      RebalanceOptions options = {}) :
+      max_concurrency_{std::max(size_t{1}, max_concurrency)}, options_{std::move(options)} { }
+
+  /**
+   * Schedules moving the data which no longer belongs to the `source` bucket (owned by `store`)
+   * to the `destination`; see `InMemoryKeyStore::Rebalance()`.
+   */
+  void Rebalance(StorePtr store, BucketPtr source, KeyStorePtr<K, V> destination) {
+    tasks_.push_back({BucketMoveResult::Kind::kRebalance, std::move(store), std::move(source),
+                      {std::move(destination)}});
+  }
+
+  /**
+   * Schedules moving all the data in the `bucket` (owned by `store`) to the `destinations`, and
+   * removing the bucket from the `store`; see `InMemoryKeyStore::RemoveBucket()`.
+   */
+  void RemoveBucket(StorePtr store, BucketPtr bucket, std::set<KeyStorePtr<K, V>> destinations) {
+    tasks_.push_back({BucketMoveResult::Kind::kRemove, std::move(store), std::move(bucket),
+                      std::move(destinations)});
+  }
+
+  /** @return the number of moves scheduled, and not run yet */
+  size_t size() const { return tasks_.size(); }
+
+  /**
+   * Runs all the moves scheduled so far, and waits for all of them to complete.
+   *
+   * @return the outcome of each of the moves, in the order they were scheduled
+   */
+  std::vector<BucketMoveResult> Run();
+
+ private:
+  struct Task {
+    BucketMoveResult::Kind kind;
+    StorePtr store;
+    BucketPtr bucket;
+    std::set<KeyStorePtr<K, V>> destinations;
+  };
+
+  BucketMoveResult RunTask(const Task &task) const;
+
+  size_t max_concurrency_;
+  RebalanceOptions options_;
+  std::vector<Task> tasks_;
+};
+
+template<typename K, typename V>
+std::vector<BucketMoveResult> RebalanceCoordinator<K, V>::Run() {
+  std::vector<BucketMoveResult> results(tasks_.size());
+  utils::ThreadsafeQueue<size_t> pending;
+  for (size_t i = 0; i < tasks_.size(); ++i) {
+    pending.push(i);
+  }
+
+  auto worker = [&]() {
+    size_t i;
+    while (pending.pop(i)) {
+      results[i] = RunTask(tasks_[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t n = 0; n < std::min(max_concurrency_, tasks_.size()); ++n) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  tasks_.clear();
+  return results;
+}
+
+template<typename K, typename V>
+BucketMoveResult RebalanceCoordinator<K, V>::RunTask(const Task &task) const {
+  BucketMoveResult result;
+  result.kind = task.kind;
+  result.store = task.store->name();
+  result.progress.bucket = task.bucket->name();
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    if (task.kind == BucketMoveResult::Kind::kRebalance) {
+      result.progress = task.store->Rebalance(task.bucket, *task.destinations.begin(), options_);
+    } else {
+      result.progress = task.store->RemoveBucket(task.bucket, task.destinations, options_);
+    }
+  } catch (const std::exception &ex) {
+    LOG(ERROR) << "Could not move data out of bucket " << task.bucket->name() << ": "
+               << ex.what();
+    result.error = ex.what();
+  }
+  result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  VLOG(2) << "Moved " << result.progress.keys_moved << " keys out of bucket "
+          << task.bucket->name() << " in " << result.duration.count() << " msec";
+  return result;
+}
+
+} // namespace keystore
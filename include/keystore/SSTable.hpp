@@ -0,0 +1,228 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "utils/utils.hpp"
+
+#include "BloomFilter.hpp"
+
+namespace keystore {
+
+/**
+ * Raised when the files of an `LsmKeyStore` cannot be written, or read back (including when they
+ * are corrupted).
+ */
+class lsm_error : public utils::base_error {
+ public:
+  explicit lsm_error(const std::string &error) : base_error{error} { }
+};
+
+/**
+ * The header of each of the records in an `SSTable` (and in the write-ahead log of an `LsmTree`):
+ * it is followed by the key and value bytes (there is no value for a deleted key).
+ */
+struct LsmRecord {
+  static constexpr uint32_t kDeleted = UINT32_MAX;
+
+  // The key's hash (see `HashKey64()`): the records are sorted by it first, then by key.
+  uint64_t hash;
+  uint32_t key_size;
+  // Or `kDeleted`, for a "tombstone," which records that the key was removed.
+  uint32_t value_size;
+};
+
+/**
+ * The order of the entries in an LSM tree: by hash (so, by their position on the hash ring,
+ * see `PackHash()`) and, only if the hashes are the same, by key.
+ *
+ * @return a negative number, zero or a positive number if the first entry comes before, is the
+ *      same as, or comes after the second
+ */
+inline int CompareEntries(uint64_t hash, std::string_view key,
+                          uint64_t other_hash, std::string_view other_key) {
+  if (hash != other_hash) {
+    return hash < other_hash ? -1 : 1;
+  }
+  return key.compare(other_key);
+}
+
+/**
+ * An entry in the index of an `SSTable`: where one of its data blocks is, and the range of
+ * hashes in it.
+ */
+struct SSTableBlock {
+  uint64_t first_hash;
+  uint64_t last_hash;
+  uint64_t offset;
+  uint32_t size;
+  uint32_t records;
+  uint64_t checksum;
+};
+
+/**
+ * Iterates over entries (including the deleted ones) in the order defined by `CompareEntries()`;
+ * the key and value are only valid until the iterator is moved.
+ */
+class EntryIterator {
+ public:
+  virtual ~EntryIterator() = default;
+
+  virtual bool Valid() const = 0;
+  virtual void Next() = 0;
+
+  virtual uint64_t hash() const = 0;
+  virtual std::string_view key() const = 0;
+  virtual std::string_view value() const = 0;
+  virtual bool deleted() const = 0;
+};
+
+/**
+ * Merges several `EntryIterator`s: when the same key is found in more than one of them, only the
+ * entry in the first one (in the order they are passed in, which must be newest first) is
+ * returned.
+ */
+class MergingIterator : public EntryIterator {
+ public:
+  explicit MergingIterator(std::vector<std::unique_ptr<EntryIterator>> sources);
+
+  bool Valid() const override { return current_ != nullptr; }
+  void Next() override;
+
+  uint64_t hash() const override { return current_->hash(); }
+  std::string_view key() const override { return current_->key(); }
+  std::string_view value() const override { return current_->value(); }
+  bool deleted() const override { return current_->deleted(); }
+
+ private:
+  void FindSmallest();
+
+  std::vector<std::unique_ptr<EntryIterator>> sources_;
+  EntryIterator *current_ = nullptr;
+};
+
+/**
+ * Writes a sorted string table: an immutable file of entries, sorted as defined by
+ * `CompareEntries()`, which must be added in that order.
+ *
+ * <p>The entries are written in (about) `block_size` data blocks, each one checksummed; they are
+ * followed by a Bloom filter of the keys' hashes, the blocks' index (the range of hashes in each
+ * of them, and where they are) and a fixed-size footer.
+ *
+ * <p>The data is written to a temporary file, which is only renamed to `path` once the table is
+ * complete (see `Finish()`).
+ */
+class SSTableWriter {
+ public:
+  SSTableWriter(const std::string &path, size_t block_size, size_t bloom_bits_per_key);
+  SSTableWriter(const SSTableWriter &) = delete;
+  SSTableWriter &operator=(const SSTableWriter &) = delete;
+
+  /** Removes the temporary file, unless `Finish()` was called. */
+  ~SSTableWriter();
+
+  void Add(uint64_t hash, std::string_view key, std::string_view value, bool deleted = false);
+
+  /** Writes the filter, index and footer and syncs the file to disk. */
+  void Finish();
+
+  /** @return the size of the data written so far */
+  size_t size() const { return offset_ + block_.size(); }
+
+  uint64_t entries() const { return hashes_.size(); }
+
+ private:
+  void FlushBlock();
+  void Write(const char *data, size_t size);
+
+  std::string path_;
+  std::string tmp_path_;
+  size_t block_size_;
+  size_t bloom_bits_per_key_;
+  int fd_ = -1;
+  bool finished_ = false;
+
+  std::string block_;
+  uint32_t block_records_ = 0;
+  uint64_t block_first_hash_ = 0;
+  uint64_t last_hash_ = 0;
+  std::string index_;
+  std::vector<uint64_t> hashes_;
+  size_t offset_ = 0;
+};
+
+/**
+ * A (memory-mapped) sorted string table, written by an `SSTableWriter`.
+ *
+ * <p>Lookups first check the Bloom filter, so that most of the tables which do not contain the
+ * key are never read: those which may contain it only read the one (or, rarely, few) blocks which
+ * contain the key's hash.
+ *
+ * <p>Once opened, a table can be read concurrently.
+ */
+class SSTable {
+ public:
+  enum class Lookup {
+    kMissing,
+    kFound,
+    kDeleted
+  };
+
+  /**
+   * @throws lsm_error if the file cannot be read, or is not a valid table
+   */
+  explicit SSTable(const std::string &path);
+  SSTable(const SSTable &) = delete;
+  SSTable &operator=(const SSTable &) = delete;
+  ~SSTable();
+
+  /**
+   * Looks up a key.
+   *
+   * @param value will contain the value, if the key is found
+   * @return whether the key was found, found deleted or not found at all
+   */
+  Lookup Get(uint64_t hash, std::string_view key, std::string *value) const;
+
+  /**
+   * @return an iterator over all the entries in the table, in order; as the entries are read,
+   *    the blocks' checksums are verified (an `lsm_error` is thrown if they do not match)
+   */
+  std::unique_ptr<EntryIterator> NewIterator() const;
+
+  const std::string &path() const { return path_; }
+  std::string filename() const;
+
+  /** @return the size of the table file, in bytes */
+  size_t size() const { return size_; }
+  uint64_t entries() const { return entries_; }
+  uint64_t min_hash() const { return min_hash_; }
+  uint64_t max_hash() const { return max_hash_; }
+
+  /** @return whether any of the table's entries have hashes in the `[min, max]` range */
+  bool Overlaps(uint64_t min, uint64_t max) const { return min_hash_ <= max && max_hash_ >= min; }
+
+ private:
+  class Iterator;
+
+  SSTableBlock index(size_t block) const;
+
+  std::string path_;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+  uint64_t entries_ = 0;
+  uint64_t min_hash_ = 0;
+  uint64_t max_hash_ = 0;
+  std::unique_ptr<BloomFilter> bloom_;
+  const char *index_ = nullptr;
+  size_t blocks_ = 0;
+};
+
+} // namespace keystore
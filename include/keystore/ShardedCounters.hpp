@@ -0,0 +1,110 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "json.hpp"
+
+#include "KeyStore.hpp"
+
+namespace keystore {
+
+/**
+ * The operations (and bytes) counted by a `ShardedCounters`.
+ */
+enum class OpCounter : size_t {
+  kGets = 0,
+  kHits,
+  kMisses,
+  kPuts,
+  kRemoves,
+  // The (estimated, see `EstimateSize()`) size of the keys and values written, and of the values
+  // read.
+  kBytesIn,
+  kBytesOut,
+};
+
+inline constexpr size_t kNumOpCounters = 7;
+
+/**
+ * How many shards each `ShardedCounters` is split into: threads are assigned to shards in
+ * round-robin, so that up to this many threads can update the same counters without ever
+ * writing to the same cache line.
+ */
+inline constexpr size_t kCounterShards = 8;
+
+/**
+ * @return the shard assigned to the calling thread
+ */
+inline size_t ThisThreadShard() {
+  static std::atomic_size_t next{0};
+  thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kCounterShards;
+  return shard;
+}
+
+/**
+ * The values of all the counters, at one point in time.
+ */
+struct OpCounts {
+  std::array<uint64_t, kNumOpCounters> values{};
+
+  uint64_t operator[](OpCounter counter) const { return values[static_cast<size_t>(counter)]; }
+
+  OpCounts &operator+=(const OpCounts &other) {
+    for (size_t i = 0; i < kNumOpCounters; ++i) {
+      values[i] += other.values[i];
+    }
+    return *this;
+  }
+};
+
+inline void to_json(json &j, const OpCounts &counts) {
+  j = {
+      {"gets", counts[OpCounter::kGets]},
+      {"hits", counts[OpCounter::kHits]},
+      {"misses", counts[OpCounter::kMisses]},
+      {"puts", counts[OpCounter::kPuts]},
+      {"removes", counts[OpCounter::kRemoves]},
+      {"bytes_in", counts[OpCounter::kBytesIn]},
+      {"bytes_out", counts[OpCounter::kBytesOut]}
+  };
+}
+
+/**
+ * Always-on operation counters, cheap enough to be updated by every operation: each thread only
+ * increments (with a relaxed atomic add) the counters in its own shard, which lives in a cache
+ * line of its own; the shards are only summed up when the counters are read.
+ *
+ * <p>Reads are not atomic across counters (e.g., `hits + misses` may briefly differ from `gets`)
+ * but never block, nor slow down, the writers.
+ */
+class ShardedCounters {
+  struct alignas(kCacheLineSize) Shard {
+    std::array<std::atomic_uint64_t, kNumOpCounters> values{};
+  };
+  static_assert(sizeof(Shard) == kCacheLineSize);
+
+  std::array<Shard, kCounterShards> shards_;
+
+ public:
+  void Add(OpCounter counter, uint64_t delta = 1) {
+    shards_[ThisThreadShard()].values[static_cast<size_t>(counter)].fetch_add(
+        delta, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] OpCounts Read() const {
+    OpCounts counts;
+    for (const auto &shard : shards_) {
+      for (size_t i = 0; i < kNumOpCounters; ++i) {
+        counts.values[i] += shard.values[i].load(std::memory_order_relaxed);
+      }
+    }
+    return counts;
+  }
+};
+
+} // namespace keystore
@@ -0,0 +1,105 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "json.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * Estimates the memory used by a value of type `T`, including any memory it owns on the heap.
+ *
+ * <p>The default is only exact for types which own no other memory (e.g., trivially copyable
+ * ones): types which do should specialize this template (in the `keystore` namespace), so that
+ * the memory used by an `InMemoryKeyStore` (see `InMemoryKeyStore::Footprint()`), and the
+ * limits of a cache (see `CacheOptions::max_bytes`), account for all of it.
+ *
+ * <pre>
+ *    template<>
+ *    struct keystore::SizeEstimator<Event> {
+ *      size_t operator()(const Event &event) const {
+ *        return sizeof(event) + EstimateSize(event.payload) - sizeof(event.payload);
+ *      }
+ *    };
+ * </pre>
+ */
+template<typename T, typename Enable = void>
+struct SizeEstimator {
+  size_t operator()(const T &value) const {
+    return sizeof(value);
+  }
+};
+
+template<typename C, typename T, typename A>
+struct SizeEstimator<std::basic_string<C, T, A>> {
+  size_t operator()(const std::basic_string<C, T, A> &value) const {
+    // Short strings are stored inline, without any further allocation: an empty string has the
+    // capacity of that inline buffer.
+    static const auto kInline = std::basic_string<C, T, A>{}.capacity();
+    auto heap = value.capacity() > kInline ? value.capacity() + 1 : 0;
+    return sizeof(value) + heap * sizeof(C);
+  }
+};
+
+template<typename T, typename A>
+struct SizeEstimator<std::vector<T, A>> {
+  size_t operator()(const std::vector<T, A> &value) const {
+    size_t size = sizeof(value) + value.capacity() * sizeof(T);
+    if constexpr (!std::is_trivially_copyable_v<T>) {
+      for (const auto &element : value) {
+        size += SizeEstimator<T>{}(element) - sizeof(T);
+      }
+    }
+    return size;
+  }
+};
+
+/**
+ * @return the memory used by `value`, as estimated by its type's `SizeEstimator`
+ */
+template<typename T>
+inline size_t EstimateSize(const T &value) {
+  return SizeEstimator<T>{}(value);
+}
+
+/**
+ * The (estimated) memory used by the data of a bucket, or of a whole store.
+ */
+struct MemoryFootprint {
+  size_t entries = 0;
+
+  // The entries: their keys and values (see `SizeEstimator`) and the map nodes holding them.
+  size_t data_bytes = 0;
+
+  // The data structures indexing the entries (the hash table, and the token index) and, for a
+  // store, its per-bucket slots.
+  size_t overhead_bytes = 0;
+
+  size_t total_bytes() const { return data_bytes + overhead_bytes; }
+
+  MemoryFootprint &operator+=(const MemoryFootprint &other) {
+    entries += other.entries;
+    data_bytes += other.data_bytes;
+    overhead_bytes += other.overhead_bytes;
+    return *this;
+  }
+};
+
+inline void to_json(json &j, const MemoryFootprint &footprint) {
+  j = {
+      {"entries", footprint.entries},
+      {"data_bytes", footprint.data_bytes},
+      {"overhead_bytes", footprint.overhead_bytes},
+      {"total_bytes", footprint.total_bytes()}
+  };
+}
+
+} // namespace keystore
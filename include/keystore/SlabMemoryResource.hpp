@@ -0,0 +1,104 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+namespace keystore {
+
+/**
+ * A size-class "slab" allocator, meant to be used as the arena for all the data of a single
+ * bucket (see `InMemoryKeyStore`).
+ *
+ * <p>Small allocations (up to `kMaxBlockSize` bytes) are rounded up to the nearest multiple of
+ * `kGranularity` and carved out of large chunks, obtained from the `upstream` resource; freed
+ * blocks are kept in a per-size-class free list and re-used by subsequent allocations of the
+ * same class. Larger allocations (e.g., the buckets array of a hash table) are forwarded to the
+ * `upstream` resource, but are still tracked, so that they can be released all at once.
+ *
+ * <p>All the memory is returned to the `upstream` resource when `release()` is called (or the
+ * resource is destroyed) at a cost that is proportional to the number of chunks, not to the
+ * number of allocations: objects allocated from this resource whose destructors only release
+ * memory back to it need not be destroyed at all.
+ *
+ * <p>This class is **not** thread-safe: callers must serialize access to it (in the
+ * `InMemoryKeyStore` this is guaranteed by the bucket's mutex).
+ */
+class SlabMemoryResource : public std::pmr::memory_resource {
+ public:
+  /** All block sizes are a multiple of this, which is also the guaranteed alignment. */
+  static constexpr size_t kGranularity = 16;
+
+  /** Allocations larger than this are forwarded to the upstream resource. */
+  static constexpr size_t kMaxBlockSize = 512;
+
+  /** The size of the chunks requested from the upstream resource. */
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  explicit SlabMemoryResource(
+      std::pmr::memory_resource *upstream = std::pmr::get_default_resource()) :
+      upstream_{upstream} { }
+
+  SlabMemoryResource(const SlabMemoryResource &) = delete;
+  SlabMemoryResource &operator=(const SlabMemoryResource &) = delete;
+
+  ~SlabMemoryResource() override { release(); }
+
+  /**
+   * Returns all the memory to the upstream resource, regardless of whether it had been
+   * deallocated or not: any object still allocated from this resource is invalid after this.
+   */
+  void release();
+
+  // ============= Allocation statistics ===========================
+
+  /** Total number of calls to `allocate()`, since this resource was created. */
+  unsigned long allocations() const { return allocations_; }
+
+  /** Total number of calls to `deallocate()`, since this resource was created. */
+  unsigned long deallocations() const { return deallocations_; }
+
+  /** Bytes currently allocated (and not yet deallocated) including the size-class rounding. */
+  size_t bytes_in_use() const { return bytes_in_use_; }
+
+  /** Bytes currently obtained from the upstream resource, both in chunks and large blocks. */
+  size_t bytes_reserved() const { return bytes_reserved_; }
+
+ protected:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  static constexpr size_t kNumClasses = kMaxBlockSize / kGranularity;
+
+  // Freed blocks are linked through their first word.
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  static size_t ClassOf(size_t bytes) { return bytes == 0 ? 0 : (bytes - 1) / kGranularity; }
+
+  std::pmr::memory_resource *upstream_;
+
+  std::array<FreeBlock *, kNumClasses> free_lists_{};
+  std::vector<void *> chunks_;
+  char *current_ = nullptr;
+  char *end_ = nullptr;
+
+  // Large blocks, which are directly allocated from the upstream, by their size and alignment.
+  std::unordered_map<void *, std::pair<size_t, size_t>> large_blocks_;
+
+  unsigned long allocations_ = 0;
+  unsigned long deallocations_ = 0;
+  size_t bytes_in_use_ = 0;
+  size_t bytes_reserved_ = 0;
+};
+
+} // namespace keystore
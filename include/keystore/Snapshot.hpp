@@ -0,0 +1,316 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "json.hpp"
+
+#include "utils/ThreadsafeQueue.hpp"
+#include "utils/utils.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * Raised when a snapshot cannot be written, or read back (including when it is corrupted).
+ */
+class snapshot_error : public utils::base_error {
+ public:
+  explicit snapshot_error(const std::string &error) : base_error{error} { }
+};
+
+/**
+ * The current wall-clock time, in milliseconds since the epoch: as the snapshots outlive the
+ * process, the expiration times are saved using this clock, rather than `NowMillis()`.
+ */
+inline int64_t WallClockMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Encodes and decodes the keys and values saved in a snapshot: this is implemented for all
+ * trivially copyable types (copied as they are) and strings; other types can be saved by
+ * specializing this template.
+ *
+ * <p>`Size(value)` returns the number of bytes `Write(value, out)` will copy to `out`; `Read(in,
+ * size)` decodes those bytes, without any further framing (the size of each key and value is
+ * saved in the snapshot).
+ */
+template<typename T, typename Enable = void>
+struct SnapshotCodec;
+
+template<typename T>
+struct SnapshotCodec<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+  static size_t Size(const T &) { return sizeof(T); }
+
+  static void Write(const T &value, char *out) { memcpy(out, &value, sizeof(T)); }
+
+  static T Read(const char *in, size_t) {
+    T value;
+    memcpy(&value, in, sizeof(T));
+    return value;
+  }
+};
+
+template<typename Alloc>
+struct SnapshotCodec<std::basic_string<char, std::char_traits<char>, Alloc>> {
+  using String = std::basic_string<char, std::char_traits<char>, Alloc>;
+
+  static size_t Size(const String &value) { return value.size(); }
+
+  static void Write(const String &value, char *out) { memcpy(out, value.data(), value.size()); }
+
+  static String Read(const char *in, size_t size) { return String(in, size); }
+};
+
+/**
+ * Encodes a key (or value) as its `SnapshotCodec` does, e.g. to store it in a file.
+ */
+template<typename T>
+std::string EncodeValue(const T &value) {
+  std::string data(SnapshotCodec<T>::Size(value), '\0');
+  SnapshotCodec<T>::Write(value, data.data());
+  return data;
+}
+
+/**
+ * Decodes a key (or value) encoded by `EncodeValue()`.
+ */
+template<typename T>
+T DecodeValue(std::string_view data) {
+  return SnapshotCodec<T>::Read(data.data(), data.size());
+}
+
+/**
+ * The extension of the snapshot files, see `SnapshotPath()`.
+ */
+inline const std::string kSnapshotExtension = ".snap";
+
+/**
+ * @return the path of the snapshot of the `bucket` in the `dir` directory
+ */
+inline std::string SnapshotPath(const std::string &dir, const std::string &bucket) {
+  return dir + "/" + bucket + kSnapshotExtension;
+}
+
+/**
+ * The header of each of the records in a snapshot: it is followed by the key and value bytes.
+ */
+struct SnapshotRecord {
+  uint32_t key_size;
+  uint32_t value_size;
+
+  // The key's hash (see `HashKey64()`), so that it need not be hashed again when restored.
+  uint64_t hash;
+
+  // When the entry expires (see `WallClockMillis()`), or 0 if it never does.
+  int64_t expires_at;
+};
+
+/**
+ * Writes the snapshot of one bucket to a file.
+ *
+ * <p>The file starts with a header (which identifies the bucket, and how many entries the
+ * snapshot contains), followed by length-prefixed, checksummed, blocks of (about) `kBlockSize`
+ * bytes, each containing as many records as fit; each record is a `SnapshotRecord` followed by
+ * the key and value bytes.
+ *
+ * <p>Records are appended to an in-memory buffer (see `Append()`) and only written to the file
+ * when `Flush()` is called: this allows the caller to hold the bucket's lock while the records
+ * are encoded, but not while they are written. The data is written to a temporary file, which is
+ * only renamed to `path` once the snapshot is complete (see `Finish()`): a partially written
+ * snapshot never replaces a complete one.
+ *
+ * <p>This class is **not** thread-safe.
+ */
+class SnapshotWriter {
+ public:
+  /** Blocks are sealed once they exceed this size. */
+  static constexpr size_t kBlockSize = 1024 * 1024;
+
+  /**
+   * @param lsn the last record of the bucket's write-ahead log included in the snapshot (0, if
+   *      there is none), so that only the following ones are replayed after restoring it
+   */
+  SnapshotWriter(const std::string &path, const std::string &bucket, uint64_t lsn = 0);
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+  /** Removes the temporary file, unless `Finish()` was called. */
+  ~SnapshotWriter();
+
+  /**
+   * Reserves space for one record in the current block.
+   *
+   * @param size the size of the record (including the `SnapshotRecord` header)
+   * @return where the record must be copied to, valid until the next call to any other method
+   */
+  char *Append(size_t size);
+
+  /** Writes the blocks sealed so far to the file. */
+  void Flush();
+
+  /**
+   * Writes all the remaining data, and the header, to the file, syncs it to disk and moves it
+   * to its final `path`.
+   *
+   * @return the size of the snapshot, in bytes
+   */
+  size_t Finish();
+
+  uint64_t entries() const { return entries_; }
+
+ private:
+  void Seal();
+  void Write(const char *data, size_t size, off_t offset);
+
+  std::string path_;
+  std::string tmp_path_;
+  std::string bucket_;
+  uint64_t lsn_;
+  int fd_ = -1;
+  bool finished_ = false;
+
+  // Sealed blocks (ready to be written) followed by the current block, which starts at `block_`.
+  std::vector<char> buffer_;
+  size_t block_ = 0;
+  uint32_t block_records_ = 0;
+  size_t sealed_ = 0;
+
+  off_t offset_ = 0;
+  uint64_t entries_ = 0;
+  uint64_t blocks_ = 0;
+};
+
+/**
+ * Reads back a snapshot written by a `SnapshotWriter`, memory-mapping the whole file, so that
+ * the records are decoded straight from the page cache.
+ *
+ * <p>Each block's checksum is verified before any of its records is returned: a corrupted (or
+ * truncated) snapshot raises a `snapshot_error`.
+ */
+class SnapshotReader {
+ public:
+  explicit SnapshotReader(const std::string &path);
+  SnapshotReader(const SnapshotReader &) = delete;
+  SnapshotReader &operator=(const SnapshotReader &) = delete;
+  ~SnapshotReader();
+
+  /**
+   * Moves to the next block of records.
+   *
+   * @param records will point to the first record of the block
+   * @param size will contain the size of the block, in bytes
+   * @param count will contain the number of records in the block
+   * @return `false` if there are no more blocks
+   */
+  bool NextBlock(const char **records, size_t *size, uint32_t *count);
+
+  const std::string &bucket() const { return bucket_; }
+
+  /** @return the last record of the write-ahead log included in the snapshot */
+  uint64_t lsn() const { return lsn_; }
+
+  /** @return the number of entries in the snapshot */
+  uint64_t entries() const { return entries_; }
+
+  /** @return the size of the snapshot, in bytes */
+  size_t size() const { return size_; }
+
+ private:
+  void Map();
+  void Close();
+
+  std::string path_;
+  int fd_ = -1;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = 0;
+
+  std::string bucket_;
+  uint64_t lsn_ = 0;
+  uint64_t entries_ = 0;
+  uint64_t blocks_ = 0;
+  uint64_t blocks_read_ = 0;
+};
+
+/**
+ * A fast (non-cryptographic) 64-bit checksum, used to detect corrupted snapshot blocks.
+ */
+uint64_t Checksum(const char *data, size_t size);
+
+/**
+ * The outcome of writing (or restoring) the snapshot of one bucket.
+ */
+struct SnapshotStats {
+  std::string bucket;
+  std::string path;
+  uint64_t entries = 0;
+  uint64_t bytes = 0;
+  std::chrono::milliseconds duration{0};
+
+  // The last record of the bucket's write-ahead log included in the snapshot, if any.
+  uint64_t lsn = 0;
+
+  // Set if the snapshot could not be written (or restored).
+  std::string error;
+
+  /** @return the throughput, in GB per second */
+  double gb_per_sec() const {
+    return duration.count() > 0 ? bytes / 1e6 / duration.count() : 0.0;
+  }
+};
+
+inline void to_json(json &j, const SnapshotStats &stats) {
+  j = {
+      {"bucket", stats.bucket},
+      {"path", stats.path},
+      {"entries", stats.entries},
+      {"bytes", stats.bytes},
+      {"duration_msec", stats.duration.count()},
+      {"gb_per_sec", stats.gb_per_sec()},
+      {"lsn", stats.lsn}
+  };
+  if (!stats.error.empty()) {
+    j["error"] = stats.error;
+  }
+}
+
+/**
+ * Runs `func(i)` for each `i` in `[0, count)` on (at most) `max_concurrency` threads, and
+ * waits for all of them to complete.
+ */
+template<typename Func>
+void ParallelFor(size_t count, size_t max_concurrency, Func func) {
+  utils::ThreadsafeQueue<size_t> pending;
+  for (size_t i = 0; i < count; ++i) {
+    pending.push(i);
+  }
+  auto worker = [&]() {
+    size_t i;
+    while (pending.pop(i)) {
+      func(i);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t n = 0; n < std::min(std::max(size_t{1}, max_concurrency), count); ++n) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+} // namespace keystore
@@ -0,0 +1,197 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "Entry.hpp"
+
+namespace keystore {
+
+/**
+ * The current time, in milliseconds, of the (monotonic) clock used to expire entries.
+ */
+inline int64_t NowMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * A hierarchical timing wheel, which tracks the expiration time of the entries of a single bucket.
+ *
+ * <p>The wheel has `kLevels` levels of `kSlots` slots each; the slots in level `L` span
+ * `kSlots^L` milliseconds each, so that the wheel covers ~4.6 hours with 1ms resolution: entries
+ * expiring further out are parked in the last slot of the top level and re-scheduled once their
+ * time comes closer. Scheduling and cancelling an entry are O(1), and each entry is moved down
+ * at most `kLevels - 1` times (when a slot in the level above is "cascaded" into the lower ones)
+ * before it expires, so that the cost of expiring entries is amortized O(1) too.
+ *
+ * <p>Expiring entries is incremental: `Advance()` stops after `budget` entries have expired, and
+ * will resume from the same point the next time it is called; ranges of time with no entries
+ * due are skipped, without visiting each of their slots.
+ *
+ * <p>See: Varghese & Lauck, "Hashed and Hierarchical Timing Wheels."
+ *
+ * <p>This class is **not** thread-safe: the bucket's mutex must be held exclusively when calling
+ * any of its methods.
+ */
+template<typename K, typename V>
+class TimingWheel {
+ public:
+  using Node = EntryNode<K, V>;
+
+  static constexpr size_t kLevels = 4;
+  static constexpr size_t kSlotBits = 6;
+  static constexpr size_t kSlots = 1UL << kSlotBits;
+  static constexpr int64_t kHorizon = 1L << (kSlotBits * kLevels);
+
+  explicit TimingWheel(int64_t now = NowMillis()) : current_{now} { }
+
+  /**
+   * Starts tracking the entry's `expires_at` time; the entry must not be already scheduled.
+   */
+  void Schedule(Node *node);
+
+  /**
+   * Stops tracking the entry, if it was scheduled.
+   */
+  void Cancel(Node *node);
+
+  /**
+   * Expires (up to `budget`) entries which are due at, or before, `now`, invoking
+   * `on_expire(node)` for each of them; the entries are no longer tracked by the wheel when
+   * `on_expire` is called, and the caller is responsible for removing them from the bucket.
+   *
+   * @return the number of entries expired
+   */
+  template<typename Func>
+  size_t Advance(int64_t now, size_t budget, Func on_expire);
+
+  /** @return the number of entries scheduled to expire */
+  size_t size() const { return size_; }
+
+ private:
+  std::vector<Node *> &Slot(size_t level, size_t index) {
+    return slots_[level * kSlots + index];
+  }
+
+  static size_t IndexAt(int64_t tick, size_t level) {
+    return (tick >> (kSlotBits * level)) & (kSlots - 1);
+  }
+
+  // Moves to the next tick, cascading the entries in the higher levels' slots which are now due
+  // within the span of the level below.
+  void Tick();
+
+  std::array<std::vector<Node *>, kLevels * kSlots> slots_;
+  std::array<size_t, kLevels> counts_{};
+  size_t size_ = 0;
+
+  // The next tick to be processed: all entries due before this have already expired.
+  int64_t current_;
+};
+
+template<typename K, typename V>
+void TimingWheel<K, V>::Schedule(Node *node) {
+  auto &entry = node->second;
+  int64_t tick = std::max(entry.expires_at, current_);
+  int64_t delta = tick - current_;
+  if (delta >= kHorizon) {
+    tick = current_ + kHorizon - 1;
+    delta = kHorizon - 1;
+  }
+  size_t level = 0;
+  while (level < kLevels - 1 && delta >= (1L << (kSlotBits * (level + 1)))) {
+    ++level;
+  }
+  auto &slot = Slot(level, IndexAt(tick, level));
+  entry.wheel_slot = static_cast<uint16_t>(level * kSlots + IndexAt(tick, level));
+  entry.wheel_pos = slot.size();
+  slot.push_back(node);
+  ++counts_[level];
+  ++size_;
+}
+
+template<typename K, typename V>
+void TimingWheel<K, V>::Cancel(Node *node) {
+  auto &entry = node->second;
+  if (entry.wheel_slot == Entry<V>::kNotScheduled) {
+    return;
+  }
+  auto &slot = slots_[entry.wheel_slot];
+  auto pos = entry.wheel_pos;
+  slot[pos] = slot.back();
+  slot[pos]->second.wheel_pos = pos;
+  slot.pop_back();
+  --counts_[entry.wheel_slot / kSlots];
+  --size_;
+  entry.wheel_slot = Entry<V>::kNotScheduled;
+}
+
+template<typename K, typename V>
+void TimingWheel<K, V>::Tick() {
+  ++current_;
+  for (size_t level = 1; level < kLevels; ++level) {
+    if ((current_ & ((1L << (kSlotBits * level)) - 1)) != 0) {
+      break;
+    }
+    auto cascaded = std::move(Slot(level, IndexAt(current_, level)));
+    Slot(level, IndexAt(current_, level)).clear();
+    counts_[level] -= cascaded.size();
+    size_ -= cascaded.size();
+    for (auto node : cascaded) {
+      Schedule(node);
+    }
+  }
+}
+
+template<typename K, typename V>
+template<typename Func>
+size_t TimingWheel<K, V>::Advance(int64_t now, size_t budget, Func on_expire) {
+  size_t expired = 0;
+  while (current_ <= now) {
+    if (size_ == 0) {
+      current_ = now + 1;
+      break;
+    }
+    if (counts_[0] == 0) {
+      // Nothing is due before the next cascade of the lowest non-empty level: skip straight to
+      // it (or to `now`, if sooner).
+      size_t level = 1;
+      while (counts_[level] == 0) {
+        ++level;
+      }
+      int64_t next = (current_ | ((1L << (kSlotBits * level)) - 1)) + 1;
+      if (next > now) {
+        current_ = now + 1;
+        break;
+      }
+      current_ = next - 1;
+      Tick();
+      continue;
+    }
+    auto &slot = Slot(0, IndexAt(current_, 0));
+    while (!slot.empty()) {
+      if (expired >= budget) {
+        return expired;
+      }
+      auto node = slot.back();
+      slot.pop_back();
+      --counts_[0];
+      --size_;
+      node->second.wheel_slot = Entry<V>::kNotScheduled;
+      on_expire(node);
+      ++expired;
+    }
+    Tick();
+  }
+  return expired;
+}
+
+} // namespace keystore
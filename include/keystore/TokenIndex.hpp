@@ -0,0 +1,115 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+#include "Entry.hpp"
+
+namespace keystore {
+
+/**
+ * The number of "tokens" the hash ring is divided into: each token spans a fixed, equally sized,
+ * range of hashes (about 1.5e-5, comparable to the tolerance used to compare partition points).
+ */
+inline constexpr uint32_t kTokens = 1U << 16U;
+
+/**
+ * @return the token for a key whose hash is `hash` (in the [0, 1] interval)
+ */
+inline uint32_t TokenOf(float hash) {
+  return std::min(static_cast<uint32_t>(std::max(hash, 0.0f) * kTokens), kTokens - 1);
+}
+
+/**
+ * The hash range spanned by the `token`, as its `[begin, end)` pair.
+ */
+inline std::pair<float, float> TokenRange(uint32_t token) {
+  return {static_cast<float>(token) / kTokens, static_cast<float>(token + 1) / kTokens};
+}
+
+/**
+ * Indexes the entries of a bucket by the token their key hashes to, in token order, so that the
+ * entries in any given range of the hash ring can be found without scanning all the others.
+ *
+ * <p>This is what makes re-balancing a bucket proportional to the number of keys which move: a new
+ * bucket takes over one or more ranges of the ring, and only the tokens in those ranges need to
+ * be visited (plus the few tokens which straddle a partition point, whose keys are checked one by
+ * one).
+ *
+ * <p>Adding and removing an entry are O(1) (plus a lookup in the map of non-empty tokens), as the
+ * entry keeps track of its position in the token's list.
+ *
+ * <p>This class is **not** thread-safe: the bucket's mutex must be held exclusively when calling
+ * any of its non-`const` methods.
+ */
+template<typename K, typename V>
+class TokenIndex {
+ public:
+  using Node = EntryNode<K, V>;
+  using Nodes = std::pmr::vector<Node *>;
+
+  explicit TokenIndex(std::pmr::memory_resource *resource) : tokens_{resource} { }
+
+  /** Adds the entry, to the token its key hashes to. */
+  void Add(Node *node) {
+    auto &nodes = tokens_[TokenOf(node->first.position())];
+    node->second.token_pos = nodes.size();
+    nodes.push_back(node);
+  }
+
+  /** Removes the entry. */
+  void Remove(Node *node) {
+    auto pos = tokens_.find(TokenOf(node->first.position()));
+    auto &nodes = pos->second;
+    auto i = node->second.token_pos;
+    nodes[i] = nodes.back();
+    nodes[i]->second.token_pos = i;
+    nodes.pop_back();
+    if (nodes.empty()) {
+      tokens_.erase(pos);
+    }
+  }
+
+  /**
+   * Invokes `func(token, nodes)` on each of the non-empty tokens, in order, starting from the
+   * `from` token, until it returns `false` (after which, no more tokens are visited).
+   *
+   * @return the token after the last one visited, or `kTokens` if all were visited
+   */
+  template<typename Func>
+  uint32_t ForEachFrom(uint32_t from, Func func) const {
+    for (auto pos = tokens_.lower_bound(from); pos != tokens_.end(); ++pos) {
+      if (!func(pos->first, pos->second)) {
+        return pos->first + 1;
+      }
+    }
+    return kTokens;
+  }
+
+  /** @return the number of non-empty tokens */
+  size_t size() const { return tokens_.size(); }
+
+  /**
+   * @param entries the number of entries in the index
+   * @return the (estimated) memory used by the index: a tree node for each non-empty token, and
+   *    a pointer for each entry (ignoring the spare capacity of the tokens' lists)
+   */
+  size_t EstimateSize(size_t entries) const {
+    // Each node of the tree has three pointers and a color, besides the token and its list.
+    const size_t kTreeNodeHeader = 4 * sizeof(void *);
+    return sizeof(tokens_) + tokens_.size() * (kTreeNodeHeader + sizeof(Nodes) + sizeof(uint32_t))
+        + entries * sizeof(Node *);
+  }
+
+ private:
+  std::pmr::map<uint32_t, Nodes> tokens_;
+};
+
+} // namespace keystore
@@ -0,0 +1,179 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+#include "KeyStore.hpp"
+#include "LatencyHistogram.hpp"
+
+namespace keystore {
+
+/**
+ * How the keys (or the values' sizes) used by a workload are chosen.
+ */
+enum class Distribution {
+  // Always the same (only meaningful for the values' sizes).
+  kConstant,
+  kUniform,
+  // A few keys are much more popular than all others; the popular ones are scattered across the
+  // key space (and hence, across the buckets).
+  kZipfian,
+  // As `kZipfian`, but the most recently inserted keys are the most popular.
+  kLatest,
+};
+
+/**
+ * @return the `Distribution` called `name` ("constant", "uniform", "zipfian" or "latest")
+ * @throws std::invalid_argument if there is no such distribution
+ */
+Distribution DistributionFrom(const std::string &name);
+
+/**
+ * The operations run by a workload, as defined by YCSB.
+ */
+enum class WorkloadOp : size_t {
+  kRead = 0,
+  kUpdate,
+  kInsert,
+  kScan,
+  kReadModifyWrite,
+};
+
+inline constexpr size_t kNumWorkloadOps = 5;
+
+/** @return the name of the `op`, as reported by `WorkloadResult` */
+const char *WorkloadOpName(WorkloadOp op);
+
+/**
+ * The definition of a workload: a mix of operations, run against a store that initially holds
+ * `record_count` records.
+ *
+ * <p>The standard mixes of the <a href="https://github.com/brianfrankcooper/YCSB/wiki/Core-Workloads">
+ * Yahoo! Cloud Serving Benchmark</a> are returned by `Ycsb()`.
+ */
+struct WorkloadOptions {
+  size_t record_count = 100000;
+  size_t operation_count = 1000000;
+
+  // The proportions of each of the operations (they need not add up to 1).
+  std::array<double, kNumWorkloadOps> proportions{0.5, 0.5, 0, 0, 0};
+
+  Distribution request_distribution = Distribution::kZipfian;
+
+  // Scans read a number of records chosen uniformly in [1, max_scan_length].
+  size_t max_scan_length = 100;
+
+  Distribution value_size_distribution = Distribution::kConstant;
+  size_t min_value_size = 100;
+  size_t max_value_size = 100;
+
+  size_t threads = 1;
+
+  /**
+   * If set, operations are started at this rate (across all threads), regardless of how long
+   * the previous ones took (an "open loop"): latencies are then measured from when an operation
+   * should have started, so that they include the time spent waiting for the store to catch up
+   * (which a "closed loop" driver fails to account for, the so-called "coordinated omission").
+   */
+  double target_ops_per_sec = 0;
+
+  // Operations run (with the same mix) before the measured ones, and not reported.
+  size_t warmup_operation_count = 0;
+
+  uint64_t seed = 42;
+
+  /**
+   * @param workload one of 'a' to 'f' (case-insensitive), see the YCSB documentation
+   * @return the options for the YCSB core workload, with all other options set to their defaults
+   * @throws std::invalid_argument if `workload` is not one of YCSB's
+   */
+  static WorkloadOptions Ycsb(char workload);
+};
+
+/**
+ * The outcome of `RunWorkload()`.
+ */
+struct WorkloadResult {
+  std::array<uint64_t, kNumWorkloadOps> operations{};
+
+  // Reads (and scans, and read-modify-writes) which did not find their key(s), and writes
+  // which the store refused.
+  std::array<uint64_t, kNumWorkloadOps> failed{};
+
+  // Latency percentiles, in nanoseconds, for each of the operations.
+  std::vector<LatencySnapshot> latencies;
+
+  double elapsed_sec = 0;
+
+  [[nodiscard]] uint64_t total_operations() const;
+  [[nodiscard]] double ops_per_sec() const {
+    return elapsed_sec > 0 ? total_operations() / elapsed_sec : 0;
+  }
+};
+
+void to_json(json &j, const WorkloadResult &result);
+
+/**
+ * Generates integers in [0, items), following Zipf's law: item `i` is chosen with a probability
+ * proportional to `1 / (i + 1)^theta`.
+ *
+ * <p>This is the algorithm (from Gray et al., "Quickly Generating Billion-Record Synthetic
+ * Databases") used by YCSB: the number of items can grow (as records are inserted) at the cost
+ * of only computing the new terms of the zeta function.
+ */
+class ZipfianGenerator {
+  uint64_t items_;
+  double theta_;
+  double alpha_;
+  double zeta2_;
+  double zetan_;
+  double eta_;
+
+  void Update();
+
+ public:
+  static constexpr double kDefaultTheta = 0.99;
+
+  explicit ZipfianGenerator(uint64_t items, double theta = kDefaultTheta);
+
+  /** Extends the range of values generated to [0, items); `items` can only grow. */
+  void Grow(uint64_t items);
+
+  uint64_t Next(std::mt19937_64 &rnd) const;
+
+  [[nodiscard]] uint64_t items() const { return items_; }
+};
+
+/**
+ * Loads the `record_count` records of the workload into the `store`, using `threads` threads.
+ *
+ * @return how many records the store accepted
+ */
+size_t LoadWorkload(KeyStore<std::string, std::string> &store, const WorkloadOptions &options);
+
+/**
+ * Runs the workload against the `store` (which should have already been loaded with
+ * `LoadWorkload()`) and reports the throughput and latencies of each operation.
+ *
+ * <p>Scans are emulated as a `MultiGet()` of consecutive records (which, as keys are hashed,
+ * live in different buckets), as not all stores support range scans.
+ */
+WorkloadResult RunWorkload(KeyStore<std::string, std::string> &store,
+                           const WorkloadOptions &options);
+
+/**
+ * @return the key of the record numbered `record`, as used by the workloads
+ */
+inline std::string WorkloadKey(uint64_t record) {
+  return "user" + std::to_string(record);
+}
+
+} // namespace keystore
@@ -0,0 +1,244 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+
+#include "utils/utils.hpp"
+
+namespace keystore {
+
+using json = nlohmann::json;
+
+/**
+ * Raised when the write-ahead log cannot be written, or read back.
+ */
+class wal_error : public utils::base_error {
+ public:
+  explicit wal_error(const std::string &error) : base_error{error} { }
+};
+
+/**
+ * When the records appended to a `WriteAheadLog` are synced to disk.
+ */
+enum class SyncPolicy {
+  // Each commit only returns once its records are synced (`fdatasync`) to disk.
+  kAlways,
+  // Each commit writes its records to the OS, which are then synced every `sync_interval`: at
+  // most that much data is lost if the machine crashes (but none, if only the process does).
+  kInterval,
+  // The records are written to the OS, but never explicitly synced (except when the log is
+  // closed).
+  kNone
+};
+
+/**
+ * Configures the write-ahead log of an `InMemoryKeyStore`, see `EnableWal()`.
+ */
+struct WalOptions {
+  // The directory where the log's segments are written; it must exist.
+  std::string dir;
+
+  // Whether each bucket has its own log (which can be replayed, and truncated, on its own, and
+  // appended to without contending with the other buckets' writers) or all buckets share one.
+  bool per_bucket = false;
+
+  SyncPolicy sync = SyncPolicy::kAlways;
+  std::chrono::milliseconds sync_interval{10};
+
+  // Once a segment exceeds this size, the following records are written to a new one.
+  size_t segment_size = 64 * 1024 * 1024;
+};
+
+/**
+ * The write operations an `InMemoryKeyStore` appends to its log.
+ */
+enum class WalOp : uint32_t {
+  kPut = 1,
+  kRemove = 2
+};
+
+/**
+ * The header of each of the records an `InMemoryKeyStore` appends to its log: it is followed by
+ * the key and (only for `kPut`) the value bytes, encoded as in a snapshot (see `SnapshotCodec`).
+ */
+struct WalRecord {
+  WalOp op;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t reserved;
+
+  // The key's hash (see `HashKey64()`), which also identifies the bucket the key belongs to.
+  uint64_t hash;
+
+  // When the entry expires (see `WallClockMillis()`), or 0 if it never does.
+  int64_t expires_at;
+};
+
+/**
+ * An append-only log of opaque records, each identified by a "log sequence number" (LSN) which
+ * increases by one with each record appended (and carries on from the last record found in the
+ * log, when it is re-opened).
+ *
+ * <p>The log is written to a sequence of segment files (named `<name>-<first LSN>.wal`) in a
+ * directory; each record is framed by its size, LSN and checksum. Once the records in the oldest
+ * segments are no longer needed (e.g., because they are included in a snapshot) the segments can
+ * be deleted, see `Truncate()`.
+ *
+ * <p>Appending a record only copies it to an in-memory buffer; `Commit(lsn)` then waits until
+ * (at least) all the records up to `lsn` are written (and, depending on the `SyncPolicy`,
+ * synced) to the file. Commits are grouped: the first thread to commit becomes the "leader," and
+ * writes (and syncs) all the records buffered so far, while the others wait; as they are likely
+ * to find their records already written once it is done, concurrent writers share a single
+ * `fdatasync`, rather than each paying for its own.
+ *
+ * <p>All methods are thread-safe.
+ */
+class WriteAheadLog {
+ public:
+  /**
+   * Opens the log `name` in the `dir` directory, creating it if it does not exist yet; if the last
+   * segment ends with a partially written record (e.g., because the process crashed while writing
+   * it), this is truncated.
+   *
+   * @param options only the `dir` and the sync and segment options are used
+   * @throws wal_error if the existing segments cannot be read
+   */
+  WriteAheadLog(const std::string &name, const WalOptions &options);
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+  /** Writes and syncs all the buffered records. */
+  ~WriteAheadLog();
+
+  /**
+   * Appends a copy of the record, which will be written to the log by a subsequent `Commit()`
+   * (or, with the `kInterval` policy, by the background syncer, at the latest).
+   *
+   * @return the record's LSN
+   */
+  uint64_t Append(const char *data, size_t size);
+
+  /**
+   * Waits until the record with the given `lsn` (and all those before it) are written to the log
+   * and, with the `kAlways` policy, synced to disk.
+   *
+   * @throws wal_error if the log cannot be written (in which case, all subsequent commits fail)
+   */
+  void Commit(uint64_t lsn);
+
+  /** Writes, and syncs, all the buffered records. */
+  void Sync();
+
+  /**
+   * Invokes `func(lsn, data, size)` on each of the records in the log whose LSN is greater than
+   * `after`, in order; the `data` is only valid during the call.
+   *
+   * <p>This should only be called before any record is appended.
+   *
+   * @return the number of records `func` was invoked on
+   * @throws wal_error if one of the segments is corrupted
+   */
+  uint64_t Replay(uint64_t after,
+                  const std::function<void(uint64_t, const char *, size_t)> &func) const;
+
+  /**
+   * Deletes all the segments which only contain records whose LSN is `lsn` or less; the segment
+   * being written to is never deleted.
+   *
+   * @return the number of segments deleted
+   */
+  size_t Truncate(uint64_t lsn);
+
+  /** @return the LSN of the last record appended, or 0 if none was ever appended */
+  uint64_t last_lsn() const;
+
+  /** @return the LSN of the last record synced to disk */
+  uint64_t durable_lsn() const;
+
+  const std::string &name() const { return name_; }
+
+  /** @return the paths of the log's segments, in order */
+  std::vector<std::string> segments() const;
+
+  /** @return the statistics of the log; the `mutex_` is not acquired */
+  json Stats() const;
+
+ private:
+  // A segment of the log, and the LSN of its first record.
+  struct Segment {
+    std::string path;
+    uint64_t first_lsn;
+  };
+
+  std::vector<Segment> ListSegments() const;
+
+  /**
+   * Invokes `func` on each valid record in the segment, until the first invalid (or truncated)
+   * one, if any.
+   *
+   * @return the size of the valid part of the segment
+   */
+  size_t ScanSegment(const Segment &segment,
+                     const std::function<void(uint64_t, const char *, size_t)> &func) const;
+
+  /**
+   * Becomes the leader, and writes (and syncs, if `sync`) all the records buffered so far; the
+   * mutex (held by `lk`) is released while writing.
+   */
+  void Flush(std::unique_lock<std::mutex> &lk, bool sync);
+
+  /** Opens a new segment, whose first record will be `first_lsn`. */
+  void Roll(uint64_t first_lsn);
+  void Write(const char *data, size_t size);
+  void DataSync();
+  void RunSyncer();
+
+  std::string name_;
+  WalOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable committed_;
+
+  // The records appended since the last flush, and the LSNs assigned so far, written to the
+  // segment, and synced.
+  std::vector<char> pending_;
+  uint64_t last_lsn_ = 0;
+  uint64_t written_lsn_ = 0;
+  uint64_t durable_lsn_ = 0;
+  // Whether a leader is currently writing the records: only the leader accesses the segment.
+  bool flushing_ = false;
+  std::string error_;
+
+  int fd_ = -1;
+  std::string segment_path_;
+  size_t segment_bytes_ = 0;
+
+  // The `last_lsn_` and `durable_lsn_`, published as they change (while holding the `mutex_`)
+  // so that they can be read without it: see `Stats()`.
+  std::atomic_uint64_t published_last_lsn_{0};
+  std::atomic_uint64_t published_durable_lsn_{0};
+
+  // The number of records appended, and how many writes (and syncs) it took to commit them.
+  std::atomic_ulong appends_{0};
+  std::atomic_ulong writes_{0};
+  std::atomic_ulong syncs_{0};
+
+  // Only with the `kInterval` policy.
+  std::thread syncer_;
+  std::condition_variable stopping_;
+  bool stopped_ = false;
+};
+
+} // namespace keystore
@@ -0,0 +1,278 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Lock profiling is only compiled in when building with `-DLOCK_PROFILING=ON` (see
+ * `CMakeLists.txt`): otherwise, a `ProfiledMutex` is the mutex it wraps, and costs nothing.
+ *
+ * <p>As this changes the layout of the classes which use a `ProfiledMutex` (e.g., `View`), the
+ * code which uses the library must be compiled with the same setting as the library itself.
+ */
+#ifndef UTILS_LOCK_PROFILING
+#define UTILS_LOCK_PROFILING 0
+#endif
+
+namespace utils {
+
+inline constexpr bool kLockProfiling = UTILS_LOCK_PROFILING != 0;
+
+/**
+ * The statistics for one (named) lock: all the locks with the same name add up to the same
+ * counts.
+ */
+struct LockCounts {
+  // Exclusive and shared acquisitions, including those which did not have to wait.
+  uint64_t acquisitions = 0;
+  uint64_t contended = 0;
+  // The total time spent waiting to acquire the lock, and holding it, across all threads.
+  uint64_t wait_nanos = 0;
+  uint64_t hold_nanos = 0;
+};
+
+/**
+ * The counts for one of the locks, as returned by `LockProfiler::Hottest()`.
+ */
+struct LockReport {
+  std::string name;
+  LockCounts counts;
+};
+
+std::ostream &operator<<(std::ostream &out, const LockReport &report);
+
+/**
+ * Records the statistics for one named lock: as many threads may acquire the same lock (or
+ * locks with the same name) at once, the counts are sharded by thread, so that updating them
+ * does not add contention of its own.
+ */
+class LockStats {
+ public:
+  static constexpr size_t kShards = 8;
+
+  void Acquired(bool contended, uint64_t wait_nanos) {
+    auto &shard = shards_[ThisThreadShard()];
+    shard.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (contended) {
+      shard.contended.fetch_add(1, std::memory_order_relaxed);
+      shard.wait_nanos.fetch_add(wait_nanos, std::memory_order_relaxed);
+    }
+  }
+
+  void Released(uint64_t hold_nanos) {
+    shards_[ThisThreadShard()].hold_nanos.fetch_add(hold_nanos, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] LockCounts Read() const;
+  void Reset();
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic_uint64_t acquisitions{0};
+    std::atomic_uint64_t contended{0};
+    std::atomic_uint64_t wait_nanos{0};
+    std::atomic_uint64_t hold_nanos{0};
+  };
+  std::array<Shard, kShards> shards_;
+
+  static size_t ThisThreadShard() {
+    static std::atomic_size_t next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shard;
+  }
+};
+
+/**
+ * The registry of all the named locks' statistics, for the whole process.
+ */
+class LockProfiler {
+  mutable std::mutex mutex_;
+  // Never removed, so that the mutexes can keep a pointer to their statistics.
+  std::map<std::string, std::unique_ptr<LockStats>, std::less<>> stats_;
+
+  LockProfiler() = default;
+
+ public:
+  static LockProfiler &Instance();
+
+  /**
+   * @return the statistics for the lock(s) with the given `name`, created if necessary; they
+   *    will never be deleted
+   */
+  LockStats *Register(std::string_view name);
+
+  /**
+   * @param max_locks how many locks to return at most; all of them, if 0
+   * @return the locks which were waited for the longest (in total, across all threads), in
+   *    descending order of total wait time; locks which were never acquired are not listed
+   */
+  [[nodiscard]] std::vector<LockReport> Hottest(size_t max_locks = 0) const;
+
+  /** Clears the statistics of all locks, e.g. after warming up a benchmark. */
+  void Reset();
+};
+
+namespace detail {
+
+inline uint64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * The shared locks held by the calling thread, and when they were acquired: unlike exclusive
+ * ones, a shared lock can be held by many threads, so this cannot be kept in the mutex itself.
+ */
+class SharedHolds {
+  static constexpr size_t kMaxHolds = 16;
+  struct Hold {
+    const void *mutex;
+    uint64_t since;
+  };
+  std::array<Hold, kMaxHolds> holds_{};
+  size_t size_ = 0;
+
+ public:
+  // If the thread holds more than `kMaxHolds` shared locks, the hold time is not recorded.
+  void Push(const void *mutex, uint64_t since) {
+    if (size_ < kMaxHolds) {
+      holds_[size_++] = {mutex, since};
+    }
+  }
+
+  bool Pop(const void *mutex, uint64_t *since) {
+    // Locks are most often released in the reverse order they were acquired.
+    for (size_t i = size_; i > 0; --i) {
+      if (holds_[i - 1].mutex == mutex) {
+        *since = holds_[i - 1].since;
+        holds_[i - 1] = holds_[--size_];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static SharedHolds &ThisThread() {
+    thread_local SharedHolds holds;
+    return holds;
+  }
+};
+
+} // namespace detail
+
+#if UTILS_LOCK_PROFILING
+
+/**
+ * A drop-in replacement for a `Mutex` (either a `std::mutex` or a `std::shared_mutex`) which
+ * records, under its `name`, how many times it is acquired, how often (and how long) threads
+ * wait to acquire it, and for how long it is held; see `LockProfiler::Hottest()`.
+ *
+ * <p>Acquiring an uncontended lock costs two more reads of the clock, and a few (per-thread)
+ * atomic increments.
+ */
+template<typename Mutex>
+class ProfiledMutex {
+  Mutex mutex_;
+  std::atomic<LockStats *> stats_;
+  // Only accessed by the thread which holds the lock exclusively.
+  uint64_t locked_at_ = 0;
+
+  LockStats *stats() const { return stats_.load(std::memory_order_relaxed); }
+
+ public:
+  explicit ProfiledMutex(std::string_view name = "unnamed")
+      : stats_{LockProfiler::Instance().Register(name)} { }
+
+  ProfiledMutex(const ProfiledMutex &) = delete;
+  ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+  /** Statistics recorded from now on are added up under the new `name`. */
+  void set_name(std::string_view name) {
+    stats_.store(LockProfiler::Instance().Register(name), std::memory_order_relaxed);
+  }
+
+  void lock() {
+    if (mutex_.try_lock()) {
+      locked_at_ = detail::NowNanos();
+      stats()->Acquired(false, 0);
+      return;
+    }
+    auto start = detail::NowNanos();
+    mutex_.lock();
+    locked_at_ = detail::NowNanos();
+    stats()->Acquired(true, locked_at_ - start);
+  }
+
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    locked_at_ = detail::NowNanos();
+    stats()->Acquired(false, 0);
+    return true;
+  }
+
+  void unlock() {
+    auto held = detail::NowNanos() - locked_at_;
+    mutex_.unlock();
+    stats()->Released(held);
+  }
+
+  void lock_shared() {
+    bool contended = !mutex_.try_lock_shared();
+    uint64_t start = contended ? detail::NowNanos() : 0;
+    if (contended) {
+      mutex_.lock_shared();
+    }
+    auto now = detail::NowNanos();
+    detail::SharedHolds::ThisThread().Push(this, now);
+    stats()->Acquired(contended, contended ? now - start : 0);
+  }
+
+  bool try_lock_shared() {
+    if (!mutex_.try_lock_shared()) {
+      return false;
+    }
+    detail::SharedHolds::ThisThread().Push(this, detail::NowNanos());
+    stats()->Acquired(false, 0);
+    return true;
+  }
+
+  void unlock_shared() {
+    uint64_t since;
+    bool tracked = detail::SharedHolds::ThisThread().Pop(this, &since);
+    auto now = detail::NowNanos();
+    mutex_.unlock_shared();
+    if (tracked) {
+      stats()->Released(now - since);
+    }
+  }
+};
+
+#else
+
+/**
+ * When lock profiling is not compiled in, this is exactly the `Mutex` it wraps.
+ */
+template<typename Mutex>
+class ProfiledMutex : public Mutex {
+ public:
+  explicit ProfiledMutex([[maybe_unused]] std::string_view name = "unnamed") { }
+  void set_name([[maybe_unused]] std::string_view name) { }
+};
+
+#endif // UTILS_LOCK_PROFILING
+
+} // namespace utils
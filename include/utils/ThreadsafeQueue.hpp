@@ -1,5 +1,7 @@
 // Copyright (c) 2016-2020 AlertAvert.com. All rights reserved.
 
+#pragma once
+
 #include <algorithm>
 #include <iostream>
 #include <mutex>
@@ -6,6 +6,11 @@
 
 
 float consistent_hash(const std::string &msg) {
+  uint32_t bits;
+  return consistent_hash(msg, &bits);
+}
+
+float consistent_hash(const std::string &msg, uint32_t *bits) {
   unsigned char* digest;
   unsigned long sum = 0;
 
@@ -13,6 +18,7 @@ float consistent_hash(const std::string &msg) {
   for (int i = 0; i < MD5_DIGEST_LENGTH - 1; i += 2) {
     sum += kBase * (unsigned long) (digest[i] + digest[i+1] * 16);
   }
+  memcpy(bits, digest, sizeof(uint32_t));
   delete[](digest);
 
   return float(sum % kModulo) / kModulo;
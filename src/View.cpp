@@ -14,15 +14,43 @@ void View::Add(const BucketPtr& bucket) {
     return;
   }
 
+  size_t index;
   {
     UniqueLock lk(buckets_mx_);
+    index = AssignIndex(bucket);
     buckets_.insert(bucket);
   }
   UniqueLock lk(partition_map_mx_);
   for (int i = 0; i < bucket->partitions(); i++) {
     float point = bucket->partition_point(i);
-    partition_to_bucket_[point] = bucket;
+    partition_to_bucket_[point] = PartitionOwner{bucket, index};
   }
+  generation_.fetch_add(1, std::memory_order_release);
+}
+
+size_t View::AssignIndex(const BucketPtr& bucket) {
+  auto pos = bucket_index_.find(bucket);
+  if (pos != bucket_index_.end()) {
+    return pos->second;
+  }
+  if (bucket_index_.size() >= kMaxBuckets) {
+    throw std::out_of_range("Cannot index more than " + std::to_string(kMaxBuckets) +
+        " buckets in a View, when adding " + bucket->name());
+  }
+  size_t index = bucket_index_.size();
+  bucket_index_[bucket] = index;
+  return index;
+}
+
+size_t View::IndexOf(const BucketPtr& bucket) {
+  UniqueLock lk(buckets_mx_);
+  return AssignIndex(bucket);
+}
+
+size_t View::FindIndex(const BucketPtr& bucket) const {
+  SharedLock lk(buckets_mx_);
+  auto pos = bucket_index_.find(bucket);
+  return pos != bucket_index_.end() ? pos->second : kMaxBuckets;
 }
 
 bool View::Remove(const BucketPtr& bucket) {
@@ -31,7 +59,8 @@ bool View::Remove(const BucketPtr& bucket) {
   {
     UniqueLock lk(partition_map_mx_);
     for (auto item : bucket->partition_points()) {
-      if (partition_to_bucket_[item] == bucket) {
+      auto pos = partition_to_bucket_.find(item);
+      if (pos != partition_to_bucket_.end() && pos->second.bucket == bucket) {
         auto res = partition_to_bucket_.erase(item);
         if (res > 0) {
           found = true;
@@ -40,6 +69,9 @@ bool View::Remove(const BucketPtr& bucket) {
         }
       }
     }
+    if (found) {
+      generation_.fetch_add(1, std::memory_order_release);
+    }
   }
   // It is possible we were asked to remove a non-existent bucket;
   // in this case, we should not decrement the count.
@@ -53,23 +85,78 @@ bool View::Remove(const BucketPtr& bucket) {
   return found;
 }
 
-BucketPtr View::FindBucket(float hash) const {
+namespace {
+
+void CheckHash(float hash) {
   if (hash < 0.0f || hash > 1.10000001f) {
     throw std::invalid_argument(
         "Hash should always be in the [0, 1] interval, was: " + std::to_string(hash));
   }
+}
+
+// Must be called while holding (at least) a shared lock on the partition map.
+const PartitionOwner &LookupOwner(const MapWithTolerance &partitions, float hash) {
+  auto pos = partitions.upper_bound(hash);
+
+  if (pos == partitions.end()) {
+    return partitions.begin()->second;
+  } else {
+    return pos->second;
+  }
+}
+
+} // namespace
+
+BucketPtr View::FindBucket(float hash) const {
+  CheckHash(hash);
 
   SharedLock lk(partition_map_mx_);
   if (partition_to_bucket_.empty()) {
     throw std::invalid_argument("No buckets in this View");
   }
-  auto pos = partition_to_bucket_.upper_bound(hash);
+  return LookupOwner(partition_to_bucket_, hash).bucket;
+}
 
-  if (pos == partition_to_bucket_.end()) {
-    return partition_to_bucket_.begin()->second;
-  } else {
-    return pos->second;
+std::vector<BucketPtr> View::FindBuckets(const std::vector<float> &hashes) const {
+  std::for_each(hashes.begin(), hashes.end(), CheckHash);
+
+  std::vector<BucketPtr> found;
+  found.reserve(hashes.size());
+
+  SharedLock lk(partition_map_mx_);
+  if (partition_to_bucket_.empty()) {
+    throw std::invalid_argument("No buckets in this View");
+  }
+  for (auto hash : hashes) {
+    found.push_back(LookupOwner(partition_to_bucket_, hash).bucket);
   }
+  return found;
+}
+
+size_t View::FindBucketIndex(float hash) const {
+  CheckHash(hash);
+
+  SharedLock lk(partition_map_mx_);
+  if (partition_to_bucket_.empty()) {
+    throw std::invalid_argument("No buckets in this View");
+  }
+  return LookupOwner(partition_to_bucket_, hash).index;
+}
+
+std::vector<size_t> View::FindBucketIndexes(const std::vector<float> &hashes) const {
+  std::for_each(hashes.begin(), hashes.end(), CheckHash);
+
+  std::vector<size_t> found;
+  found.reserve(hashes.size());
+
+  SharedLock lk(partition_map_mx_);
+  if (partition_to_bucket_.empty()) {
+    throw std::invalid_argument("No buckets in this View");
+  }
+  for (auto hash : hashes) {
+    found.push_back(LookupOwner(partition_to_bucket_, hash).index);
+  }
+  return found;
 }
 
 std::ostream &operator<<(std::ostream &out, const View &view) {
@@ -87,9 +174,35 @@ std::set<BucketPtr> View::buckets() const {
   return buckets_;
 }
 
+size_t View::EstimateSize() const {
+  // The nodes of a `std::map` (or `std::set`) have three pointers and a color, besides their
+  // value; those of a `std::unordered_map` have a pointer to the next node, and the table has a
+  // pointer for each of its buckets.
+  const size_t kTreeNodeHeader = 4 * sizeof(void *);
+  size_t size = sizeof(*this);
+  {
+    SharedLock lk(buckets_mx_);
+    for (const auto &bucket : buckets_) {
+      // The `Bucket` is allocated along with its `shared_ptr` control block.
+      size += kTreeNodeHeader + sizeof(BucketPtr) + sizeof(Bucket) + 2 * sizeof(long) +
+          bucket->partitions() * sizeof(float);
+      if (bucket->name().capacity() > std::string{}.capacity()) {
+        size += bucket->name().capacity() + 1;
+      }
+    }
+    size += bucket_index_.size() * (sizeof(void *) + sizeof(std::pair<BucketPtr, size_t>)) +
+        bucket_index_.bucket_count() * sizeof(void *);
+  }
+  SharedLock lk(partition_map_mx_);
+  size += partition_to_bucket_.size() *
+      (kTreeNodeHeader + sizeof(MapWithTolerance::value_type));
+  return size;
+}
+
 void View::Clear() {
   UniqueLock lk(buckets_mx_);
   partition_to_bucket_.clear();
+  generation_.fetch_add(1, std::memory_order_release);
 }
 
 View::operator json() const {
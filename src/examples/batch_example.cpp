@@ -0,0 +1,107 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "utils/ParseArgs.hpp"
+
+using namespace std;
+using namespace keystore;
+
+using Store = InMemoryKeyStore<std::string, std::string>;
+
+/**
+ * Runs `num_ops` operations against the `store`, in batches of `batch_size` keys.
+ *
+ * @return the throughput, in operations per second
+ */
+double Measure(long num_ops, long batch_size, const std::function<void(long)> &run_batch) {
+  auto starts = std::chrono::steady_clock::now();
+  for (long done = 0; done < num_ops; done += batch_size) {
+    run_batch(done);
+  }
+  auto ends = std::chrono::steady_clock::now();
+  auto usec = std::chrono::duration_cast<std::chrono::microseconds>(ends - starts).count();
+  return usec > 0 ? num_ops * 1e6 / usec : 0;
+}
+
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::utils::ParseArgs parser(argv, argc);
+
+  FLAGS_v = parser.Enabled("verbose") ? 2 : 0;
+  FLAGS_logtostderr = parser.Enabled("verbose");
+
+  int buckets = parser.GetInt("buckets", 5);
+  int partitions = parser.GetInt("partitions", 10);
+  long num_keys = parser.GetInt("values", 1000000);
+  long num_ops = parser.GetInt("ops", 1 << 20);
+
+  utils::PrintVersion("KeyValue Store -- Batched Operations Throughput", RELEASE_STR);
+  if (parser.Enabled("version")) {
+    return EXIT_SUCCESS;
+  }
+
+  std::shared_ptr<View> pv = std::move(make_balanced_view(buckets, partitions));
+  std::unordered_set<std::string> bucket_names;
+  for (int i = 0; i < buckets; ++i) {
+    bucket_names.insert("bucket-" + std::to_string(i));
+  }
+  Store store{"Batch Demo "s + RELEASE_STR, pv, bucket_names};
+
+  for (long i = 0; i < num_keys; ++i) {
+    store.Put(to_string(i), "this is a random value for " + to_string(i));
+  }
+
+  // The keys are generated up front, so that we only measure the store's operations.
+  mt19937 gen(random_device{}());
+  uniform_int_distribution<long> distrib(0, num_keys - 1);
+  std::vector<std::string> keys;
+  keys.reserve(num_ops + 1024);
+  for (long i = 0; i < num_ops + 1024; ++i) {
+    keys.push_back(to_string(distrib(gen)));
+  }
+
+  cout << setw(8) << "batch" << setw(16) << "Get ops/s" << setw(16) << "MultiGet ops/s"
+       << setw(16) << "MultiPut ops/s" << endl;
+  for (long batch_size = 1; batch_size <= 1024; batch_size *= 2) {
+    auto gets = Measure(num_ops, batch_size, [&](long from) {
+      for (long i = from; i < from + batch_size; ++i) {
+        store.Get(keys[i]);
+      }
+    });
+
+    // As for the single `Get`s, the batches are built before the clock starts.
+    std::vector<std::vector<std::string>> batches;
+    for (long from = 0; from < num_ops; from += batch_size) {
+      batches.emplace_back(keys.begin() + from, keys.begin() + from + batch_size);
+    }
+    auto multi_gets = Measure(num_ops, batch_size, [&](long from) {
+      store.MultiGet(batches[from / batch_size]);
+    });
+    batches.clear();
+
+    std::vector<std::vector<std::pair<std::string, std::string>>> items;
+    for (long from = 0; from < num_ops; from += batch_size) {
+      auto &batch = items.emplace_back();
+      batch.reserve(batch_size);
+      for (long i = from; i < from + batch_size; ++i) {
+        batch.emplace_back(keys[i], "updated value for " + keys[i]);
+      }
+    }
+    auto multi_puts = Measure(num_ops, batch_size, [&](long from) {
+      store.MultiPut(items[from / batch_size]);
+    });
+
+    cout << setw(8) << batch_size << fixed << setprecision(0)
+         << setw(16) << gets << setw(16) << multi_gets << setw(16) << multi_puts << endl;
+  }
+
+  return EXIT_SUCCESS;
+}
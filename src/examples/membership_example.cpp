@@ -0,0 +1,410 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/LatencyHistogram.hpp"
+#include "keystore/RebalanceCoordinator.hpp"
+#include "utils/ParseArgs.hpp"
+
+using namespace std;
+using namespace keystore;
+
+using Store = InMemoryKeyStore<std::string, std::string>;
+using StorePtr = std::shared_ptr<Store>;
+
+long ElapsedMsec(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - since).count();
+}
+
+std::vector<int> ParseList(const std::string &list) {
+  std::vector<int> values;
+  std::istringstream in{list};
+  std::string value;
+  while (std::getline(in, value, ',')) {
+    values.push_back(std::stoi(value));
+  }
+  return values;
+}
+
+/**
+ * @return `partitions` random points on the ring, none of which is too close to any of the
+ *    `taken` ones (which the new points are added to): the `View` considers points closer than
+ *    `FloatLessWithTolerance` to be the same, and the bucket added last would take the point over
+ */
+std::vector<float> RandomPoints(int partitions, mt19937 &gen, std::set<float> &taken) {
+  const float kMinDistance = 1e-4;
+  uniform_real_distribution<float> distrib(0.0, 1.0);
+  std::vector<float> points;
+  while (points.size() < static_cast<size_t>(partitions)) {
+    auto point = distrib(gen);
+    auto next = taken.lower_bound(point - kMinDistance);
+    if (next == taken.end() || *next > point + kMinDistance) {
+      points.push_back(point);
+      taken.insert(point);
+    }
+  }
+  return points;
+}
+
+std::set<float> PointsOf(const View &view) {
+  std::set<float> points;
+  for (const auto &bucket : view.buckets()) {
+    for (auto point : bucket->partition_points()) {
+      points.insert(point);
+    }
+  }
+  return points;
+}
+
+/**
+ * @return a `View` with `buckets` buckets, whose partition points are either evenly spaced
+ *    around the ring (see `make_balanced_view()`) or random, as they would be if each bucket
+ *    was created independently
+ */
+std::shared_ptr<View> MakeView(const std::string &placement, int buckets, int partitions,
+                               mt19937 &gen) {
+  if (placement == "balanced") {
+    return make_balanced_view(buckets, partitions);
+  }
+  if (placement != "random") {
+    throw std::invalid_argument("Unknown placement: '" + placement + "'");
+  }
+  auto pv = std::make_shared<View>();
+  std::set<float> taken;
+  for (int i = 0; i < buckets; ++i) {
+    pv->Add(std::make_shared<Bucket>("bucket-" + std::to_string(i),
+                                     RandomPoints(partitions, gen, taken)));
+  }
+  return pv;
+}
+
+/**
+ * A set of stores (the "nodes" of a cluster, all in this process) sharing the same `View`, and
+ * the routing table that the clients use to find the store which owns each bucket.
+ */
+class Cluster {
+ public:
+  Cluster(std::shared_ptr<View> view, int nodes) : view_{std::move(view)} {
+    std::vector<std::unordered_set<std::string>> owned(nodes);
+    size_t i = 0;
+    for (const auto &bucket : view_->buckets()) {
+      owned[i++ % nodes].insert(bucket->name());
+    }
+    for (int i = 0; i < nodes; ++i) {
+      stores_.push_back(std::make_shared<Store>("node-" + std::to_string(i), view_, owned[i]));
+    }
+    for (const auto &store : stores_) {
+      for (const auto &bucket : store->buckets()) {
+        owners_[bucket->name()] = store;
+      }
+    }
+  }
+
+  const std::shared_ptr<View> &view() const { return view_; }
+  const std::vector<StorePtr> &stores() const { return stores_; }
+
+  StorePtr AddNode() {
+    auto store = std::make_shared<Store>("node-" + std::to_string(stores_.size()), view_,
+                                         std::unordered_set<std::string>{});
+    stores_.push_back(store);
+    return store;
+  }
+
+  StorePtr OwnerOf(const BucketPtr &bucket) const {
+    std::shared_lock<std::shared_mutex> lk(mx_);
+    auto pos = owners_.find(bucket->name());
+    return pos == owners_.end() ? nullptr : pos->second;
+  }
+
+  StorePtr OwnerOf(const std::string &key) const {
+    return OwnerOf(view_->FindBucket(HashKey(key)));
+  }
+
+  void Assign(const BucketPtr &bucket, StorePtr store) {
+    std::unique_lock<std::shared_mutex> lk(mx_);
+    owners_[bucket->name()] = std::move(store);
+  }
+
+  void Unassign(const BucketPtr &bucket) {
+    std::unique_lock<std::shared_mutex> lk(mx_);
+    owners_.erase(bucket->name());
+  }
+
+ private:
+  std::shared_ptr<View> view_;
+  std::vector<StorePtr> stores_;
+  mutable std::shared_mutex mx_;
+  std::unordered_map<std::string, StorePtr> owners_;
+};
+
+/**
+ * Foreground traffic (90% reads, 10% updates, of keys chosen uniformly) sent to the cluster by
+ * `clients` threads, at a fixed total rate, while the buckets are moved: the latencies are
+ * recorded separately before (the baseline) and during the move.
+ */
+class Traffic {
+ public:
+  enum Phase { kBaseline = 0, kMoving = 1 };
+
+  Traffic(const Cluster &cluster, const std::vector<std::string> &keys, int clients, long rate)
+      : cluster_{cluster}, keys_{keys} {
+    for (int i = 0; i < clients; ++i) {
+      threads_.emplace_back(&Traffic::Run, this, i, rate > 0 ? 1e9 * clients / rate : 0);
+    }
+  }
+
+  ~Traffic() { Stop(); }
+
+  void SetPhase(Phase phase) { phase_ = phase; }
+
+  void Stop() {
+    stop_ = true;
+    for (auto &thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+  LatencySnapshot Latencies(Phase phase) const { return latencies_[phase].Snapshot(); }
+  long misses(Phase phase) const { return misses_[phase]; }
+
+ private:
+  void Run(int client, double interval_nanos) {
+    mt19937 gen(client);
+    uniform_int_distribution<size_t> distrib(0, keys_.size() - 1);
+    auto next = std::chrono::steady_clock::now();
+    while (!stop_) {
+      if (interval_nanos > 0) {
+        next += std::chrono::nanoseconds(static_cast<long>(interval_nanos));
+        std::this_thread::sleep_until(next);
+      }
+      const auto &key = keys_[distrib(gen)];
+      auto phase = phase_.load();
+      auto start = ReadClock();
+      auto store = cluster_.OwnerOf(key);
+      bool found = false;
+      if (store) {
+        found = gen() % 10 == 0 ? store->Put(key, key) : store->Get(key).has_value();
+      }
+      latencies_[phase].Record(ReadClock() - start);
+      if (!found) {
+        ++misses_[phase];
+      }
+    }
+  }
+
+  const Cluster &cluster_;
+  const std::vector<std::string> &keys_;
+  std::atomic_bool stop_{false};
+  std::atomic<Phase> phase_{kBaseline};
+  std::array<LatencyHistogram, 2> latencies_;
+  std::array<std::atomic_long, 2> misses_{};
+  std::vector<std::thread> threads_;
+};
+
+/**
+ * The keys (and their estimated size, in bytes) which belong to any of the `buckets`: moving
+ * exactly these is the least a membership change involving those buckets can do.
+ */
+std::pair<long, long> MustMove(const View &view, const std::vector<std::string> &keys,
+                               const std::string &value, const std::set<BucketPtr> &buckets) {
+  long count = 0;
+  long bytes = 0;
+  for (const auto &key : keys) {
+    if (buckets.count(view.FindBucket(HashKey(key))) > 0) {
+      ++count;
+      bytes += EstimateSize(key) + EstimateSize(value);
+    }
+  }
+  return {count, bytes};
+}
+
+struct Outcome {
+  long keys_moved = 0;
+  long bytes_moved = 0;
+  long keys_failed = 0;
+  long msec = 0;
+};
+
+Outcome Summarize(const std::vector<BucketMoveResult> &results, long msec) {
+  Outcome outcome;
+  outcome.msec = msec;
+  for (const auto &result : results) {
+    outcome.keys_moved += result.progress.keys_moved;
+    outcome.bytes_moved += result.progress.bytes_moved;
+    outcome.keys_failed += result.progress.keys_failed;
+    if (!result.success()) {
+      LOG(ERROR) << "Could not move the data out of bucket " << result.progress.bucket << ": "
+                 << result.error;
+    }
+  }
+  return outcome;
+}
+
+/**
+ * Measures the cost of membership changes in a cluster of `--nodes` stores (4, by default)
+ * sharing a `View` with `--buckets` buckets (12, by default) and holding `--values` keys: first
+ * a new node joins, with a new bucket, and the buckets it takes over ranges of the ring from are
+ * rebalanced; then one of the original buckets is removed, and its data moved to the stores
+ * which now own its ranges.
+ *
+ * <p>For each change, it reports the keys and bytes moved, compared with the minimum (the keys
+ * which belong to the new, or removed, bucket) and the ideal (the share of the keys that a
+ * bucket would own, if the ring was perfectly balanced); how long the move took; and the
+ * latency of the foreground traffic (`--clients` threads, sending `--rate` operations per second
+ * in total) before and during the move, along with how many reads missed (the keys of the new
+ * bucket are not found, until they have been moved).
+ *
+ * <p>The runs are repeated for each number of partitions per bucket (`--partitions`, a
+ * comma-separated list) and for both placements of the partition points on the ring (evenly
+ * spaced, or random; `--placement=balanced,random`).
+ */
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::utils::ParseArgs parser(argv, argc);
+
+  FLAGS_v = parser.Enabled("verbose") ? 2 : 0;
+  FLAGS_logtostderr = parser.Enabled("verbose");
+
+  int buckets = parser.GetInt("buckets", 12);
+  int nodes = parser.GetInt("nodes", 4);
+  auto partition_counts = ParseList(parser.Get("partitions", "1,5,20"));
+  auto placements_list = parser.Get("placement", "balanced,random");
+  long num_keys = parser.GetInt("values", 1000000);
+  int value_size = parser.GetInt("value-size", 100);
+  int clients = parser.GetInt("clients", 2);
+  long rate = parser.GetInt("rate", 20000);
+  long baseline_msec = parser.GetInt("baseline-msec", 1000);
+  int concurrency = parser.GetInt("concurrency", 4);
+
+  utils::PrintVersion("KeyValue Store -- Membership Changes Cost", RELEASE_STR);
+  if (parser.Enabled("version")) {
+    return EXIT_SUCCESS;
+  }
+
+  std::vector<std::string> placements;
+  std::istringstream in{placements_list};
+  for (std::string placement; std::getline(in, placement, ',');) {
+    placements.push_back(placement);
+  }
+
+  std::vector<std::string> keys;
+  keys.reserve(num_keys);
+  for (long i = 0; i < num_keys; ++i) {
+    keys.push_back("key-" + to_string(i));
+  }
+  const std::string value(value_size, 'x');
+  mt19937 gen(random_device{}());
+
+  cout << setw(9) << "placement" << setw(6) << "parts" << setw(8) << "change"
+       << setw(10) << "moved" << setw(10) << "minimum" << setw(10) << "ideal"
+       << setw(8) << "MB" << setw(8) << "min MB" << setw(8) << "msec"
+       << setw(10) << "base p99" << setw(10) << "move p99" << setw(8) << "misses" << endl;
+
+  auto report = [&](const std::string &placement, int partitions, const std::string &change,
+                    const Outcome &outcome, std::pair<long, long> minimum, long ideal,
+                    const Traffic &traffic) {
+    auto p99_usec = [&](Traffic::Phase phase) {
+      return traffic.Latencies(phase).ValueAt(99.0) / 1000;
+    };
+    cout << setw(9) << placement << setw(6) << partitions << setw(8) << change
+         << setw(10) << outcome.keys_moved << setw(10) << minimum.first << setw(10) << ideal
+         << fixed << setprecision(1) << setw(8) << outcome.bytes_moved / 1e6
+         << setw(8) << minimum.second / 1e6 << setw(8) << outcome.msec
+         << setw(10) << p99_usec(Traffic::kBaseline) << setw(10) << p99_usec(Traffic::kMoving)
+         << setw(8) << traffic.misses(Traffic::kMoving) << endl;
+    if (outcome.keys_failed > 0) {
+      cout << "  " << outcome.keys_failed << " keys could not be moved" << endl;
+    }
+  };
+
+  for (const auto &placement : placements) {
+    for (auto partitions : partition_counts) {
+      Cluster cluster{MakeView(placement, buckets, partitions, gen), nodes};
+      const auto &pv = cluster.view();
+      for (const auto &key : keys) {
+        cluster.OwnerOf(key)->Put(key, value);
+      }
+
+      // A new node joins, with a new bucket: the buckets it takes over ranges from are
+      // rebalanced, while the clients already route the new bucket's keys to the new node.
+      {
+        Traffic traffic{cluster, keys, clients, rate};
+        std::this_thread::sleep_for(std::chrono::milliseconds(baseline_msec));
+        traffic.SetPhase(Traffic::kMoving);
+
+        auto taken = PointsOf(*pv);
+        auto start = std::chrono::steady_clock::now();
+        auto new_bucket = std::make_shared<Bucket>("bucket-" + std::to_string(buckets),
+                                                   RandomPoints(partitions, gen, taken));
+        std::set<BucketPtr> sources;
+        for (auto point : new_bucket->partition_points()) {
+          sources.insert(pv->FindBucket(point));
+        }
+        auto node = cluster.AddNode();
+        pv->Add(new_bucket);
+        node->AddBucket(new_bucket);
+        cluster.Assign(new_bucket, node);
+
+        RebalanceCoordinator<std::string, std::string> coordinator{
+            static_cast<size_t>(concurrency)};
+        for (const auto &source : sources) {
+          coordinator.Rebalance(cluster.OwnerOf(source), source, node);
+        }
+        auto results = coordinator.Run();
+        auto outcome = Summarize(results, ElapsedMsec(start));
+        traffic.Stop();
+
+        report(placement, partitions, "add", outcome, MustMove(*pv, keys, value, {new_bucket}),
+               num_keys / (buckets + 1), traffic);
+      }
+
+      // One of the original buckets is removed: its data goes to the stores which own the
+      // buckets that take over its ranges.
+      {
+        Traffic traffic{cluster, keys, clients, rate};
+        std::this_thread::sleep_for(std::chrono::milliseconds(baseline_msec));
+
+        BucketPtr victim;
+        for (const auto &bucket : pv->buckets()) {
+          if (bucket->name() == "bucket-0") {
+            victim = bucket;
+          }
+        }
+        auto owner = cluster.OwnerOf(victim);
+        auto minimum = MustMove(*pv, keys, value, {victim});
+        traffic.SetPhase(Traffic::kMoving);
+
+        auto start = std::chrono::steady_clock::now();
+        pv->Remove(victim);
+        std::set<KeyStorePtr<std::string, std::string>> destinations{
+            cluster.stores().begin(), cluster.stores().end()};
+        RebalanceCoordinator<std::string, std::string> coordinator{1};
+        coordinator.RemoveBucket(owner, victim, destinations);
+        auto results = coordinator.Run();
+        auto outcome = Summarize(results, ElapsedMsec(start));
+        cluster.Unassign(victim);
+        traffic.Stop();
+
+        report(placement, partitions, "remove", outcome, minimum, num_keys / (buckets + 1),
+               traffic);
+      }
+    }
+  }
+  cout << "(latencies in usec)" << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "utils/ParseArgs.hpp"
+
+using namespace std;
+using namespace keystore;
+
+using Store = InMemoryKeyStore<std::string, long>;
+
+long ElapsedMsec(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - since).count();
+}
+
+/**
+ * Measures the cost of adding one bucket to a store with `--buckets` buckets (10, by default)
+ * and `--values` keys: the data is moved out of the buckets which the new one takes over a
+ * range of the hash ring from, and only the keys in that range (and those in the tokens around
+ * the partition points) are visited.
+ *
+ * <p>For comparison, it also reports how long it takes to just re-hash all the keys in the
+ * source buckets, which is the minimum cost of a rebalance which scans the whole bucket; and how
+ * long it takes to hand one of the buckets over, as a whole, to another store.
+ */
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::utils::ParseArgs parser(argv, argc);
+
+  FLAGS_v = parser.Enabled("verbose") ? 2 : 0;
+  FLAGS_logtostderr = parser.Enabled("verbose");
+
+  int buckets = parser.GetInt("buckets", 10);
+  int partitions = parser.GetInt("partitions", 5);
+  long num_keys = parser.GetInt("values", 5000000);
+
+  utils::PrintVersion("KeyValue Store -- Rebalance Cost", RELEASE_STR);
+  if (parser.Enabled("version")) {
+    return EXIT_SUCCESS;
+  }
+
+  std::shared_ptr<View> pv = std::move(make_balanced_view(buckets, partitions));
+  std::unordered_set<std::string> bucket_names;
+  for (int i = 0; i < buckets; ++i) {
+    bucket_names.insert("bucket-" + std::to_string(i));
+  }
+  auto store = std::make_shared<Store>("Rebalance Demo "s + RELEASE_STR, pv, bucket_names);
+
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < num_keys; ++i) {
+    store->Put("key-" + to_string(i), i);
+  }
+  cout << "Stored " << num_keys << " keys in " << buckets << " buckets in "
+       << ElapsedMsec(start) << " msec" << endl;
+
+  // The new bucket's partition points are random, as they would be for a new node.
+  mt19937 gen(random_device{}());
+  uniform_real_distribution<float> distrib(0.0, 1.0);
+  std::vector<float> points;
+  for (int i = 0; i < partitions; ++i) {
+    points.push_back(distrib(gen));
+  }
+  auto new_bucket = std::make_shared<Bucket>("bucket-" + std::to_string(buckets), points);
+  std::set<BucketPtr> sources;
+  for (auto point : new_bucket->partition_points()) {
+    sources.insert(pv->FindBucket(point));
+  }
+
+  std::map<std::string, long> sizes;
+  auto stats = store->Stats();
+  for (const auto &bucket : stats["buckets"]) {
+    sizes[bucket["name"].get<std::string>()] = bucket["size"].get<long>();
+  }
+
+  // The lower bound for a full scan: hashing (only) all the keys in the source buckets.
+  std::vector<std::string> source_keys;
+  for (long i = 0; i < num_keys; ++i) {
+    auto key = "key-" + to_string(i);
+    if (sources.count(pv->FindBucket(HashKey(key))) > 0) {
+      source_keys.push_back(std::move(key));
+    }
+  }
+  start = std::chrono::steady_clock::now();
+  long in_sources = 0;
+  for (const auto &key : source_keys) {
+    in_sources += sources.count(pv->FindBucket(HashKey(key)));
+  }
+  auto full_scan_msec = ElapsedMsec(start);
+
+  pv->Add(new_bucket);
+  store->AddBucket(new_bucket);
+
+  cout << setw(12) << "bucket" << setw(12) << "size" << setw(12) << "scanned"
+       << setw(12) << "moved" << setw(10) << "msec" << endl;
+  long moved = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto &source : sources) {
+    auto bucket_start = std::chrono::steady_clock::now();
+    auto progress = store->Rebalance(source, store, RebalanceOptions{});
+    if (!progress.complete) {
+      LOG(ERROR) << "Could not rebalance bucket " << source->name();
+      return EXIT_FAILURE;
+    }
+    moved += progress.keys_moved;
+    cout << setw(12) << source->name() << setw(12) << sizes[source->name()]
+         << setw(12) << progress.keys_scanned << setw(12) << progress.keys_moved
+         << setw(10) << ElapsedMsec(bucket_start) << endl;
+  }
+  auto rebalance_msec = ElapsedMsec(start);
+
+  cout << "Moved " << moved << " keys (" << fixed << setprecision(2)
+       << 100.0 * moved / num_keys << "% of the total) in " << rebalance_msec << " msec" << endl
+       << "Hashing the " << in_sources << " keys in the source buckets takes " << full_scan_msec
+       << " msec" << endl;
+
+  // Handing a whole bucket over to another store, in the same process, copies none of its data.
+  Store other{"Other Store", pv, {}};
+  auto handed_over = *sources.begin();
+  start = std::chrono::steady_clock::now();
+  if (!store->TransferBucket(handed_over, other)) {
+    LOG(ERROR) << "Could not hand over bucket " << handed_over->name();
+    return EXIT_FAILURE;
+  }
+  auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  cout << "Handed over bucket " << handed_over->name() << " ("
+       << other.Stats()["tot_elem_counts"] << " keys) to another store in " << usec << " usec"
+       << endl;
+
+  return EXIT_SUCCESS;
+}
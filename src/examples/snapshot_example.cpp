@@ -0,0 +1,92 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "utils/ParseArgs.hpp"
+
+using namespace std;
+using namespace keystore;
+
+using Store = InMemoryKeyStore<std::string, std::string>;
+
+long ElapsedMsec(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - since).count();
+}
+
+void Report(const std::string &what, const std::vector<SnapshotStats> &results, long msec) {
+  unsigned long entries = 0, bytes = 0;
+  for (const auto &result : results) {
+    if (!result.error.empty()) {
+      LOG(ERROR) << what << " " << result.path << " failed: " << result.error;
+    }
+    entries += result.entries;
+    bytes += result.bytes;
+  }
+  cout << setw(10) << what << setw(12) << entries << setw(12) << bytes / (1024 * 1024)
+       << setw(10) << msec << setw(10) << fixed << setprecision(2)
+       << (msec > 0 ? bytes / 1e6 / msec : 0.0) << endl;
+}
+
+/**
+ * Measures how fast a store with `--buckets` buckets (10, by default) and `--values` keys (each
+ * with a `--value_size` bytes value) can be saved to per-bucket snapshots in `--dir`, and
+ * restored from them into an empty store.
+ */
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::utils::ParseArgs parser(argv, argc);
+
+  FLAGS_v = parser.Enabled("verbose") ? 2 : 0;
+  FLAGS_logtostderr = parser.Enabled("verbose");
+
+  int buckets = parser.GetInt("buckets", 10);
+  long num_keys = parser.GetInt("values", 5000000);
+  int value_size = parser.GetInt("value_size", 100);
+  std::string dir = parser.Get("dir", "/tmp/snapshot_demo");
+
+  utils::PrintVersion("KeyValue Store -- Snapshots", RELEASE_STR);
+  if (parser.Enabled("version")) {
+    return EXIT_SUCCESS;
+  }
+
+  std::shared_ptr<View> pv = std::move(make_balanced_view(buckets, 5));
+  std::unordered_set<std::string> bucket_names;
+  for (int i = 0; i < buckets; ++i) {
+    bucket_names.insert("bucket-" + std::to_string(i));
+  }
+  Store store{"Snapshot Demo "s + RELEASE_STR, pv, bucket_names};
+
+  auto start = std::chrono::steady_clock::now();
+  std::string value(value_size, 'x');
+  for (long i = 0; i < num_keys; ++i) {
+    store.Put("key-" + to_string(i), value);
+  }
+  cout << "Stored " << num_keys << " keys in " << buckets << " buckets in "
+       << ElapsedMsec(start) << " msec" << endl;
+
+  std::filesystem::create_directories(dir);
+  cout << setw(10) << "" << setw(12) << "entries" << setw(12) << "MB"
+       << setw(10) << "msec" << setw(10) << "GB/s" << endl;
+
+  start = std::chrono::steady_clock::now();
+  auto saved = store.SnapshotAll(dir);
+  Report("snapshot", saved, ElapsedMsec(start));
+
+  Store restored{"Restored", pv, bucket_names};
+  start = std::chrono::steady_clock::now();
+  auto loaded = restored.RestoreAll(dir);
+  Report("restore", loaded, ElapsedMsec(start));
+
+  if (restored.Get("key-0") != store.Get("key-0")) {
+    LOG(ERROR) << "The restored data does not match the original";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/BloomFilter.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace keystore {
+
+namespace {
+
+// The keys' hashes are mixed again, as (e.g., for integer keys) their upper bits are not very
+// random; all the probes are derived from the one mixed hash ("double hashing").
+inline uint64_t Mix(uint64_t hash) {
+  hash ^= hash >> 33U;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33U;
+  hash *= 0xc4ceb9fe1a85ec53UL;
+  return hash ^ (hash >> 33U);
+}
+
+} // namespace
+
+BloomFilter::BloomFilter(size_t keys, size_t bits_per_key) {
+  // The optimal number of probes is ln(2) * bits_per_key.
+  probes_ = static_cast<uint8_t>(std::clamp(std::lround(bits_per_key * 0.69), 1L, 30L));
+  bits_ = std::max<size_t>(64, keys * bits_per_key);
+  bits_ = (bits_ + 7) / 8 * 8;
+  data_.assign(bits_ / 8, '\0');
+  data_.push_back(static_cast<char>(probes_));
+}
+
+BloomFilter::BloomFilter(std::string data) : data_{std::move(data)} {
+  if (data_.empty()) {
+    data_.push_back('\0');
+  }
+  bits_ = (data_.size() - 1) * 8;
+  probes_ = static_cast<uint8_t>(data_.back());
+}
+
+void BloomFilter::Add(uint64_t hash) {
+  auto h = Mix(hash);
+  auto delta = (h >> 33U) | (h << 31U);
+  for (uint8_t i = 0; i < probes_; ++i) {
+    auto bit = h % bits_;
+    data_[bit / 8] = static_cast<char>(data_[bit / 8] | (1U << (bit % 8)));
+    h += delta;
+  }
+}
+
+bool BloomFilter::MayContain(uint64_t hash) const {
+  if (bits_ == 0) {
+    return true;
+  }
+  auto h = Mix(hash);
+  auto delta = (h >> 33U) | (h << 31U);
+  for (uint8_t i = 0; i < probes_; ++i) {
+    auto bit = h % bits_;
+    if ((data_[bit / 8] & (1U << (bit % 8))) == 0) {
+      return false;
+    }
+    h += delta;
+  }
+  return true;
+}
+
+} // namespace keystore
@@ -0,0 +1,119 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/CountMinSketch.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace keystore {
+
+namespace {
+
+constexpr size_t kDepth = CountMinSketch::kDepth;
+
+// Seeds for each of the rows' hash functions (from the SplitMix64 generator).
+const uint64_t kSeeds[kDepth] = {
+    0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL, 0x94D049BB133111EBULL, 0xD6E8FEB86659FD93ULL
+};
+
+uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+} // namespace
+
+template<typename Counter, Counter MaxCount>
+BasicCountMinSketch<Counter, MaxCount>::BasicCountMinSketch(size_t width,
+                                                            unsigned long sample_size) :
+    width_{1} {
+  while (width_ < width) {
+    width_ <<= 1;
+  }
+  sample_size_ = sample_size > 0 ? sample_size : 10 * width_;
+  counters_.reset(new std::atomic<Counter>[kDepth * width_]());
+}
+
+template<typename Counter, Counter MaxCount>
+size_t BasicCountMinSketch<Counter, MaxCount>::Index(uint64_t hash, size_t row) const {
+  return row * width_ + (Mix(hash + kSeeds[row]) & (width_ - 1));
+}
+
+template<typename Counter, Counter MaxCount>
+Counter BasicCountMinSketch<Counter, MaxCount>::Increment(uint64_t hash) {
+  Counter estimate = kMaxCount;
+  for (size_t row = 0; row < kDepth; ++row) {
+    auto &counter = counters_[Index(hash, row)];
+    auto count = counter.load(std::memory_order_relaxed);
+    while (count < kMaxCount &&
+           !counter.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) { }
+    // On success, `count` is still the value before the increment.
+    estimate = std::min(estimate, count < kMaxCount ? static_cast<Counter>(count + 1) : count);
+  }
+  // Not aging the counters also spares all the threads updating the same `additions_`.
+  if (sample_size_ != kNoAging) {
+    auto additions = additions_.fetch_add(1, std::memory_order_relaxed) + 1;
+    // Only the thread which resets the count halves the counters: others which crossed the
+    // threshold at the same time would otherwise halve them again.
+    if (additions >= sample_size_ &&
+        additions_.compare_exchange_strong(additions, 0, std::memory_order_relaxed)) {
+      Halve();
+    }
+  }
+  return estimate;
+}
+
+template<typename Counter, Counter MaxCount>
+Counter BasicCountMinSketch<Counter, MaxCount>::Estimate(uint64_t hash) const {
+  Counter estimate = kMaxCount;
+  for (size_t row = 0; row < kDepth; ++row) {
+    estimate = std::min(estimate, counters_[Index(hash, row)].load(std::memory_order_relaxed));
+  }
+  return estimate;
+}
+
+template<typename Counter, Counter MaxCount>
+void BasicCountMinSketch<Counter, MaxCount>::Age() {
+  additions_.store(0, std::memory_order_relaxed);
+  Halve();
+}
+
+template<typename Counter, Counter MaxCount>
+void BasicCountMinSketch<Counter, MaxCount>::Halve() {
+  for (size_t i = 0; i < kDepth * width_; ++i) {
+    counters_[i].store(counters_[i].load(std::memory_order_relaxed) / 2,
+                       std::memory_order_relaxed);
+  }
+}
+
+template<typename Counter, Counter MaxCount>
+void BasicCountMinSketch<Counter, MaxCount>::Merge(const BasicCountMinSketch &other) {
+  if (other.width_ != width_) {
+    throw std::invalid_argument("Cannot merge sketches of different widths: " +
+                                std::to_string(width_) + " and " + std::to_string(other.width_));
+  }
+  for (size_t i = 0; i < kDepth * width_; ++i) {
+    auto count = counters_[i].load(std::memory_order_relaxed);
+    auto added = other.counters_[i].load(std::memory_order_relaxed);
+    counters_[i].store(added > kMaxCount - count ? kMaxCount : static_cast<Counter>(count + added),
+                       std::memory_order_relaxed);
+  }
+}
+
+template<typename Counter, Counter MaxCount>
+void BasicCountMinSketch<Counter, MaxCount>::Reset() {
+  additions_.store(0, std::memory_order_relaxed);
+  for (size_t i = 0; i < kDepth * width_; ++i) {
+    counters_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+template class BasicCountMinSketch<uint8_t, 15>;
+template class BasicCountMinSketch<uint32_t, UINT32_MAX>;
+
+} // namespace keystore
@@ -0,0 +1,100 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/HyperLogLog.hpp"
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+namespace keystore {
+
+namespace {
+
+// The SplitMix64 finalizer.
+uint64_t Mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// The bias correction constant, as a function of the number of registers `m`.
+double Alpha(size_t m) {
+  switch (m) {
+    case 16:
+      return 0.673;
+    case 32:
+      return 0.697;
+    case 64:
+      return 0.709;
+    default:
+      return 0.7213 / (1.0 + 1.079 / m);
+  }
+}
+
+} // namespace
+
+HyperLogLog::HyperLogLog(unsigned int precision) : precision_{precision} {
+  if (precision < kMinPrecision || precision > kMaxPrecision) {
+    throw std::invalid_argument("HyperLogLog precision must be between " +
+                                std::to_string(kMinPrecision) + " and " +
+                                std::to_string(kMaxPrecision) + ", was: " +
+                                std::to_string(precision));
+  }
+  registers_.reset(new std::atomic_uint8_t[registers()]());
+}
+
+void HyperLogLog::Add(uint64_t hash) {
+  auto x = Mix(hash);
+  auto index = x >> (64 - precision_);
+  // The position of the leftmost 1-bit in the remaining bits (the sentinel bounds the rank).
+  auto rest = (x << precision_) | (uint64_t{1} << (precision_ - 1));
+  auto rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+
+  auto &reg = registers_[index];
+  auto current = reg.load(std::memory_order_relaxed);
+  while (current < rank &&
+         !reg.compare_exchange_weak(current, rank, std::memory_order_relaxed)) { }
+}
+
+double HyperLogLog::Estimate() const {
+  auto m = registers();
+  double sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < m; ++i) {
+    auto rank = registers_[i].load(std::memory_order_relaxed);
+    sum += std::ldexp(1.0, -rank);
+    if (rank == 0) {
+      ++zeros;
+    }
+  }
+  double estimate = Alpha(m) * m * m / sum;
+  // Small ranges are better estimated by Linear Counting, while there still are empty registers.
+  if (estimate <= 2.5 * m && zeros > 0) {
+    estimate = m * std::log(static_cast<double>(m) / zeros);
+  }
+  return estimate;
+}
+
+void HyperLogLog::Merge(const HyperLogLog &other) {
+  if (other.precision_ != precision_) {
+    throw std::invalid_argument("Cannot merge HyperLogLog sketches of different precisions: " +
+                                std::to_string(precision_) + " and " +
+                                std::to_string(other.precision_));
+  }
+  for (size_t i = 0; i < registers(); ++i) {
+    auto rank = other.registers_[i].load(std::memory_order_relaxed);
+    auto current = registers_[i].load(std::memory_order_relaxed);
+    while (current < rank &&
+           !registers_[i].compare_exchange_weak(current, rank, std::memory_order_relaxed)) { }
+  }
+}
+
+void HyperLogLog::Reset() {
+  for (size_t i = 0; i < registers(); ++i) {
+    registers_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+} // namespace keystore
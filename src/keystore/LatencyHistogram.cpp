@@ -0,0 +1,167 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+
+namespace keystore {
+
+double NanosPerTick() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const double nanos_per_tick = []() {
+    auto start = std::chrono::steady_clock::now();
+    auto start_ticks = ReadClock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto ticks = ReadClock() - start_ticks;
+    auto nanos = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+    return ticks > 0 ? nanos / ticks : 1.0;
+  }();
+  return nanos_per_tick;
+#else
+  return 1.0;
+#endif
+}
+
+LatencySnapshot LatencyHistogram::Snapshot(double nanos_per_tick) const {
+  std::vector<uint64_t> counts(kNumBuckets, 0);
+  for (size_t shard = 0; shard < kCounterShards; ++shard) {
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      counts[i] += shards_[shard].counts[i].load(std::memory_order_relaxed);
+    }
+  }
+  return LatencySnapshot{std::move(counts), nanos_per_tick};
+}
+
+void LatencyHistogram::Reset() {
+  for (size_t shard = 0; shard < kCounterShards; ++shard) {
+    for (auto &count : shards_[shard].counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+LatencySnapshot::LatencySnapshot(std::vector<uint64_t> counts, double nanos_per_tick)
+    : counts_{std::move(counts)}, nanos_per_tick_{nanos_per_tick} {
+  for (auto count : counts_) {
+    total_ += count;
+  }
+}
+
+double LatencySnapshot::ValueAt(double percentile) const {
+  if (total_ == 0) {
+    return 0;
+  }
+  // The rank of the value, 1-based: the 0th percentile is the lowest value.
+  auto rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * total_));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  size_t last = 0;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    if (counts_[i] == 0) {
+      continue;
+    }
+    last = i;
+    seen += counts_[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  return LatencyHistogram::HighestValueIn(last) * nanos_per_tick_;
+}
+
+double LatencySnapshot::Mean() const {
+  if (total_ == 0) {
+    return 0;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    sum += static_cast<double>(counts_[i]) * LatencyHistogram::HighestValueIn(i);
+  }
+  return sum / total_ * nanos_per_tick_;
+}
+
+std::string LatencySnapshot::ToText() const {
+  std::ostringstream out;
+  char line[128];
+  std::snprintf(line, sizeof(line), "%12s %14s %10s %14s\n\n",
+                "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+  out << line;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    if (counts_[i] == 0) {
+      continue;
+    }
+    seen += counts_[i];
+    double fraction = static_cast<double>(seen) / total_;
+    double value = LatencyHistogram::HighestValueIn(i) * nanos_per_tick_;
+    if (seen < total_) {
+      std::snprintf(line, sizeof(line), "%12.3f %2.12f %10lu %14.2f\n",
+                    value, fraction, static_cast<unsigned long>(seen), 1.0 / (1.0 - fraction));
+    } else {
+      std::snprintf(line, sizeof(line), "%12.3f %2.12f %10lu\n",
+                    value, fraction, static_cast<unsigned long>(seen));
+    }
+    out << line;
+  }
+  std::snprintf(line, sizeof(line), "#[Mean    = %12.3f, Max         = %12.3f]\n",
+                Mean(), Max());
+  out << line;
+  std::snprintf(line, sizeof(line), "#[Total count = %10lu, Unit        = %12s]\n",
+                static_cast<unsigned long>(total_), "nsec");
+  out << line;
+  return out.str();
+}
+
+void to_json(json &j, const LatencySnapshot &snapshot) {
+  j = {
+      {"samples", snapshot.count()},
+      {"p50", snapshot.ValueAt(50.0)},
+      {"p99", snapshot.ValueAt(99.0)},
+      {"p999", snapshot.ValueAt(99.9)},
+      {"max", snapshot.Max()}
+  };
+}
+
+const char *LatencyOpName(LatencyOp op) {
+  switch (op) {
+    case LatencyOp::kGet:
+      return "get";
+    case LatencyOp::kPut:
+      return "put";
+    case LatencyOp::kRemove:
+      return "remove";
+    case LatencyOp::kFindBucket:
+      return "find_bucket";
+    case LatencyOp::kRebalance:
+      return "rebalance";
+  }
+  return "unknown";
+}
+
+std::string OpLatencies::ToText() const {
+  std::ostringstream out;
+  auto nanos_per_tick = NanosPerTick();
+  for (size_t i = 0; i < kNumLatencyOps; ++i) {
+    auto op = static_cast<LatencyOp>(i);
+    out << "# " << LatencyOpName(op) << "\n" << (*this)[op].Snapshot(nanos_per_tick).ToText()
+        << "\n";
+  }
+  return out.str();
+}
+
+void to_json(json &j, const OpLatencies &latencies) {
+  j = json::object();
+  auto nanos_per_tick = NanosPerTick();
+  for (size_t i = 0; i < kNumLatencyOps; ++i) {
+    auto op = static_cast<LatencyOp>(i);
+    j[LatencyOpName(op)] = latencies[op].Snapshot(nanos_per_tick);
+  }
+}
+
+} // namespace keystore
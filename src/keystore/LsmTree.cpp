@@ -0,0 +1,786 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/LsmTree.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace keystore {
+
+namespace {
+
+constexpr char kTableExtension[] = ".sst";
+constexpr char kTmpExtension[] = ".tmp";
+
+// The memory taken by each entry in a memtable, besides its key and value (roughly, that of a
+// node in the map).
+constexpr size_t kEntryOverhead = 64;
+
+std::string ErrorMessage(const std::string &what, const std::string &path) {
+  return what + " " + path + ": " + strerror(errno);
+}
+
+/**
+ * Iterates over a (frozen) memtable, keeping it alive.
+ */
+template<typename Map>
+class MapIterator : public EntryIterator {
+ public:
+  explicit MapIterator(std::shared_ptr<const Map> map) :
+      map_{std::move(map)}, it_{map_->begin()} { }
+
+  bool Valid() const override { return it_ != map_->end(); }
+  void Next() override { ++it_; }
+
+  uint64_t hash() const override { return it_->first.first; }
+  std::string_view key() const override { return it_->first.second; }
+  std::string_view value() const override {
+    return it_->second ? std::string_view{*it_->second} : std::string_view{};
+  }
+  bool deleted() const override { return !it_->second; }
+
+ private:
+  std::shared_ptr<const Map> map_;
+  typename Map::const_iterator it_;
+};
+
+/**
+ * Merges the entries of the memtables and tables of a tree, keeping them alive.
+ */
+class TreeIterator : public MergingIterator {
+ public:
+  TreeIterator(std::vector<std::unique_ptr<EntryIterator>> sources,
+               std::vector<std::shared_ptr<const void>> pinned) :
+      MergingIterator(std::move(sources)), pinned_{std::move(pinned)} { }
+
+ private:
+  std::vector<std::shared_ptr<const void>> pinned_;
+};
+
+void SyncDir(const std::string &dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+} // namespace
+
+// ============= BackgroundPool =================================
+
+BackgroundPool::BackgroundPool(size_t threads) {
+  for (size_t i = 0; i < std::max(size_t{1}, threads); ++i) {
+    threads_.emplace_back(&BackgroundPool::Run, this);
+  }
+}
+
+BackgroundPool::~BackgroundPool() {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    stopping_ = true;
+  }
+  pending_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void BackgroundPool::Submit(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    jobs_.push_back(std::move(job));
+  }
+  pending_.notify_one();
+}
+
+void BackgroundPool::Run() {
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      pending_.wait(lk, [this]() { return stopping_ || !jobs_.empty(); });
+      if (jobs_.empty()) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    try {
+      job();
+    } catch (const std::exception &e) {
+      LOG(ERROR) << "Background job failed: " << e.what();
+    }
+  }
+}
+
+// ============= LsmTree =================================
+
+struct LsmTree::MemTable {
+  struct Less {
+    using is_transparent = void;
+
+    template<typename A, typename B>
+    bool operator()(const A &a, const B &b) const {
+      return CompareEntries(a.first, a.second, b.first, b.second) < 0;
+    }
+  };
+  using Map = std::map<std::pair<uint64_t, std::string>, std::optional<std::string>, Less>;
+
+  Map entries;
+  size_t bytes = 0;
+  // The last record of the log applied to this table.
+  uint64_t last_lsn = 0;
+
+  /**
+   * @return the entry for the key (which is empty, if the key was removed) or `nullptr` if the
+   *    key is not in this table
+   */
+  const std::optional<std::string> *Find(uint64_t hash, std::string_view key) const {
+    auto it = entries.find(std::pair<uint64_t, std::string_view>{hash, key});
+    return it == entries.end() ? nullptr : &it->second;
+  }
+};
+
+struct LsmTree::Version {
+  // Level 0 is newest first, the others are sorted by `min_hash()`.
+  std::array<std::vector<std::shared_ptr<SSTable>>, kLevels> levels;
+
+  SSTable::Lookup Get(uint64_t hash, std::string_view key, std::string *value) const {
+    for (const auto &table : levels[0]) {
+      auto result = table->Get(hash, key, value);
+      if (result != SSTable::Lookup::kMissing) {
+        return result;
+      }
+    }
+    for (size_t level = 1; level < kLevels; ++level) {
+      const auto &tables = levels[level];
+      // The tables do not overlap: only the last one which starts at, or before, the hash may
+      // contain it.
+      auto it = std::upper_bound(tables.begin(), tables.end(), hash,
+          [](uint64_t h, const std::shared_ptr<SSTable> &table) { return h < table->min_hash(); });
+      if (it != tables.begin() && (*--it)->max_hash() >= hash) {
+        auto result = (*it)->Get(hash, key, value);
+        if (result != SSTable::Lookup::kMissing) {
+          return result;
+        }
+      }
+    }
+    return SSTable::Lookup::kMissing;
+  }
+
+  size_t bytes(size_t level) const {
+    size_t total = 0;
+    for (const auto &table : levels[level]) {
+      total += table->size();
+    }
+    return total;
+  }
+};
+
+LsmTree::LsmTree(const std::string &dir, const LsmOptions &options, BackgroundPool *pool) :
+    dir_{dir}, options_{options}, pool_{pool} {
+  Recover();
+}
+
+LsmTree::~LsmTree() {
+  std::unique_lock<std::shared_mutex> lk(mutex_);
+  stopping_ = true;
+  changed_.wait(lk, [this]() { return !scheduled_; });
+}
+
+void LsmTree::Recover() {
+  std::filesystem::create_directories(dir_);
+  auto version = std::make_shared<Version>();
+  std::unordered_set<std::string> live;
+  auto path = dir_ + "/" + kManifest;
+  if (std::filesystem::exists(path)) {
+    json manifest;
+    try {
+      std::ifstream in(path);
+      in >> manifest;
+      next_file_ = manifest["next_file"].get<uint64_t>();
+      flushed_lsn_ = manifest["flushed_lsn"].get<uint64_t>();
+      const auto &levels = manifest["levels"];
+      for (size_t level = 0; level < std::min(kLevels, levels.size()); ++level) {
+        for (const auto &name : levels[level]) {
+          version->levels[level].push_back(std::make_shared<SSTable>(dir_ + "/" +
+              name.get<std::string>()));
+          live.insert(name.get<std::string>());
+        }
+      }
+    } catch (const json::exception &e) {
+      throw lsm_error("Corrupted manifest " + path + ": " + e.what());
+    }
+  }
+  // The tables (and temporary files) left behind by flushes and compactions which did not
+  // complete.
+  for (const auto &entry : std::filesystem::directory_iterator(dir_)) {
+    auto name = entry.path().filename().string();
+    auto extension = entry.path().extension().string();
+    if ((extension == kTableExtension && live.count(name) == 0) || extension == kTmpExtension) {
+      VLOG(2) << "Deleting " << entry.path() << ", which is not part of the tree";
+      std::filesystem::remove(entry.path());
+    }
+  }
+  version_ = version;
+  memtable_ = std::make_shared<MemTable>();
+
+  WalOptions wal_options;
+  wal_options.dir = dir_;
+  wal_options.sync = options_.sync;
+  wal_options.segment_size = std::max(options_.memtable_size, size_t{1024 * 1024});
+  wal_ = std::make_unique<WriteAheadLog>("wal", wal_options);
+
+  std::unique_lock<std::shared_mutex> lk(mutex_);
+  auto replayed = wal_->Replay(flushed_lsn_, [this](uint64_t lsn, const char *data, size_t size) {
+    LsmRecord record{};
+    if (size < sizeof(record)) {
+      throw lsm_error("Invalid record " + std::to_string(lsn) + " in the log of " + dir_);
+    }
+    memcpy(&record, data, sizeof(record));
+    bool deleted = record.value_size == LsmRecord::kDeleted;
+    if (sizeof(record) + record.key_size + (deleted ? 0 : record.value_size) > size) {
+      throw lsm_error("Invalid record " + std::to_string(lsn) + " in the log of " + dir_);
+    }
+    std::string_view key{data + sizeof(record), record.key_size};
+    std::string_view value{data + sizeof(record) + record.key_size,
+                           deleted ? 0 : record.value_size};
+    ApplyLocked(record.hash, key, deleted ? nullptr : &value, lsn);
+    MaybeRotate();
+  });
+  VLOG(2) << "Opened LSM tree " << dir_ << ", replayed " << replayed << " writes from its log";
+  MaybeSchedule();
+}
+
+uint64_t LsmTree::LogLocked(uint64_t hash, std::string_view key, const std::string_view *value) {
+  thread_local std::string buffer;
+  LsmRecord record{hash, static_cast<uint32_t>(key.size()),
+                   value ? static_cast<uint32_t>(value->size()) : LsmRecord::kDeleted};
+  buffer.assign(reinterpret_cast<const char *>(&record), sizeof(record));
+  buffer.append(key);
+  if (value) {
+    buffer.append(*value);
+  }
+  return wal_->Append(buffer.data(), buffer.size());
+}
+
+void LsmTree::ApplyLocked(uint64_t hash, std::string_view key, const std::string_view *value,
+                          uint64_t lsn) {
+  auto &entries = memtable_->entries;
+  auto it = entries.find(std::pair<uint64_t, std::string_view>{hash, key});
+  if (it == entries.end()) {
+    it = entries.emplace(std::make_pair(hash, std::string{key}), std::nullopt).first;
+    memtable_->bytes += sizeof(LsmRecord) + key.size() + kEntryOverhead;
+  } else if (it->second) {
+    memtable_->bytes -= it->second->size();
+  }
+  if (value) {
+    it->second.emplace(*value);
+    memtable_->bytes += value->size();
+  } else {
+    it->second.reset();
+  }
+  memtable_->last_lsn = lsn;
+}
+
+void LsmTree::CheckError() const {
+  if (!error_.empty()) {
+    throw lsm_error("LSM tree " + dir_ + " failed: " + error_);
+  }
+}
+
+void LsmTree::MakeRoom(std::unique_lock<std::shared_mutex> &lk) {
+  if (immutables_.size() >= kMaxImmutables) {
+    ++stalls_;
+    changed_.wait(lk, [this]() {
+      return immutables_.size() < kMaxImmutables || !error_.empty() || closed_;
+    });
+  }
+  CheckError();
+  if (closed_) {
+    throw lsm_error("LSM tree " + dir_ + " is closed");
+  }
+}
+
+void LsmTree::MaybeRotate(bool force) {
+  if (memtable_->bytes >= options_.memtable_size || (force && !memtable_->entries.empty())) {
+    immutables_.push_back(std::move(memtable_));
+    memtable_ = std::make_shared<MemTable>();
+    MaybeSchedule();
+  }
+}
+
+void LsmTree::MaybeSchedule() {
+  if (scheduled_ || stopping_ || !error_.empty()) {
+    return;
+  }
+  if (!immutables_.empty() || NeedsCompaction(*version_)) {
+    scheduled_ = true;
+    pool_->Submit([this]() { RunBackground(); });
+  }
+}
+
+void LsmTree::Apply(const std::vector<Write> &writes) {
+  uint64_t lsn = 0;
+  {
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    MakeRoom(lk);
+    for (const auto &write : writes) {
+      std::string_view value;
+      if (write.value) {
+        value = *write.value;
+      }
+      lsn = LogLocked(write.hash, write.key, write.value ? &value : nullptr);
+      ApplyLocked(write.hash, write.key, write.value ? &value : nullptr, lsn);
+    }
+    MaybeRotate();
+  }
+  if (lsn > 0) {
+    wal_->Commit(lsn);
+  }
+}
+
+void LsmTree::Put(uint64_t hash, std::string_view key, std::string_view value) {
+  uint64_t lsn;
+  {
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    MakeRoom(lk);
+    lsn = LogLocked(hash, key, &value);
+    ApplyLocked(hash, key, &value, lsn);
+    MaybeRotate();
+  }
+  wal_->Commit(lsn);
+}
+
+bool LsmTree::Remove(uint64_t hash, std::string_view key) {
+  uint64_t lsn;
+  {
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    MakeRoom(lk);
+    // Removing a key which is not found does not write a tombstone for it.
+    const std::optional<std::string> *entry = memtable_->Find(hash, key);
+    for (auto it = immutables_.rbegin(); entry == nullptr && it != immutables_.rend(); ++it) {
+      entry = (*it)->Find(hash, key);
+    }
+    if (entry != nullptr) {
+      if (!*entry) {
+        return false;
+      }
+    } else {
+      std::string value;
+      if (version_->Get(hash, key, &value) != SSTable::Lookup::kFound) {
+        return false;
+      }
+    }
+    lsn = LogLocked(hash, key, nullptr);
+    ApplyLocked(hash, key, nullptr, lsn);
+    MaybeRotate();
+  }
+  wal_->Commit(lsn);
+  return true;
+}
+
+bool LsmTree::Get(uint64_t hash, std::string_view key, std::string *value) const {
+  std::shared_ptr<const Version> version;
+  {
+    std::shared_lock<std::shared_mutex> lk(mutex_);
+    const std::optional<std::string> *entry = memtable_->Find(hash, key);
+    for (auto it = immutables_.rbegin(); entry == nullptr && it != immutables_.rend(); ++it) {
+      entry = (*it)->Find(hash, key);
+    }
+    if (entry != nullptr) {
+      if (*entry) {
+        *value = **entry;
+      }
+      return entry->has_value();
+    }
+    version = version_;
+  }
+  // The tables are immutable, and are read without holding the lock.
+  return version->Get(hash, key, value) == SSTable::Lookup::kFound;
+}
+
+std::unique_ptr<EntryIterator> LsmTree::NewIterator() const {
+  std::vector<std::unique_ptr<EntryIterator>> sources;
+  std::vector<std::shared_ptr<const void>> pinned;
+  std::shared_ptr<const Version> version;
+  {
+    std::shared_lock<std::shared_mutex> lk(mutex_);
+    // The active memtable is copied, as it keeps changing; the frozen ones are not.
+    auto active = std::make_shared<const MemTable::Map>(memtable_->entries);
+    sources.push_back(std::make_unique<MapIterator<MemTable::Map>>(active));
+    for (auto it = immutables_.rbegin(); it != immutables_.rend(); ++it) {
+      std::shared_ptr<const MemTable::Map> entries{*it, &(*it)->entries};
+      sources.push_back(std::make_unique<MapIterator<MemTable::Map>>(entries));
+    }
+    version = version_;
+  }
+  for (const auto &tables : version->levels) {
+    for (const auto &table : tables) {
+      sources.push_back(table->NewIterator());
+    }
+  }
+  pinned.push_back(version);
+  return std::make_unique<TreeIterator>(std::move(sources), std::move(pinned));
+}
+
+void LsmTree::Flush() {
+  std::unique_lock<std::shared_mutex> lk(mutex_);
+  CheckError();
+  MaybeRotate(true);
+  changed_.wait(lk, [this]() { return immutables_.empty() || !error_.empty(); });
+  CheckError();
+}
+
+void LsmTree::Close() {
+  {
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    closed_ = true;
+  }
+  changed_.notify_all();
+}
+
+void LsmTree::Reopen() {
+  std::unique_lock<std::shared_mutex> lk(mutex_);
+  closed_ = false;
+}
+
+void LsmTree::WaitForCompactions() {
+  std::unique_lock<std::shared_mutex> lk(mutex_);
+  changed_.wait(lk, [this]() { return !scheduled_; });
+  CheckError();
+}
+
+bool LsmTree::NeedsCompaction(const Version &version) const {
+  if (version.levels[0].size() >= options_.l0_compaction_trigger) {
+    return true;
+  }
+  for (size_t level = 1; level < kLevels - 1; ++level) {
+    if (version.bytes(level) > MaxBytes(level)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t LsmTree::MaxBytes(size_t level) const {
+  size_t bytes = options_.level_base_size;
+  for (size_t i = 1; i < level; ++i) {
+    bytes *= options_.level_multiplier;
+  }
+  return bytes;
+}
+
+void LsmTree::RunBackground() {
+  try {
+    std::lock_guard<std::mutex> lk(background_mx_);
+    if (!FlushImmutable()) {
+      Compact();
+    }
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Background job for LSM tree " << dir_ << " failed: " << e.what();
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    error_ = e.what();
+  }
+  // Only one unit of work is done at a time, so that the trees share the pool's threads fairly.
+  std::unique_lock<std::shared_mutex> lk(mutex_);
+  scheduled_ = false;
+  MaybeSchedule();
+  changed_.notify_all();
+}
+
+bool LsmTree::FlushImmutable() {
+  std::shared_ptr<MemTable> memtable;
+  {
+    std::shared_lock<std::shared_mutex> lk(mutex_);
+    if (immutables_.empty()) {
+      return false;
+    }
+    memtable = immutables_.front();
+  }
+  MapIterator<MemTable::Map> entries{std::shared_ptr<const MemTable::Map>{memtable,
+                                                                          &memtable->entries}};
+  // The tombstones must be kept, as the older tables may still contain the keys.
+  auto tables = WriteTables(&entries, false, SIZE_MAX);
+  json manifest;
+  {
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    auto version = std::make_shared<Version>(*version_);
+    version->levels[0].insert(version->levels[0].begin(), tables.begin(), tables.end());
+    version_ = version;
+    immutables_.erase(immutables_.begin());
+    flushed_lsn_ = memtable->last_lsn;
+    ++flushes_;
+    manifest = Manifest(*version, flushed_lsn_);
+  }
+  SaveManifest(dir_, manifest);
+  // The log is only needed for the writes which are not yet in a table.
+  wal_->Truncate(memtable->last_lsn);
+  VLOG(2) << "Flushed " << memtable->entries.size() << " entries to level 0 of " << dir_;
+  return true;
+}
+
+bool LsmTree::Compact() {
+  std::shared_ptr<const Version> version;
+  {
+    std::shared_lock<std::shared_mutex> lk(mutex_);
+    version = version_;
+  }
+  size_t level = 0;
+  std::vector<std::shared_ptr<SSTable>> inputs;
+  if (version->levels[0].size() >= options_.l0_compaction_trigger) {
+    inputs = version->levels[0];
+  } else {
+    for (level = 1; level < kLevels - 1; ++level) {
+      if (version->bytes(level) > MaxBytes(level)) {
+        break;
+      }
+    }
+    if (level == kLevels - 1) {
+      return false;
+    }
+    // Round-robin, so that the whole key space is eventually compacted.
+    const auto &tables = version->levels[level];
+    auto it = std::find_if(tables.begin(), tables.end(), [&](const auto &table) {
+      return table->min_hash() > compact_pointer_[level];
+    });
+    inputs.push_back(it == tables.end() ? tables.front() : *it);
+    compact_pointer_[level] = inputs.back()->max_hash();
+  }
+
+  auto min = inputs.front()->min_hash();
+  auto max = inputs.front()->max_hash();
+  for (const auto &table : inputs) {
+    min = std::min(min, table->min_hash());
+    max = std::max(max, table->max_hash());
+  }
+  std::vector<std::shared_ptr<SSTable>> overlaps;
+  for (const auto &table : version->levels[level + 1]) {
+    if (table->Overlaps(min, max)) {
+      overlaps.push_back(table);
+    }
+  }
+  // The tombstones can only be dropped if no older table may still contain the keys.
+  bool bottom = true;
+  for (auto deeper = level + 2; deeper < kLevels && bottom; ++deeper) {
+    for (const auto &table : version->levels[deeper]) {
+      if (table->Overlaps(min, max)) {
+        bottom = false;
+        break;
+      }
+    }
+  }
+
+  std::vector<std::shared_ptr<SSTable>> outputs;
+  if (level > 0 && overlaps.empty()) {
+    // Nothing to merge with: the table is simply moved to the next level.
+    outputs = inputs;
+  } else {
+    // The inputs go first, as they are newer than the tables in the next level.
+    std::vector<std::unique_ptr<EntryIterator>> sources;
+    for (const auto &table : inputs) {
+      sources.push_back(table->NewIterator());
+    }
+    for (const auto &table : overlaps) {
+      sources.push_back(table->NewIterator());
+    }
+    MergingIterator merged{std::move(sources)};
+    outputs = WriteTables(&merged, bottom, options_.table_size);
+  }
+
+  std::unordered_set<const SSTable *> replaced;
+  for (const auto &table : inputs) {
+    replaced.insert(table.get());
+  }
+  for (const auto &table : overlaps) {
+    replaced.insert(table.get());
+  }
+  json manifest;
+  size_t bytes = 0;
+  {
+    std::unique_lock<std::shared_mutex> lk(mutex_);
+    auto next = std::make_shared<Version>(*version_);
+    for (auto l : {level, level + 1}) {
+      auto &tables = next->levels[l];
+      tables.erase(std::remove_if(tables.begin(), tables.end(), [&](const auto &table) {
+        return replaced.count(table.get()) > 0;
+      }), tables.end());
+    }
+    auto &tables = next->levels[level + 1];
+    tables.insert(tables.end(), outputs.begin(), outputs.end());
+    std::sort(tables.begin(), tables.end(), [](const auto &a, const auto &b) {
+      return a->min_hash() < b->min_hash();
+    });
+    for (const auto &table : outputs) {
+      bytes += table->size();
+    }
+    version_ = next;
+    ++compactions_;
+    bytes_compacted_ += bytes;
+    manifest = Manifest(*next, flushed_lsn_);
+  }
+  SaveManifest(dir_, manifest);
+
+  // The tables are still mapped by the readers which use them (and the files are only actually
+  // deleted once they are all done).
+  std::unordered_set<const SSTable *> kept;
+  for (const auto &table : outputs) {
+    kept.insert(table.get());
+  }
+  for (const auto *table : replaced) {
+    if (kept.count(table) == 0) {
+      unlink(table->path().c_str());
+    }
+  }
+  VLOG(2) << "Compacted " << inputs.size() << " tables from level " << level << " and "
+          << overlaps.size() << " from level " << level + 1 << " of " << dir_ << " into "
+          << outputs.size() << " tables (" << bytes << " bytes)";
+  return true;
+}
+
+std::vector<std::shared_ptr<SSTable>> LsmTree::WriteTables(EntryIterator *entries,
+                                                           bool drop_deleted, size_t table_size) {
+  std::vector<std::shared_ptr<SSTable>> tables;
+  std::unique_ptr<SSTableWriter> writer;
+  std::string path;
+  uint64_t last_hash = 0;
+  auto finish = [&]() {
+    writer->Finish();
+    writer.reset();
+    tables.push_back(std::make_shared<SSTable>(path));
+  };
+  for (; entries->Valid(); entries->Next()) {
+    if (drop_deleted && entries->deleted()) {
+      continue;
+    }
+    // All the entries with the same hash go to the same table, so that the tables (in levels
+    // from 1) do not overlap.
+    if (writer && writer->size() >= table_size && entries->hash() != last_hash) {
+      finish();
+    }
+    if (!writer) {
+      path = TablePath(next_file_++);
+      writer = std::make_unique<SSTableWriter>(path, options_.block_size,
+                                               options_.bloom_bits_per_key);
+    }
+    writer->Add(entries->hash(), entries->key(), entries->value(), entries->deleted());
+    last_hash = entries->hash();
+  }
+  if (writer) {
+    finish();
+  }
+  return tables;
+}
+
+std::string LsmTree::TablePath(uint64_t number) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%06lu%s", number, kTableExtension);
+  return dir_ + "/" + name;
+}
+
+json LsmTree::Manifest(const Version &version, uint64_t flushed_lsn) const {
+  json levels = json::array();
+  for (const auto &tables : version.levels) {
+    json names = json::array();
+    for (const auto &table : tables) {
+      names.push_back(table->filename());
+    }
+    levels.push_back(names);
+  }
+  return {
+      {"next_file", next_file_.load()},
+      {"flushed_lsn", flushed_lsn},
+      {"levels", levels}
+  };
+}
+
+void LsmTree::SaveManifest(const std::string &dir, const json &manifest) {
+  auto path = dir + "/" + kManifest;
+  auto tmp_path = path + kTmpExtension;
+  auto data = manifest.dump();
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw lsm_error(ErrorMessage("Cannot create", tmp_path));
+  }
+  bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) &&
+      fdatasync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw lsm_error(ErrorMessage("Cannot write", path));
+  }
+  SyncDir(dir);
+}
+
+std::vector<std::string> LsmTree::Checkpoint(const std::string &dir) {
+  if (std::filesystem::exists(dir)) {
+    throw lsm_error("Cannot checkpoint " + dir_ + " to " + dir + ", which already exists");
+  }
+  Flush();
+  // No tables are deleted while they are linked.
+  std::lock_guard<std::mutex> bg(background_mx_);
+  std::shared_ptr<const Version> version;
+  {
+    std::shared_lock<std::shared_mutex> lk(mutex_);
+    version = version_;
+  }
+  std::filesystem::create_directories(dir);
+  std::vector<std::string> files;
+  for (const auto &tables : version->levels) {
+    for (const auto &table : tables) {
+      auto target = dir + "/" + table->filename();
+      if (link(table->path().c_str(), target.c_str()) != 0) {
+        std::filesystem::copy_file(table->path(), target);
+      }
+      files.push_back(target);
+    }
+  }
+  // There is no log in the copy.
+  SaveManifest(dir, Manifest(*version, 0));
+  files.push_back(dir + "/" + kManifest);
+  return files;
+}
+
+json LsmTree::Stats() const {
+  std::shared_lock<std::shared_mutex> lk(mutex_);
+  json levels = json::array();
+  for (size_t level = 0; level < kLevels; ++level) {
+    uint64_t entries = 0;
+    for (const auto &table : version_->levels[level]) {
+      entries += table->entries();
+    }
+    levels.push_back({
+        {"tables", version_->levels[level].size()},
+        {"bytes", version_->bytes(level)},
+        {"entries", entries}
+    });
+  }
+  json stats = {
+      {"dir", dir_},
+      {"memtable_bytes", memtable_->bytes},
+      {"immutables", immutables_.size()},
+      {"flushed_lsn", flushed_lsn_},
+      {"flushes", flushes_},
+      {"compactions", compactions_},
+      {"bytes_compacted", bytes_compacted_},
+      {"stalls", stalls_},
+      {"levels", levels},
+      {"wal", wal_->Stats()}
+  };
+  if (!error_.empty()) {
+    stats["error"] = error_;
+  }
+  return stats;
+}
+
+} // namespace keystore
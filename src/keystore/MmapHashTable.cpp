@@ -0,0 +1,415 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/MmapHashTable.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "keystore/HashedKey.hpp"
+
+namespace keystore {
+
+namespace {
+
+constexpr char kMagic[8] = {'D', 'L', 'H', 'T', '0', '0', '0', '1'};
+
+// The `offset` of the slots which were never used, and of those whose entry was removed (which
+// do not stop a probe).
+constexpr uint64_t kEmpty = 0;
+constexpr uint64_t kRemoved = 1;
+
+constexpr size_t kHeaderSize = 4096;
+constexpr size_t kSizeClasses = 48;
+constexpr size_t kMinBlockSize = 32;
+// The file grows in multiples of this.
+constexpr size_t kFileIncrement = 64 * 1024;
+
+// How many slots of the old array each write moves to the new one, while rehashing: enough that
+// the rehash completes well before the new array needs to grow.
+constexpr size_t kRehashStep = 16;
+
+// Precedes the key and value of each entry, in the heap.
+struct Record {
+  // The size of the block the record was allocated in.
+  uint64_t capacity;
+  uint32_t key_size;
+  uint32_t value_size;
+};
+
+// The power of two blocks of `size` bytes are allocated in.
+size_t SizeClass(uint64_t size) {
+  size = std::max<uint64_t>(size, kMinBlockSize);
+  return 64 - __builtin_clzl(size - 1);
+}
+
+std::string ErrorMessage(const std::string &what, const std::string &path) {
+  return what + " " + path + ": " + strerror(errno);
+}
+
+} // namespace
+
+struct MmapHashTable::Header {
+  char magic[8];
+  // Where the next block will be allocated (the end of the heap).
+  uint64_t heap_end;
+  uint64_t count;
+  // The slots marked as removed, in the current array.
+  uint64_t removed;
+  uint64_t slots;
+  uint64_t capacity;
+  // Only set while rehashing: the entries in the old array, before `rehash_cursor`, have all
+  // been moved to the current one.
+  uint64_t old_slots;
+  uint64_t old_capacity;
+  uint64_t rehash_cursor;
+  // The heads of the lists of free blocks, for each size class.
+  uint64_t free_lists[kSizeClasses];
+  uint64_t free_bytes;
+};
+
+struct MmapHashTable::Slot {
+  uint64_t hash;
+  // Of the entry's `Record`, or `kEmpty` (or `kRemoved`).
+  uint64_t offset;
+};
+
+MmapHashTable::MmapHashTable(const std::string &path, size_t initial_capacity) : path_{path} {
+  static_assert(sizeof(Header) <= kHeaderSize);
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw mmap_error(ErrorMessage("Cannot open", path));
+  }
+  struct stat st{};
+  if (fstat(fd_, &st) != 0) {
+    close(fd_);
+    throw mmap_error(ErrorMessage("Cannot stat", path));
+  }
+  if (st.st_size == 0) {
+    uint64_t capacity = 16;
+    while (capacity * 3 / 4 < initial_capacity) {
+      capacity *= 2;
+    }
+    auto size = kHeaderSize + capacity * sizeof(Slot) + kFileIncrement;
+    Resize(size / kFileIncrement * kFileIncrement);
+    auto *h = header();
+    memcpy(h->magic, kMagic, sizeof(kMagic));
+    h->heap_end = kHeaderSize;
+    auto slots = Allocate(capacity * sizeof(Slot));
+    h = header();
+    h->slots = slots;
+    h->capacity = capacity;
+    return;
+  }
+  // Opening an existing table only maps it.
+  Map(st.st_size);
+  if (size_ < kHeaderSize || memcmp(header()->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header()->heap_end > size_) {
+    munmap(data_, size_);
+    close(fd_);
+    throw mmap_error("Not a valid hash table: " + path);
+  }
+}
+
+MmapHashTable::~MmapHashTable() {
+  if (data_ != nullptr) {
+    msync(data_, size_, MS_SYNC);
+    munmap(data_, size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void MmapHashTable::Map(size_t size) {
+  void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mem == MAP_FAILED) {
+    throw mmap_error(ErrorMessage("Cannot map", path_));
+  }
+  data_ = static_cast<char *>(mem);
+  size_ = size;
+}
+
+void MmapHashTable::Resize(size_t size) {
+  if (ftruncate(fd_, size) != 0) {
+    throw mmap_error(ErrorMessage("Cannot grow", path_));
+  }
+  if (data_ == nullptr) {
+    Map(size);
+    return;
+  }
+  // The mapping may move: all the references into it are offsets.
+  void *mem = mremap(data_, size_, size, MREMAP_MAYMOVE);
+  if (mem == MAP_FAILED) {
+    throw mmap_error(ErrorMessage("Cannot re-map", path_));
+  }
+  data_ = static_cast<char *>(mem);
+  size_ = size;
+}
+
+uint64_t MmapHashTable::Allocate(uint64_t size) {
+  auto size_class = SizeClass(size);
+  uint64_t block = 1UL << size_class;
+  auto *h = header();
+  if (h->free_lists[size_class] != 0) {
+    auto offset = h->free_lists[size_class];
+    memcpy(&h->free_lists[size_class], data_ + offset, sizeof(uint64_t));
+    h->free_bytes -= block;
+    return offset;
+  }
+  if (h->heap_end + block > size_) {
+    auto needed = std::max(size_ * 2, h->heap_end + block);
+    Resize((needed + kFileIncrement - 1) / kFileIncrement * kFileIncrement);
+    h = header();
+  }
+  auto offset = h->heap_end;
+  h->heap_end += block;
+  return offset;
+}
+
+void MmapHashTable::Free(uint64_t offset) {
+  Record record{};
+  memcpy(&record, data_ + offset, sizeof(record));
+  auto size_class = SizeClass(record.capacity);
+  auto *h = header();
+  memcpy(data_ + offset, &h->free_lists[size_class], sizeof(uint64_t));
+  h->free_lists[size_class] = offset;
+  h->free_bytes += record.capacity;
+}
+
+uint64_t MmapHashTable::WriteRecord(std::string_view key, std::string_view value) {
+  auto size = sizeof(Record) + key.size() + value.size();
+  auto offset = Allocate(size);
+  Record record{1UL << SizeClass(size), static_cast<uint32_t>(key.size()),
+                static_cast<uint32_t>(value.size())};
+  memcpy(data_ + offset, &record, sizeof(record));
+  memcpy(data_ + offset + sizeof(record), key.data(), key.size());
+  memcpy(data_ + offset + sizeof(record) + key.size(), value.data(), value.size());
+  return offset;
+}
+
+size_t MmapHashTable::Find(uint64_t offset, uint64_t capacity, uint64_t hash,
+                           std::string_view key) const {
+  const auto *table = slots(offset);
+  auto mask = capacity - 1;
+  for (size_t i = MixBits(hash) & mask, n = 0; n < capacity; i = (i + 1) & mask, ++n) {
+    if (table[i].offset == kEmpty) {
+      break;
+    }
+    if (table[i].offset != kRemoved && table[i].hash == hash) {
+      Record record{};
+      memcpy(&record, data_ + table[i].offset, sizeof(record));
+      if (std::string_view{data_ + table[i].offset + sizeof(record), record.key_size} == key) {
+        return i;
+      }
+    }
+  }
+  return capacity;
+}
+
+size_t MmapHashTable::FindFree(const Slot *slots, uint64_t capacity, uint64_t hash) {
+  auto mask = capacity - 1;
+  auto i = MixBits(hash) & mask;
+  while (slots[i].offset > kRemoved) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+std::optional<std::string_view> MmapHashTable::Get(uint64_t hash, std::string_view key) const {
+  const auto *h = header();
+  uint64_t offset = kEmpty;
+  auto pos = Find(h->slots, h->capacity, hash, key);
+  if (pos < h->capacity) {
+    offset = slots(h->slots)[pos].offset;
+  } else if (h->old_slots != 0) {
+    pos = Find(h->old_slots, h->old_capacity, hash, key);
+    if (pos < h->old_capacity) {
+      offset = slots(h->old_slots)[pos].offset;
+    }
+  }
+  if (offset == kEmpty) {
+    return std::nullopt;
+  }
+  Record record{};
+  memcpy(&record, data_ + offset, sizeof(record));
+  return std::string_view{data_ + offset + sizeof(record) + record.key_size, record.value_size};
+}
+
+void MmapHashTable::Put(uint64_t hash, std::string_view key, std::string_view value) {
+  Migrate(kRehashStep);
+  auto *h = header();
+  uint64_t offset = kEmpty;
+  auto pos = Find(h->slots, h->capacity, hash, key);
+  if (pos < h->capacity) {
+    offset = slots(h->slots)[pos].offset;
+  } else if (h->old_slots != 0) {
+    // Not yet moved: it is moved now, to the current array.
+    auto old_pos = Find(h->old_slots, h->old_capacity, hash, key);
+    if (old_pos < h->old_capacity) {
+      offset = slots(h->old_slots)[old_pos].offset;
+      slots(h->old_slots)[old_pos].offset = kRemoved;
+      pos = FindFree(slots(h->slots), h->capacity, hash);
+      if (slots(h->slots)[pos].offset == kRemoved) {
+        --h->removed;
+      }
+      slots(h->slots)[pos] = {hash, offset};
+    }
+  }
+
+  if (offset != kEmpty) {
+    Record record{};
+    memcpy(&record, data_ + offset, sizeof(record));
+    if (sizeof(record) + key.size() + value.size() <= record.capacity) {
+      // The new value fits in the same block.
+      record.value_size = value.size();
+      memcpy(data_ + offset, &record, sizeof(record));
+      memcpy(data_ + offset + sizeof(record) + key.size(), value.data(), value.size());
+    } else {
+      auto moved = WriteRecord(key, value);
+      Free(offset);
+      slots(header()->slots)[pos].offset = moved;
+    }
+    MaybeGrow();
+    return;
+  }
+
+  offset = WriteRecord(key, value);
+  h = header();
+  pos = FindFree(slots(h->slots), h->capacity, hash);
+  if (slots(h->slots)[pos].offset == kRemoved) {
+    --h->removed;
+  }
+  slots(h->slots)[pos] = {hash, offset};
+  ++h->count;
+  MaybeGrow();
+}
+
+bool MmapHashTable::Remove(uint64_t hash, std::string_view key) {
+  auto *h = header();
+  for (auto [table, capacity] : {std::make_pair(h->slots, h->capacity),
+                                 std::make_pair(h->old_slots, h->old_capacity)}) {
+    if (table == 0) {
+      continue;
+    }
+    auto pos = Find(table, capacity, hash, key);
+    if (pos < capacity) {
+      Free(slots(table)[pos].offset);
+      slots(table)[pos].offset = kRemoved;
+      if (table == h->slots) {
+        ++h->removed;
+      }
+      --h->count;
+      return true;
+    }
+  }
+  return false;
+}
+
+void MmapHashTable::MaybeGrow() {
+  auto *h = header();
+  if (h->old_slots != 0) {
+    // Should the writes outpace the rehash, it is completed in one go.
+    if ((h->count + h->removed) * 10 >= h->capacity * 9) {
+      Migrate(h->old_capacity);
+    }
+    return;
+  }
+  if ((h->count + h->removed) * 4 < h->capacity * 3) {
+    return;
+  }
+  // If most of the used slots were removed, the new array is the same size.
+  auto capacity = h->count * 2 >= h->capacity ? h->capacity * 2 : h->capacity;
+  auto offset = Allocate(capacity * sizeof(Slot));
+  memset(data_ + offset, 0, capacity * sizeof(Slot));
+  h = header();
+  h->old_slots = h->slots;
+  h->old_capacity = h->capacity;
+  h->rehash_cursor = 0;
+  h->slots = offset;
+  h->capacity = capacity;
+  h->removed = 0;
+}
+
+void MmapHashTable::Migrate(size_t count) {
+  auto *h = header();
+  if (h->old_slots == 0) {
+    return;
+  }
+  auto *old = slots(h->old_slots);
+  auto *current = slots(h->slots);
+  auto end = std::min<uint64_t>(h->rehash_cursor + count, h->old_capacity);
+  for (auto i = h->rehash_cursor; i < end; ++i) {
+    if (old[i].offset > kRemoved) {
+      auto pos = FindFree(current, h->capacity, old[i].hash);
+      if (current[pos].offset == kRemoved) {
+        --h->removed;
+      }
+      current[pos] = old[i];
+      // Not empty, so that the probes for the entries not yet moved carry on past it.
+      old[i].offset = kRemoved;
+    }
+  }
+  h->rehash_cursor = end;
+  if (end == h->old_capacity) {
+    // The old array is re-used as any other free block.
+    Record record{h->old_capacity * sizeof(Slot), 0, 0};
+    memcpy(data_ + h->old_slots, &record, sizeof(record));
+    Free(h->old_slots);
+    h->old_slots = 0;
+    h->old_capacity = 0;
+    h->rehash_cursor = 0;
+  }
+}
+
+void MmapHashTable::ForEach(
+    const std::function<void(uint64_t, std::string_view, std::string_view)> &func) const {
+  const auto *h = header();
+  for (auto [table, capacity] : {std::make_pair(h->slots, h->capacity),
+                                 std::make_pair(h->old_slots, h->old_capacity)}) {
+    if (table == 0) {
+      continue;
+    }
+    const auto *entries = slots(table);
+    for (size_t i = 0; i < capacity; ++i) {
+      if (entries[i].offset > kRemoved) {
+        Record record{};
+        memcpy(&record, data_ + entries[i].offset, sizeof(record));
+        const char *key = data_ + entries[i].offset + sizeof(record);
+        func(entries[i].hash, {key, record.key_size},
+             {key + record.key_size, record.value_size});
+      }
+    }
+  }
+}
+
+void MmapHashTable::Sync() const {
+  if (msync(data_, size_, MS_SYNC) != 0) {
+    throw mmap_error(ErrorMessage("Cannot sync", path_));
+  }
+}
+
+size_t MmapHashTable::size() const {
+  return header()->count;
+}
+
+json MmapHashTable::Stats() const {
+  const auto *h = header();
+  return {
+      {"path", path_},
+      {"entries", h->count},
+      {"capacity", h->capacity},
+      {"removed", h->removed},
+      {"rehashing", h->old_slots != 0},
+      {"file_size", size_},
+      {"heap_bytes", h->heap_end - kHeaderSize},
+      {"free_bytes", h->free_bytes}
+  };
+}
+
+} // namespace keystore
@@ -0,0 +1,344 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/SSTable.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "keystore/Snapshot.hpp"
+
+namespace keystore {
+
+namespace {
+
+constexpr char kMagic[8] = {'D', 'L', 'S', 'S', 'T', '0', '0', '1'};
+
+struct Footer {
+  uint64_t entries;
+  uint64_t min_hash;
+  uint64_t max_hash;
+  uint64_t bloom_offset;
+  uint64_t bloom_size;
+  uint64_t index_offset;
+  uint64_t blocks;
+  uint64_t checksum;  // Of the filter and the index.
+  char magic[8];
+};
+
+std::string ErrorMessage(const std::string &what, const std::string &path) {
+  return what + " " + path + ": " + strerror(errno);
+}
+
+} // namespace
+
+// ============= MergingIterator =================================
+
+MergingIterator::MergingIterator(std::vector<std::unique_ptr<EntryIterator>> sources) :
+    sources_{std::move(sources)} {
+  FindSmallest();
+}
+
+void MergingIterator::FindSmallest() {
+  current_ = nullptr;
+  for (auto &source : sources_) {
+    if (source->Valid() && (current_ == nullptr ||
+        CompareEntries(source->hash(), source->key(), current_->hash(), current_->key()) < 0)) {
+      current_ = source.get();
+    }
+  }
+}
+
+void MergingIterator::Next() {
+  // Skips the same key in all the (older) sources, too.
+  auto hash = current_->hash();
+  std::string key{current_->key()};
+  for (auto &source : sources_) {
+    if (source->Valid() && source->hash() == hash && source->key() == key) {
+      source->Next();
+    }
+  }
+  FindSmallest();
+}
+
+// ============= SSTableWriter =================================
+
+SSTableWriter::SSTableWriter(const std::string &path, size_t block_size,
+                             size_t bloom_bits_per_key) :
+    path_{path}, tmp_path_{path + ".tmp"}, block_size_{block_size},
+    bloom_bits_per_key_{bloom_bits_per_key} {
+  fd_ = open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw lsm_error(ErrorMessage("Cannot create", tmp_path_));
+  }
+  block_.reserve(block_size_ + block_size_ / 4);
+}
+
+SSTableWriter::~SSTableWriter() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (!finished_) {
+    unlink(tmp_path_.c_str());
+  }
+}
+
+void SSTableWriter::Add(uint64_t hash, std::string_view key, std::string_view value,
+                        bool deleted) {
+  // Entries with the same hash are never split across blocks, so that the blocks' ranges do not
+  // overlap.
+  if (block_.size() >= block_size_ && hash != last_hash_) {
+    FlushBlock();
+  }
+  if (block_records_ == 0) {
+    block_first_hash_ = hash;
+  }
+  LsmRecord record{hash, static_cast<uint32_t>(key.size()),
+                   deleted ? LsmRecord::kDeleted : static_cast<uint32_t>(value.size())};
+  block_.append(reinterpret_cast<const char *>(&record), sizeof(record));
+  block_.append(key);
+  if (!deleted) {
+    block_.append(value);
+  }
+  ++block_records_;
+  last_hash_ = hash;
+  hashes_.push_back(hash);
+}
+
+void SSTableWriter::FlushBlock() {
+  if (block_records_ == 0) {
+    return;
+  }
+  SSTableBlock entry{block_first_hash_, last_hash_, offset_, static_cast<uint32_t>(block_.size()),
+                   block_records_, Checksum(block_.data(), block_.size())};
+  index_.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+  Write(block_.data(), block_.size());
+  block_.clear();
+  block_records_ = 0;
+}
+
+void SSTableWriter::Finish() {
+  FlushBlock();
+
+  BloomFilter bloom{hashes_.size(), bloom_bits_per_key_};
+  for (auto hash : hashes_) {
+    bloom.Add(hash);
+  }
+  Footer footer{};
+  footer.entries = hashes_.size();
+  footer.min_hash = hashes_.empty() ? 0 : hashes_.front();
+  footer.max_hash = hashes_.empty() ? 0 : hashes_.back();
+  footer.bloom_offset = offset_;
+  footer.bloom_size = bloom.data().size();
+  footer.index_offset = offset_ + bloom.data().size();
+  footer.blocks = index_.size() / sizeof(SSTableBlock);
+  std::string metadata = bloom.data() + index_;
+  footer.checksum = Checksum(metadata.data(), metadata.size());
+  memcpy(footer.magic, kMagic, sizeof(kMagic));
+  Write(metadata.data(), metadata.size());
+  Write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+
+  if (fdatasync(fd_) != 0) {
+    throw lsm_error(ErrorMessage("Cannot sync", tmp_path_));
+  }
+  close(fd_);
+  fd_ = -1;
+  if (rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+    throw lsm_error(ErrorMessage("Cannot rename " + tmp_path_ + " to", path_));
+  }
+  finished_ = true;
+}
+
+void SSTableWriter::Write(const char *data, size_t size) {
+  while (size > 0) {
+    auto written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw lsm_error(ErrorMessage("Cannot write to", tmp_path_));
+    }
+    data += written;
+    size -= written;
+    offset_ += written;
+  }
+}
+
+// ============= SSTable =================================
+
+/**
+ * Iterates over the records in each block, in turn, verifying the block's checksum first.
+ */
+class SSTable::Iterator : public EntryIterator {
+ public:
+  explicit Iterator(const SSTable &table) : table_{table} {
+    LoadBlock();
+  }
+
+  bool Valid() const override { return block_ < table_.blocks_; }
+
+  void Next() override {
+    pos_ += sizeof(record_) + record_.key_size + (deleted() ? 0 : record_.value_size);
+    if (pos_ >= end_) {
+      ++block_;
+      LoadBlock();
+    } else {
+      Parse();
+    }
+  }
+
+  uint64_t hash() const override { return record_.hash; }
+  std::string_view key() const override {
+    return {table_.data_ + pos_ + sizeof(record_), record_.key_size};
+  }
+  std::string_view value() const override {
+    if (deleted()) {
+      return {};
+    }
+    return {table_.data_ + pos_ + sizeof(record_) + record_.key_size, record_.value_size};
+  }
+  bool deleted() const override { return record_.value_size == LsmRecord::kDeleted; }
+
+ private:
+  void LoadBlock() {
+    if (block_ >= table_.blocks_) {
+      return;
+    }
+    auto entry = table_.index(block_);
+    if (entry.offset + entry.size > table_.size_ ||
+        Checksum(table_.data_ + entry.offset, entry.size) != entry.checksum) {
+      throw lsm_error("Corrupted block " + std::to_string(block_) + " in " + table_.path_);
+    }
+    pos_ = entry.offset;
+    end_ = entry.offset + entry.size;
+    Parse();
+  }
+
+  void Parse() {
+    if (pos_ + sizeof(record_) > end_) {
+      throw lsm_error("Corrupted record in " + table_.path_);
+    }
+    memcpy(&record_, table_.data_ + pos_, sizeof(record_));
+    auto size = sizeof(record_) + record_.key_size + (deleted() ? 0 : record_.value_size);
+    if (pos_ + size > end_) {
+      throw lsm_error("Corrupted record in " + table_.path_);
+    }
+  }
+
+  const SSTable &table_;
+  size_t block_ = 0;
+  size_t pos_ = 0;
+  size_t end_ = 0;
+  LsmRecord record_{};
+};
+
+SSTable::SSTable(const std::string &path) : path_{path} {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw lsm_error(ErrorMessage("Cannot open", path));
+  }
+  struct stat st{};
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw lsm_error(ErrorMessage("Cannot stat", path));
+  }
+  size_ = st.st_size;
+  if (size_ < sizeof(Footer)) {
+    close(fd);
+    throw lsm_error("Not an SSTable (too short): " + path);
+  }
+  void *mem = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw lsm_error(ErrorMessage("Cannot map", path));
+  }
+  data_ = static_cast<const char *>(mem);
+  // Lookups hit random blocks.
+  madvise(mem, size_, MADV_RANDOM);
+
+  Footer footer{};
+  memcpy(&footer, data_ + size_ - sizeof(footer), sizeof(footer));
+  auto metadata_size = footer.bloom_size + footer.blocks * sizeof(SSTableBlock);
+  if (memcmp(footer.magic, kMagic, sizeof(kMagic)) != 0 ||
+      footer.bloom_offset + metadata_size + sizeof(footer) != size_ ||
+      Checksum(data_ + footer.bloom_offset, metadata_size) != footer.checksum) {
+    munmap(mem, size_);
+    throw lsm_error("Not an SSTable (or corrupted): " + path);
+  }
+  entries_ = footer.entries;
+  min_hash_ = footer.min_hash;
+  max_hash_ = footer.max_hash;
+  bloom_ = std::make_unique<BloomFilter>(std::string{data_ + footer.bloom_offset,
+                                                     footer.bloom_size});
+  index_ = data_ + footer.index_offset;
+  blocks_ = footer.blocks;
+}
+
+SSTable::~SSTable() {
+  munmap(const_cast<char *>(data_), size_);
+}
+
+SSTableBlock SSTable::index(size_t block) const {
+  // The index is not necessarily aligned.
+  SSTableBlock entry{};
+  memcpy(&entry, index_ + block * sizeof(entry), sizeof(entry));
+  return entry;
+}
+
+SSTable::Lookup SSTable::Get(uint64_t hash, std::string_view key, std::string *value) const {
+  if (entries_ == 0 || hash < min_hash_ || hash > max_hash_ || !bloom_->MayContain(hash)) {
+    return Lookup::kMissing;
+  }
+  // The first block whose range may contain the hash.
+  size_t low = 0, high = blocks_;
+  while (low < high) {
+    auto mid = (low + high) / 2;
+    if (index(mid).last_hash < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  for (auto block = low; block < blocks_ && index(block).first_hash <= hash; ++block) {
+    auto entry = index(block);
+    auto pos = entry.offset;
+    auto end = entry.offset + entry.size;
+    while (pos + sizeof(LsmRecord) <= end) {
+      LsmRecord record{};
+      memcpy(&record, data_ + pos, sizeof(record));
+      if (record.hash > hash) {
+        return Lookup::kMissing;
+      }
+      bool deleted = record.value_size == LsmRecord::kDeleted;
+      auto next = pos + sizeof(record) + record.key_size + (deleted ? 0 : record.value_size);
+      if (next > end) {
+        throw lsm_error("Corrupted record in " + path_);
+      }
+      if (record.hash == hash &&
+          std::string_view(data_ + pos + sizeof(record), record.key_size) == key) {
+        if (deleted) {
+          return Lookup::kDeleted;
+        }
+        value->assign(data_ + pos + sizeof(record) + record.key_size, record.value_size);
+        return Lookup::kFound;
+      }
+      pos = next;
+    }
+  }
+  return Lookup::kMissing;
+}
+
+std::unique_ptr<EntryIterator> SSTable::NewIterator() const {
+  return std::make_unique<Iterator>(*this);
+}
+
+std::string SSTable::filename() const {
+  auto pos = path_.rfind('/');
+  return pos == std::string::npos ? path_ : path_.substr(pos + 1);
+}
+
+} // namespace keystore
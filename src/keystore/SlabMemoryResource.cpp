@@ -0,0 +1,75 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/SlabMemoryResource.hpp"
+
+namespace keystore {
+
+void *SlabMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+  ++allocations_;
+  if (bytes > kMaxBlockSize || alignment > kGranularity) {
+    void *p = upstream_->allocate(bytes, alignment);
+    large_blocks_[p] = {bytes, alignment};
+    bytes_in_use_ += bytes;
+    bytes_reserved_ += bytes;
+    return p;
+  }
+
+  auto cls = ClassOf(bytes);
+  auto block_size = (cls + 1) * kGranularity;
+  bytes_in_use_ += block_size;
+
+  if (free_lists_[cls]) {
+    auto block = free_lists_[cls];
+    free_lists_[cls] = block->next;
+    return block;
+  }
+  if (current_ + block_size > end_) {
+    // Whatever is left in the current chunk is wasted: as all blocks are at most
+    // `kMaxBlockSize`, this is a small fraction of the chunk.
+    current_ = static_cast<char *>(upstream_->allocate(kChunkSize, kGranularity));
+    end_ = current_ + kChunkSize;
+    chunks_.push_back(current_);
+    bytes_reserved_ += kChunkSize;
+  }
+  void *p = current_;
+  current_ += block_size;
+  return p;
+}
+
+void SlabMemoryResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+  ++deallocations_;
+  if (bytes > kMaxBlockSize || alignment > kGranularity) {
+    auto pos = large_blocks_.find(p);
+    if (pos != large_blocks_.end()) {
+      bytes_in_use_ -= bytes;
+      bytes_reserved_ -= bytes;
+      upstream_->deallocate(p, pos->second.first, pos->second.second);
+      large_blocks_.erase(pos);
+    }
+    return;
+  }
+
+  auto cls = ClassOf(bytes);
+  bytes_in_use_ -= (cls + 1) * kGranularity;
+  auto block = static_cast<FreeBlock *>(p);
+  block->next = free_lists_[cls];
+  free_lists_[cls] = block;
+}
+
+void SlabMemoryResource::release() {
+  for (auto chunk : chunks_) {
+    upstream_->deallocate(chunk, kChunkSize, kGranularity);
+  }
+  for (const auto &[p, size_align] : large_blocks_) {
+    upstream_->deallocate(p, size_align.first, size_align.second);
+  }
+  chunks_.clear();
+  large_blocks_.clear();
+  free_lists_.fill(nullptr);
+  current_ = end_ = nullptr;
+  bytes_in_use_ = 0;
+  bytes_reserved_ = 0;
+}
+
+} // namespace keystore
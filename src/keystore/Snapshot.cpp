@@ -0,0 +1,282 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/Snapshot.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace keystore {
+
+namespace {
+
+constexpr char kMagic[8] = {'D', 'L', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr uint32_t kVersion = 2;
+
+// The fixed-size part of the file header: it is followed by the bucket's name.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t name_size;
+  uint64_t entries;
+  uint64_t blocks;
+  uint64_t lsn;
+  uint64_t checksum;  // Of all the fields above, and the bucket's name.
+};
+
+struct BlockHeader {
+  uint32_t size;
+  uint32_t records;
+  uint64_t checksum;  // Of the block's records.
+};
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+
+inline uint64_t Round(uint64_t acc, uint64_t word) {
+  acc += word * kPrime2;
+  acc = (acc << 31U) | (acc >> 33U);
+  return acc * kPrime1;
+}
+
+std::string ErrorMessage(const std::string &what, const std::string &path) {
+  return what + " " + path + ": " + strerror(errno);
+}
+
+uint64_t HeaderChecksum(const FileHeader &header, const char *name) {
+  FileHeader copy = header;
+  copy.checksum = 0;
+  std::string data{reinterpret_cast<const char *>(&copy), sizeof(copy)};
+  data.append(name, header.name_size);
+  return Checksum(data.data(), data.size());
+}
+
+} // namespace
+
+uint64_t Checksum(const char *data, size_t size) {
+  // Four independent lanes, so that the multiplications can be pipelined.
+  uint64_t lanes[4] = {kPrime1 + kPrime2, kPrime2, 0, -kPrime1};
+  size_t pos = 0;
+  for (; pos + 32 <= size; pos += 32) {
+    for (size_t lane = 0; lane < 4; ++lane) {
+      uint64_t word;
+      memcpy(&word, data + pos + 8 * lane, sizeof(word));
+      lanes[lane] = Round(lanes[lane], word);
+    }
+  }
+  uint64_t acc = size;
+  for (auto lane : lanes) {
+    acc = Round(acc, lane);
+  }
+  for (; pos + 8 <= size; pos += 8) {
+    uint64_t word;
+    memcpy(&word, data + pos, sizeof(word));
+    acc = Round(acc, word);
+  }
+  if (pos < size) {
+    uint64_t word = 0;
+    memcpy(&word, data + pos, size - pos);
+    acc = Round(acc, word);
+  }
+  acc ^= acc >> 33U;
+  acc *= kPrime2;
+  acc ^= acc >> 29U;
+  return acc;
+}
+
+// ============= SnapshotWriter =================================
+
+SnapshotWriter::SnapshotWriter(const std::string &path, const std::string &bucket,
+                               uint64_t lsn) :
+    path_{path}, tmp_path_{path + ".tmp"}, bucket_{bucket}, lsn_{lsn} {
+  fd_ = open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw snapshot_error(ErrorMessage("Cannot create", tmp_path_));
+  }
+  // The header is written last, once the number of entries is known.
+  offset_ = sizeof(FileHeader) + bucket_.size();
+  buffer_.reserve(kBlockSize + kBlockSize / 4);
+  buffer_.resize(sizeof(BlockHeader));
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (!finished_) {
+    unlink(tmp_path_.c_str());
+  }
+}
+
+char *SnapshotWriter::Append(size_t size) {
+  if (buffer_.size() - block_ - sizeof(BlockHeader) >= kBlockSize) {
+    Seal();
+  }
+  auto pos = buffer_.size();
+  buffer_.resize(pos + size);
+  ++block_records_;
+  ++entries_;
+  return buffer_.data() + pos;
+}
+
+void SnapshotWriter::Seal() {
+  BlockHeader header{};
+  header.size = buffer_.size() - block_ - sizeof(BlockHeader);
+  header.records = block_records_;
+  header.checksum = Checksum(buffer_.data() + block_ + sizeof(BlockHeader), header.size);
+  memcpy(buffer_.data() + block_, &header, sizeof(header));
+  ++blocks_;
+
+  sealed_ = buffer_.size();
+  block_ = sealed_;
+  block_records_ = 0;
+  buffer_.resize(sealed_ + sizeof(BlockHeader));
+}
+
+void SnapshotWriter::Flush() {
+  if (sealed_ == 0) {
+    return;
+  }
+  Write(buffer_.data(), sealed_, offset_);
+  offset_ += sealed_;
+  buffer_.erase(buffer_.begin(), buffer_.begin() + sealed_);
+  block_ -= sealed_;
+  sealed_ = 0;
+}
+
+size_t SnapshotWriter::Finish() {
+  if (block_records_ > 0) {
+    Seal();
+  }
+  Flush();
+
+  FileHeader header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.name_size = bucket_.size();
+  header.entries = entries_;
+  header.blocks = blocks_;
+  header.lsn = lsn_;
+  header.checksum = HeaderChecksum(header, bucket_.data());
+  Write(reinterpret_cast<const char *>(&header), sizeof(header), 0);
+  Write(bucket_.data(), bucket_.size(), sizeof(header));
+
+  if (fdatasync(fd_) != 0) {
+    throw snapshot_error(ErrorMessage("Cannot sync", tmp_path_));
+  }
+  close(fd_);
+  fd_ = -1;
+  if (rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+    throw snapshot_error(ErrorMessage("Cannot rename " + tmp_path_ + " to", path_));
+  }
+  finished_ = true;
+  return offset_;
+}
+
+void SnapshotWriter::Write(const char *data, size_t size, off_t offset) {
+  while (size > 0) {
+    auto written = pwrite(fd_, data, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw snapshot_error(ErrorMessage("Cannot write to", tmp_path_));
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+// ============= SnapshotReader =================================
+
+SnapshotReader::SnapshotReader(const std::string &path) : path_{path} {
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    throw snapshot_error(ErrorMessage("Cannot open", path));
+  }
+  try {
+    Map();
+  } catch (...) {
+    Close();
+    throw;
+  }
+}
+
+SnapshotReader::~SnapshotReader() {
+  Close();
+}
+
+void SnapshotReader::Map() {
+  struct stat st{};
+  if (fstat(fd_, &st) != 0) {
+    throw snapshot_error(ErrorMessage("Cannot stat", path_));
+  }
+  size_ = st.st_size;
+  if (size_ < sizeof(FileHeader)) {
+    throw snapshot_error("Not a snapshot (too short): " + path_);
+  }
+  // The pages are read ahead, and faulted in, all at once.
+  void *mem = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd_, 0);
+  if (mem == MAP_FAILED) {
+    throw snapshot_error(ErrorMessage("Cannot map", path_));
+  }
+  data_ = static_cast<const char *>(mem);
+  madvise(mem, size_, MADV_SEQUENTIAL);
+
+  FileHeader header{};
+  memcpy(&header, data_, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    throw snapshot_error("Not a snapshot (or an unsupported version): " + path_);
+  }
+  if (sizeof(header) + header.name_size > size_ ||
+      HeaderChecksum(header, data_ + sizeof(header)) != header.checksum) {
+    throw snapshot_error("Corrupted snapshot header: " + path_);
+  }
+  bucket_.assign(data_ + sizeof(header), header.name_size);
+  entries_ = header.entries;
+  blocks_ = header.blocks;
+  lsn_ = header.lsn;
+  offset_ = sizeof(header) + header.name_size;
+}
+
+void SnapshotReader::Close() {
+  if (data_) {
+    munmap(const_cast<char *>(data_), size_);
+    data_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool SnapshotReader::NextBlock(const char **records, size_t *size, uint32_t *count) {
+  if (blocks_read_ == blocks_) {
+    return false;
+  }
+  BlockHeader header{};
+  if (offset_ + sizeof(header) > size_) {
+    throw snapshot_error("Truncated snapshot: " + path_);
+  }
+  memcpy(&header, data_ + offset_, sizeof(header));
+  offset_ += sizeof(header);
+  if (offset_ + header.size > size_) {
+    throw snapshot_error("Truncated snapshot: " + path_);
+  }
+  if (Checksum(data_ + offset_, header.size) != header.checksum) {
+    throw snapshot_error("Corrupted block " + std::to_string(blocks_read_) + " in snapshot: " +
+        path_);
+  }
+  *records = data_ + offset_;
+  *size = header.size;
+  *count = header.records;
+  offset_ += header.size;
+  ++blocks_read_;
+  return true;
+}
+
+} // namespace keystore
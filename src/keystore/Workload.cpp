@@ -0,0 +1,430 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/Workload.hpp"
+
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace keystore {
+
+Distribution DistributionFrom(const std::string &name) {
+  if (name == "constant") {
+    return Distribution::kConstant;
+  }
+  if (name == "uniform") {
+    return Distribution::kUniform;
+  }
+  if (name == "zipfian") {
+    return Distribution::kZipfian;
+  }
+  if (name == "latest") {
+    return Distribution::kLatest;
+  }
+  throw std::invalid_argument("Unknown distribution: '" + name + "'");
+}
+
+const char *WorkloadOpName(WorkloadOp op) {
+  switch (op) {
+    case WorkloadOp::kRead:
+      return "read";
+    case WorkloadOp::kUpdate:
+      return "update";
+    case WorkloadOp::kInsert:
+      return "insert";
+    case WorkloadOp::kScan:
+      return "scan";
+    case WorkloadOp::kReadModifyWrite:
+      return "read_modify_write";
+  }
+  return "unknown";
+}
+
+WorkloadOptions WorkloadOptions::Ycsb(char workload) {
+  WorkloadOptions options;
+  switch (std::tolower(workload)) {
+    case 'a':  // Update heavy
+      options.proportions = {0.5, 0.5, 0, 0, 0};
+      break;
+    case 'b':  // Read mostly
+      options.proportions = {0.95, 0.05, 0, 0, 0};
+      break;
+    case 'c':  // Read only
+      options.proportions = {1.0, 0, 0, 0, 0};
+      break;
+    case 'd':  // Read latest
+      options.proportions = {0.95, 0, 0.05, 0, 0};
+      options.request_distribution = Distribution::kLatest;
+      break;
+    case 'e':  // Short ranges
+      options.proportions = {0, 0, 0.05, 0.95, 0};
+      break;
+    case 'f':  // Read-modify-write
+      options.proportions = {0.5, 0, 0, 0, 0.5};
+      break;
+    default:
+      throw std::invalid_argument(std::string{"Unknown YCSB workload: '"} + workload + "'");
+  }
+  return options;
+}
+
+uint64_t WorkloadResult::total_operations() const {
+  uint64_t total = 0;
+  for (auto count : operations) {
+    total += count;
+  }
+  return total;
+}
+
+void to_json(json &j, const WorkloadResult &result) {
+  json ops = json::object();
+  for (size_t i = 0; i < kNumWorkloadOps; ++i) {
+    if (result.operations[i] == 0) {
+      continue;
+    }
+    json op = result.latencies[i];
+    op["count"] = result.operations[i];
+    op["failed"] = result.failed[i];
+    ops[WorkloadOpName(static_cast<WorkloadOp>(i))] = op;
+  }
+  j = {
+      {"operations", result.total_operations()},
+      {"elapsed_sec", result.elapsed_sec},
+      {"ops_per_sec", result.ops_per_sec()},
+      {"latency", ops}
+  };
+}
+
+namespace {
+
+double Zeta(uint64_t from, uint64_t to, double theta) {
+  double sum = 0;
+  for (uint64_t i = from; i < to; ++i) {
+    sum += 1.0 / std::pow(i + 1, theta);
+  }
+  return sum;
+}
+
+// The FNV-1a hash of a 64-bit integer, which scatters the popular items of a Zipfian
+// distribution across the whole range (as YCSB's "scrambled" Zipfian generator does).
+uint64_t Scramble(uint64_t value) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (int i = 0; i < 8; ++i) {
+    hash ^= value & 0xFFU;
+    hash *= 0x100000001B3ULL;
+    value >>= 8U;
+  }
+  return hash;
+}
+
+} // namespace
+
+ZipfianGenerator::ZipfianGenerator(uint64_t items, double theta)
+    : items_{items}, theta_{theta}, alpha_{1.0 / (1.0 - theta)}, zeta2_{Zeta(0, 2, theta)},
+      zetan_{Zeta(0, items, theta)} {
+  if (items == 0) {
+    throw std::invalid_argument("A Zipfian distribution needs at least one item");
+  }
+  Update();
+}
+
+void ZipfianGenerator::Update() {
+  eta_ = (1.0 - std::pow(2.0 / items_, 1.0 - theta_)) / (1.0 - zeta2_ / zetan_);
+}
+
+void ZipfianGenerator::Grow(uint64_t items) {
+  if (items <= items_) {
+    return;
+  }
+  zetan_ += Zeta(items_, items, theta_);
+  items_ = items;
+  Update();
+}
+
+uint64_t ZipfianGenerator::Next(std::mt19937_64 &rnd) const {
+  double u = std::uniform_real_distribution<double>{0.0, 1.0}(rnd);
+  double uz = u * zetan_;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + std::pow(0.5, theta_)) {
+    return std::min<uint64_t>(1, items_ - 1);
+  }
+  auto item = static_cast<uint64_t>(items_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+  return std::min(item, items_ - 1);
+}
+
+namespace {
+
+void Validate(const WorkloadOptions &options) {
+  double total = 0;
+  for (auto proportion : options.proportions) {
+    if (proportion < 0) {
+      throw std::invalid_argument("Operation proportions cannot be negative");
+    }
+    total += proportion;
+  }
+  if (total <= 0) {
+    throw std::invalid_argument("At least one operation must have a positive proportion");
+  }
+  if (options.record_count == 0 || options.threads == 0) {
+    throw std::invalid_argument("Workloads need at least one record and one thread");
+  }
+  if (options.min_value_size > options.max_value_size) {
+    throw std::invalid_argument("The minimum value size cannot exceed the maximum");
+  }
+  if (options.request_distribution == Distribution::kConstant) {
+    throw std::invalid_argument("Keys cannot be chosen with a constant distribution");
+  }
+}
+
+/**
+ * Generates values (random printable characters) whose sizes follow the workload's
+ * `value_size_distribution`.
+ */
+class ValueGenerator {
+  const WorkloadOptions &options_;
+  std::string pool_;
+  std::unique_ptr<ZipfianGenerator> sizes_;
+
+ public:
+  ValueGenerator(const WorkloadOptions &options, std::mt19937_64 &rnd) : options_{options} {
+    pool_.resize(2 * options.max_value_size + 1);
+    std::uniform_int_distribution<int> chars{' ', '~'};
+    for (auto &c : pool_) {
+      c = static_cast<char>(chars(rnd));
+    }
+    if (options.value_size_distribution == Distribution::kZipfian
+        || options.value_size_distribution == Distribution::kLatest) {
+      sizes_ = std::make_unique<ZipfianGenerator>(
+          options.max_value_size - options.min_value_size + 1);
+    }
+  }
+
+  std::string Next(std::mt19937_64 &rnd) const {
+    auto size = options_.min_value_size;
+    if (sizes_) {
+      size += sizes_->Next(rnd);
+    } else if (options_.value_size_distribution == Distribution::kUniform) {
+      size = std::uniform_int_distribution<size_t>{
+          options_.min_value_size, options_.max_value_size}(rnd);
+    }
+    auto offset = std::uniform_int_distribution<size_t>{0, options_.max_value_size}(rnd);
+    return pool_.substr(offset, size);
+  }
+};
+
+/**
+ * Chooses which (existing) record each operation accesses.
+ */
+class KeyChooser {
+  Distribution distribution_;
+  ZipfianGenerator zipfian_;
+
+ public:
+  KeyChooser(Distribution distribution, const ZipfianGenerator &zipfian)
+      : distribution_{distribution}, zipfian_{zipfian} { }
+
+  // `records` is the number of records inserted so far.
+  uint64_t Next(std::mt19937_64 &rnd, uint64_t records) {
+    switch (distribution_) {
+      case Distribution::kZipfian:
+        zipfian_.Grow(records);
+        return Scramble(zipfian_.Next(rnd)) % records;
+      case Distribution::kLatest:
+        zipfian_.Grow(records);
+        return records - 1 - zipfian_.Next(rnd);
+      default:
+        return std::uniform_int_distribution<uint64_t>{0, records - 1}(rnd);
+    }
+  }
+};
+
+/**
+ * Runs the operations of a workload, from several threads.
+ */
+class WorkloadDriver {
+  // How long, before an operation is due, open-loop threads stop sleeping and start spinning.
+  static constexpr double kSpinNanos = 200000;
+
+  KeyStore<std::string, std::string> &store_;
+  const WorkloadOptions &options_;
+  std::discrete_distribution<size_t> mix_;
+  ZipfianGenerator zipfian_;
+
+  // The records are numbered from 0; `inserted_` is the number of those which have been
+  // inserted so far, while `next_record_` is the next number to insert.
+  std::atomic_uint64_t next_record_;
+  std::atomic_uint64_t inserted_;
+
+  std::array<LatencyHistogram, kNumWorkloadOps> latencies_;
+  std::array<std::atomic_uint64_t, kNumWorkloadOps> operations_{};
+  std::array<std::atomic_uint64_t, kNumWorkloadOps> failed_{};
+
+  // Runs `count` operations; if `measured`, at the target rate (if any) starting at `start`.
+  void Run(size_t thread, size_t count, bool measured, uint64_t start);
+
+  bool RunOp(WorkloadOp op, KeyChooser &keys, const ValueGenerator &values,
+             std::mt19937_64 &rnd);
+
+ public:
+  WorkloadDriver(KeyStore<std::string, std::string> &store, const WorkloadOptions &options)
+      : store_{store}, options_{options},
+        mix_{options.proportions.begin(), options.proportions.end()},
+        zipfian_{options.record_count},
+        next_record_{options.record_count}, inserted_{options.record_count} { }
+
+  // Runs `count` operations, split across all the threads.
+  void RunAll(size_t count, bool measured);
+
+  WorkloadResult Result(double elapsed_sec) const;
+};
+
+void WorkloadDriver::RunAll(size_t count, bool measured) {
+  auto start = ReadClock();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < options_.threads; ++t) {
+    auto share = count / options_.threads + (t < count % options_.threads ? 1 : 0);
+    threads.emplace_back(&WorkloadDriver::Run, this, t, share, measured, start);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void WorkloadDriver::Run(size_t thread, size_t count, bool measured, uint64_t start) {
+  std::mt19937_64 rnd{options_.seed + thread + (measured ? 0 : 1000)};
+  KeyChooser keys{options_.request_distribution, zipfian_};
+  ValueGenerator values{options_, rnd};
+  auto nanos_per_tick = NanosPerTick();
+
+  // Each thread starts its operations at an equal share of the target rate.
+  bool open_loop = measured && options_.target_ops_per_sec > 0;
+  double interval = open_loop
+      ? 1e9 * options_.threads / options_.target_ops_per_sec / nanos_per_tick : 0;
+  auto spin_ticks = static_cast<uint64_t>(kSpinNanos / nanos_per_tick);
+
+  for (size_t i = 0; i < count; ++i) {
+    auto began = ReadClock();
+    if (open_loop) {
+      auto scheduled = start + static_cast<uint64_t>(i * interval);
+      // Sleeping overshoots by tens of microseconds, which would be reported as latency: we
+      // only sleep for most of the wait, then spin.
+      if (scheduled > began + spin_ticks) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(
+            static_cast<int64_t>((scheduled - began - spin_ticks) * nanos_per_tick)));
+      }
+      while (ReadClock() < scheduled) {
+        std::this_thread::yield();
+      }
+      began = scheduled;
+    }
+    auto op = static_cast<WorkloadOp>(mix_(rnd));
+    bool ok = RunOp(op, keys, values, rnd);
+    if (measured) {
+      auto index = static_cast<size_t>(op);
+      latencies_[index].Record(ReadClock() - began);
+      operations_[index].fetch_add(1, std::memory_order_relaxed);
+      if (!ok) {
+        failed_[index].fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+bool WorkloadDriver::RunOp(WorkloadOp op, KeyChooser &keys, const ValueGenerator &values,
+                           std::mt19937_64 &rnd) {
+  auto records = inserted_.load(std::memory_order_acquire);
+  switch (op) {
+    case WorkloadOp::kRead:
+      return store_.Get(WorkloadKey(keys.Next(rnd, records))).has_value();
+    case WorkloadOp::kUpdate:
+      return store_.Put(WorkloadKey(keys.Next(rnd, records)), values.Next(rnd));
+    case WorkloadOp::kInsert: {
+      auto record = next_record_.fetch_add(1, std::memory_order_relaxed);
+      bool ok = store_.Put(WorkloadKey(record), values.Next(rnd));
+      // Records inserted concurrently may complete out of order: for simplicity, they become
+      // visible to the other operations as they complete, regardless of their numbers.
+      inserted_.fetch_add(1, std::memory_order_release);
+      return ok;
+    }
+    case WorkloadOp::kScan: {
+      auto first = keys.Next(rnd, records);
+      auto length = std::uniform_int_distribution<size_t>{1, options_.max_scan_length}(rnd);
+      std::vector<std::string> scanned;
+      scanned.reserve(length);
+      for (size_t i = 0; i < length; ++i) {
+        scanned.push_back(WorkloadKey((first + i) % records));
+      }
+      bool ok = true;
+      for (const auto &value : store_.MultiGet(scanned)) {
+        ok = ok && value.has_value();
+      }
+      return ok;
+    }
+    case WorkloadOp::kReadModifyWrite: {
+      auto key = WorkloadKey(keys.Next(rnd, records));
+      bool found = store_.Get(key).has_value();
+      return store_.Put(key, values.Next(rnd)) && found;
+    }
+  }
+  return false;
+}
+
+WorkloadResult WorkloadDriver::Result(double elapsed_sec) const {
+  WorkloadResult result;
+  result.elapsed_sec = elapsed_sec;
+  auto nanos_per_tick = NanosPerTick();
+  for (size_t i = 0; i < kNumWorkloadOps; ++i) {
+    result.operations[i] = operations_[i].load();
+    result.failed[i] = failed_[i].load();
+    result.latencies.push_back(latencies_[i].Snapshot(nanos_per_tick));
+  }
+  return result;
+}
+
+} // namespace
+
+size_t LoadWorkload(KeyStore<std::string, std::string> &store, const WorkloadOptions &options) {
+  Validate(options);
+  std::atomic_size_t loaded{0};
+  std::vector<std::thread> threads;
+  auto chunk = (options.record_count + options.threads - 1) / options.threads;
+  for (size_t t = 0; t < options.threads; ++t) {
+    threads.emplace_back([&, t]() {
+      std::mt19937_64 rnd{options.seed + t};
+      ValueGenerator values{options, rnd};
+      size_t count = 0;
+      for (auto record = t * chunk; record < std::min((t + 1) * chunk, options.record_count);
+           ++record) {
+        if (store.Put(WorkloadKey(record), values.Next(rnd))) {
+          ++count;
+        }
+      }
+      loaded += count;
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return loaded;
+}
+
+WorkloadResult RunWorkload(KeyStore<std::string, std::string> &store,
+                           const WorkloadOptions &options) {
+  Validate(options);
+  WorkloadDriver driver{store, options};
+  if (options.warmup_operation_count > 0) {
+    driver.RunAll(options.warmup_operation_count, false);
+  }
+  auto start = std::chrono::steady_clock::now();
+  driver.RunAll(options.operation_count, true);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return driver.Result(elapsed.count());
+}
+
+} // namespace keystore
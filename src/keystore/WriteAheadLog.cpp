@@ -0,0 +1,386 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "keystore/WriteAheadLog.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "keystore/Snapshot.hpp"
+
+namespace keystore {
+
+namespace {
+
+constexpr char kSegmentExtension[] = ".wal";
+
+// Precedes each record in a segment.
+struct RecordHeader {
+  uint32_t size;
+  uint32_t reserved;
+  uint64_t lsn;
+  uint64_t checksum;  // Of the record's data, XOR its LSN.
+};
+
+std::string ErrorMessage(const std::string &what, const std::string &path) {
+  return what + " " + path + ": " + strerror(errno);
+}
+
+} // namespace
+
+WriteAheadLog::WriteAheadLog(const std::string &name, const WalOptions &options) :
+    name_{name}, options_{options} {
+  auto segments = ListSegments();
+  if (!segments.empty()) {
+    const auto &last = segments.back();
+    last_lsn_ = last.first_lsn - 1;
+    auto valid = ScanSegment(last, [this](uint64_t lsn, const char *, size_t) {
+      last_lsn_ = lsn;
+    });
+    if (valid < std::filesystem::file_size(last.path)) {
+      LOG(WARNING) << "Truncating the partially written records at the end of " << last.path;
+      if (truncate(last.path.c_str(), valid) != 0) {
+        throw wal_error(ErrorMessage("Cannot truncate", last.path));
+      }
+    }
+  }
+  written_lsn_ = durable_lsn_ = last_lsn_;
+  published_last_lsn_.store(last_lsn_, std::memory_order_relaxed);
+  published_durable_lsn_.store(durable_lsn_, std::memory_order_relaxed);
+  VLOG(2) << "Opened WAL " << name_ << " in " << options_.dir << " with " << segments.size()
+          << " segments, last LSN: " << last_lsn_;
+
+  if (options_.sync == SyncPolicy::kInterval) {
+    syncer_ = std::thread(&WriteAheadLog::RunSyncer, this);
+  }
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    stopped_ = true;
+  }
+  stopping_.notify_all();
+  if (syncer_.joinable()) {
+    syncer_.join();
+  }
+  std::unique_lock<std::mutex> lk(mutex_);
+  committed_.wait(lk, [this] { return !flushing_; });
+  if (error_.empty() && durable_lsn_ < last_lsn_) {
+    Flush(lk, true);
+  }
+  if (!error_.empty()) {
+    LOG(ERROR) << "WAL " << name_ << " could not be synced: " << error_;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+uint64_t WriteAheadLog::Append(const char *data, size_t size) {
+  RecordHeader header{};
+  header.size = size;
+  auto checksum = Checksum(data, size);
+
+  std::lock_guard<std::mutex> lk(mutex_);
+  header.lsn = ++last_lsn_;
+  header.checksum = checksum ^ header.lsn;
+  auto bytes = reinterpret_cast<const char *>(&header);
+  pending_.insert(pending_.end(), bytes, bytes + sizeof(header));
+  pending_.insert(pending_.end(), data, data + size);
+  // Only ever updated while holding the `mutex_`: no need for an atomic increment.
+  published_last_lsn_.store(header.lsn, std::memory_order_relaxed);
+  appends_.store(appends_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  return header.lsn;
+}
+
+void WriteAheadLog::Commit(uint64_t lsn) {
+  bool sync = options_.sync == SyncPolicy::kAlways;
+  std::unique_lock<std::mutex> lk(mutex_);
+  while ((sync ? durable_lsn_ : written_lsn_) < lsn) {
+    if (!error_.empty()) {
+      throw wal_error(error_);
+    }
+    // If no other thread is writing the buffered records, this one writes them all (its own,
+    // and those of all the threads which will be waiting for it).
+    if (!flushing_) {
+      Flush(lk, sync);
+    } else {
+      committed_.wait(lk);
+    }
+  }
+}
+
+void WriteAheadLog::Sync() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto lsn = last_lsn_;
+  while (durable_lsn_ < lsn) {
+    if (!error_.empty()) {
+      throw wal_error(error_);
+    }
+    if (!flushing_) {
+      Flush(lk, true);
+    } else {
+      committed_.wait(lk);
+    }
+  }
+}
+
+void WriteAheadLog::Flush(std::unique_lock<std::mutex> &lk, bool sync) {
+  flushing_ = true;
+  std::vector<char> batch;
+  batch.swap(pending_);
+  auto first_lsn = written_lsn_ + 1;
+  auto upto = last_lsn_;
+  bool needs_sync = sync && durable_lsn_ < upto;
+
+  // Only the leader accesses the segment, so the lock can be released while writing it.
+  lk.unlock();
+  std::string error;
+  try {
+    if (!batch.empty()) {
+      if (fd_ < 0 || segment_bytes_ >= options_.segment_size) {
+        Roll(first_lsn);
+      }
+      Write(batch.data(), batch.size());
+    }
+    if (needs_sync) {
+      DataSync();
+    }
+  } catch (const std::exception &ex) {
+    error = ex.what();
+  }
+  lk.lock();
+
+  flushing_ = false;
+  if (error.empty()) {
+    written_lsn_ = upto;
+    if (needs_sync) {
+      durable_lsn_ = upto;
+      published_durable_lsn_.store(upto, std::memory_order_relaxed);
+    }
+  } else {
+    LOG(ERROR) << "Cannot write WAL " << name_ << ": " << error;
+    error_ = error;
+  }
+  // Re-uses the buffer, to avoid re-allocating it with every commit.
+  if (pending_.empty()) {
+    batch.clear();
+    pending_.swap(batch);
+  }
+  committed_.notify_all();
+}
+
+void WriteAheadLog::Roll(uint64_t first_lsn) {
+  if (fd_ >= 0) {
+    if (options_.sync == SyncPolicy::kInterval) {
+      DataSync();
+    }
+    close(fd_);
+    fd_ = -1;
+  }
+  char filename[32];
+  snprintf(filename, sizeof(filename), "-%020lu", first_lsn);
+  segment_path_ = options_.dir + "/" + name_ + filename + kSegmentExtension;
+  fd_ = open(segment_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw wal_error(ErrorMessage("Cannot create", segment_path_));
+  }
+  segment_bytes_ = 0;
+
+  // The new segment must be found after a crash, for its records to be durable.
+  if (options_.sync != SyncPolicy::kNone) {
+    int dir_fd = open(options_.dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+  }
+  VLOG(2) << "WAL " << name_ << " rolled over to " << segment_path_;
+}
+
+void WriteAheadLog::Write(const char *data, size_t size) {
+  ++writes_;
+  while (size > 0) {
+    auto written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw wal_error(ErrorMessage("Cannot write to", segment_path_));
+    }
+    data += written;
+    size -= written;
+    segment_bytes_ += written;
+  }
+}
+
+void WriteAheadLog::DataSync() {
+  if (fd_ < 0) {
+    return;
+  }
+  ++syncs_;
+  if (fdatasync(fd_) != 0) {
+    throw wal_error(ErrorMessage("Cannot sync", segment_path_));
+  }
+}
+
+void WriteAheadLog::RunSyncer() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  while (!stopped_) {
+    stopping_.wait_for(lk, options_.sync_interval, [this] { return stopped_; });
+    if (!stopped_ && !flushing_ && error_.empty() && durable_lsn_ < last_lsn_) {
+      Flush(lk, true);
+    }
+  }
+}
+
+uint64_t WriteAheadLog::Replay(
+    uint64_t after, const std::function<void(uint64_t, const char *, size_t)> &func) const {
+  auto segments = ListSegments();
+  uint64_t replayed = 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    bool last = i + 1 == segments.size();
+    // Skips the segments whose records all precede `after`, without reading them.
+    if (!last && segments[i + 1].first_lsn <= after + 1) {
+      continue;
+    }
+    auto valid = ScanSegment(segments[i], [&](uint64_t lsn, const char *data, size_t size) {
+      if (lsn > after) {
+        func(lsn, data, size);
+        ++replayed;
+      }
+    });
+    if (valid < std::filesystem::file_size(segments[i].path)) {
+      if (!last) {
+        throw wal_error("Corrupted WAL segment: " + segments[i].path);
+      }
+      LOG(WARNING) << "Ignoring the partially written records at the end of "
+                   << segments[i].path;
+    }
+  }
+  return replayed;
+}
+
+size_t WriteAheadLog::ScanSegment(
+    const Segment &segment,
+    const std::function<void(uint64_t, const char *, size_t)> &func) const {
+  int fd = open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw wal_error(ErrorMessage("Cannot open", segment.path));
+  }
+  struct stat st{};
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw wal_error(ErrorMessage("Cannot stat", segment.path));
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw wal_error(ErrorMessage("Cannot map", segment.path));
+  }
+  madvise(mem, size, MADV_SEQUENTIAL);
+  const char *data = static_cast<const char *>(mem);
+
+  size_t pos = 0;
+  auto expected_lsn = segment.first_lsn;
+  try {
+    while (pos + sizeof(RecordHeader) <= size) {
+      RecordHeader header{};
+      memcpy(&header, data + pos, sizeof(header));
+      auto record = data + pos + sizeof(header);
+      if (header.lsn != expected_lsn || header.size > size - pos - sizeof(header) ||
+          (Checksum(record, header.size) ^ header.lsn) != header.checksum) {
+        break;
+      }
+      func(header.lsn, record, header.size);
+      pos += sizeof(header) + header.size;
+      ++expected_lsn;
+    }
+  } catch (...) {
+    munmap(mem, size);
+    throw;
+  }
+  munmap(mem, size);
+  return pos;
+}
+
+size_t WriteAheadLog::Truncate(uint64_t lsn) {
+  // The segment being written to is always the last one: it is never deleted, as there is no
+  // segment after it.
+  auto segments = ListSegments();
+  size_t deleted = 0;
+  for (size_t i = 0; i + 1 < segments.size() && segments[i + 1].first_lsn <= lsn + 1; ++i) {
+    if (unlink(segments[i].path.c_str()) != 0) {
+      LOG(ERROR) << ErrorMessage("Cannot delete", segments[i].path);
+      break;
+    }
+    ++deleted;
+  }
+  VLOG(2) << "Deleted " << deleted << " segments of WAL " << name_ << ", up to LSN " << lsn;
+  return deleted;
+}
+
+std::vector<WriteAheadLog::Segment> WriteAheadLog::ListSegments() const {
+  std::vector<Segment> segments;
+  auto prefix = name_ + "-";
+  for (const auto &file : std::filesystem::directory_iterator(options_.dir)) {
+    auto filename = file.path().filename().string();
+    if (!file.is_regular_file() || file.path().extension() != kSegmentExtension ||
+        filename.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    auto lsn = filename.substr(prefix.size(), filename.size() - prefix.size() -
+        strlen(kSegmentExtension));
+    if (lsn.empty() || !std::all_of(lsn.begin(), lsn.end(), ::isdigit)) {
+      continue;
+    }
+    segments.push_back({file.path().string(), std::stoul(lsn)});
+  }
+  std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+    return a.first_lsn < b.first_lsn;
+  });
+  return segments;
+}
+
+std::vector<std::string> WriteAheadLog::segments() const {
+  std::vector<std::string> paths;
+  for (const auto &segment : ListSegments()) {
+    paths.push_back(segment.path);
+  }
+  return paths;
+}
+
+uint64_t WriteAheadLog::last_lsn() const {
+  return published_last_lsn_.load(std::memory_order_relaxed);
+}
+
+uint64_t WriteAheadLog::durable_lsn() const {
+  return published_durable_lsn_.load(std::memory_order_relaxed);
+}
+
+json WriteAheadLog::Stats() const {
+  return {
+      {"name", name_},
+      {"last_lsn", last_lsn()},
+      {"durable_lsn", durable_lsn()},
+      {"appends", appends_.load(std::memory_order_relaxed)},
+      {"writes", writes_.load()},
+      {"syncs", syncs_.load()}
+  };
+}
+
+} // namespace keystore
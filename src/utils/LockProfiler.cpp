@@ -0,0 +1,90 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include "utils/LockProfiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace utils {
+
+LockCounts LockStats::Read() const {
+  LockCounts counts;
+  for (const auto &shard : shards_) {
+    counts.acquisitions += shard.acquisitions.load(std::memory_order_relaxed);
+    counts.contended += shard.contended.load(std::memory_order_relaxed);
+    counts.wait_nanos += shard.wait_nanos.load(std::memory_order_relaxed);
+    counts.hold_nanos += shard.hold_nanos.load(std::memory_order_relaxed);
+  }
+  return counts;
+}
+
+void LockStats::Reset() {
+  for (auto &shard : shards_) {
+    shard.acquisitions.store(0, std::memory_order_relaxed);
+    shard.contended.store(0, std::memory_order_relaxed);
+    shard.wait_nanos.store(0, std::memory_order_relaxed);
+    shard.hold_nanos.store(0, std::memory_order_relaxed);
+  }
+}
+
+LockProfiler &LockProfiler::Instance() {
+  // Never destroyed, as mutexes may still be released during the program's shutdown.
+  static auto *profiler = new LockProfiler();
+  return *profiler;
+}
+
+LockStats *LockProfiler::Register(std::string_view name) {
+  std::lock_guard<std::mutex> lk(mutex_);
+  auto pos = stats_.find(name);
+  if (pos == stats_.end()) {
+    pos = stats_.emplace(std::string{name}, std::make_unique<LockStats>()).first;
+  }
+  return pos->second.get();
+}
+
+std::vector<LockReport> LockProfiler::Hottest(size_t max_locks) const {
+  std::vector<LockReport> reports;
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    for (const auto &[name, stats] : stats_) {
+      auto counts = stats->Read();
+      if (counts.acquisitions > 0) {
+        reports.push_back({name, counts});
+      }
+    }
+  }
+  std::sort(reports.begin(), reports.end(), [](const LockReport &a, const LockReport &b) {
+    if (a.counts.wait_nanos != b.counts.wait_nanos) {
+      return a.counts.wait_nanos > b.counts.wait_nanos;
+    }
+    if (a.counts.contended != b.counts.contended) {
+      return a.counts.contended > b.counts.contended;
+    }
+    return a.counts.hold_nanos > b.counts.hold_nanos;
+  });
+  if (max_locks > 0 && reports.size() > max_locks) {
+    reports.resize(max_locks);
+  }
+  return reports;
+}
+
+void LockProfiler::Reset() {
+  std::lock_guard<std::mutex> lk(mutex_);
+  for (auto &[name, stats] : stats_) {
+    stats->Reset();
+  }
+}
+
+std::ostream &operator<<(std::ostream &out, const LockReport &report) {
+  const auto &counts = report.counts;
+  char contended[16];
+  std::snprintf(contended, sizeof(contended), "%.2f%%", counts.acquisitions > 0
+                ? 100.0 * counts.contended / counts.acquisitions : 0.0);
+  out << report.name << ": " << counts.acquisitions << " acquisitions, "
+      << counts.contended << " contended (" << contended << "), waited "
+      << counts.wait_nanos / 1000 << " usec, held " << counts.hold_nanos / 1000 << " usec";
+  return out;
+}
+
+} // namespace utils
@@ -0,0 +1,64 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#pragma once
+
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "View.hpp"
+
+/**
+ * The fixture of the tests of the stores (and files) which persist data: each test runs in a
+ * temporary directory of its own (`dir_`), removed after it, against a `View` of four buckets
+ * (`bucket-0` to `bucket-3`), all of them owned, by default, by the stores it creates.
+ */
+class TempDirFixture : public ::testing::Test {
+ protected:
+  std::string dir_;
+  std::shared_ptr<View> pv_ = make_balanced_view(4, 3);
+  std::unordered_set<std::string> buckets_{"bucket-0", "bucket-1", "bucket-2", "bucket-3"};
+
+  void SetUp() override {
+    // Named after the test suite, e.g. `/tmp/LsmTests_XXXXXX`.
+    std::string tmpl = std::string{"/tmp/"} +
+        ::testing::UnitTest::GetInstance()->current_test_info()->test_suite_name() + "_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(tmpl.data()));
+    dir_ = tmpl;
+  }
+
+  void TearDown() override {
+    if (!dir_.empty()) {
+      std::filesystem::remove_all(dir_);
+    }
+  }
+
+  /**
+   * @param name the name of the store
+   * @param buckets the buckets the store owns
+   * @param args any other arguments of the store's constructor, following the buckets
+   * @return a new `Store`, using the fixture's `View`
+   */
+  template<typename Store, typename... Args>
+  std::shared_ptr<Store> MakeStore(const std::string &name,
+                                   const std::unordered_set<std::string> &buckets,
+                                   Args &&... args) {
+    return std::make_shared<Store>(name, pv_, buckets, std::forward<Args>(args)...);
+  }
+
+  /** @return the bucket of the fixture's `View` called `name`, if any */
+  BucketPtr BucketNamed(const std::string &name) const {
+    for (const auto &bucket : pv_->buckets()) {
+      if (bucket->name() == name) {
+        return bucket;
+      }
+    }
+    return nullptr;
+  }
+};
@@ -0,0 +1,108 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <memory_resource>
+#include <unordered_map>
+
+#include <gtest/gtest.h>
+
+#include "keystore/CountMinSketch.hpp"
+#include "keystore/Eviction.hpp"
+
+using namespace keystore;
+
+TEST(CountMinSketchTests, EstimatesFrequencies) {
+  CountMinSketch sketch{1024};
+  for (int i = 0; i < 10; ++i) {
+    sketch.Increment(42);
+  }
+  sketch.Increment(7);
+
+  ASSERT_EQ(1024, sketch.width());
+  ASSERT_LE(10, sketch.Estimate(42));
+  ASSERT_LE(1, sketch.Estimate(7));
+  ASSERT_GT(sketch.Estimate(42), sketch.Estimate(7));
+}
+
+TEST(CountMinSketchTests, SaturatesAndAges) {
+  CountMinSketch sketch{64, 1000000};
+  for (int i = 0; i < 100; ++i) {
+    sketch.Increment(99);
+  }
+  ASSERT_EQ(CountMinSketch::kMaxCount, sketch.Estimate(99));
+  sketch.Age();
+  ASSERT_EQ(CountMinSketch::kMaxCount / 2, sketch.Estimate(99));
+}
+
+class TinyLfuPolicyTests : public ::testing::Test {
+ protected:
+  using Policy = TinyLfuPolicy<long, long>;
+  using Map = EntryMap<long, long>;
+
+  Map map_;
+  // Wide enough that the frequencies of the ~1,000 keys in each test are (almost) exact.
+  Policy policy_{0.01, 4096};
+
+  void Insert(long key) {
+    auto [pos, inserted] = map_.try_emplace(HashedKey<long>{key}, key);
+    ASSERT_TRUE(inserted);
+    policy_.OnInsert(&*pos);
+  }
+
+  void Access(long key) {
+    HashedKey<long> hashed{key};
+    policy_.RecordAccess(hashed.hash);
+    map_.find(hashed)->second.referenced = true;
+  }
+
+  long Evict() {
+    auto victim = policy_.SelectVictim();
+    EXPECT_NE(nullptr, victim);
+    long key = victim->first.key;
+    map_.erase(victim->first);
+    return key;
+  }
+};
+
+TEST_F(TinyLfuPolicyTests, EmptyHasNoVictim) {
+  ASSERT_EQ(nullptr, policy_.SelectVictim());
+}
+
+TEST_F(TinyLfuPolicyTests, EvictsLeastRecentlyUsed) {
+  for (long key = 0; key < 10; ++key) {
+    Insert(key);
+    policy_.Maintain();
+  }
+  ASSERT_EQ(10, policy_.size());
+  for (long key = 1; key < 10; ++key) {
+    Access(key);
+  }
+  ASSERT_EQ(0, Evict());
+  ASSERT_EQ(9, policy_.size());
+}
+
+TEST_F(TinyLfuPolicyTests, IsScanResistant) {
+  // A "hot" set of keys, accessed frequently.
+  for (long key = 0; key < 100; ++key) {
+    Insert(key);
+    for (int i = 0; i < 5; ++i) {
+      Access(key);
+    }
+    policy_.Maintain();
+  }
+
+  // A scan of keys which are only seen once should not push out any of the hot keys (other
+  // than the one which was still in the admission window, when the scan started).
+  for (long key = 1000; key < 2000; ++key) {
+    Insert(key);
+    Evict();
+  }
+  long survivors = 0;
+  for (long key = 0; key < 100; ++key) {
+    survivors += map_.count(HashedKey<long>{key});
+  }
+  ASSERT_LE(99, survivors);
+}
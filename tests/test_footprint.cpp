@@ -0,0 +1,164 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <gtest/gtest.h>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/SizeEstimator.hpp"
+
+namespace {
+
+// An event whose payload is stored elsewhere, but is owned by the event (e.g., in a memory pool).
+struct Event {
+  long id;
+  size_t payload_size;
+};
+
+} // namespace
+
+template<>
+struct keystore::SizeEstimator<Event> {
+  size_t operator()(const Event &event) const {
+    return sizeof(event) + event.payload_size;
+  }
+};
+
+using namespace keystore;
+
+class FootprintTests : public ::testing::Test {
+ protected:
+  std::shared_ptr<View> pv = make_balanced_view(5, 10);
+
+  std::unordered_set<std::string> AllBuckets() const {
+    std::unordered_set<std::string> names;
+    for (const auto &bucket : pv->buckets()) {
+      names.insert(bucket->name());
+    }
+    return names;
+  }
+};
+
+TEST_F(FootprintTests, EstimatesSizes) {
+  ASSERT_EQ(sizeof(long), EstimateSize(42L));
+
+  // Short strings are stored inline.
+  std::string small{"short"};
+  ASSERT_EQ(sizeof(std::string), EstimateSize(small));
+  std::string large(1000, 'x');
+  ASSERT_EQ(sizeof(std::string) + large.capacity() + 1, EstimateSize(large));
+
+  // Around the end of the inline buffer (15 characters, with libstdc++).
+  const auto kInline = std::string{}.capacity();
+  std::string fits(kInline, 'x');
+  ASSERT_EQ(sizeof(std::string), EstimateSize(fits));
+  std::string spills(kInline + 1, 'x');
+  ASSERT_LT(kInline, spills.capacity());
+  ASSERT_EQ(sizeof(std::string) + spills.capacity() + 1, EstimateSize(spills));
+  std::string longer(2 * kInline + 1, 'x');
+  ASSERT_EQ(sizeof(std::string) + longer.capacity() + 1, EstimateSize(longer));
+
+  std::vector<long> longs(10);
+  ASSERT_EQ(sizeof(longs) + longs.capacity() * sizeof(long), EstimateSize(longs));
+  std::vector<std::string> strings{small, large};
+  ASSERT_EQ(sizeof(strings) + strings.capacity() * sizeof(std::string) + large.capacity() + 1,
+            EstimateSize(strings));
+
+  // Types can plug their own estimators in.
+  Event event{1, 1000};
+  ASSERT_EQ(sizeof(Event) + 1000, EstimateSize(event));
+}
+
+TEST_F(FootprintTests, TracksWrites) {
+  InMemoryKeyStore<std::string, std::string> store{"test", pv, AllBuckets()};
+  auto empty = store.Footprint();
+  ASSERT_EQ(0, empty.entries);
+  ASSERT_EQ(0, empty.data_bytes);
+  ASSERT_LT(0, empty.overhead_bytes);
+
+  const std::string value(100, 'v');
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(store.Put("key-" + std::to_string(i), value));
+  }
+  auto full = store.Footprint();
+  ASSERT_EQ(1000, full.entries);
+  // Each entry holds, at least, its key and value.
+  ASSERT_GT(full.data_bytes, 1000 * (sizeof(std::string) + EstimateSize(value)));
+  ASSERT_GT(full.overhead_bytes, empty.overhead_bytes);
+
+  // Replacing a value accounts for the difference in size.
+  const std::string larger(1000, 'v');
+  ASSERT_TRUE(store.Put("key-0", larger));
+  ASSERT_EQ(full.data_bytes + EstimateSize(larger) - EstimateSize(value),
+            store.Footprint().data_bytes);
+
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(store.Remove("key-" + std::to_string(i)));
+  }
+  ASSERT_EQ(0, store.Footprint().entries);
+  ASSERT_EQ(0, store.Footprint().data_bytes);
+}
+
+TEST_F(FootprintTests, ReportedInStats) {
+  InMemoryKeyStore<std::string, Event> store{"test", pv, AllBuckets()};
+  for (int i = 0; i < 500; ++i) {
+    store.Put("key-" + std::to_string(i), Event{i, 200});
+  }
+  auto footprint = store.Footprint();
+  auto stats = store.Stats();
+  ASSERT_EQ(footprint.data_bytes, stats["memory"]["data_bytes"]);
+  ASSERT_EQ(footprint.overhead_bytes, stats["memory"]["overhead_bytes"]);
+  ASSERT_EQ(footprint.total_bytes(), stats["memory"]["total_bytes"]);
+  ASSERT_EQ(pv->EstimateSize(), stats["memory"]["view_bytes"]);
+
+  size_t bytes = 0;
+  for (const auto &bucket : stats["buckets"]) {
+    bytes += bucket["bytes"].get<size_t>();
+    ASSERT_LT(0, bucket["overhead_bytes"].get<size_t>());
+  }
+  ASSERT_EQ(footprint.data_bytes, bytes);
+  // The custom estimator accounts for the payloads.
+  ASSERT_GT(bytes, 500 * 200);
+}
+
+TEST_F(FootprintTests, FollowsBuckets) {
+  auto bucket = *pv->buckets().begin();
+  InMemoryKeyStore<long, long> store{"test", pv, AllBuckets()};
+  InMemoryKeyStore<long, long> other{"other", pv, {}};
+  for (long i = 0; i < 1000; ++i) {
+    store.Put(i, i);
+  }
+  auto moved = store.Footprint(bucket);
+  ASSERT_LT(0, moved.entries);
+  ASSERT_EQ(0, other.Footprint(bucket).entries);
+
+  auto before = store.Footprint();
+  ASSERT_TRUE(store.TransferBucket(bucket, other));
+  ASSERT_EQ(before.data_bytes - moved.data_bytes, store.Footprint().data_bytes);
+  ASSERT_EQ(moved.data_bytes, other.Footprint().data_bytes);
+  ASSERT_EQ(moved.entries, other.Footprint(bucket).entries);
+  ASSERT_EQ(0, store.Footprint(bucket).entries);
+}
+
+TEST_F(FootprintTests, CacheLimitsUseTheSameEstimates) {
+  InMemoryKeyStore<std::string, std::string> store{"test", pv, AllBuckets()};
+  for (int i = 0; i < 1000; ++i) {
+    store.Put("key-" + std::to_string(i), std::string(100, 'v'));
+  }
+  auto bytes = store.Footprint().data_bytes;
+
+  CacheOptions options;
+  options.max_bytes = bytes / 2;
+  store.EnableCache(options);
+  ASSERT_EQ(store.Stats()["cache"]["bytes"], store.Footprint().data_bytes);
+  ASSERT_LE(store.Footprint().data_bytes, bytes / 2);
+}
+
+TEST_F(FootprintTests, EstimatesViewSize) {
+  auto small = make_balanced_view(2, 5);
+  auto large = make_balanced_view(20, 5);
+  ASSERT_LT(small->EstimateSize(), large->EstimateSize());
+  ASSERT_GT(small->EstimateSize(), 10 * sizeof(float));
+}
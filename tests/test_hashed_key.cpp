@@ -0,0 +1,68 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "keystore/Entry.hpp"
+#include "keystore/HashedKey.hpp"
+
+using namespace keystore;
+
+TEST(HashedKeyTests, PositionIsTheConsistentHash) {
+  for (long key : {0L, 1L, 42L, 65534L, 65535L, 123456789L}) {
+    ASSERT_EQ(HashKey(key), HashedKey<long>{key}.position());
+  }
+  for (const auto &key : std::vector<std::string>{"", "a", "key-1",
+                                                   "a much longer key than all the others"}) {
+    ASSERT_EQ(HashKey(key), HashedKey<std::string>{key}.position());
+  }
+  ASSERT_EQ(HashKey("a key"), PositionOf(HashKey64("a key")));
+}
+
+TEST(HashedKeyTests, PacksPositions) {
+  for (float position : {0.0f, 1e-7f, 0.25f, 0.5f, 0.99999f, 1.0f}) {
+    ASSERT_EQ(position, PositionOf(PackHash(position, 0xdeadbeef)));
+  }
+  // Hashes are in the same order as the positions they contain.
+  ASSERT_LT(PackHash(0.25, UINT32_MAX), PackHash(0.5, 0));
+}
+
+TEST(HashedKeyTests, TellsApartKeysInTheSamePosition) {
+  // These all hash to the same position on the ring.
+  HashedKey<long> key{42}, same{42}, other{42 + 65535}, another{42 + 2 * 65535};
+  ASSERT_EQ(key.position(), other.position());
+  ASSERT_EQ(key.position(), another.position());
+
+  ASSERT_EQ(key, same);
+  ASSERT_NE(key.hash, other.hash);
+  ASSERT_NE(other.hash, another.hash);
+  ASSERT_FALSE(key == other);
+}
+
+TEST(HashedKeyTests, MapsNeverRehashKeys) {
+  EntryMap<std::string, long> map;
+  for (long i = 0; i < 1000; ++i) {
+    map.try_emplace(HashedKey<std::string>{"key-" + std::to_string(i)}, i);
+  }
+  // A key with the wrong hash is not found, as its hash is never recomputed.
+  ASSERT_EQ(1, map.count(HashedKey<std::string>{"key-42"}));
+  ASSERT_EQ(0, map.count(HashedKey<std::string>{"key-42", 0}));
+  ASSERT_EQ(42, map.find(HashedKey<std::string>{"key-42"})->second.value);
+}
+
+TEST(HashedKeyTests, AllocatesKeysFromTheMapResource) {
+  std::pmr::monotonic_buffer_resource arena;
+  EntryMap<std::pmr::string, long> map{&arena};
+  std::pmr::string key{"a key long enough not to fit in the string itself"};
+  auto [pos, inserted] = map.try_emplace(HashedKey<std::pmr::string>{key}, 1L);
+  ASSERT_TRUE(inserted);
+  ASSERT_EQ(&arena, pos->first.key.get_allocator().resource());
+  ASSERT_EQ(HashKey(key), pos->first.position());
+}
@@ -0,0 +1,237 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <atomic>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "keystore/InMemoryKeyStore.hpp"
+
+using namespace keystore;
+using namespace std::string_literals;
+
+class HotKeyTests : public ::testing::Test {
+ protected:
+  std::shared_ptr<View> pv = make_balanced_view(5, 10);
+
+  std::unordered_set<std::string> AllBuckets() const {
+    std::unordered_set<std::string> names;
+    for (const auto &bucket : pv->buckets()) {
+      names.insert(bucket->name());
+    }
+    return names;
+  }
+
+  static ReplicationOptions Options() {
+    ReplicationOptions options;
+    options.sample_every = 2;
+    options.promote_after = 4;
+    return options;
+  }
+
+  // The replication statistics of the bucket which `key` belongs to.
+  template<typename K, typename V>
+  json ReplicationStats(const InMemoryKeyStore<K, V> &store, const K &key) const {
+    auto bucket = pv->FindBucket(HashKey(key));
+    auto stats = store.Stats();
+    for (const auto &bucket_stats : stats["buckets"]) {
+      if (bucket_stats["name"] == bucket->name()) {
+        return bucket_stats["replication"];
+      }
+    }
+    return {};
+  }
+};
+
+TEST_F(HotKeyTests, PromotesHotKeys) {
+  InMemoryKeyStore<std::string, std::string> store{"test", pv, AllBuckets()};
+  store.EnableHotKeyReplication(Options());
+  ASSERT_TRUE(store.has_hot_key_replication());
+  ASSERT_THROW(store.EnableHotKeyReplication(), std::logic_error);
+  for (int i = 0; i < 100; ++i) {
+    store.Put("key-" + std::to_string(i), "value-" + std::to_string(i));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ("value-7", store.Get("key-7").value_or(""));
+  }
+  ASSERT_FALSE(store.Get("missing").has_value());
+
+  auto stats = ReplicationStats(store, "key-7"s);
+  ASSERT_EQ(1, stats["promotions"]);
+  ASSERT_EQ("key-7", stats["replicated"][0]["key"]);
+  // About half of the reads are served by the replicas, as the others are sampled.
+  ASSERT_GT(stats["hits"].get<uint64_t>(), 300);
+  ASSERT_EQ(stats["hits"], store.Stats()["replication"]["hits"]);
+  // All the reads are counted, whether they are served by the replicas or not.
+  ASSERT_EQ(1001, store.Counters()[OpCounter::kGets]);
+}
+
+TEST_F(HotKeyTests, SketchesCountReplicatedReads) {
+  InMemoryKeyStore<std::string, std::string> store{"test", pv, AllBuckets()};
+  store.EnableSketches();
+  store.EnableHotKeyReplication(Options());
+  store.Put("hot", "value");
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ("value", store.Get("hot").value_or(""));
+  }
+  ASSERT_GT(ReplicationStats(store, "hot"s)["hits"].get<uint64_t>(), 300);
+
+  // The reads served by the replicas are counted, as well as the sampled ones.
+  auto hot_keys = store.Sketches()->HotKeys();
+  ASSERT_EQ(1, hot_keys.size());
+  ASSERT_EQ("hot", hot_keys[0].key);
+  ASSERT_LE(1000, hot_keys[0].count);
+}
+
+TEST_F(HotKeyTests, CacheModeBypassesReplicas) {
+  InMemoryKeyStore<std::string, std::string> store{"test", pv, AllBuckets()};
+  CacheOptions options;
+  options.max_entries = 1000;
+  store.EnableCache(options);
+  store.EnableHotKeyReplication(Options());
+  store.Put("hot", "value");
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ("value", store.Get("hot").value_or(""));
+  }
+  // Every read reached the bucket, and its eviction policy.
+  auto stats = ReplicationStats(store, "hot"s);
+  ASSERT_EQ(0, stats["hits"]);
+  ASSERT_EQ(0, stats["promotions"]);
+  ASSERT_EQ(1000, store.Stats()["cache"]["hits"]);
+}
+
+TEST_F(HotKeyTests, WritesInvalidateReplicas) {
+  InMemoryKeyStore<std::string, long> store{"test", pv, AllBuckets()};
+  store.EnableHotKeyReplication(Options());
+  store.Put("hot", 1);
+  for (int i = 0; i < 100; ++i) {
+    store.Get("hot");
+  }
+  ASSERT_EQ(1, ReplicationStats(store, "hot"s)["promotions"]);
+
+  // Every read after a write sees the new value, from either the bucket or the replicas.
+  for (long value = 2; value < 10; ++value) {
+    ASSERT_TRUE(store.Put("hot", value));
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(value, store.Get("hot"));
+    }
+  }
+  auto stats = ReplicationStats(store, "hot"s);
+  ASSERT_EQ(8, stats["invalidations"]);
+  // As the key is still hot, it is replicated again after each write.
+  ASSERT_EQ(9, stats["promotions"]);
+
+  ASSERT_TRUE(store.Remove("hot"));
+  ASSERT_FALSE(store.Get("hot").has_value());
+  ASSERT_TRUE(ReplicationStats(store, "hot"s)["replicated"].empty());
+}
+
+TEST_F(HotKeyTests, ReplicasExpire) {
+  InMemoryKeyStore<std::string, long> store{"test", pv, AllBuckets()};
+  store.EnableHotKeyReplication(Options());
+  store.Put("hot", 1, std::chrono::milliseconds{100});
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(1, store.Get("hot"));
+  }
+  ASSERT_EQ(1, ReplicationStats(store, "hot"s)["promotions"]);
+  std::this_thread::sleep_for(std::chrono::milliseconds{150});
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_FALSE(store.Get("hot").has_value());
+  }
+}
+
+TEST_F(HotKeyTests, ReplacesColdestKey) {
+  auto options = Options();
+  options.max_keys = 2;
+  InMemoryKeyStore<long, long> store{"test", pv, AllBuckets()};
+  store.EnableHotKeyReplication(options);
+  // All in the same bucket.
+  std::vector<long> keys;
+  auto bucket = pv->FindBucket(HashKey(0L));
+  for (long key = 0; keys.size() < 3; ++key) {
+    if (pv->FindBucket(HashKey(key)) == bucket) {
+      store.Put(key, key);
+      keys.push_back(key);
+    }
+  }
+  for (int i = 0; i < 100; ++i) {
+    store.Get(keys[0]);
+    store.Get(keys[1]);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    store.Get(keys[2]);
+  }
+  auto stats = ReplicationStats(store, keys[0]);
+  ASSERT_EQ(3, stats["promotions"]);
+  ASSERT_EQ(1, stats["demotions"]);
+  ASSERT_EQ(2, stats["replicated"].size());
+  ASSERT_EQ(keys[2], stats["replicated"][0]["key"]);
+}
+
+TEST_F(HotKeyTests, ConcurrentReadsAndWrites) {
+  InMemoryKeyStore<std::string, long> store{"test", pv, AllBuckets()};
+  store.EnableHotKeyReplication(Options());
+  store.Put("hot", 0);
+  const long kWrites = 2000;
+
+  std::atomic_bool failed{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+      // No reader ever goes back to an older value.
+      long last = 0;
+      while (last < kWrites) {
+        auto value = store.Get("hot").value_or(-1);
+        if (value < last) {
+          failed = true;
+          return;
+        }
+        last = value;
+      }
+    });
+  }
+  for (long value = 1; value <= kWrites; ++value) {
+    store.Put("hot", value);
+    if (value % 100 == 0) {
+      std::this_thread::yield();
+    }
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  ASSERT_FALSE(failed);
+}
+
+TEST_F(HotKeyTests, ReplicasDoNotFollowBuckets) {
+  auto bucket = pv->FindBucket(HashKey(std::string{"hot"}));
+  InMemoryKeyStore<std::string, long> store{"test", pv, AllBuckets()};
+  InMemoryKeyStore<std::string, long> other{"other", pv, {}};
+  store.EnableHotKeyReplication(Options());
+  other.EnableHotKeyReplication(Options());
+  store.Put("hot", 1);
+  for (int i = 0; i < 100; ++i) {
+    store.Get("hot");
+  }
+  ASSERT_EQ(1, ReplicationStats(store, "hot"s)["replicated"].size());
+
+  // The adopting store finds out for itself whether the key is still hot.
+  ASSERT_TRUE(store.TransferBucket(bucket, other));
+  ASSERT_FALSE(store.Get("hot").has_value());
+  ASSERT_TRUE(ReplicationStats(other, "hot"s)["replicated"].empty());
+  ASSERT_EQ(1, other.Get("hot"));
+}
+
+TEST_F(HotKeyTests, InvalidOptions) {
+  InMemoryKeyStore<long, long> store{"test", pv, AllBuckets()};
+  ReplicationOptions options;
+  options.sample_every = 10;
+  ASSERT_THROW(store.EnableHotKeyReplication(options), std::invalid_argument);
+  options = {};
+  options.max_keys = 0;
+  ASSERT_THROW(store.EnableHotKeyReplication(options), std::invalid_argument);
+  ASSERT_FALSE(store.has_hot_key_replication());
+}
@@ -4,6 +4,7 @@
 // Ignore CLion warning caused by GTest TEST() macro.
 #pragma ide diagnostic ignored "cert-err58-cpp"
 
+#include <thread>
 #include <unordered_set>
 
 #include <gmock/gmock.h>
@@ -249,3 +250,642 @@ TEST_F(MultiKeyStoreTests, RemoveBucket) {
   store_lookup_by_bkt_[br->name()]->RemoveBucket(br, destinationStores);
   AssertAllKeys(kTot);
 }
+
+TEST_F(KeyStoreTests, CanMultiPutAndGet) {
+  std::vector<std::pair<std::string, long>> items;
+  std::vector<std::string> keys;
+  for (int i = 0; i < 200; ++i) {
+    items.emplace_back(std::to_string(i), 3 * i);
+    keys.push_back(std::to_string(i));
+  }
+  auto stored = store_->MultiPut(items);
+  ASSERT_EQ(items.size(), stored.size());
+  ASSERT_TRUE(std::all_of(stored.begin(), stored.end(), [](bool b) { return b; }));
+
+  // Results must be returned in the same order as the keys, regardless of their buckets.
+  std::reverse(keys.begin(), keys.end());
+  keys.emplace_back("not-there");
+  auto found = store_->MultiGet(keys);
+  ASSERT_EQ(keys.size(), found.size());
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_TRUE(found[i]) << "Missing value for " << keys[i];
+    ASSERT_EQ(3 * std::stol(keys[i]), *found[i]);
+    ASSERT_EQ(*found[i], *store_->Get(keys[i]));
+  }
+  ASSERT_FALSE(found[200]);
+}
+
+TEST_F(KeyStoreTests, CanMultiRemove) {
+  auto mapper = [](int num) { return 100 + 2 * num; };
+  Insert(1, 99, mapper);
+
+  auto removed = store_->MultiRemove({"10", "foo", "20", "10"});
+  ASSERT_THAT(removed, ::testing::ElementsAre(true, false, true, false));
+  ASSERT_FALSE(store_->Get("10"));
+  ASSERT_FALSE(store_->Get("20"));
+  Assert(21, 99, mapper);
+}
+
+TEST_F(MultiKeyStoreTests, MultiPutSkipsForeignBuckets) {
+  std::vector<std::pair<long, long>> items;
+  for (long i = 0; i < 1000; ++i) {
+    items.emplace_back(i, 100 + 2 * i);
+  }
+  unsigned long tot = 0;
+  for (const auto &store : stores_) {
+    auto stored = store->MultiPut(items);
+    for (size_t i = 0; i < items.size(); ++i) {
+      ASSERT_EQ(stored[i], store->Get(items[i].first).has_value());
+    }
+    tot += std::count(stored.begin(), stored.end(), true);
+  }
+  ASSERT_EQ(items.size(), tot);
+  AssertAllKeys(1000);
+}
+
+TEST_F(MultiKeyStoreTests, CanReAddRemovedBucket) {
+  const long kTot = 1000;
+  Insert(kTot);
+  auto br = pv_->FindBucket(0.666);
+  auto owner = store_lookup_by_bkt_[br->name()];
+  pv_->Remove(br);
+
+  std::set<KeyStorePtr<long, long>> destinationStores{stores_.begin(), stores_.end()};
+  destinationStores.erase(owner);
+  ASSERT_TRUE(owner->RemoveBucket(br, destinationStores));
+  ASSERT_EQ(1, owner->num_buckets());
+  ASSERT_FALSE(owner->RemoveBucket(br, destinationStores));
+  AssertAllKeys(kTot);
+
+  // Once the bucket is back in the View, the keys that hash to it can be stored again.
+  pv_->Add(br);
+  owner->AddBucket(br);
+  ASSERT_EQ(2, owner->num_buckets());
+  long key = 0;
+  while (pv_->FindBucket(HashKey(key)) != br) {
+    ++key;
+  }
+  ASSERT_FALSE(owner->Get(key));
+  ASSERT_TRUE(owner->Put(key, 99));
+  ASSERT_EQ(99, *owner->Get(key));
+}
+
+TEST_F(KeyStoreTests, StatsReportMemory) {
+  auto mapper = [](int num) { return num; };
+  Insert(0, 1000, mapper);
+
+  auto stats = store_->DetailedStats();
+  ASSERT_EQ(1000, stats["tot_elem_counts"]);
+  for (const auto &bucket : stats["buckets"]) {
+    auto memory = bucket["memory"];
+    ASSERT_LE(bucket["size"].get<long>(), memory["allocations"].get<long>());
+    ASSERT_LT(0, memory["bytes_per_entry"].get<double>());
+    ASSERT_LE(memory["bytes_in_use"].get<long>(), memory["bytes_reserved"].get<long>());
+  }
+}
+
+TEST(PmrKeyStoreTests, CanUsePmrStringsAndCustomArenas) {
+  using PmrStore = InMemoryKeyStore<std::pmr::string, std::pmr::string>;
+  std::shared_ptr<View> pv = make_balanced_view(3, 5);
+  PmrStore store{"pmr", pv, {"bucket-0", "bucket-1", "bucket-2"}, []() {
+    return std::make_unique<std::pmr::unsynchronized_pool_resource>();
+  }};
+
+  for (int i = 0; i < 500; ++i) {
+    std::pmr::string key{"key-" + std::to_string(i)};
+    ASSERT_TRUE(store.Put(key, std::pmr::string{"value for " + key}));
+  }
+  ASSERT_EQ("value for key-42", *store.Get(std::pmr::string{"key-42"}));
+  ASSERT_TRUE(store.Remove(std::pmr::string{"key-42"}));
+  ASSERT_FALSE(store.Get(std::pmr::string{"key-42"}));
+
+  // Not using a SlabMemoryResource, there are no memory stats.
+  auto stats = store.DetailedStats();
+  ASSERT_EQ(499, stats["tot_elem_counts"]);
+  ASSERT_FALSE(stats["buckets"][0].contains("memory"));
+}
+
+TEST(PmrKeyStoreTests, StringPayloadsAreOnlyInTheArenaForPmrStrings) {
+  static_assert(!kReleasedWithArena<std::string, std::string>);
+  static_assert(kReleasedWithArena<std::pmr::string, std::pmr::string>);
+  std::shared_ptr<View> pv = make_balanced_view(1, 5);
+  InMemoryKeyStore<std::string, std::string> store{"std", pv, {"bucket-0"}};
+  InMemoryKeyStore<std::pmr::string, std::pmr::string> pmr_store{"pmr", pv, {"bucket-0"}};
+
+  const size_t kValueSize = 200;
+  for (int i = 0; i < 1000; ++i) {
+    std::string key{"key-" + std::to_string(i)};
+    ASSERT_TRUE(store.Put(key, std::string(kValueSize, 'x')));
+    ASSERT_TRUE(pmr_store.Put(std::pmr::string{key}, std::pmr::string(kValueSize, 'x')));
+  }
+
+  // The arena only holds the nodes of the `std::string` entries: their values are allocated
+  // with `malloc`.
+  auto bytes_per_entry = [](const json &stats) {
+    return stats["buckets"][0]["memory"]["bytes_per_entry"].get<double>();
+  };
+  ASSERT_LE(bytes_per_entry(store.DetailedStats()) + kValueSize,
+            bytes_per_entry(pmr_store.DetailedStats()));
+}
+
+TEST_F(MultiKeyStoreTests, CacheModeEnforcesGlobalLimit) {
+  CacheOptions options;
+  options.max_entries = 100;
+  stores_[0]->EnableCache(options);
+  ASSERT_TRUE(stores_[0]->is_cache());
+  ASSERT_THROW(stores_[0]->EnableCache(options), std::logic_error);
+
+  for (long i = 0; i < 10000; ++i) {
+    stores_[0]->Put(i, i);
+  }
+  ASSERT_EQ(100, GetTotalCount(*stores_[0]));
+
+  auto stats = stores_[0]->Stats()["cache"];
+  ASSERT_EQ(100, stats["entries"]);
+  ASSERT_LT(0, stats["evictions"].get<long>());
+  ASSERT_EQ("global", stats["scope"]);
+}
+
+TEST_F(MultiKeyStoreTests, CacheModeEnforcesPerBucketBytes) {
+  for (long i = 0; i < 10000; ++i) {
+    stores_[1]->Put(6 * i, i);
+  }
+  CacheOptions options;
+  options.max_bytes = 2048;
+  options.scope = CacheOptions::Scope::kPerBucket;
+  stores_[1]->EnableCache(options);
+
+  auto stats = stores_[1]->Stats();
+  for (const auto &bucket : stats["buckets"]) {
+    ASSERT_LE(bucket["cache"]["bytes"].get<long>(), 2048);
+    ASSERT_LT(0, bucket["size"].get<long>());
+  }
+}
+
+TEST_F(MultiKeyStoreTests, CacheModeReportsHitRatio) {
+  CacheOptions options;
+  options.max_entries = 1000;
+  stores_[2]->EnableCache(options);
+
+  // Long keys hash to their value (modulo 65535) so we spread them around the unit circle.
+  for (long i = 0; i < 10000; ++i) {
+    stores_[2]->Put(6 * i, i);
+  }
+  long found = 0;
+  for (long i = 0; i < 10000; ++i) {
+    found += stores_[2]->Get(6 * i).has_value();
+  }
+  auto stats = stores_[2]->Stats()["cache"];
+  ASSERT_EQ(1000, found);
+  ASSERT_EQ(found, stats["hits"]);
+  ASSERT_LT(0, stats["hit_ratio"].get<double>());
+  ASSERT_GT(1, stats["hit_ratio"].get<double>());
+
+  // Removing a bucket releases its share of the cache.
+  auto bucket = *stores_[2]->buckets().begin();
+  pv_->Remove(bucket);
+  std::set<KeyStorePtr<long, long>> destinations{sink_};
+  ASSERT_TRUE(stores_[2]->RemoveBucket(bucket, destinations));
+  ASSERT_EQ(GetTotalCount(*stores_[2]), stores_[2]->Stats()["cache"]["entries"]);
+}
+
+TEST_F(KeyStoreTests, ExpiresEntries) {
+  using namespace std::chrono_literals;
+  ASSERT_TRUE(store_->Put("foo", 1, 30ms));
+  ASSERT_TRUE(store_->Put("bar", 2));
+  ASSERT_EQ(1, *store_->Get("foo"));
+
+  std::this_thread::sleep_for(60ms);
+  ASSERT_FALSE(store_->Get("foo"));
+  ASSERT_EQ(2, *store_->Get("bar"));
+
+  // The expired entry is not returned, but its memory has not been reclaimed yet.
+  auto ttl = store_->Stats()["ttl"];
+  ASSERT_EQ(1, ttl["expired_reads"]);
+  ASSERT_EQ(1, ttl["scheduled"]);
+
+  ASSERT_EQ(1, store_->Expire());
+  auto stats = store_->Stats();
+  ASSERT_EQ(1, stats["ttl"]["reclaimed"]);
+  ASSERT_EQ(0, stats["ttl"]["scheduled"]);
+  ASSERT_EQ(1, stats["tot_elem_counts"]);
+}
+
+TEST_F(KeyStoreTests, PutReplacesTtl) {
+  using namespace std::chrono_literals;
+  ASSERT_TRUE(store_->Put("foo", 1, 30ms));
+  ASSERT_TRUE(store_->Put("foo", 2));
+  ASSERT_TRUE(store_->Put("bar", 3, 1h));
+  ASSERT_TRUE(store_->Put("bar", 4, 0ms));
+
+  std::this_thread::sleep_for(60ms);
+  ASSERT_EQ(2, *store_->Get("foo"));
+  ASSERT_FALSE(store_->Get("bar"));
+  ASSERT_EQ(0, store_->Stats()["ttl"]["scheduled"]);
+}
+
+TEST_F(KeyStoreTests, WritesReclaimExpiredEntries) {
+  using namespace std::chrono_literals;
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(store_->Put(std::to_string(i), i, 10ms));
+  }
+  std::this_thread::sleep_for(30ms);
+  for (int i = 10; i < 50; ++i) {
+    ASSERT_TRUE(store_->Put(std::to_string(i), i, 1h));
+  }
+  auto stats = store_->Stats();
+  ASSERT_EQ(10, stats["ttl"]["reclaimed"]);
+  ASSERT_EQ(40, stats["ttl"]["scheduled"]);
+  ASSERT_EQ(40, stats["tot_elem_counts"]);
+}
+
+TEST_F(MultiKeyStoreTests, RemoveBucketKeepsTtl) {
+  using namespace std::chrono_literals;
+  // Long keys hash to their value (modulo 65535) so we spread them around the unit circle.
+  const long kTot = 1000;
+  for (long i = 0; i < kTot; ++i) {
+    for (const auto &store : stores_) {
+      if (store->Put(60 * i, i, 1h)) {
+        break;
+      }
+    }
+  }
+  auto br = pv_->FindBucket(0.666);
+  pv_->Remove(br);
+  std::set<KeyStorePtr<long, long>> destinations{stores_.begin(), stores_.end()};
+  auto source = store_lookup_by_bkt_[br->name()];
+  ASSERT_LT(0, source->Stats()["ttl"]["scheduled"].get<long>());
+  ASSERT_TRUE(source->RemoveBucket(br, destinations));
+
+  long found = 0, scheduled = 0;
+  for (const auto &store : stores_) {
+    scheduled += store->Stats()["ttl"]["scheduled"].get<long>();
+    for (long i = 0; i < kTot; ++i) {
+      found += store->Get(60 * i).has_value();
+    }
+  }
+  ASSERT_EQ(kTot, found);
+  ASSERT_EQ(kTot, scheduled);
+}
+
+TEST_F(MultiKeyStoreTests, RebalanceIsResumable) {
+  const long kTot = 20000;
+  Insert(kTot);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  auto source = pv_->FindBucket(0.05);
+  auto source_store = store_lookup_by_bkt_[source->name()];
+  pv_->Add(new_bkt);
+  stores_[0]->AddBucket(new_bkt);
+
+  RebalanceOptions options;
+  options.batch_size = 100;
+  options.max_batches = 1;
+  RebalanceProgress progress;
+  int calls = 0;
+  do {
+    progress = source_store->Rebalance(source, stores_[0], options);
+    ASSERT_FALSE(progress.failed);
+    ++calls;
+
+    // In between batches, the data is either in the source or in the destination bucket.
+    if (calls == 1) {
+      auto stats = source_store->DetailedStats();
+      bool reported = false;
+      for (const auto &bucket : stats["buckets"]) {
+        if (bucket["name"] == source->name()) {
+          ASSERT_EQ(1, bucket["rebalance"]["batches"]);
+          reported = true;
+        }
+      }
+      ASSERT_TRUE(reported);
+
+      unsigned long tot = 0;
+      for (const auto &store : stores_) {
+        tot += GetTotalCount(*store);
+      }
+      ASSERT_EQ(kTot, tot);
+    }
+  } while (!progress.complete);
+
+  ASSERT_LT(1, calls);
+  ASSERT_LT(0, progress.keys_moved);
+  AssertAllKeys(kTot);
+}
+
+TEST_F(MultiKeyStoreTests, RemoveBucketAfterPartialRebalance) {
+  // Long keys hash to their value (modulo 65535): the source bucket owns the keys up to 3640,
+  // before the tokens the rebalance scans, and those from 21845 to 25490.
+  const long kTot = 25000;
+  Insert(kTot);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.36});
+  auto source = pv_->FindBucket(0.36);
+  auto source_store = store_lookup_by_bkt_[source->name()];
+  pv_->Add(new_bkt);
+  stores_[0]->AddBucket(new_bkt);
+
+  RebalanceOptions options;
+  options.batch_size = 500;
+  options.max_batches = 2;
+  auto progress = source_store->Rebalance(source, stores_[0], options);
+  ASSERT_FALSE(progress.complete);
+  ASSERT_LT(0, progress.cursor.position);
+
+  // All the keys left in the source are moved, including those in the tokens already scanned.
+  pv_->Remove(source);
+  std::set<KeyStorePtr<long, long>> destinations{stores_.begin(), stores_.end()};
+  progress = source_store->RemoveBucket(source, destinations, RebalanceOptions{});
+  ASSERT_TRUE(progress.complete);
+  ASSERT_TRUE(progress.all_keys);
+  AssertAllKeys(kTot);
+}
+
+TEST_F(MultiKeyStoreTests, RebalanceRestartsOnViewChange) {
+  // As in RemoveBucketAfterPartialRebalance, the source's first arc is before the cursor.
+  const long kTot = 25000;
+  Insert(kTot);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.36});
+  auto source = pv_->FindBucket(0.36);
+  auto source_store = store_lookup_by_bkt_[source->name()];
+  pv_->Add(new_bkt);
+  stores_[0]->AddBucket(new_bkt);
+
+  RebalanceOptions options;
+  options.batch_size = 500;
+  options.max_batches = 2;
+  auto progress = source_store->Rebalance(source, stores_[0], options);
+  ASSERT_FALSE(progress.complete);
+
+  // Some of the keys in the tokens already scanned now belong to another bucket.
+  BucketPtr other_bkt = std::make_shared<Bucket>("bucket-21", std::vector<float>{0.03});
+  pv_->Add(other_bkt);
+  stores_[0]->AddBucket(other_bkt);
+  options.max_batches = 0;
+  progress = source_store->Rebalance(source, stores_[0], options);
+  ASSERT_TRUE(progress.complete);
+  ASSERT_EQ(pv_->generation(), progress.view_generation);
+  AssertAllKeys(kTot);
+}
+
+TEST_F(MultiKeyStoreTests, RebalanceIsThrottled) {
+  const long kTot = 20000;
+  Insert(kTot);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  auto source = pv_->FindBucket(0.05);
+  pv_->Add(new_bkt);
+  stores_[0]->AddBucket(new_bkt);
+
+  RebalanceOptions options;
+  options.batch_size = 10;
+  options.max_keys_per_sec = 10000;
+  unsigned long batches = 0;
+  options.on_progress = [&](const RebalanceProgress &progress) {
+    ASSERT_EQ(++batches, progress.batches);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  auto progress = store_lookup_by_bkt_[source->name()]->Rebalance(source, stores_[0], options);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  ASSERT_TRUE(progress.complete);
+  ASSERT_EQ(batches, progress.batches);
+  // The throttle only waits after each batch but the last one.
+  ASSERT_LE((progress.keys_moved - options.batch_size) / 10000.0, elapsed.count());
+  AssertAllKeys(kTot);
+}
+
+TEST_F(MultiKeyStoreTests, RebalanceOnlyScansMovedKeys) {
+  const long kTot = 20000;
+  Insert(kTot);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  auto source = pv_->FindBucket(0.05);
+  auto source_store = store_lookup_by_bkt_[source->name()];
+  pv_->Add(new_bkt);
+  stores_[0]->AddBucket(new_bkt);
+
+  auto progress = source_store->Rebalance(source, stores_[0], RebalanceOptions{});
+  ASSERT_TRUE(progress.complete);
+  ASSERT_LT(0, progress.keys_moved);
+
+  // Only the keys in the tokens around a partition point are scanned, without being moved.
+  long partition_points = 0;
+  for (const auto &bucket : pv_->buckets()) {
+    partition_points += bucket->partition_points().size();
+  }
+  ASSERT_LE(progress.keys_scanned, progress.keys_moved + 3 * partition_points);
+  AssertAllKeys(kTot);
+}
+
+TEST_F(MultiKeyStoreTests, TransferBucketHandsOverAllData) {
+  using namespace std::chrono_literals;
+  const long kTot = 1000;
+  for (long i = 0; i < kTot; ++i) {
+    for (const auto &store : stores_) {
+      if (i % 2 == 0 ? store->Put(60 * i, i) : store->Put(60 * i, i, 1h)) {
+        break;
+      }
+    }
+  }
+  auto bucket = pv_->FindBucket(0.5);
+  auto source = store_lookup_by_bkt_[bucket->name()];
+  auto destination = source == stores_[0] ? stores_[1] : stores_[0];
+  auto scheduled = source->Stats()["ttl"]["scheduled"].get<long>() +
+      destination->Stats()["ttl"]["scheduled"].get<long>();
+
+  ASSERT_TRUE(source->TransferBucket(bucket, *destination));
+  ASSERT_EQ(1, source->num_buckets());
+  ASSERT_EQ(3, destination->num_buckets());
+  ASSERT_EQ(scheduled, destination->Stats()["ttl"]["scheduled"].get<long>() +
+      source->Stats()["ttl"]["scheduled"].get<long>());
+
+  long found = 0;
+  for (long i = 0; i < kTot; ++i) {
+    for (const auto &store : stores_) {
+      auto value = store->Get(60 * i);
+      if (value) {
+        ASSERT_EQ(i, *value);
+        ++found;
+      }
+    }
+  }
+  ASSERT_EQ(kTot, found);
+
+  // The bucket's keys are now written to the destination.
+  long key = 0;
+  while (pv_->FindBucket(HashKey(key)) != bucket) {
+    ++key;
+  }
+  ASSERT_FALSE(source->Put(key, -1));
+  ASSERT_TRUE(destination->Put(key, -1));
+  ASSERT_EQ(-1, *destination->Get(key));
+
+  // The bucket is no longer owned by the source, and cannot be adopted twice.
+  ASSERT_EQ(nullptr, source->ReleaseBucket(bucket));
+  ASSERT_FALSE(source->TransferBucket(bucket, *destination));
+  auto released = destination->ReleaseBucket(bucket);
+  ASSERT_NE(nullptr, released);
+  ASSERT_TRUE(source->AdoptBucket(std::move(released)));
+  ASSERT_EQ(nullptr, released);
+  ASSERT_EQ(-1, *source->Get(key));
+}
+
+TEST_F(MultiKeyStoreTests, AdoptedBucketsAreCached) {
+  for (long i = 0; i < 10000; ++i) {
+    for (const auto &store : stores_) {
+      if (store->Put(6 * i, i)) {
+        break;
+      }
+    }
+  }
+  CacheOptions options;
+  options.max_entries = 100;
+  stores_[1]->EnableCache(options);
+  stores_[2]->EnableCache(options);
+  ASSERT_EQ(100, stores_[2]->Stats()["cache"]["entries"]);
+
+  // Adopted by a cache, the bucket's entries are evicted down to its limits.
+  auto bucket = stores_[0]->view()->FindBucket(0.1);
+  ASSERT_EQ(stores_[0], store_lookup_by_bkt_[bucket->name()]);
+  ASSERT_TRUE(stores_[0]->TransferBucket(bucket, *stores_[1]));
+  ASSERT_EQ(100, GetTotalCount(*stores_[1]));
+  ASSERT_EQ(100, stores_[1]->Stats()["cache"]["entries"]);
+
+  // Released by a cache, the bucket's entries are no longer accounted for.
+  bucket = stores_[2]->view()->FindBucket(0.9);
+  ASSERT_EQ(stores_[2], store_lookup_by_bkt_[bucket->name()]);
+  auto released = stores_[2]->ReleaseBucket(bucket);
+  auto size = released->size();
+  ASSERT_EQ(100 - size, stores_[2]->Stats()["cache"]["entries"]);
+  ASSERT_TRUE(stores_[1]->AdoptBucket(std::move(released)));
+  ASSERT_GE(100, stores_[1]->Stats()["cache"]["entries"].get<long>());
+  ASSERT_EQ(4, stores_[1]->num_buckets());
+}
+
+TEST_F(KeyStoreTests, CanIterateInBatches) {
+  Insert(0, 5000, [](int i) { return i; });
+  std::unordered_map<std::string, long> found;
+  std::string continuation;
+  int batches = 0;
+  do {
+    auto batch = store_->Iterate(continuation, 100);
+    if (!batch.done()) {
+      ASSERT_LE(100, batch.entries.size());
+    }
+    for (const auto &[key, value] : batch.entries) {
+      ASSERT_TRUE(found.emplace(key, value).second) << "Duplicate key " << key;
+    }
+    continuation = batch.continuation;
+    ++batches;
+  } while (!continuation.empty());
+  ASSERT_EQ(5000, found.size());
+  ASSERT_LE(45, batches);
+  for (const auto &[key, value] : found) {
+    ASSERT_EQ(std::stol(key), value);
+  }
+  ASSERT_THROW(store_->Iterate("bucket-0", 100), invalid_continuation);
+  ASSERT_THROW(store_->Iterate("x:bucket-0", 100), invalid_continuation);
+  ASSERT_THROW(store_->Iterate("99999999999999999999:bucket-0", 100), invalid_continuation);
+  ASSERT_THROW(store_->Iterate(std::to_string(kTokens + 1) + ":bucket-0", 100),
+               invalid_continuation);
+  ASSERT_NO_THROW(store_->Iterate(std::to_string(kTokens) + ":bucket-0", 100));
+}
+
+TEST_F(KeyStoreTests, CanIterateOverSomeBuckets) {
+  Insert(0, 5000, [](int i) { return i; });
+  auto bucket = pv_->FindBucket(0.1);
+  long expected = 0;
+  for (int i = 0; i < 5000; ++i) {
+    if (pv_->FindBucket(HashKey(std::to_string(i))) == bucket) {
+      ++expected;
+    }
+  }
+  BucketFilter filter = [&bucket](const BucketPtr &b) { return b == bucket; };
+  long count = 0;
+  std::string continuation;
+  do {
+    auto batch = store_->Iterate(continuation, 64, filter);
+    for (const auto &entry : batch.entries) {
+      ASSERT_EQ(bucket, pv_->FindBucket(HashKey(entry.first)));
+      ++count;
+    }
+    continuation = batch.continuation;
+  } while (!continuation.empty());
+  ASSERT_GT(expected, 0);
+  ASSERT_EQ(expected, count);
+}
+
+TEST_F(MultiKeyStoreTests, IterationSurvivesRemovedBuckets) {
+  Insert(10000);
+  auto &store = stores_[0];
+  auto batch = store->Iterate("", 100);
+  ASSERT_FALSE(batch.done());
+  std::unordered_set<long> found;
+  for (const auto &entry : batch.entries) {
+    found.insert(entry.first);
+  }
+
+  // The store's other bucket is handed over while the iteration is paused.
+  auto names = store->bucket_names();
+  BucketPtr moved;
+  for (const auto &b : store->buckets()) {
+    if (b->name() == names.back()) {
+      moved = b;
+    }
+  }
+  ASSERT_TRUE(store->TransferBucket(moved, *stores_[1]));
+  do {
+    batch = store->Iterate(batch.continuation, 1000);
+    for (const auto &entry : batch.entries) {
+      ASSERT_TRUE(found.insert(entry.first).second);
+    }
+  } while (!batch.done());
+  long expected = 0;
+  for (long i = 0; i < 10000; ++i) {
+    if (pv_->FindBucket(HashKey(i))->name() == names.front()) {
+      ++expected;
+      ASSERT_EQ(1, found.count(i));
+    }
+  }
+  ASSERT_EQ(expected, found.size());
+}
+
+TEST_F(KeyStoreTests, CountsOperations) {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([this, t]() {
+      for (int i = t * 1000; i < (t + 1) * 1000; ++i) {
+        store_->Put(std::to_string(i), i);
+        store_->Get(std::to_string(i));
+        store_->Get("missing-" + std::to_string(i));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_TRUE(store_->Remove("42"));
+  ASSERT_FALSE(store_->Remove("42"));
+  store_->MultiGet({"1", "2", "missing"});
+
+  auto counts = store_->Counters();
+  ASSERT_EQ(4000, counts[OpCounter::kPuts]);
+  ASSERT_EQ(8003, counts[OpCounter::kGets]);
+  ASSERT_EQ(4002, counts[OpCounter::kHits]);
+  ASSERT_EQ(4001, counts[OpCounter::kMisses]);
+  ASSERT_EQ(1, counts[OpCounter::kRemoves]);
+  ASSERT_EQ(4002 * sizeof(long), counts[OpCounter::kBytesOut]);
+  ASSERT_LT(4000 * sizeof(long), counts[OpCounter::kBytesIn]);
+
+  auto stats = store_->Stats();
+  ASSERT_EQ(3999, stats["tot_elem_counts"]);
+  ASSERT_EQ(4000, stats["ops"]["puts"]);
+  long puts = 0;
+  for (const auto &bucket : stats["buckets"]) {
+    puts += bucket["ops"]["puts"].get<long>();
+  }
+  ASSERT_EQ(4000, puts);
+}
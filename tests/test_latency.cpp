@@ -0,0 +1,113 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/LatencyHistogram.hpp"
+
+using namespace keystore;
+
+TEST(LatencyHistogramTests, BucketsCoverAllValues) {
+  ASSERT_EQ(0, LatencyHistogram::BucketOf(0));
+  ASSERT_EQ(31, LatencyHistogram::BucketOf(31));
+  ASSERT_EQ(LatencyHistogram::kNumBuckets - 1, LatencyHistogram::BucketOf(~0ULL));
+
+  // Each bucket starts right after the previous one ends, and is at most ~3% wide.
+  for (size_t bucket = 1; bucket < LatencyHistogram::kNumBuckets; ++bucket) {
+    auto lowest = LatencyHistogram::HighestValueIn(bucket - 1) + 1;
+    auto highest = LatencyHistogram::HighestValueIn(bucket);
+    ASSERT_EQ(bucket, LatencyHistogram::BucketOf(lowest));
+    ASSERT_EQ(bucket, LatencyHistogram::BucketOf(highest));
+    ASSERT_LE(highest - lowest, lowest / LatencyHistogram::kSubBuckets);
+  }
+}
+
+TEST(LatencyHistogramTests, ReportsPercentiles) {
+  LatencyHistogram histogram;
+  ASSERT_EQ(0, histogram.Snapshot(1.0).ValueAt(99.0));
+
+  for (uint64_t value = 1; value <= 10000; ++value) {
+    histogram.Record(value * 100);
+  }
+  auto snapshot = histogram.Snapshot(1.0);
+  ASSERT_EQ(10000, snapshot.count());
+  ASSERT_NEAR(500000, snapshot.ValueAt(50.0), 500000 * 0.04);
+  ASSERT_NEAR(990000, snapshot.ValueAt(99.0), 990000 * 0.04);
+  ASSERT_NEAR(999000, snapshot.ValueAt(99.9), 999000 * 0.04);
+  ASSERT_NEAR(1000000, snapshot.Max(), 1000000 * 0.04);
+  ASSERT_NEAR(500050, snapshot.Mean(), 500050 * 0.04);
+
+  // Ticks are converted to nanoseconds.
+  ASSERT_NEAR(250000, histogram.Snapshot(0.5).ValueAt(50.0), 250000 * 0.04);
+
+  histogram.Reset();
+  ASSERT_EQ(0, histogram.Snapshot(1.0).count());
+}
+
+TEST(LatencyHistogramTests, MergesThreads) {
+  LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 1; t <= 16; ++t) {
+    threads.emplace_back([&histogram, t]() {
+      for (int i = 0; i < 1000; ++i) {
+        histogram.Record(t * 1000);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto snapshot = histogram.Snapshot(1.0);
+  ASSERT_EQ(16000, snapshot.count());
+  ASSERT_NEAR(8000, snapshot.ValueAt(50.0), 8000 * 0.04);
+  ASSERT_NEAR(16000, snapshot.Max(), 16000 * 0.04);
+}
+
+TEST(LatencyHistogramTests, ExportsText) {
+  LatencyHistogram histogram;
+  for (uint64_t value : {10, 10, 20, 40}) {
+    histogram.Record(value);
+  }
+  auto text = histogram.Snapshot(1.0).ToText();
+  ASSERT_NE(std::string::npos, text.find("Percentile"));
+  ASSERT_NE(std::string::npos, text.find("      10.000 0.500000000000          2           2.00\n"))
+      << text;
+  ASSERT_NE(std::string::npos, text.find("      40.000 1.000000000000          4\n")) << text;
+  ASSERT_NE(std::string::npos, text.find("#[Total count =          4")) << text;
+}
+
+TEST(LatencyHistogramTests, StoreRecordsLatencies) {
+  if (!kLatencyHistograms) {
+    GTEST_SKIP() << "Latency histograms are compiled out";
+  }
+  std::shared_ptr<View> pv = make_balanced_view(2, 3);
+  InMemoryKeyStore<long, long> store{"test", pv, {"bucket-0", "bucket-1"}};
+  for (long i = 0; i < 20000; ++i) {
+    ASSERT_TRUE(store.Put(30 * i, i));
+    ASSERT_EQ(i, *store.Get(30 * i));
+  }
+
+  // Only a sample of the operations is timed.
+  const auto &latencies = store.Latencies();
+  auto gets = latencies[LatencyOp::kGet].Snapshot().count();
+  ASSERT_GT(gets, 20000 / kLatencySampleEvery / 2);
+  ASSERT_LT(gets, 20000 / kLatencySampleEvery * 2);
+  ASSERT_EQ(0, latencies[LatencyOp::kRemove].Snapshot().count());
+
+  auto stats = store.Stats();
+  ASSERT_EQ(gets, stats["latency"]["get"]["samples"]);
+  ASSERT_GT(stats["latency"]["put"]["p50"].get<double>(), 0);
+  ASSERT_LE(stats["latency"]["put"]["p50"].get<double>(),
+            stats["latency"]["put"]["p999"].get<double>());
+  // Finding the bucket is timed for both puts and gets.
+  ASSERT_GT(stats["latency"]["find_bucket"]["samples"].get<uint64_t>(), gets);
+  ASSERT_LE(stats["latency"]["find_bucket"]["p50"].get<double>(),
+            stats["latency"]["get"]["p50"].get<double>());
+  ASSERT_NE(std::string::npos, latencies.ToText().find("# find_bucket\n"));
+}
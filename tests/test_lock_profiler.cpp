@@ -0,0 +1,115 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "utils/LockProfiler.hpp"
+
+using namespace utils;
+
+// When compiled out, the profiled mutexes are exactly the mutexes they wrap.
+static_assert(kLockProfiling
+              || sizeof(ProfiledMutex<std::shared_mutex>) == sizeof(std::shared_mutex));
+
+TEST(LockProfilerTests, ReportsHottestLocks) {
+  auto &profiler = LockProfiler::Instance();
+  auto *cold = profiler.Register("profiler-test/cold");
+  auto *hot = profiler.Register("profiler-test/hot");
+  ASSERT_EQ(hot, profiler.Register("profiler-test/hot"));
+  profiler.Register("profiler-test/unused");
+
+  for (int i = 0; i < 100; ++i) {
+    cold->Acquired(false, 0);
+    cold->Released(10);
+    hot->Acquired(i % 2 == 0, 1000);
+    hot->Released(100);
+  }
+  std::vector<LockReport> reports;
+  for (const auto &report : profiler.Hottest()) {
+    if (report.name.rfind("profiler-test/", 0) == 0) {
+      reports.push_back(report);
+    }
+  }
+  ASSERT_EQ(2, reports.size());
+  ASSERT_EQ("profiler-test/hot", reports[0].name);
+  ASSERT_EQ(100, reports[0].counts.acquisitions);
+  ASSERT_EQ(50, reports[0].counts.contended);
+  ASSERT_EQ(50000, reports[0].counts.wait_nanos);
+  ASSERT_EQ(10000, reports[0].counts.hold_nanos);
+  ASSERT_EQ("profiler-test/cold", reports[1].name);
+  ASSERT_EQ(0, reports[1].counts.contended);
+
+  std::ostringstream out;
+  out << reports[0];
+  ASSERT_EQ("profiler-test/hot: 100 acquisitions, 50 contended (50.00%), waited 50 usec, "
+            "held 10 usec", out.str());
+
+  cold->Reset();
+  hot->Reset();
+  ASSERT_EQ(0, hot->Read().acquisitions);
+}
+
+TEST(LockProfilerTests, ProfilesContendedMutex) {
+  if (!kLockProfiling) {
+    GTEST_SKIP() << "Lock profiling is compiled out";
+  }
+  ProfiledMutex<std::mutex> mutex{"profiler-test/contended"};
+  std::atomic<bool> locked{false};
+  std::thread holder([&]() {
+    std::lock_guard<ProfiledMutex<std::mutex>> lk(mutex);
+    locked = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  });
+  while (!locked) {
+    std::this_thread::yield();
+  }
+  {
+    std::lock_guard<ProfiledMutex<std::mutex>> lk(mutex);
+  }
+  holder.join();
+
+  auto counts = LockProfiler::Instance().Register("profiler-test/contended")->Read();
+  ASSERT_EQ(2, counts.acquisitions);
+  ASSERT_EQ(1, counts.contended);
+  ASSERT_GT(counts.wait_nanos, 5'000'000);
+  ASSERT_GE(counts.hold_nanos, 20'000'000);
+}
+
+TEST(LockProfilerTests, ProfilesSharedLocks) {
+  if (!kLockProfiling) {
+    GTEST_SKIP() << "Lock profiling is compiled out";
+  }
+  ProfiledMutex<std::shared_mutex> mutex{"profiler-test/shared"};
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&mutex]() {
+      std::shared_lock<ProfiledMutex<std::shared_mutex>> lk(mutex);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  auto counts = LockProfiler::Instance().Register("profiler-test/shared")->Read();
+  ASSERT_EQ(4, counts.acquisitions);
+  ASSERT_EQ(0, counts.contended);
+  ASSERT_GE(counts.hold_nanos, 40'000'000);
+
+  // The bucket locks are named after their store and bucket.
+  std::shared_ptr<View> pv = make_balanced_view(2, 3);
+  keystore::InMemoryKeyStore<long, long> store{"profiled", pv, {"bucket-0", "bucket-1"}};
+  for (long i = 0; i < 100; ++i) {
+    store.Put(30 * i, i);
+  }
+  auto bucket = LockProfiler::Instance().Register("profiled/bucket-0")->Read();
+  ASSERT_GT(bucket.acquisitions, 0);
+  ASSERT_GT(LockProfiler::Instance().Register("View::partition_map_mx_")->Read().acquisitions, 0);
+}
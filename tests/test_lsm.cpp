@@ -0,0 +1,389 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "TempDirFixture.hpp"
+
+#include "keystore/BloomFilter.hpp"
+#include "keystore/LsmKeyStore.hpp"
+#include "keystore/SSTable.hpp"
+
+using namespace keystore;
+
+using KSll = LsmKeyStore<long, long>;
+using KSss = LsmKeyStore<std::string, std::string>;
+
+class LsmTests : public TempDirFixture { };
+
+TEST(BloomFilterTests, HasFewFalsePositives) {
+  BloomFilter filter{10000, 10};
+  for (long i = 0; i < 10000; ++i) {
+    filter.Add(HashKey64(i));
+  }
+  // Once saved and loaded back, the filter is the same.
+  BloomFilter loaded{filter.data()};
+  int false_positives = 0;
+  for (long i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(loaded.MayContain(HashKey64(i)));
+    if (loaded.MayContain(HashKey64(i + 10000))) {
+      ++false_positives;
+    }
+  }
+  ASSERT_LT(false_positives, 300);
+}
+
+TEST_F(LsmTests, CanWriteAndReadTables) {
+  auto path = dir_ + "/table.sst";
+  {
+    SSTableWriter writer{path, 256, 10};
+    for (long i = 0; i < 1000; ++i) {
+      writer.Add(i * 10, std::to_string(i), "value-" + std::to_string(i), i % 7 == 0);
+    }
+    writer.Finish();
+  }
+  ASSERT_FALSE(std::filesystem::exists(path + ".tmp"));
+
+  SSTable table{path};
+  ASSERT_EQ(1000, table.entries());
+  ASSERT_EQ(0, table.min_hash());
+  ASSERT_EQ(9990, table.max_hash());
+  std::string value;
+  for (long i = 0; i < 1000; ++i) {
+    auto result = table.Get(i * 10, std::to_string(i), &value);
+    if (i % 7 == 0) {
+      ASSERT_EQ(SSTable::Lookup::kDeleted, result);
+    } else {
+      ASSERT_EQ(SSTable::Lookup::kFound, result);
+      ASSERT_EQ("value-" + std::to_string(i), value);
+    }
+    // Same hash, different key.
+    ASSERT_EQ(SSTable::Lookup::kMissing, table.Get(i * 10, "other", &value));
+    ASSERT_EQ(SSTable::Lookup::kMissing, table.Get(i * 10 + 5, std::to_string(i), &value));
+  }
+
+  long count = 0;
+  for (auto it = table.NewIterator(); it->Valid(); it->Next()) {
+    ASSERT_EQ(count * 10, it->hash());
+    ASSERT_EQ(count % 7 == 0, it->deleted());
+    ++count;
+  }
+  ASSERT_EQ(1000, count);
+}
+
+TEST_F(LsmTests, DetectsCorruptedTables) {
+  auto path = dir_ + "/table.sst";
+  {
+    SSTableWriter writer{path, 256, 10};
+    for (long i = 0; i < 100; ++i) {
+      writer.Add(i, std::to_string(i), std::string(20, 'x'));
+    }
+    writer.Finish();
+  }
+  {
+    std::fstream file{path, std::ios::in | std::ios::out | std::ios::binary};
+    file.seekp(100);
+    file.put('!');
+  }
+  SSTable table{path};
+  ASSERT_THROW({
+    for (auto it = table.NewIterator(); it->Valid(); it->Next()) { }
+  }, lsm_error);
+
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+  ASSERT_THROW(SSTable{path}, lsm_error);
+}
+
+TEST_F(LsmTests, MergesNewestFirst) {
+  auto write = [this](const std::string &name, long from, const std::string &value) {
+    SSTableWriter writer{dir_ + "/" + name, 4096, 10};
+    for (long i = from; i < from + 10; ++i) {
+      writer.Add(i, "key", value, value.empty());
+    }
+    writer.Finish();
+    return std::make_unique<SSTable>(dir_ + "/" + name);
+  };
+  auto newer = write("newer.sst", 5, "");
+  auto older = write("older.sst", 0, "old");
+  std::vector<std::unique_ptr<EntryIterator>> sources;
+  sources.push_back(newer->NewIterator());
+  sources.push_back(older->NewIterator());
+  MergingIterator merged{std::move(sources)};
+  long count = 0;
+  for (; merged.Valid(); merged.Next()) {
+    ASSERT_EQ(count, merged.hash());
+    ASSERT_EQ(count >= 5, merged.deleted());
+    ++count;
+  }
+  ASSERT_EQ(15, count);
+}
+
+class LsmKeyStoreTests : public LsmTests {
+ protected:
+  LsmOptions options_;
+
+  void SetUp() override {
+    LsmTests::SetUp();
+    // Small enough that the data is flushed, and compacted across a few levels.
+    options_.dir = dir_ + "/store";
+    options_.memtable_size = 16 * 1024;
+    options_.block_size = 512;
+    options_.l0_compaction_trigger = 2;
+    options_.level_base_size = 32 * 1024;
+    options_.level_multiplier = 4;
+    options_.table_size = 8 * 1024;
+    options_.sync = SyncPolicy::kNone;
+  }
+
+  std::shared_ptr<KSll> MakeStore(const std::string &name,
+                                  const std::unordered_set<std::string> &buckets) {
+    auto options = options_;
+    options.dir = dir_ + "/" + name;
+    return TempDirFixture::MakeStore<KSll>(name, buckets, options);
+  }
+
+  static void Insert(KeyStore<long, long> &store, long count) {
+    for (long i = 0; i < count; ++i) {
+      ASSERT_TRUE(store.Put(30 * i, i));
+    }
+  }
+};
+
+TEST_F(LsmKeyStoreTests, CanPutGetRemove) {
+  KSll store{"test", pv_, buckets_, options_};
+  Insert(store, 2000);
+  for (long i = 0; i < 2000; i += 3) {
+    ASSERT_TRUE(store.Put(30 * i, -i));
+  }
+  for (long i = 0; i < 2000; i += 5) {
+    ASSERT_TRUE(store.Remove(30 * i));
+    ASSERT_FALSE(store.Remove(30 * i));
+  }
+  auto check = [&store]() {
+    for (long i = 0; i < 2000; ++i) {
+      auto value = store.Get(30 * i);
+      if (i % 5 == 0) {
+        ASSERT_FALSE(value) << "Unexpected value for " << i;
+      } else {
+        ASSERT_EQ(i % 3 == 0 ? -i : i, *value);
+      }
+    }
+  };
+  check();
+  store.Flush();
+  check();
+
+  auto stats = store.Stats();
+  ASSERT_EQ(4, stats["buckets"].size());
+  ASSERT_GT(stats["tot_tables"].get<long>(), 0);
+  long compactions = 0;
+  for (const auto &bucket : stats["buckets"]) {
+    compactions += bucket["compactions"].get<long>();
+    ASSERT_EQ(0, bucket["memtable_bytes"]);
+  }
+  ASSERT_GT(compactions, 0);
+  ASSERT_FALSE(store.Get(-1));
+}
+
+TEST_F(LsmKeyStoreTests, RecoversAfterRestart) {
+  {
+    KSll store{"test", pv_, buckets_, options_};
+    Insert(store, 2000);
+    for (long i = 0; i < 2000; i += 2) {
+      ASSERT_TRUE(store.Remove(30 * i));
+    }
+  }
+  // Some of the writes are in the tables, the others in the logs.
+  KSll store{"test", pv_, buckets_, options_};
+  for (long i = 0; i < 2000; ++i) {
+    auto value = store.Get(30 * i);
+    if (i % 2 == 0) {
+      ASSERT_FALSE(value);
+    } else {
+      ASSERT_EQ(i, *value);
+    }
+  }
+}
+
+TEST_F(LsmKeyStoreTests, CanStoreStrings) {
+  KSss store{"strings", pv_, buckets_, options_};
+  std::vector<std::pair<std::string, std::string>> items;
+  for (int i = 0; i < 1000; ++i) {
+    items.emplace_back("key-" + std::to_string(i), std::string(i % 100, 'v'));
+  }
+  for (auto stored : store.MultiPut(items)) {
+    ASSERT_TRUE(stored);
+  }
+  store.Flush();
+  ASSERT_EQ(std::string(42, 'v'), *store.Get("key-42"));
+  ASSERT_EQ("", *store.Get("key-100"));
+  ASSERT_FALSE(store.Get("key-1000"));
+}
+
+TEST_F(LsmKeyStoreTests, CanRebalance) {
+  auto source = MakeStore("source", buckets_);
+  auto destination = MakeStore("destination", {});
+  Insert(*source, 2000);
+  source->Flush();
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  std::set<BucketPtr> rebalance_bkts;
+  for (auto ppt : new_bkt->partition_points()) {
+    rebalance_bkts.insert(pv_->FindBucket(ppt));
+  }
+  pv_->Add(new_bkt);
+  destination->AddBucket(new_bkt);
+  for (const auto &bucket : rebalance_bkts) {
+    ASSERT_TRUE(source->Rebalance(bucket, destination));
+  }
+  long moved = 0;
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == new_bkt) {
+      ASSERT_EQ(i, *destination->Get(30 * i));
+      ++moved;
+    } else {
+      ASSERT_EQ(i, *source->Get(30 * i));
+    }
+  }
+  ASSERT_GT(moved, 0);
+}
+
+TEST_F(LsmKeyStoreTests, CanRemoveBucket) {
+  auto first = MakeStore("first", {"bucket-0", "bucket-1"});
+  auto second = MakeStore("second", {"bucket-2", "bucket-3"});
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_TRUE(first->Put(30 * i, i) || second->Put(30 * i, i));
+  }
+  auto removed = pv_->FindBucket(0.666);
+  pv_->Remove(removed);
+  auto owner = removed->name() < "bucket-2" ? first : second;
+  ASSERT_TRUE(owner->RemoveBucket(removed, {first, second}));
+  ASSERT_FALSE(std::filesystem::exists(dir_ + "/" + owner->name() + "/" + removed->name()));
+  for (long i = 0; i < 2000; ++i) {
+    auto value = first->Get(30 * i);
+    if (!value) {
+      value = second->Get(30 * i);
+    }
+    ASSERT_EQ(i, *value);
+  }
+}
+
+TEST_F(LsmKeyStoreTests, CanTransferBucket) {
+  auto source = MakeStore("source", buckets_);
+  auto destination = MakeStore("destination", {});
+  Insert(*source, 2000);
+  auto bucket = pv_->FindBucket(0.5);
+
+  ASSERT_TRUE(source->TransferBucket(bucket, *destination));
+  ASSERT_FALSE(source->TransferBucket(bucket, *destination));
+  ASSERT_FALSE(std::filesystem::exists(dir_ + "/source/" + bucket->name()));
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+      ASSERT_EQ(i, *destination->Get(30 * i));
+      ASSERT_FALSE(source->Get(30 * i));
+    } else {
+      ASSERT_EQ(i, *source->Get(30 * i));
+    }
+  }
+  // The bucket can still be written to, in its new store.
+  ASSERT_TRUE(destination->Put(30 * 1000, -1) || source->Put(30 * 1000, -1));
+}
+
+TEST_F(LsmKeyStoreTests, DoesNotLoseConcurrentWrites) {
+  auto source = MakeStore("source", buckets_);
+  auto destination = MakeStore("destination", {});
+  auto bucket = pv_->FindBucket(0.5);
+  auto removed = pv_->FindBucket(0.1);
+  ASSERT_NE(bucket, removed);
+
+  // Writes to the buckets being transferred and removed either succeed, and are then found in the
+  // destination, or fail.
+  std::vector<std::vector<long>> written(4);
+  std::vector<std::thread> threads;
+  for (long t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t]() {
+      for (long i = t; i < 8000; i += 4) {
+        if (source->Put(30 * i, i)) {
+          written[t].push_back(i);
+        }
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  ASSERT_TRUE(source->TransferBucket(bucket, *destination));
+  pv_->Remove(removed);
+  ASSERT_TRUE(source->RemoveBucket(removed, {source, destination}));
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (const auto &keys : written) {
+    for (long i : keys) {
+      auto value = source->Get(30 * i);
+      if (!value) {
+        value = destination->Get(30 * i);
+      }
+      ASSERT_TRUE(value) << "Lost key " << 30 * i;
+      ASSERT_EQ(i, *value);
+    }
+  }
+}
+
+TEST_F(LsmKeyStoreTests, KeepsTreeOfBucketAddedTwice) {
+  auto store = MakeStore("test", buckets_);
+  Insert(*store, 2000);
+  store->AddBucket(pv_->FindBucket(0.5));
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_EQ(i, *store->Get(30 * i));
+  }
+  ASSERT_EQ(4, store->Stats()["buckets"].size());
+}
+
+TEST_F(LsmKeyStoreTests, CanExportBucket) {
+  auto source = MakeStore("source", buckets_);
+  Insert(*source, 2000);
+  auto bucket = pv_->FindBucket(0.1);
+  auto files = source->ExportBucket(bucket, dir_ + "/export");
+  ASSERT_FALSE(files.empty());
+  ASSERT_THROW(source->ExportBucket(bucket, dir_ + "/export"), lsm_error);
+
+  // As if the files were shipped to another host.
+  std::filesystem::create_directories(dir_ + "/remote");
+  std::filesystem::copy(dir_ + "/export", dir_ + "/remote/" + bucket->name());
+  auto remote = MakeStore("remote", {bucket->name()});
+  long found = 0;
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+      ASSERT_EQ(i, *remote->Get(30 * i));
+      ++found;
+    }
+  }
+  ASSERT_GT(found, 0);
+}
+
+TEST_F(LsmKeyStoreTests, CanWriteConcurrently) {
+  KSll store{"test", pv_, buckets_, options_};
+  std::vector<std::thread> threads;
+  for (long t = 0; t < 4; ++t) {
+    threads.emplace_back([&store, t]() {
+      for (long i = t; i < 4000; i += 4) {
+        ASSERT_TRUE(store.Put(15 * i, i));
+        ASSERT_EQ(i, *store.Get(15 * i));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  store.Flush();
+  for (long i = 0; i < 4000; ++i) {
+    ASSERT_EQ(i, *store.Get(15 * i));
+  }
+}
@@ -0,0 +1,311 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "TempDirFixture.hpp"
+
+#include "keystore/MmapKeyStore.hpp"
+
+using namespace keystore;
+
+using KSll = MmapKeyStore<long, long>;
+using KSss = MmapKeyStore<std::string, std::string>;
+
+class MmapTests : public TempDirFixture { };
+
+TEST_F(MmapTests, CanPutGetRemove) {
+  // Starts small, so that the table is rehashed a few times.
+  MmapHashTable table{dir_ + "/table.ht", 16};
+  for (long i = 0; i < 10000; ++i) {
+    table.Put(HashKey64(i), std::to_string(i), "value-" + std::to_string(i));
+  }
+  ASSERT_EQ(10000, table.size());
+  for (long i = 0; i < 10000; i += 3) {
+    ASSERT_TRUE(table.Remove(HashKey64(i), std::to_string(i)));
+    ASSERT_FALSE(table.Remove(HashKey64(i), std::to_string(i)));
+  }
+  // Values which outgrow their record are moved; the others overwritten in place.
+  for (long i = 1; i < 10000; i += 3) {
+    table.Put(HashKey64(i), std::to_string(i), std::string(i % 200, 'x'));
+  }
+  for (long i = 0; i < 10000; ++i) {
+    auto value = table.Get(HashKey64(i), std::to_string(i));
+    if (i % 3 == 0) {
+      ASSERT_FALSE(value);
+    } else if (i % 3 == 1) {
+      ASSERT_EQ(std::string(i % 200, 'x'), *value);
+    } else {
+      ASSERT_EQ("value-" + std::to_string(i), *value);
+    }
+    // Same hash, different key.
+    ASSERT_FALSE(table.Get(HashKey64(i), "other"));
+  }
+
+  long count = 0;
+  table.ForEach([&count](uint64_t hash, std::string_view key, std::string_view) {
+    ASSERT_EQ(HashKey64(std::stol(std::string{key})), hash);
+    ++count;
+  });
+  ASSERT_EQ(table.size(), count);
+  auto stats = table.Stats();
+  ASSERT_GE(stats["capacity"].get<long>(), 10000);
+  ASSERT_GT(stats["free_bytes"].get<long>(), 0);
+}
+
+TEST_F(MmapTests, ReusesFreedSpace) {
+  MmapHashTable table{dir_ + "/table.ht", 1024};
+  for (long i = 0; i < 500; ++i) {
+    table.Put(HashKey64(i), std::to_string(i), std::string(100, 'v'));
+  }
+  auto heap_bytes = table.Stats()["heap_bytes"].get<long>();
+  for (int round = 0; round < 10; ++round) {
+    for (long i = 0; i < 500; ++i) {
+      ASSERT_TRUE(table.Remove(HashKey64(i), std::to_string(i)));
+    }
+    for (long i = 0; i < 500; ++i) {
+      table.Put(HashKey64(i), std::to_string(i), std::string(100, 'v'));
+    }
+  }
+  ASSERT_EQ(heap_bytes, table.Stats()["heap_bytes"].get<long>());
+}
+
+TEST_F(MmapTests, CanReopen) {
+  auto path = dir_ + "/table.ht";
+  {
+    MmapHashTable table{path, 16};
+    for (long i = 0; i < 1000; ++i) {
+      table.Put(HashKey64(i), std::to_string(i), std::to_string(-i));
+    }
+  }
+  MmapHashTable table{path};
+  ASSERT_EQ(1000, table.size());
+  for (long i = 0; i < 1000; ++i) {
+    ASSERT_EQ(std::to_string(-i), *table.Get(HashKey64(i), std::to_string(i)));
+  }
+}
+
+TEST_F(MmapTests, RejectsInvalidFiles) {
+  auto path = dir_ + "/table.ht";
+  {
+    std::ofstream out{path};
+    out << "this is not a hash table";
+  }
+  ASSERT_THROW(MmapHashTable{path}, mmap_error);
+  ASSERT_THROW(MmapHashTable{dir_ + "/missing/table.ht"}, mmap_error);
+}
+
+class MmapKeyStoreTests : public MmapTests {
+ protected:
+  std::shared_ptr<KSll> MakeStore(const std::string &name,
+                                  const std::unordered_set<std::string> &buckets) {
+    return TempDirFixture::MakeStore<KSll>(name, buckets, MmapOptions{dir_ + "/" + name, 64});
+  }
+
+  static void Insert(KeyStore<long, long> &store, long count) {
+    for (long i = 0; i < count; ++i) {
+      ASSERT_TRUE(store.Put(30 * i, i));
+    }
+  }
+};
+
+TEST_F(MmapKeyStoreTests, CanPutGetRemove) {
+  auto store = MakeStore("test", buckets_);
+  Insert(*store, 2000);
+  for (long i = 0; i < 2000; i += 3) {
+    ASSERT_TRUE(store->Put(30 * i, -i));
+  }
+  for (long i = 0; i < 2000; i += 5) {
+    ASSERT_TRUE(store->Remove(30 * i));
+    ASSERT_FALSE(store->Remove(30 * i));
+  }
+  for (long i = 0; i < 2000; ++i) {
+    auto value = store->Get(30 * i);
+    if (i % 5 == 0) {
+      ASSERT_FALSE(value) << "Unexpected value for " << i;
+    } else {
+      ASSERT_EQ(i % 3 == 0 ? -i : i, *value);
+    }
+  }
+  auto stats = store->Stats();
+  ASSERT_EQ(4, stats["buckets"].size());
+  ASSERT_EQ(1600, stats["tot_elem_counts"]);
+}
+
+TEST_F(MmapKeyStoreTests, CanReopen) {
+  {
+    auto store = MakeStore("test", buckets_);
+    Insert(*store, 2000);
+    store->Sync();
+  }
+  auto store = MakeStore("test", buckets_);
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_EQ(i, *store->Get(30 * i));
+  }
+}
+
+TEST_F(MmapKeyStoreTests, CanStoreStrings) {
+  KSss store{"strings", pv_, buckets_, MmapOptions{dir_ + "/strings"}};
+  std::vector<std::pair<std::string, std::string>> items;
+  for (int i = 0; i < 1000; ++i) {
+    items.emplace_back("key-" + std::to_string(i), std::string(i % 100, 'v'));
+  }
+  for (auto stored : store.MultiPut(items)) {
+    ASSERT_TRUE(stored);
+  }
+  ASSERT_EQ(std::string(42, 'v'), *store.Get("key-42"));
+  ASSERT_EQ("", *store.Get("key-100"));
+  ASSERT_FALSE(store.Get("key-1000"));
+}
+
+TEST_F(MmapKeyStoreTests, CanRebalance) {
+  auto source = MakeStore("source", buckets_);
+  auto destination = MakeStore("destination", {});
+  Insert(*source, 2000);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  std::set<BucketPtr> rebalance_bkts;
+  for (auto ppt : new_bkt->partition_points()) {
+    rebalance_bkts.insert(pv_->FindBucket(ppt));
+  }
+  pv_->Add(new_bkt);
+  destination->AddBucket(new_bkt);
+  for (const auto &bucket : rebalance_bkts) {
+    ASSERT_TRUE(source->Rebalance(bucket, destination));
+  }
+  long moved = 0;
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == new_bkt) {
+      ASSERT_EQ(i, *destination->Get(30 * i));
+      ++moved;
+    } else {
+      ASSERT_EQ(i, *source->Get(30 * i));
+    }
+  }
+  ASSERT_GT(moved, 0);
+  ASSERT_EQ(2000 - moved, source->Stats()["tot_elem_counts"]);
+}
+
+TEST_F(MmapKeyStoreTests, CanRemoveBucket) {
+  auto first = MakeStore("first", {"bucket-0", "bucket-1"});
+  auto second = MakeStore("second", {"bucket-2", "bucket-3"});
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_TRUE(first->Put(30 * i, i) || second->Put(30 * i, i));
+  }
+  auto removed = pv_->FindBucket(0.666);
+  pv_->Remove(removed);
+  auto owner = removed->name() < "bucket-2" ? first : second;
+  ASSERT_TRUE(owner->RemoveBucket(removed, {first, second}));
+  ASSERT_FALSE(std::filesystem::exists(
+      dir_ + "/" + owner->name() + "/" + removed->name() + ".ht"));
+  for (long i = 0; i < 2000; ++i) {
+    auto value = first->Get(30 * i);
+    if (!value) {
+      value = second->Get(30 * i);
+    }
+    ASSERT_EQ(i, *value);
+  }
+}
+
+TEST_F(MmapKeyStoreTests, CanTransferBucket) {
+  auto source = MakeStore("source", buckets_);
+  auto destination = MakeStore("destination", {});
+  Insert(*source, 2000);
+  auto bucket = pv_->FindBucket(0.5);
+
+  ASSERT_TRUE(source->TransferBucket(bucket, *destination));
+  ASSERT_FALSE(source->TransferBucket(bucket, *destination));
+  ASSERT_FALSE(std::filesystem::exists(dir_ + "/source/" + bucket->name() + ".ht"));
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+      ASSERT_EQ(i, *destination->Get(30 * i));
+      ASSERT_FALSE(source->Get(30 * i));
+    } else {
+      ASSERT_EQ(i, *source->Get(30 * i));
+    }
+  }
+  ASSERT_TRUE(destination->Put(30 * 1000, -1) || source->Put(30 * 1000, -1));
+}
+
+TEST_F(MmapKeyStoreTests, CannotTransferBucketToItself) {
+  auto store = MakeStore("test", buckets_);
+  Insert(*store, 2000);
+  ASSERT_FALSE(store->TransferBucket(pv_->FindBucket(0.5), *store));
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_EQ(i, *store->Get(30 * i));
+  }
+}
+
+TEST_F(MmapKeyStoreTests, KeepsTableOfBucketAddedTwice) {
+  auto store = MakeStore("test", buckets_);
+  Insert(*store, 2000);
+  store->AddBucket(pv_->FindBucket(0.5));
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_EQ(i, *store->Get(30 * i));
+  }
+  ASSERT_EQ(4, store->Stats()["buckets"].size());
+}
+
+namespace {
+
+// Overwrites one of the keys being moved, in the store it is moved from, while it is copied.
+class OverwritingStore : public KSll {
+ public:
+  using KSll::KSll;
+
+  std::shared_ptr<KSll> source;
+  long key = 0;
+
+  std::vector<bool> MultiPut(const std::vector<std::pair<long, long>> &items) override {
+    if (source) {
+      source->Put(key, -1);
+      source.reset();
+    }
+    return KSll::MultiPut(items);
+  }
+};
+
+} // namespace
+
+TEST_F(MmapKeyStoreTests, MovesEntriesOverwrittenWhileCopied) {
+  auto source = MakeStore("source", buckets_);
+  Insert(*source, 2000);
+  auto destination = TempDirFixture::MakeStore<OverwritingStore>(
+      "destination", buckets_, MmapOptions{dir_ + "/destination", 64});
+  destination->source = source;
+  destination->key = 30 * 7;
+  auto bucket = pv_->FindBucket(HashKey(30 * 7L));
+
+  ASSERT_TRUE(source->RemoveBucket(bucket, {destination}));
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+      ASSERT_EQ(i == 7 ? -1 : i, *destination->Get(30 * i));
+    }
+  }
+}
+
+TEST_F(MmapKeyStoreTests, CanWriteConcurrently) {
+  auto store = MakeStore("test", buckets_);
+  std::vector<std::thread> threads;
+  for (long t = 0; t < 4; ++t) {
+    threads.emplace_back([&store, t]() {
+      for (long i = t; i < 8000; i += 4) {
+        ASSERT_TRUE(store->Put(15 * i, i));
+        ASSERT_EQ(i, *store->Get(15 * i));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (long i = 0; i < 8000; ++i) {
+    ASSERT_EQ(i, *store->Get(15 * i));
+  }
+}
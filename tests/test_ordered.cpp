@@ -0,0 +1,289 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <map>
+#include <random>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "keystore/OrderedKeyStore.hpp"
+
+using namespace keystore;
+
+using KSll = OrderedKeyStore<long, long>;
+using KSss = OrderedKeyStore<std::string, std::string>;
+
+TEST(BPlusTreeTests, MatchesMap) {
+  BPlusTree<long, long> tree;
+  std::map<long, long> expected;
+  std::mt19937 rnd{42};
+  for (int i = 0; i < 50000; ++i) {
+    long key = rnd() % 20000;
+    if (rnd() % 3 == 0) {
+      ASSERT_EQ(expected.erase(key) > 0, tree.Erase(key));
+    } else {
+      ASSERT_EQ(expected.count(key) == 0, tree.Insert(key, i));
+      expected[key] = i;
+    }
+  }
+  ASSERT_EQ(expected.size(), tree.size());
+  ASSERT_GT(tree.height(), 2);
+
+  auto it = tree.begin();
+  for (const auto &[key, value] : expected) {
+    ASSERT_TRUE(it.valid());
+    ASSERT_EQ(key, it.key());
+    ASSERT_EQ(value, it.value());
+    ASSERT_EQ(value, *tree.Find(key));
+    ++it;
+  }
+  ASSERT_FALSE(it.valid());
+  for (long key = -1; key <= 20000; key += 7) {
+    auto lower = tree.LowerBound(key);
+    auto expected_lower = expected.lower_bound(key);
+    if (expected_lower == expected.end()) {
+      ASSERT_FALSE(lower.valid());
+    } else {
+      ASSERT_EQ(expected_lower->first, lower.key());
+    }
+  }
+}
+
+TEST(BPlusTreeTests, CanRemoveAll) {
+  BPlusTree<long, long> tree;
+  for (long i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(tree.Insert(i, i));
+  }
+  for (long i = 0; i < 10000; i += 2) {
+    ASSERT_TRUE(tree.Erase(i));
+  }
+  for (long i = 9999; i > 0; i -= 2) {
+    ASSERT_TRUE(tree.Erase(i));
+    ASSERT_FALSE(tree.Erase(i));
+  }
+  ASSERT_TRUE(tree.empty());
+  ASSERT_EQ(1, tree.height());
+  ASSERT_FALSE(tree.begin().valid());
+  ASSERT_FALSE(tree.LowerBound(0).valid());
+  ASSERT_TRUE(tree.Insert(5, 5));
+  ASSERT_EQ(5, tree.begin().key());
+}
+
+class OrderedKeyStoreTests : public ::testing::Test {
+ protected:
+  std::shared_ptr<View> pv_ = make_balanced_view(4, 3);
+  std::unordered_set<std::string> buckets_{"bucket-0", "bucket-1", "bucket-2", "bucket-3"};
+
+  static void Insert(KeyStore<long, long> &store, long count) {
+    for (long i = 0; i < count; ++i) {
+      ASSERT_TRUE(store.Put(30 * i, i));
+    }
+  }
+};
+
+TEST_F(OrderedKeyStoreTests, CanPutGetRemove) {
+  KSll store{"test", pv_, buckets_};
+  Insert(store, 2000);
+  for (long i = 0; i < 2000; i += 3) {
+    ASSERT_TRUE(store.Put(30 * i, -i));
+  }
+  for (long i = 0; i < 2000; i += 5) {
+    ASSERT_TRUE(store.Remove(30 * i));
+    ASSERT_FALSE(store.Remove(30 * i));
+  }
+  for (long i = 0; i < 2000; ++i) {
+    auto value = store.Get(30 * i);
+    if (i % 5 == 0) {
+      ASSERT_FALSE(value) << "Unexpected value for " << i;
+    } else {
+      ASSERT_EQ(i % 3 == 0 ? -i : i, *value);
+    }
+  }
+  auto stats = store.Stats();
+  ASSERT_EQ(4, stats["num_buckets"]);
+  ASSERT_EQ(1600, stats["tot_elem_counts"]);
+}
+
+TEST_F(OrderedKeyStoreTests, ScansAcrossBuckets) {
+  KSll store{"test", pv_, buckets_};
+  Insert(store, 2000);
+  auto entries = store.Scan(30 * 100, 30 * 1500, 10000);
+  ASSERT_EQ(1400, entries.size());
+  for (long i = 0; i < 1400; ++i) {
+    ASSERT_EQ(30 * (i + 100), entries[i].first);
+    ASSERT_EQ(i + 100, entries[i].second);
+  }
+  // Bounds need not be keys in the store.
+  entries = store.Scan(30 * 100 + 1, 30 * 103 + 1, 10000);
+  ASSERT_EQ(3, entries.size());
+  ASSERT_EQ(30 * 101, entries[0].first);
+
+  // Longer than a batch, but limited.
+  entries = store.Scan(0, 30 * 2000, 1000);
+  ASSERT_EQ(1000, entries.size());
+  ASSERT_EQ(30 * 999, entries.back().first);
+  ASSERT_TRUE(store.Scan(0, 30 * 2000, 0).empty());
+  ASSERT_TRUE(store.Scan(30 * 2000, 30 * 3000, 10).empty());
+}
+
+TEST_F(OrderedKeyStoreTests, CanPrefixScan) {
+  KSss store{"strings", pv_, buckets_};
+  for (int day = 10; day < 20; ++day) {
+    for (int hour = 10; hour < 24; ++hour) {
+      auto key = "2020-06-" + std::to_string(day) + "T" + std::to_string(hour);
+      ASSERT_TRUE(store.Put(key, "event-" + std::to_string(day * 100 + hour)));
+    }
+  }
+  auto entries = store.PrefixScan("2020-06-14", 100);
+  ASSERT_EQ(14, entries.size());
+  for (int i = 0; i < 14; ++i) {
+    ASSERT_EQ("2020-06-14T" + std::to_string(10 + i), entries[i].first);
+    ASSERT_EQ("event-" + std::to_string(1410 + i), entries[i].second);
+  }
+  ASSERT_EQ(140, store.PrefixScan("2020-06", 1000).size());
+  ASSERT_EQ(5, store.PrefixScan("2020-06", 5).size());
+  ASSERT_TRUE(store.PrefixScan("2020-07", 10).empty());
+}
+
+TEST_F(OrderedKeyStoreTests, CanRebalance) {
+  auto source = std::make_shared<KSll>("source", pv_, buckets_);
+  auto destination = std::make_shared<KSll>("destination", pv_, std::unordered_set<std::string>{});
+  Insert(*source, 2000);
+
+  BucketPtr new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  std::set<BucketPtr> rebalance_bkts;
+  for (auto ppt : new_bkt->partition_points()) {
+    rebalance_bkts.insert(pv_->FindBucket(ppt));
+  }
+  pv_->Add(new_bkt);
+  destination->AddBucket(new_bkt);
+  for (const auto &bucket : rebalance_bkts) {
+    ASSERT_TRUE(source->Rebalance(bucket, destination));
+  }
+  long moved = 0;
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == new_bkt) {
+      ASSERT_EQ(i, *destination->Get(30 * i));
+      ++moved;
+    } else {
+      ASSERT_EQ(i, *source->Get(30 * i));
+    }
+  }
+  ASSERT_GT(moved, 0);
+  ASSERT_EQ(2000 - moved, source->Scan(0, 30 * 2000, 2000).size());
+  ASSERT_EQ(moved, destination->Scan(0, 30 * 2000, 2000).size());
+}
+
+TEST_F(OrderedKeyStoreTests, CanRemoveBucket) {
+  auto first = std::make_shared<KSll>(
+      "first", pv_, std::unordered_set<std::string>{"bucket-0", "bucket-1"});
+  auto second = std::make_shared<KSll>(
+      "second", pv_, std::unordered_set<std::string>{"bucket-2", "bucket-3"});
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_TRUE(first->Put(30 * i, i) || second->Put(30 * i, i));
+  }
+  auto removed = pv_->FindBucket(0.666);
+  pv_->Remove(removed);
+  auto owner = removed->name() < "bucket-2" ? first : second;
+  ASSERT_TRUE(owner->RemoveBucket(removed, {first, second}));
+  for (long i = 0; i < 2000; ++i) {
+    auto value = first->Get(30 * i);
+    if (!value) {
+      value = second->Get(30 * i);
+    }
+    ASSERT_EQ(i, *value);
+  }
+}
+
+TEST_F(OrderedKeyStoreTests, CanTransferBucket) {
+  KSll source{"source", pv_, buckets_};
+  KSll destination{"destination", pv_, {}};
+  Insert(source, 2000);
+  auto bucket = pv_->FindBucket(0.5);
+
+  ASSERT_TRUE(source.TransferBucket(bucket, destination));
+  ASSERT_FALSE(source.TransferBucket(bucket, destination));
+  ASSERT_FALSE(destination.TransferBucket(bucket, destination));
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+      ASSERT_EQ(i, *destination.Get(30 * i));
+      ASSERT_FALSE(source.Get(30 * i));
+    } else {
+      ASSERT_EQ(i, *source.Get(30 * i));
+    }
+  }
+  ASSERT_EQ(2000, source.Scan(0, 30 * 2000, 2000).size()
+      + destination.Scan(0, 30 * 2000, 2000).size());
+}
+
+namespace {
+
+// Overwrites one of the keys being moved, in the store it is moved from, while it is copied.
+class OverwritingStore : public KSll {
+ public:
+  using KSll::KSll;
+
+  std::shared_ptr<KSll> source;
+  long key = 0;
+
+  std::vector<bool> MultiPut(const std::vector<std::pair<long, long>> &items) override {
+    if (source) {
+      source->Put(key, -1);
+      source.reset();
+    }
+    return KSll::MultiPut(items);
+  }
+};
+
+} // namespace
+
+TEST_F(OrderedKeyStoreTests, MovesEntriesOverwrittenWhileCopied) {
+  auto source = std::make_shared<KSll>("source", pv_, buckets_);
+  for (long i = 0; i < 2000; ++i) {
+    ASSERT_TRUE(source->Put(30 * i, i));
+  }
+  auto destination = std::make_shared<OverwritingStore>("destination", pv_, buckets_);
+  destination->source = source;
+  destination->key = 30 * 7;
+  auto bucket = pv_->FindBucket(HashKey(30 * 7L));
+
+  ASSERT_TRUE(source->RemoveBucket(bucket, {destination}));
+  for (long i = 0; i < 2000; ++i) {
+    if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+      ASSERT_EQ(i == 7 ? -1 : i, *destination->Get(30 * i));
+    }
+  }
+}
+
+TEST_F(OrderedKeyStoreTests, CanScanWhileWriting) {
+  KSll store{"test", pv_, buckets_};
+  Insert(store, 2000);
+  std::atomic<bool> done{false};
+  std::thread writer([&store, &done]() {
+    // Only odd keys are added and removed: the even ones must always be found.
+    for (long round = 0; round < 20; ++round) {
+      for (long i = 1; i < 2000; i += 2) {
+        ASSERT_TRUE(round % 2 == 0 ? store.Remove(30 * i) : store.Put(30 * i, i));
+      }
+    }
+    done = true;
+  });
+  while (!done) {
+    auto entries = store.Scan(0, 30 * 2000, 5000);
+    long evens = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (i > 0) {
+        ASSERT_LT(entries[i - 1].first, entries[i].first);
+      }
+      if (entries[i].second % 2 == 0) {
+        ++evens;
+      }
+    }
+    ASSERT_EQ(1000, evens);
+  }
+  writer.join();
+}
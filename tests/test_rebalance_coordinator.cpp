@@ -0,0 +1,146 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <gtest/gtest.h>
+
+#include "keystore/RebalanceCoordinator.hpp"
+
+using namespace keystore;
+
+using KSll = InMemoryKeyStore<long, long>;
+using KSllPtr = std::shared_ptr<KSll>;
+
+/**
+ * Refuses to store any data, so that the moves to it fail.
+ */
+class RejectingStore : public KeyStore<long, long> {
+ public:
+  RejectingStore() : KeyStore("rejecting") { }
+
+  bool Put(const long &key, const long &value) override { return false; }
+  [[nodiscard]] std::optional<long> Get(const long &key) const override { return {}; }
+  bool Remove(const long &key) override { return false; }
+};
+
+class RebalanceCoordinatorTests : public ::testing::Test {
+ protected:
+  static constexpr long kTot = 10000;
+
+  std::shared_ptr<View> pv_;
+  std::vector<KSllPtr> stores_;
+  std::map<std::string, KSllPtr> store_by_bucket_;
+
+  void SetUp() override {
+    pv_ = make_balanced_view(6, 3);
+    for (int i = 0; i < 3; ++i) {
+      std::string b1{"bucket-" + std::to_string(2 * i)}, b2{"bucket-" + std::to_string(2 * i + 1)};
+      auto store = std::make_shared<KSll>("store-" + std::to_string(i), pv_,
+                                          std::unordered_set<std::string>{b1, b2});
+      stores_.push_back(store);
+      store_by_bucket_[b1] = store;
+      store_by_bucket_[b2] = store;
+    }
+    // Long keys hash to their value (modulo 65535) so we spread them around the unit circle.
+    for (long i = 0; i < kTot; ++i) {
+      bool stored = false;
+      for (const auto &store : stores_) {
+        stored = stored || store->Put(6 * i, i);
+      }
+      ASSERT_TRUE(stored);
+    }
+  }
+
+  void AssertAllKeys() {
+    for (long i = 0; i < kTot; ++i) {
+      long found = 0;
+      for (const auto &store : stores_) {
+        auto value = store->Get(6 * i);
+        if (value) {
+          ASSERT_EQ(i, *value);
+          ++found;
+        }
+      }
+      ASSERT_EQ(1, found) << "Key " << 6 * i;
+    }
+  }
+};
+
+TEST_F(RebalanceCoordinatorTests, RebalancesInParallel) {
+  auto new_bkt = std::make_shared<Bucket>("bucket-20", std::vector<float>{0.05, 0.58});
+  std::set<BucketPtr> sources;
+  for (auto ppt : new_bkt->partition_points()) {
+    sources.insert(pv_->FindBucket(ppt));
+  }
+  ASSERT_EQ(2, sources.size());
+  pv_->Add(new_bkt);
+  stores_[0]->AddBucket(new_bkt);
+
+  RebalanceOptions options;
+  options.batch_size = 100;
+  RebalanceCoordinator<long, long> coordinator{2, options};
+  for (const auto &source : sources) {
+    coordinator.Rebalance(store_by_bucket_[source->name()], source, stores_[0]);
+  }
+  ASSERT_EQ(2, coordinator.size());
+
+  auto results = coordinator.Run();
+  ASSERT_EQ(0, coordinator.size());
+  ASSERT_EQ(2, results.size());
+  auto pos = sources.begin();
+  for (const auto &result : results) {
+    ASSERT_TRUE(result.success());
+    ASSERT_EQ((*pos++)->name(), result.progress.bucket);
+    ASSERT_LT(0, result.progress.keys_moved);
+    ASSERT_LT(0, result.progress.bytes_moved);
+    ASSERT_EQ(0, result.progress.keys_failed);
+    json j = result;
+    ASSERT_EQ("rebalance", j["kind"]);
+  }
+  AssertAllKeys();
+}
+
+TEST_F(RebalanceCoordinatorTests, RemovesBucketsInParallel) {
+  std::vector<BucketPtr> removed{pv_->FindBucket(0.2), pv_->FindBucket(0.7)};
+  ASSERT_NE(removed[0], removed[1]);
+  for (const auto &bucket : removed) {
+    pv_->Remove(bucket);
+  }
+
+  RebalanceCoordinator<long, long> coordinator{4};
+  std::set<KeyStorePtr<long, long>> destinations{stores_.begin(), stores_.end()};
+  for (const auto &bucket : removed) {
+    coordinator.RemoveBucket(store_by_bucket_[bucket->name()], bucket, destinations);
+  }
+  auto results = coordinator.Run();
+
+  int num_buckets = 0;
+  for (const auto &store : stores_) {
+    num_buckets += store->num_buckets();
+  }
+  ASSERT_EQ(4, num_buckets);
+  for (const auto &result : results) {
+    ASSERT_TRUE(result.success()) << json(result).dump();
+    ASSERT_LT(0, result.progress.keys_moved);
+  }
+  AssertAllKeys();
+}
+
+TEST_F(RebalanceCoordinatorTests, ReportsFailures) {
+  auto bucket = pv_->FindBucket(0.5);
+  pv_->Remove(bucket);
+
+  RebalanceCoordinator<long, long> coordinator{1};
+  coordinator.RemoveBucket(store_by_bucket_[bucket->name()], bucket,
+                           {std::make_shared<RejectingStore>()});
+  auto results = coordinator.Run();
+
+  ASSERT_EQ(1, results.size());
+  ASSERT_FALSE(results[0].success());
+  ASSERT_TRUE(results[0].progress.failed);
+  ASSERT_LT(0, results[0].progress.keys_failed);
+  ASSERT_EQ(0, results[0].progress.keys_moved);
+  ASSERT_EQ(2, store_by_bucket_[bucket->name()]->num_buckets());
+}
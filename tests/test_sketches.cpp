@@ -0,0 +1,228 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <random>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "keystore/HyperLogLog.hpp"
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/KeySketches.hpp"
+#include "keystore/Workload.hpp"
+
+using namespace keystore;
+
+TEST(HyperLogLogTests, EstimatesCardinality) {
+  for (uint64_t n : {10, 1000, 100000}) {
+    HyperLogLog hll;
+    for (uint64_t i = 0; i < n; ++i) {
+      // Duplicates do not count.
+      hll.Add(HashedKey<long>{static_cast<long>(i)}.hash);
+      hll.Add(HashedKey<long>{static_cast<long>(i)}.hash);
+    }
+    ASSERT_NEAR(n, hll.Estimate(), n * 0.05) << "with " << n << " distinct items";
+  }
+  ASSERT_THROW(HyperLogLog{2}, std::invalid_argument);
+  ASSERT_THROW(HyperLogLog{30}, std::invalid_argument);
+}
+
+TEST(HyperLogLogTests, Merges) {
+  HyperLogLog first, second;
+  for (uint64_t i = 0; i < 20000; ++i) {
+    first.Add(i);
+  }
+  // Half of these overlap with the first.
+  for (uint64_t i = 10000; i < 30000; ++i) {
+    second.Add(i);
+  }
+  first.Merge(second);
+  ASSERT_NEAR(30000, first.Estimate(), 30000 * 0.05);
+
+  HyperLogLog other{10};
+  ASSERT_THROW(first.Merge(other), std::invalid_argument);
+  first.Reset();
+  ASSERT_EQ(0, first.Estimate());
+}
+
+TEST(CountMinSketchTests, MergesWideCounts) {
+  WideCountMinSketch first{1024, WideCountMinSketch::kNoAging};
+  WideCountMinSketch second{1024, WideCountMinSketch::kNoAging};
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ(i + 1, first.Increment(42));
+  }
+  for (int i = 0; i < 500; ++i) {
+    second.Increment(42);
+  }
+  first.Merge(second);
+  ASSERT_EQ(1500, first.Estimate(42));
+
+  WideCountMinSketch narrow{64};
+  ASSERT_THROW(first.Merge(narrow), std::invalid_argument);
+  first.Reset();
+  ASSERT_EQ(0, first.Estimate(42));
+}
+
+TEST(KeySketchesTests, FindsHotKeys) {
+  SketchOptions options;
+  options.top_k = 5;
+  KeySketches<long> sketches{options};
+
+  ZipfianGenerator zipfian{10000};
+  std::mt19937_64 rnd{7};
+  for (int i = 0; i < 100000; ++i) {
+    long key = static_cast<long>(zipfian.Next(rnd));
+    sketches.Record(key, HashedKey<long>{key}.hash);
+  }
+  auto hot = sketches.HotKeys();
+  ASSERT_EQ(5, hot.size());
+  // The most popular items of a Zipfian distribution are the ones with the lowest rank.
+  for (const auto &key : hot) {
+    ASSERT_LT(key.key, 10);
+  }
+  ASSERT_EQ(0, hot[0].key);
+  ASSERT_GE(hot[0].count, hot[1].count);
+  // About 10% of the accesses (see `WorkloadTests.ZipfianIsSkewed`).
+  ASSERT_NEAR(10000, hot[0].count, 3000);
+  ASSERT_LT(sketches.DistinctKeys(), 10000);
+  ASSERT_GT(sketches.DistinctKeys(), 1000);
+}
+
+TEST(KeySketchesTests, MergesHotKeys) {
+  SketchOptions options;
+  options.top_k = 3;
+  KeySketches<std::string> first{options}, second{options};
+  auto record = [](KeySketches<std::string> &sketches, const std::string &key, int times) {
+    for (int i = 0; i < times; ++i) {
+      sketches.Record(key, HashedKey<std::string>{key}.hash);
+    }
+  };
+  record(first, "a", 100);
+  record(first, "b", 50);
+  record(first, "c", 40);
+  record(second, "c", 40);
+  record(second, "d", 60);
+  record(second, "e", 10);
+
+  // "c" is only the third most accessed key in each, but the hottest overall.
+  first.Merge(second);
+  auto hot = first.HotKeys();
+  ASSERT_EQ(3, hot.size());
+  ASSERT_EQ("a", hot[0].key);
+  ASSERT_EQ("c", hot[1].key);
+  ASSERT_EQ(80, hot[1].count);
+  ASSERT_EQ("d", hot[2].key);
+  ASSERT_EQ(5, first.DistinctKeys());
+
+  KeySketches<std::string> copy{first};
+  ASSERT_EQ(100, copy.HotKeys()[0].count);
+
+  options.top_k = 5;
+  KeySketches<std::string> other{options};
+  ASSERT_THROW(first.Merge(other), std::invalid_argument);
+}
+
+TEST(KeySketchesTests, ConcurrentRecords) {
+  KeySketches<long> sketches{SketchOptions{}};
+  std::vector<std::thread> threads;
+  for (long t = 0; t < 4; ++t) {
+    threads.emplace_back([&sketches, t]() {
+      for (long i = 0; i < 10000; ++i) {
+        // Every thread hits key 0 once every 10 accesses.
+        long key = i % 10 == 0 ? 0 : t * 10000 + i;
+        sketches.Record(key, HashedKey<long>{key}.hash);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto hot = sketches.HotKeys();
+  ASSERT_EQ(0, hot[0].key);
+  ASSERT_LE(4000, hot[0].count);
+  ASSERT_NEAR(36000, sketches.DistinctKeys(), 36000 * 0.05);
+}
+
+class KeyStoreSketchesTests : public ::testing::Test {
+ protected:
+  std::shared_ptr<View> pv = make_balanced_view(5, 10);
+
+  std::unordered_set<std::string> AllBuckets() const {
+    std::unordered_set<std::string> names;
+    for (const auto &bucket : pv->buckets()) {
+      names.insert(bucket->name());
+    }
+    return names;
+  }
+};
+
+TEST_F(KeyStoreSketchesTests, RecordsAccesses) {
+  InMemoryKeyStore<std::string, std::string> store{"test", pv, AllBuckets()};
+  ASSERT_EQ(nullptr, store.Sketches());
+  auto before = store.Footprint().overhead_bytes;
+  store.EnableSketches();
+  ASSERT_TRUE(store.has_sketches());
+  ASSERT_THROW(store.EnableSketches(), std::logic_error);
+  ASSERT_GT(store.Footprint().overhead_bytes, before);
+
+  for (int i = 0; i < 1000; ++i) {
+    store.Put("key-" + std::to_string(i), "value");
+  }
+  for (int i = 0; i < 100; ++i) {
+    store.Get("hot");
+    store.MultiGet({"hot", "key-1"});
+  }
+  store.Put("hot", "value", std::chrono::milliseconds{1000});
+
+  auto sketches = store.Sketches();
+  ASSERT_NEAR(1001, sketches->DistinctKeys(), 50);
+  auto hot = sketches->HotKeys();
+  ASSERT_EQ("hot", hot[0].key);
+  ASSERT_EQ(201, hot[0].count);
+  ASSERT_EQ("key-1", hot[1].key);
+  ASSERT_EQ(101, hot[1].count);
+
+  auto stats = store.Stats();
+  ASSERT_EQ("hot", stats["sketches"]["hot_keys"][0]["key"]);
+  ASSERT_EQ(201, stats["sketches"]["hot_keys"][0]["count"]);
+  ASSERT_EQ(sketches->DistinctKeys(), stats["sketches"]["distinct_keys"]);
+  uint64_t distinct = 0;
+  for (const auto &bucket : stats["buckets"]) {
+    distinct += bucket["sketches"]["distinct_keys"].get<uint64_t>();
+  }
+  ASSERT_NEAR(1001, distinct, 50);
+
+  store.ResetSketches();
+  ASSERT_EQ(0, store.Sketches()->DistinctKeys());
+  ASSERT_TRUE(store.Sketches()->HotKeys().empty());
+}
+
+TEST_F(KeyStoreSketchesTests, MergeAcrossStores) {
+  auto bucket = *pv->buckets().begin();
+  auto others = AllBuckets();
+  others.erase(bucket->name());
+  InMemoryKeyStore<long, long> store{"test", pv, {bucket->name()}};
+  InMemoryKeyStore<long, long> other{"other", pv, others};
+  store.EnableSketches();
+  other.EnableSketches();
+  ASSERT_EQ(nullptr, other.Sketches(bucket));
+
+  for (long i = 0; i < 5000; ++i) {
+    store.Put(i, i);
+    other.Put(i, i);
+  }
+  auto sketches = store.Sketches();
+  sketches->Merge(*other.Sketches());
+  ASSERT_NEAR(5000, sketches->DistinctKeys(), 250);
+
+  // The bucket's sketches follow it to the other store.
+  auto moved = store.Sketches(bucket)->DistinctKeys();
+  ASSERT_LT(0, moved);
+  ASSERT_TRUE(store.TransferBucket(bucket, other));
+  ASSERT_EQ(moved, other.Sketches(bucket)->DistinctKeys());
+  ASSERT_EQ(0, store.Sketches()->DistinctKeys());
+  ASSERT_NEAR(5000, other.Sketches()->DistinctKeys(), 250);
+}
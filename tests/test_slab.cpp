@@ -0,0 +1,97 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+
+#include <gtest/gtest.h>
+
+#include "keystore/SlabMemoryResource.hpp"
+
+using namespace keystore;
+
+/**
+ * Upstream resource which keeps track of how many bytes are outstanding, so that we can verify
+ * that everything is eventually returned.
+ */
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  long outstanding_ = 0;
+
+ protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    outstanding_ += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    outstanding_ -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+TEST(SlabMemoryResourceTests, ReusesFreedBlocks) {
+  SlabMemoryResource slab;
+
+  void *p = slab.allocate(40);
+  ASSERT_EQ(48, slab.bytes_in_use());
+  slab.deallocate(p, 40);
+  ASSERT_EQ(0, slab.bytes_in_use());
+
+  // Same size class, so we get the same block back.
+  void *q = slab.allocate(33);
+  ASSERT_EQ(p, q);
+  ASSERT_EQ(2, slab.allocations());
+  ASSERT_EQ(1, slab.deallocations());
+  ASSERT_EQ(SlabMemoryResource::kChunkSize, slab.bytes_reserved());
+}
+
+TEST(SlabMemoryResourceTests, BlocksAreAligned) {
+  SlabMemoryResource slab;
+  for (size_t size = 1; size <= SlabMemoryResource::kMaxBlockSize; size += 7) {
+    auto p = reinterpret_cast<uintptr_t>(slab.allocate(size));
+    ASSERT_EQ(0, p % SlabMemoryResource::kGranularity) << "Misaligned block for size " << size;
+  }
+}
+
+TEST(SlabMemoryResourceTests, ReleaseReturnsEverythingUpstream) {
+  CountingResource upstream;
+  {
+    SlabMemoryResource slab{&upstream};
+    std::pmr::unordered_map<long, std::pmr::string> map{&slab};
+    for (long i = 0; i < 10000; ++i) {
+      map.emplace(i, "a value that is long enough to need a heap allocation: " +
+          std::to_string(i));
+    }
+    ASSERT_LT(0, upstream.outstanding_);
+    ASSERT_EQ(upstream.outstanding_, slab.bytes_reserved());
+    ASSERT_LE(slab.bytes_in_use(), slab.bytes_reserved());
+
+    // The map's entries are simply dropped, without being destroyed.
+    auto leaked = new(slab.allocate(sizeof(map), alignof(decltype(map))))
+        std::pmr::unordered_map<long, std::pmr::string>(std::move(map));
+    ASSERT_EQ(10000, leaked->size());
+    slab.release();
+    ASSERT_EQ(0, upstream.outstanding_);
+    ASSERT_EQ(0, slab.bytes_in_use());
+  }
+  ASSERT_EQ(0, upstream.outstanding_);
+}
+
+TEST(SlabMemoryResourceTests, LargeBlocksGoUpstream) {
+  CountingResource upstream;
+  SlabMemoryResource slab{&upstream};
+
+  void *p = slab.allocate(4096);
+  ASSERT_EQ(4096, upstream.outstanding_);
+  ASSERT_EQ(4096, slab.bytes_in_use());
+  slab.deallocate(p, 4096);
+  ASSERT_EQ(0, upstream.outstanding_);
+  ASSERT_EQ(0, slab.bytes_reserved());
+}
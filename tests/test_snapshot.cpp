@@ -0,0 +1,149 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <filesystem>
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "TempDirFixture.hpp"
+
+#include "keystore/InMemoryKeyStore.hpp"
+
+using namespace keystore;
+using namespace std::chrono_literals;
+
+using KSll = InMemoryKeyStore<long, long>;
+using KSss = InMemoryKeyStore<std::string, std::string>;
+
+class SnapshotTests : public TempDirFixture { };
+
+TEST_F(SnapshotTests, CanRoundTripABucket) {
+  auto store = MakeStore<KSll>("source", buckets_);
+  for (long i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(store->Put(6 * i, i));
+  }
+  auto bucket = BucketNamed("bucket-0");
+  auto path = SnapshotPath(dir_, bucket->name());
+
+  // Small batches, so that the snapshot is written in several steps.
+  auto saved = store->Snapshot(bucket, path, 100);
+  ASSERT_TRUE(saved.error.empty());
+  ASSERT_GT(saved.entries, 0);
+  ASSERT_EQ(std::filesystem::file_size(path), saved.bytes);
+
+  auto restored_store = std::make_unique<KSll>("restored", pv_,
+      std::unordered_set<std::string>{"bucket-0"});
+  auto restored = restored_store->Restore(path);
+  ASSERT_EQ("bucket-0", restored.bucket);
+  ASSERT_EQ(saved.entries, restored.entries);
+
+  long found = 0;
+  for (long i = 0; i < 10000; ++i) {
+    if (pv_->FindBucket(HashKey(6 * i)) == bucket) {
+      auto value = restored_store->Get(6 * i);
+      ASSERT_TRUE(value) << "Missing key " << 6 * i;
+      ASSERT_EQ(i, *value);
+      ++found;
+    }
+  }
+  ASSERT_EQ(saved.entries, found);
+}
+
+TEST_F(SnapshotTests, CanRoundTripStrings) {
+  auto store = MakeStore<KSss>("source", buckets_);
+  for (int i = 0; i < 5000; ++i) {
+    ASSERT_TRUE(store->Put("key-" + std::to_string(i), std::string(i % 100, 'x')));
+  }
+  auto results = store->SnapshotAll(dir_, 2);
+  ASSERT_EQ(4, results.size());
+  for (const auto &result : results) {
+    ASSERT_TRUE(result.error.empty()) << result.error;
+  }
+
+  auto restored = MakeStore<KSss>("restored", buckets_);
+  long entries = 0;
+  for (const auto &result : restored->RestoreAll(dir_, 2)) {
+    ASSERT_TRUE(result.error.empty()) << result.error;
+    entries += result.entries;
+  }
+  ASSERT_EQ(5000, entries);
+  for (int i = 0; i < 5000; ++i) {
+    auto value = restored->Get("key-" + std::to_string(i));
+    ASSERT_TRUE(value);
+    ASSERT_EQ(std::string(i % 100, 'x'), *value);
+  }
+}
+
+TEST_F(SnapshotTests, KeepsTimeToLive) {
+  auto store = MakeStore<KSll>("source", buckets_);
+  for (long i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(store->Put(60 * i, i, i % 2 == 0 ? 50ms : 500ms));
+  }
+  ASSERT_TRUE(store->Put(7, 7));
+  auto bucket = pv_->FindBucket(HashKey(7L));
+  auto path = SnapshotPath(dir_, bucket->name());
+  store->Snapshot(bucket, path);
+
+  std::this_thread::sleep_for(100ms);
+  auto restored = MakeStore<KSll>("restored", buckets_);
+  auto stats = restored->Restore(path);
+  ASSERT_GT(stats.entries, 1);
+  ASSERT_EQ(7, *restored->Get(7));
+  for (long i = 0; i < 1000; ++i) {
+    if (pv_->FindBucket(HashKey(60 * i)) == bucket) {
+      // The expired entries are not restored.
+      ASSERT_EQ(i % 2 != 0, restored->Get(60 * i).has_value());
+    }
+  }
+  // The others keep their TTL.
+  std::this_thread::sleep_for(500ms);
+  for (long i = 0; i < 1000; ++i) {
+    ASSERT_FALSE(restored->Get(60 * i));
+  }
+  ASSERT_EQ(7, *restored->Get(7));
+}
+
+TEST_F(SnapshotTests, DetectsCorruption) {
+  auto store = MakeStore<KSll>("source", buckets_);
+  for (long i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(store->Put(6 * i, i));
+  }
+  auto bucket = BucketNamed("bucket-1");
+  auto path = SnapshotPath(dir_, bucket->name());
+  auto saved = store->Snapshot(bucket, path);
+
+  // Flips one byte in the middle of the records.
+  {
+    std::fstream file{path, std::ios::in | std::ios::out | std::ios::binary};
+    file.seekg(saved.bytes / 2);
+    char byte = 0;
+    file.read(&byte, 1);
+    byte ^= 0x5a;
+    file.seekp(saved.bytes / 2);
+    file.write(&byte, 1);
+  }
+  auto restored = MakeStore<KSll>("restored", buckets_);
+  ASSERT_THROW(restored->Restore(path), snapshot_error);
+
+  std::filesystem::resize_file(path, 10);
+  ASSERT_THROW(restored->Restore(path), snapshot_error);
+  ASSERT_THROW(restored->Restore(dir_ + "/missing.snap"), snapshot_error);
+}
+
+TEST_F(SnapshotTests, OnlyRestoresOwnedBuckets) {
+  auto store = MakeStore<KSll>("source", buckets_);
+  ASSERT_TRUE(store->Put(6, 6));
+  auto bucket = pv_->FindBucket(HashKey(6L));
+  auto path = SnapshotPath(dir_, bucket->name());
+  store->Snapshot(bucket, path);
+
+  KSll other{"other", pv_, {}};
+  ASSERT_THROW(other.Restore(path), snapshot_error);
+  ASSERT_THROW(other.Snapshot(bucket, path), snapshot_error);
+  // The failed snapshot did not replace the previous one.
+  ASSERT_EQ(1, MakeStore<KSll>("restored", buckets_)->Restore(path).entries);
+}
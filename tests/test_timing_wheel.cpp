@@ -0,0 +1,98 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "keystore/TimingWheel.hpp"
+
+using namespace keystore;
+
+class TimingWheelTests : public ::testing::Test {
+ protected:
+  using Wheel = TimingWheel<long, long>;
+  using Map = EntryMap<long, long>;
+
+  static constexpr int64_t kStart = 1000;
+
+  Map map_;
+  Wheel wheel_{kStart};
+
+  void Schedule(long key, int64_t expires_at) {
+    auto [pos, inserted] = map_.try_emplace(HashedKey<long>{key}, key);
+    ASSERT_TRUE(inserted);
+    pos->second.expires_at = expires_at;
+    wheel_.Schedule(&*pos);
+  }
+
+  std::vector<long> Advance(int64_t now, size_t budget = 1000) {
+    std::vector<long> expired;
+    wheel_.Advance(now, budget, [&](Wheel::Node *node) {
+      EXPECT_LE(node->second.expires_at, now);
+      expired.push_back(node->first.key);
+      map_.erase(node->first);
+    });
+    return expired;
+  }
+};
+
+TEST_F(TimingWheelTests, ExpiresInOrder) {
+  Schedule(1, kStart + 10);
+  Schedule(2, kStart + 100);
+  Schedule(3, kStart + 5000);
+  Schedule(4, kStart + 300000);
+  ASSERT_EQ(4, wheel_.size());
+
+  ASSERT_TRUE(Advance(kStart + 9).empty());
+  ASSERT_EQ(std::vector<long>{1}, Advance(kStart + 10));
+  ASSERT_EQ(std::vector<long>{2}, Advance(kStart + 4999));
+  ASSERT_EQ(std::vector<long>{3}, Advance(kStart + 299999));
+  ASSERT_EQ(std::vector<long>{4}, Advance(kStart + 300000));
+  ASSERT_EQ(0, wheel_.size());
+}
+
+TEST_F(TimingWheelTests, ExpiresPastDueImmediately) {
+  Schedule(1, kStart - 100);
+  ASSERT_EQ(std::vector<long>{1}, Advance(kStart));
+}
+
+TEST_F(TimingWheelTests, ExpiresBeyondHorizon) {
+  int64_t far = kStart + 3 * Wheel::kHorizon;
+  Schedule(1, far);
+  ASSERT_TRUE(Advance(far - 1).empty());
+  ASSERT_EQ(1, wheel_.size());
+  ASSERT_EQ(std::vector<long>{1}, Advance(far));
+}
+
+TEST_F(TimingWheelTests, CanCancel) {
+  Schedule(1, kStart + 10);
+  Schedule(2, kStart + 10);
+  wheel_.Cancel(&*map_.find(HashedKey<long>{1}));
+  ASSERT_EQ(Entry<long>::kNotScheduled, map_.find(HashedKey<long>{1})->second.wheel_slot);
+  ASSERT_EQ(1, wheel_.size());
+
+  // Cancelling twice is a no-op.
+  wheel_.Cancel(&*map_.find(HashedKey<long>{1}));
+  ASSERT_EQ(std::vector<long>{2}, Advance(kStart + 10));
+}
+
+TEST_F(TimingWheelTests, ResumesWithinBudget) {
+  for (long key = 0; key < 100; ++key) {
+    Schedule(key, kStart + key * 7);
+  }
+  size_t total = 0;
+  while (total < 100) {
+    auto expired = Advance(kStart + 1000, 8);
+    ASSERT_LE(expired.size(), 8);
+    ASSERT_FALSE(expired.empty());
+    total += expired.size();
+  }
+  ASSERT_EQ(0, wheel_.size());
+  ASSERT_TRUE(map_.empty());
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <algorithm>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "keystore/TokenIndex.hpp"
+
+using namespace keystore;
+
+TEST(TokenTests, SpansTheRing) {
+  ASSERT_EQ(0, TokenOf(0.0));
+  ASSERT_EQ(kTokens / 2, TokenOf(0.5));
+  ASSERT_EQ(kTokens - 1, TokenOf(1.0));
+
+  for (float hash : {0.0f, 0.1234f, 0.5f, 0.99999f}) {
+    auto [begin, end] = TokenRange(TokenOf(hash));
+    ASSERT_LE(begin, hash);
+    ASSERT_GT(end, hash);
+  }
+}
+
+class TokenIndexTests : public ::testing::Test {
+ protected:
+  using Index = TokenIndex<long, long>;
+  using Map = EntryMap<long, long>;
+
+  Map map_;
+  Index index_{std::pmr::get_default_resource()};
+
+  void Insert(long key, uint32_t token) {
+    // A key that hashes to the (start of the) `token`.
+    HashedKey<long> hashed{key, PackHash(TokenRange(token).first, key)};
+    auto [pos, inserted] = map_.try_emplace(hashed, key);
+    ASSERT_TRUE(inserted);
+    index_.Add(&*pos);
+  }
+
+  Map::iterator Find(long key) {
+    return std::find_if(map_.begin(), map_.end(), [key](const auto &node) {
+      return node.first.key == key;
+    });
+  }
+
+  std::vector<uint32_t> Tokens(uint32_t from) {
+    std::vector<uint32_t> tokens;
+    index_.ForEachFrom(from, [&](uint32_t token, const Index::Nodes &nodes) {
+      tokens.push_back(token);
+      return true;
+    });
+    return tokens;
+  }
+};
+
+TEST_F(TokenIndexTests, VisitsTokensInOrder) {
+  Insert(1, 300);
+  Insert(2, 10);
+  Insert(3, 300);
+  Insert(4, 20);
+  ASSERT_EQ(3, index_.size());
+  ASSERT_EQ((std::vector<uint32_t>{10, 20, 300}), Tokens(0));
+  ASSERT_EQ((std::vector<uint32_t>{20, 300}), Tokens(11));
+
+  // Stopping returns the token to resume from.
+  auto next = index_.ForEachFrom(0, [](uint32_t token, const Index::Nodes &nodes) {
+    return token < 20;
+  });
+  ASSERT_EQ(21, next);
+}
+
+TEST_F(TokenIndexTests, CanRemove) {
+  Insert(1, 300);
+  Insert(2, 300);
+  Insert(3, 300);
+  index_.Remove(&*Find(1));
+  index_.ForEachFrom(0, [](uint32_t token, const Index::Nodes &nodes) {
+    EXPECT_EQ(2, nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      EXPECT_EQ(i, nodes[i]->second.token_pos);
+    }
+    return true;
+  });
+  index_.Remove(&*Find(2));
+  index_.Remove(&*Find(3));
+  ASSERT_EQ(0, index_.size());
+  ASSERT_TRUE(Tokens(0).empty());
+}
@@ -95,6 +95,30 @@ TEST(ViewTests, CanRemoveBucket) {
   EXPECT_EQ(0, v.num_buckets());
 }
 
+TEST(ViewTests, GenerationTracksChanges) {
+  View v;
+  auto pb1 = std::make_shared<Bucket>("test-1", std::vector<float>{0.2, 0.6});
+  auto pb2 = std::make_shared<Bucket>("test-2", std::vector<float>{0.4, 0.8});
+
+  auto generation = v.generation();
+  v.Add(pb1);
+  ASSERT_LT(generation, v.generation());
+  generation = v.generation();
+  v.Add(pb2);
+  ASSERT_LT(generation, v.generation());
+
+  // Lookups, and removing a bucket which is not there, do not change the partition map.
+  generation = v.generation();
+  v.FindBucket(0.5);
+  v.IndexOf(pb1);
+  ASSERT_EQ(generation, v.generation());
+  ASSERT_TRUE(v.Remove(pb2));
+  ASSERT_LT(generation, v.generation());
+  generation = v.generation();
+  ASSERT_FALSE(v.Remove(pb2));
+  ASSERT_EQ(generation, v.generation());
+}
+
 
 // Using consistent hash, adding a node should result in a
 // very small number of items in need of being moved around.
@@ -307,3 +331,33 @@ TEST(MultithreadViewTests, CanRenameBuckets) {
                 [&actual](auto bp) { actual.push_back(bp->name()); });
   ASSERT_THAT(actual, ::testing::ElementsAreArray({"b1", "b2", "b3", "b5"}));
 }
+
+TEST(ViewTests, AssignsStableIndexes) {
+  View v;
+  auto pb1 = std::make_shared<Bucket>("test-1", std::vector<float>{0.2, 0.6, 0.9});
+  auto pb2 = std::make_shared<Bucket>("test-2", std::vector<float>{0.4, 0.8});
+  auto pb3 = std::make_shared<Bucket>("test-3", std::vector<float>{0.3, 0.5});
+
+  v.Add(pb1);
+  v.Add(pb2);
+  auto idx1 = v.IndexOf(pb1);
+  auto idx2 = v.IndexOf(pb2);
+  ASSERT_NE(idx1, idx2);
+
+  ASSERT_EQ(idx1, v.FindBucketIndex(0.55));
+  ASSERT_EQ(idx2, v.FindBucketIndex(0.7));
+  ASSERT_THAT(v.FindBucketIndexes({0.55, 0.7, 0.95}), ::testing::ElementsAre(idx1, idx2, idx1));
+
+  // Removing a bucket does not free its index, so it is never re-used by other buckets.
+  ASSERT_TRUE(v.Remove(pb2));
+  v.Add(pb3);
+  ASSERT_EQ(idx2, v.IndexOf(pb2));
+  ASSERT_NE(idx2, v.IndexOf(pb3));
+  ASSERT_EQ(v.IndexOf(pb3), v.FindBucketIndex(0.45));
+
+  // Looking up an index never assigns one.
+  auto pb4 = std::make_shared<Bucket>("test-4", std::vector<float>{0.1});
+  ASSERT_EQ(idx2, v.FindIndex(pb2));
+  ASSERT_EQ(kMaxBuckets, v.FindIndex(pb4));
+  ASSERT_EQ(kMaxBuckets, v.FindIndex(pb4));
+}
@@ -0,0 +1,309 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+// Ignore CLion warning caused by GTest TEST() macro.
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+#include <filesystem>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "TempDirFixture.hpp"
+#include "tests.h"
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/WriteAheadLog.hpp"
+
+using namespace keystore;
+using namespace std::chrono_literals;
+
+using KSll = InMemoryKeyStore<long, long>;
+using KSss = InMemoryKeyStore<std::string, std::string>;
+
+class WriteAheadLogTests : public TempDirFixture {
+ protected:
+  WalOptions options_;
+
+  void SetUp() override {
+    TempDirFixture::SetUp();
+    options_.dir = dir_;
+  }
+
+  static std::vector<std::string> ReadAll(const WriteAheadLog &wal, uint64_t after = 0) {
+    std::vector<std::string> records;
+    wal.Replay(after, [&](uint64_t lsn, const char *data, size_t size) {
+      records.emplace_back(data, size);
+    });
+    return records;
+  }
+};
+
+TEST_F(WriteAheadLogTests, CanAppendAndReplay) {
+  {
+    WriteAheadLog wal{"test", options_};
+    for (int i = 0; i < 100; ++i) {
+      auto record = "record-" + std::to_string(i);
+      ASSERT_EQ(i + 1, wal.Append(record.data(), record.size()));
+    }
+    wal.Commit(100);
+    ASSERT_EQ(100, wal.durable_lsn());
+  }
+  WriteAheadLog wal{"test", options_};
+  ASSERT_EQ(100, wal.last_lsn());
+  auto records = ReadAll(wal);
+  ASSERT_EQ(100, records.size());
+  ASSERT_EQ("record-42", records[42]);
+
+  // Only the records after the given LSN are replayed.
+  records = ReadAll(wal, 90);
+  ASSERT_EQ(10, records.size());
+  ASSERT_EQ("record-90", records[0]);
+
+  // The LSNs carry on from the last record.
+  ASSERT_EQ(101, wal.Append("more", 4));
+}
+
+TEST_F(WriteAheadLogTests, GroupsCommits) {
+  WriteAheadLog wal{"test", options_};
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 8; ++t) {
+    writers.emplace_back([&wal, t]() {
+      for (int i = 0; i < 200; ++i) {
+        auto record = std::to_string(t) + "-" + std::to_string(i);
+        wal.Commit(wal.Append(record.data(), record.size()));
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  ASSERT_EQ(1600, wal.durable_lsn());
+  ASSERT_EQ(1600, ReadAll(wal).size());
+
+  auto stats = wal.Stats();
+  ASSERT_EQ(1600, stats["appends"]);
+  // Concurrent writers share the syncs.
+  ASSERT_LT(stats["syncs"].get<long>(), 1600);
+}
+
+TEST_F(WriteAheadLogTests, SyncsPeriodically) {
+  options_.sync = SyncPolicy::kInterval;
+  options_.sync_interval = 5ms;
+  WriteAheadLog wal{"test", options_};
+  wal.Commit(wal.Append("one", 3));
+  ASSERT_TRUE(tests::WaitAtMostFor([&wal]() { return wal.durable_lsn() == 1; }, 1s, 5ms));
+
+  options_.sync = SyncPolicy::kNone;
+  WriteAheadLog unsynced{"unsynced", options_};
+  unsynced.Commit(unsynced.Append("two", 3));
+  ASSERT_EQ(0, unsynced.durable_lsn());
+  ASSERT_EQ(1, ReadAll(unsynced).size());
+}
+
+TEST_F(WriteAheadLogTests, IgnoresTornRecords) {
+  std::string segment;
+  {
+    WriteAheadLog wal{"test", options_};
+    for (int i = 0; i < 10; ++i) {
+      wal.Append("0123456789", 10);
+    }
+    wal.Sync();
+    segment = wal.segments().back();
+  }
+  // As if the process crashed while writing the last record.
+  std::filesystem::resize_file(segment, std::filesystem::file_size(segment) - 5);
+
+  WriteAheadLog wal{"test", options_};
+  ASSERT_EQ(9, wal.last_lsn());
+  ASSERT_EQ(9, ReadAll(wal).size());
+  wal.Commit(wal.Append("again", 5));
+  auto records = ReadAll(wal);
+  ASSERT_EQ(10, records.size());
+  ASSERT_EQ("again", records.back());
+}
+
+TEST_F(WriteAheadLogTests, CanTruncate) {
+  options_.segment_size = 1024;
+  WriteAheadLog wal{"test", options_};
+  std::string record(100, 'x');
+  for (int i = 0; i < 100; ++i) {
+    wal.Commit(wal.Append(record.data(), record.size()));
+  }
+  auto segments = wal.segments().size();
+  ASSERT_GT(segments, 5);
+
+  ASSERT_GT(wal.Truncate(50), 0);
+  ASSERT_LT(wal.segments().size(), segments);
+  auto records = ReadAll(wal, 50);
+  ASSERT_EQ(50, records.size());
+
+  // The segment being written to is never deleted.
+  wal.Truncate(100);
+  ASSERT_EQ(1, wal.segments().size());
+  ASSERT_EQ(0, ReadAll(wal, 100).size());
+}
+
+class KeyStoreWalTests : public WriteAheadLogTests {
+ protected:
+  std::shared_ptr<KSll> MakeStore() {
+    auto store = TempDirFixture::MakeStore<KSll>("test", buckets_);
+    store->EnableWal(options_);
+    return store;
+  }
+
+  // Writes to a store, and checks that another store recovers the same data from the log.
+  void CheckRecovers() {
+    {
+      auto store = MakeStore();
+      for (long i = 0; i < 2000; ++i) {
+        ASSERT_TRUE(store->Put(30 * i, i));
+      }
+      for (long i = 0; i < 2000; i += 2) {
+        ASSERT_TRUE(store->Remove(30 * i));
+      }
+      std::vector<std::pair<long, long>> items;
+      for (long i = 0; i < 100; ++i) {
+        items.emplace_back(30 * i, -i);
+      }
+      store->MultiPut(items);
+      ASSERT_TRUE(store->Put(30 * 1000, 1, 1h));
+      ASSERT_TRUE(store->Put(30 * 1001, 1, 1ms));
+    }
+    std::this_thread::sleep_for(5ms);
+
+    auto store = MakeStore();
+    ASSERT_GT(store->ReplayWal(2), 3000);
+    for (long i = 0; i < 2000; ++i) {
+      auto value = store->Get(30 * i);
+      if (i < 100) {
+        ASSERT_EQ(-i, *value);
+      } else if (i == 1000) {
+        ASSERT_EQ(1, *value);
+      } else if (i == 1001 || i % 2 == 0) {
+        ASSERT_FALSE(value) << "Unexpected value for " << i;
+      } else {
+        ASSERT_EQ(i, *value);
+      }
+    }
+  }
+};
+
+TEST_F(KeyStoreWalTests, RecoversFromSharedLog) {
+  CheckRecovers();
+  ASSERT_EQ(1, MakeStore()->Stats()["wal"].size());
+}
+
+TEST_F(KeyStoreWalTests, RecoversFromPerBucketLogs) {
+  options_.per_bucket = true;
+  CheckRecovers();
+  ASSERT_EQ(4, MakeStore()->Stats()["wal"].size());
+}
+
+TEST_F(KeyStoreWalTests, RecoversFromSnapshotsAndLog) {
+  for (bool per_bucket : {false, true}) {
+    std::filesystem::remove_all(options_.dir);
+    auto snapshots = options_.dir + "/snapshots";
+    std::filesystem::create_directories(snapshots);
+    options_.per_bucket = per_bucket;
+    options_.segment_size = 4096;
+    {
+      auto store = MakeStore();
+      for (long i = 0; i < 2000; ++i) {
+        ASSERT_TRUE(store->Put(30 * i, i));
+      }
+      auto segments = std::distance(std::filesystem::directory_iterator(options_.dir),
+                                    std::filesystem::directory_iterator{});
+      for (const auto &result : store->SnapshotAll(snapshots)) {
+        ASSERT_TRUE(result.error.empty());
+        ASSERT_GT(result.lsn, 0);
+      }
+      // The segments included in the snapshots were deleted.
+      ASSERT_LT(std::distance(std::filesystem::directory_iterator(options_.dir),
+                              std::filesystem::directory_iterator{}), segments);
+      for (long i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(store->Put(30 * i, -i));
+      }
+      ASSERT_TRUE(store->Remove(30 * 1999));
+    }
+    auto store = MakeStore();
+    for (const auto &result : store->RestoreAll(snapshots)) {
+      ASSERT_TRUE(result.error.empty());
+    }
+    ASSERT_EQ(2000, store->Stats()["tot_elem_counts"]);
+
+    // Only the writes made after the snapshots are replayed.
+    ASSERT_EQ(1001, store->ReplayWal());
+    for (long i = 0; i < 1999; ++i) {
+      ASSERT_EQ(i < 1000 ? -i : i, *store->Get(30 * i));
+    }
+    ASSERT_FALSE(store->Get(30 * 1999));
+  }
+}
+
+TEST_F(KeyStoreWalTests, SkipsBucketsNotOwned) {
+  {
+    auto store = MakeStore();
+    for (long i = 0; i < 1000; ++i) {
+      ASSERT_TRUE(store->Put(30 * i, i));
+    }
+  }
+  buckets_ = {"bucket-0"};
+  auto store = MakeStore();
+  store->ReplayWal();
+  long found = 0;
+  for (long i = 0; i < 1000; ++i) {
+    if (store->Get(30 * i)) {
+      ASSERT_EQ("bucket-0", pv_->FindBucket(HashKey(30 * i))->name());
+      ++found;
+    }
+  }
+  ASSERT_EQ(found, store->Stats()["tot_elem_counts"]);
+  ASSERT_GT(found, 0);
+}
+
+TEST_F(KeyStoreWalTests, LogsWritesToAdoptedBuckets) {
+  auto bucket = BucketNamed("bucket-2");
+  for (bool per_bucket : {false, true}) {
+    std::filesystem::remove_all(options_.dir);
+    std::filesystem::create_directories(options_.dir);
+    options_.per_bucket = per_bucket;
+    std::vector<long> keys;
+    {
+      // The source has no log, and the destination (with a log) owns none of the buckets yet.
+      auto source = TempDirFixture::MakeStore<KSll>("source", buckets_);
+      auto all_buckets = std::exchange(buckets_, {});
+      auto destination = MakeStore();
+      buckets_ = all_buckets;
+      ASSERT_TRUE(source->TransferBucket(bucket, *destination));
+      for (long i = 0; keys.size() < 100; ++i) {
+        if (pv_->FindBucket(HashKey(30 * i)) == bucket) {
+          ASSERT_TRUE(destination->Put(30 * i, i));
+          keys.push_back(i);
+        }
+      }
+    }
+    auto store = MakeStore();
+    ASSERT_EQ(keys.size(), store->ReplayWal());
+    for (long i : keys) {
+      ASSERT_EQ(i, *store->Get(30 * i));
+    }
+  }
+}
+
+TEST_F(KeyStoreWalTests, LogsStrings) {
+  {
+    KSss store{"strings", pv_, buckets_};
+    store.EnableWal(options_);
+    ASSERT_THROW(store.EnableWal(options_), std::logic_error);
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_TRUE(store.Put("key-" + std::to_string(i), std::string(i, 'v')));
+    }
+  }
+  KSss store{"strings", pv_, buckets_};
+  store.EnableWal(options_);
+  ASSERT_EQ(100, store.ReplayWal());
+  ASSERT_EQ(std::string(42, 'v'), *store.Get("key-42"));
+}
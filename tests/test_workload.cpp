@@ -0,0 +1,158 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com)
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <map>
+
+#include "keystore/InMemoryKeyStore.hpp"
+#include "keystore/Workload.hpp"
+
+using namespace keystore;
+
+class WorkloadTests : public ::testing::Test {
+ protected:
+  std::shared_ptr<View> pv = make_balanced_view(5, 10);
+
+  std::unique_ptr<InMemoryKeyStore<std::string, std::string>> MakeStore() {
+    std::unordered_set<std::string> buckets;
+    for (int i = 0; i < 5; ++i) {
+      buckets.insert("bucket-" + std::to_string(i));
+    }
+    return std::make_unique<InMemoryKeyStore<std::string, std::string>>("test", pv, buckets);
+  }
+};
+
+TEST_F(WorkloadTests, ZipfianIsSkewed) {
+  const uint64_t kItems = 1000;
+  const int kSamples = 100000;
+  ZipfianGenerator zipfian{kItems};
+  std::mt19937_64 rnd{7};
+
+  std::map<uint64_t, int> counts;
+  for (int i = 0; i < kSamples; ++i) {
+    auto item = zipfian.Next(rnd);
+    ASSERT_LT(item, kItems);
+    ++counts[item];
+  }
+  // With theta = 0.99 and 1,000 items, the first item is chosen ~13% of the times, and each
+  // item is chosen about twice as often as the one with twice its rank.
+  ASSERT_NEAR(0.13, static_cast<double>(counts[0]) / kSamples, 0.02);
+  ASSERT_GT(counts[0], counts[1]);
+  ASSERT_GT(counts[1], counts[9]);
+  ASSERT_NEAR(2.0, static_cast<double>(counts[4]) / counts[9], 0.4);
+}
+
+TEST_F(WorkloadTests, ZipfianGrows) {
+  ZipfianGenerator zipfian{10};
+  std::mt19937_64 rnd{7};
+  zipfian.Grow(5);
+  ASSERT_EQ(10, zipfian.items());
+  zipfian.Grow(100000);
+  ASSERT_EQ(100000, zipfian.items());
+
+  ZipfianGenerator expected{100000};
+  std::mt19937_64 other{7};
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ(expected.Next(other), zipfian.Next(rnd));
+  }
+}
+
+TEST_F(WorkloadTests, YcsbWorkloads) {
+  auto d = WorkloadOptions::Ycsb('D');
+  ASSERT_EQ(Distribution::kLatest, d.request_distribution);
+  ASSERT_DOUBLE_EQ(0.05, d.proportions[static_cast<size_t>(WorkloadOp::kInsert)]);
+
+  auto e = WorkloadOptions::Ycsb('e');
+  ASSERT_DOUBLE_EQ(0.95, e.proportions[static_cast<size_t>(WorkloadOp::kScan)]);
+  ASSERT_EQ(Distribution::kZipfian, e.request_distribution);
+
+  ASSERT_THROW(WorkloadOptions::Ycsb('g'), std::invalid_argument);
+  ASSERT_THROW(DistributionFrom("pareto"), std::invalid_argument);
+  ASSERT_EQ(Distribution::kUniform, DistributionFrom("uniform"));
+}
+
+TEST_F(WorkloadTests, RunsWorkload) {
+  auto store = MakeStore();
+  auto options = WorkloadOptions::Ycsb('d');
+  options.record_count = 1000;
+  options.operation_count = 20000;
+  options.warmup_operation_count = 1000;
+  options.threads = 4;
+  options.value_size_distribution = Distribution::kUniform;
+  options.min_value_size = 10;
+  options.max_value_size = 50;
+
+  ASSERT_EQ(1000, LoadWorkload(*store, options));
+  auto value = store->Get(WorkloadKey(999));
+  ASSERT_TRUE(value.has_value());
+  ASSERT_GE(value->size(), 10);
+  ASSERT_LE(value->size(), 50);
+
+  auto result = RunWorkload(*store, options);
+  ASSERT_EQ(20000, result.total_operations());
+  auto reads = result.operations[static_cast<size_t>(WorkloadOp::kRead)];
+  auto inserts = result.operations[static_cast<size_t>(WorkloadOp::kInsert)];
+  ASSERT_EQ(20000, reads + inserts);
+  ASSERT_NEAR(1000, inserts, 200);
+  ASSERT_EQ(0, result.failed[static_cast<size_t>(WorkloadOp::kInsert)]);
+  ASSERT_EQ(reads, result.latencies[static_cast<size_t>(WorkloadOp::kRead)].count());
+
+  // All the records inserted, including by the warmup, are in the store.
+  for (size_t i = 0; i < options.record_count + options.warmup_operation_count / 10; ++i) {
+    if (!store->Get(WorkloadKey(i))) {
+      ASSERT_GT(i, options.record_count);
+    }
+  }
+  json j = result;
+  ASSERT_TRUE(j["latency"].contains("read"));
+  ASSERT_FALSE(j["latency"].contains("update"));
+  ASSERT_EQ(20000, j["operations"]);
+}
+
+TEST_F(WorkloadTests, ScansAndReadModifyWrites) {
+  auto store = MakeStore();
+  for (auto workload : {'e', 'f'}) {
+    auto options = WorkloadOptions::Ycsb(workload);
+    options.record_count = 500;
+    options.operation_count = 2000;
+    options.max_scan_length = 10;
+    LoadWorkload(*store, options);
+
+    auto result = RunWorkload(*store, options);
+    ASSERT_EQ(2000, result.total_operations());
+    // Scans and reads only miss records being inserted concurrently (there are none here).
+    for (auto failed : result.failed) {
+      ASSERT_EQ(0, failed);
+    }
+  }
+}
+
+TEST_F(WorkloadTests, OpenLoop) {
+  auto store = MakeStore();
+  auto options = WorkloadOptions::Ycsb('c');
+  options.record_count = 100;
+  options.operation_count = 200;
+  options.threads = 2;
+  options.target_ops_per_sec = 2000;
+  LoadWorkload(*store, options);
+
+  auto result = RunWorkload(*store, options);
+  ASSERT_EQ(200, result.total_operations());
+  // 200 operations at 2,000/sec should take (at least) 100 msec.
+  ASSERT_GE(result.elapsed_sec, 0.09);
+  ASSERT_LT(result.elapsed_sec, 1.0);
+}
+
+TEST_F(WorkloadTests, InvalidOptions) {
+  auto store = MakeStore();
+  WorkloadOptions options;
+  options.proportions = {0, 0, 0, 0, 0};
+  ASSERT_THROW(RunWorkload(*store, options), std::invalid_argument);
+
+  options = WorkloadOptions::Ycsb('a');
+  options.min_value_size = 100;
+  options.max_value_size = 10;
+  ASSERT_THROW(LoadWorkload(*store, options), std::invalid_argument);
+}